@@ -1,365 +1,7242 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <pthread.h>
-
-#define PORT 8080
-#define MAX_PEERS 100
-#define MAX_CONTENT 20
-#define BUFFER_SIZE 256
-#define MAX_NAME_LENGTH 255 // Increased size for names
-
-typedef struct {
-    char peer_name[MAX_NAME_LENGTH]; // Increased size
-    char content_name[MAX_NAME_LENGTH]; // Increased size
-    struct sockaddr_in address; // Peer address
-} ContentInfo;
-
-ContentInfo content_list[MAX_PEERS][MAX_CONTENT]; // List of contents registered by peers
-int content_count[MAX_PEERS]; // Count of contents for each peer
-
-int sockfd; // Global variable for the socket file descriptor
-pthread_mutex_t mutex; // Mutex for thread safety
-
-void *handle_peer(void *arg);
-void register_content(char *peer_name, char *content_name, struct sockaddr_in *addr);
-void deregister_content(char *peer_name, char *content_name);
-void search_content(char *content_name, struct sockaddr_in *client_addr);
-void handle_list(struct sockaddr_in *client_addr, char *peer_name);
-void send_error(struct sockaddr_in *client_addr, char *error_msg);
-void handle_download(char *content_name, struct sockaddr_in *client_addr);
-
-int main() {
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
-
-    // Initialize content count
-    memset(content_count, 0, sizeof(content_count));
-    pthread_mutex_init(&mutex, NULL); // Initialize the mutex
-
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Prepare server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-
-    // Bind the socket
-    if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    }
-
-    printf("Index Server is running on port %d\n", PORT);
-
-    while (1) {
-        int n = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
-        buffer[n] = '\0';
-        printf("Received: %s\n", buffer);
-
-        // Create a new thread to handle the peer request
-        pthread_t thread_id;
-        struct {
-            char buffer[BUFFER_SIZE];
-            struct sockaddr_in addr;
-        } *args = malloc(sizeof(*args)); // Allocate memory for arguments
-        strncpy(args->buffer, buffer, BUFFER_SIZE);
-        args->addr = client_addr;
-
-        pthread_create(&thread_id, NULL, handle_peer, (void *)args);
-        pthread_detach(thread_id);
-    }
-
-    close(sockfd);
-    pthread_mutex_destroy(&mutex); // Clean up the mutex
-    return 0;
-}
-
-void *handle_peer(void *arg) {
-    struct {
-        char buffer[BUFFER_SIZE];
-        struct sockaddr_in addr;
-    } *args = (void *)arg;
-
-    char *buffer = args->buffer;
-    struct sockaddr_in client_addr = args->addr;
-    char command[2];
-    char peer_name[MAX_NAME_LENGTH]; // Increased size
-    char content_name[MAX_NAME_LENGTH]; // Increased size
-
-    // Read the command and names
-    sscanf(buffer, "%1s %s %s", command, peer_name, content_name);
-
-    if (strcmp(command, "R") == 0) {
-        // Register content
-        register_content(peer_name, content_name, &client_addr);
-    } else if (strcmp(command, "Q") == 0) {
-        // Deregister content
-        deregister_content(peer_name, content_name);
-    } else if (strcmp(command, "D") == 0) {
-        // Handle download request
-        handle_download(content_name, &client_addr);
-    } else if (strcmp(command, "L") == 0) {
-    // Handle list command
-        handle_list(&client_addr, peer_name); // Pass peer_name
-    } else if (strcmp(command, "S") == 0) {
-        // Handle search command
-        search_content(content_name, &client_addr);
-    } else {
-        send_error(&client_addr, "Invalid command");
-    }
-
-    free(args); // Free allocated memory for arguments
-    return NULL;
-}
-
-void search_content(char *content_name, struct sockaddr_in *client_addr) {
-    pthread_mutex_lock(&mutex); // Lock for thread safety
-
-    char response[BUFFER_SIZE];
-    int found = 0;
-
-    for (int i = 0; i < MAX_PEERS; i++) {
-        for (int j = 0; j < content_count[i]; j++) {
-            if (strcmp(content_list[i][j].content_name, content_name) == 0) {
-                // Content found, prepare response
-                sprintf(response, "Content '%s' found at %s:%d", content_name,
-                        inet_ntoa(content_list[i][j].address.sin_addr),
-                        ntohs(content_list[i][j].address.sin_port));
-                sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
-                printf("Sent search response to client: %s\n", response);
-                found = 1;
-                pthread_mutex_unlock(&mutex); // Unlock before returning
-                return;
-            }
-        }
-    }
-
-    // If content not found
-    if (!found) {
-        send_error(client_addr, "Content not found");
-    }
-
-    pthread_mutex_unlock(&mutex); // Unlock
-}
-
-void handle_list(struct sockaddr_in *client_addr, char *peer_name) {
-    pthread_mutex_lock(&mutex); // Lock for thread safety
-
-    char response[BUFFER_SIZE];
-    strcpy(response, "Registered content:\n");
-
-    int found_content = 0;
-    int peer_index = -1;
-
-    // Find the peer index based on the peer_name
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (strcmp(content_list[i][0].peer_name, peer_name) == 0) {
-            peer_index = i;
-            break;
-        }
-    }
-
-    if (peer_index != -1) {
-        for (int j = 0; j < content_count[peer_index]; j++) {
-            strcat(response, content_list[peer_index][j].content_name);
-            strcat(response, "\n");
-            found_content = 1;
-        }
-    }
-
-    if (!found_content) {
-        strcat(response, "No content registered.");
-    }
-
-    sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
-    printf("Sent content list to client: %s\n", response);
-
-    pthread_mutex_unlock(&mutex); // Unlock
-}
-void register_content(char *peer_name, char *content_name, struct sockaddr_in *addr) {
-    pthread_mutex_lock(&mutex); // Lock for thread safety
-
-    // Find the peer index
-    int peer_index = -1;
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (strcmp(content_list[i][0].peer_name, peer_name) == 0) {
-            peer_index = i;
-            break;
-        }
-    }
-
-    // If peer is not found, add it
-    if (peer_index == -1) {
-        for (int i = 0; i < MAX_PEERS; i++) {
-            if (content_list[i][0].peer_name[0] == '\0') { // Empty slot
-                peer_index = i;
-                strcpy(content_list[i][0].peer_name, peer_name);
-                break;
-            }
-        }
-    }
-
-    // Register content
-    if (peer_index != -1 && content_count[peer_index] < MAX_CONTENT) {
-        strcpy(content_list[peer_index][content_count[peer_index]].content_name, content_name);
-        content_list[peer_index][content_count[peer_index]].address = *addr;
-
-        // Now read the file data from the socket
-        char file_path[MAX_NAME_LENGTH];
-        sprintf(file_path, "./%s", content_name); // Save the file in the current directory
-
-        // Open the file for writing
-        FILE *file = fopen(file_path, "wb");
-        if (!file) {
-            send_error(addr, "Failed to create file");
-            pthread_mutex_unlock(&mutex); // Unlock
-            return;
-        }
-
-        // Read the file data from the socket
-        char buffer[BUFFER_SIZE];
-        ssize_t bytes_received;
-        while ((bytes_received = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, NULL, NULL)) > 0) {
-            fwrite(buffer, 1, bytes_received, file);
-        }
-
-        // Check if the loop exited due to an error
-        if (bytes_received < 0) {
-            perror("Failed to receive file data");
-            fclose(file);
-            send_error(addr, "Failed to receive file data");
-            pthread_mutex_unlock(&mutex); // Unlock
-            return;
-        }
-
-        fclose(file);
-        content_count[peer_index]++;
-        printf("Registered content '%s' for peer '%s'\n", content_name, peer_name);
-    } else {
-        send_error(addr, "Content registration failed");
-    }
-
-    pthread_mutex_unlock(&mutex); // Unlock
-}
-
-void deregister_content(char *peer_name, char *content_name) {
-    pthread_mutex_lock(&mutex); // Lock for thread safety
-
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (strcmp(content_list[i][0].peer_name, peer_name) == 0) {
-            for (int j = 0; j < content_count[i]; j++) {
-                if (strcmp(content_list[i][j].content_name, content_name) == 0) {
-                    // Remove content
-                    for (int k = j; k < content_count[i] - 1; k++) {
- content_list[i][k] = content_list[i][k + 1];
-                    }
-                    content_count[i]--;
-                    printf("Deregistered content '%s' for peer '%s'\n", content_name, peer_name);
-                    pthread_mutex_unlock(&mutex); // Unlock
-                    return;
-                }
-            }
-        }
-    }
-
-    pthread_mutex_unlock(&mutex); // Unlock
-}
-
-void handle_download(char *content_name, struct sockaddr_in *client_addr) {
-    pthread_mutex_lock(&mutex); // Lock for thread safety
-
-    for (int i = 0; i < MAX_PEERS; i++) {
-        for (int j = 0; j < content_count[i]; j++) {
-            if (strcmp(content_list[i][j].content_name, content_name) == 0) {
-                // Send the content file to the client
-                char response[BUFFER_SIZE];
-                sprintf(response, "Content found at %s:%d", inet_ntoa(content_list[i][j].address.sin_addr), ntohs(content_list[i][j].address.sin_port));
-                sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
-                printf("Sent response to client: %s\n", response);
-
-                // Now send the actual file over a TCP connection
-                int tcp_sock;
-                struct sockaddr_in content_server_addr;
-                char file_path[MAX_NAME_LENGTH];
-                sprintf(file_path, "./%s", content_name); // Assuming files are stored in the current directory
-
-                // Create TCP socket for sending the file
-                if ((tcp_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-                    perror("TCP socket creation failed");
-                    pthread_mutex_unlock(&mutex); // Unlock
-                    return;
-                }
-
-                // Prepare content server address
-                memset(&content_server_addr, 0, sizeof(content_server_addr));
-                content_server_addr.sin_family = AF_INET;
-                content_server_addr.sin_addr = content_list[i][j].address.sin_addr; // Correctly copy the address
-                content_server_addr.sin_port = content_list[i][j].address.sin_port; // Use the same port as the peer
-
-                // Bind the TCP socket to a port
-                if (bind(tcp_sock, (struct sockaddr *)&content_server_addr, sizeof(content_server_addr)) < 0) {
-                    perror("Bind failed for TCP socket");
-                    close(tcp_sock);
-                    pthread_mutex_unlock(&mutex); // Unlock
-                    return;
-                }
-
-                // Listen for incoming connections
-                listen(tcp_sock, 1);
-                printf("Waiting for a connection to send file '%s'...\n", content_name);
-
-                // Accept the incoming connection
-                int new_sock;
-                socklen_t addr_len = sizeof(content_server_addr);
-                if ((new_sock = accept(tcp_sock, (struct sockaddr *)&content_server_addr, &addr_len)) < 0) {
-                    perror("Failed to accept connection");
-                    close(tcp_sock);
-                    pthread_mutex_unlock(&mutex); // Unlock
-                    return;
-                }
-
-                // Open the file to send
-                FILE *file = fopen(file_path, "rb");
-                if (!file) {
-                    perror("File not found");
-                    close(new_sock);
-                    close(tcp_sock);
-                    pthread_mutex_unlock(&mutex); // Unlock
-                    return;
-                }
-
-                // Send the file
-                char file_buffer[BUFFER_SIZE];
-                size_t bytes_read;
-                while ((bytes_read = fread(file_buffer, 1, sizeof(file_buffer), file)) > 0) {
-                    send(new_sock, file_buffer, bytes_read, 0);
-                }
-
-                fclose(file);
-                close(new_sock);
-                close(tcp_sock);
-                printf("File '%s' sent successfully.\n", content_name);
-                pthread_mutex_unlock(&mutex); // Unlock
-                return;
-            }
-        }
-    }
-
-    send_error(client_addr, "Content not found");
-    pthread_mutex_unlock(&mutex); // Unlock
-}
-
-void send_error(struct sockaddr_in *client_addr, char *error_msg) {
-    sendto(sockfd, error_msg, strlen(error_msg), 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
-    printf("Sent error to client: %s\n", error_msg);
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "p2p_hash.h"
+#include "p2p_histogram.h"
+#include "p2p_lz4.h"
+#include "p2p_protocol.h"
+#include "p2p_cluster.h"
+
+#define PORT 8080 // Default control port; uploads, downloads and replication use the three after it
+#define BUFFER_SIZE PROTO_MAX_DATAGRAM // Largest control datagram
+#define MAX_NAME_LENGTH 255 // Increased size for names
+#define MIN_SHARDS 4 // Control-plane shards even on small machines, so a batch waiting on the log stalls few clients
+#define MAX_SHARDS 64 // Control-plane shards at most, however many cores there are
+#define BATCH_SIZE 32 // Datagrams read/written per recvmmsg/sendmmsg call
+#define SHARD_RCVBUF (4 << 20) // Receive queue of a shard, deep enough that overload shows as waiting before drops
+#define ADMIT_RATE 1000 // Tokens a client earns per second unless -a says otherwise
+#define ADMIT_BURST_SECONDS 2 // A quiet client saves up this many seconds of tokens for a burst
+#define ADMIT_CLIENTS 65536 // Buckets client addresses hash into (power of two); addresses in one share its rate
+#define ADMIT_WRITE_COST 4 // Tokens a catalog write takes per record; reads and heartbeats take 1 or 2
+#define SHED_WRITE_MS 50 // A write that waited this long in a shard's queue is turned away
+#define SHED_READ_MS 200 // Reads are kept longer: they are cheaper and never wait for the log
+#define SHED_CONTROL_MS 1000 // Heartbeats longer still, as a peer whose lease lapses costs far more
+#define RETRY_MIN_MS 20 // Bounds of the retry after given to a client turned away
+#define RETRY_MAX_MS 5000
+#define INDEX_INITIAL_CAPACITY 1024 // Starting slots of each name index (power of two)
+#define INDEX_MAX_LOAD 70 // Grow a name index once live + deleted slots pass this percentage
+#define PEER_CONTENTS_INITIAL 8 // Starting slots of a peer's set of content names (power of two)
+#define NAME_ARENA_BYTES (1ULL << 32) // Address space reserved for catalog names, so 32 bits locate any of them
+#define NAME_CELL 8 // Catalog names take whole cells of this many bytes, their terminator included
+#define NAME_CLASSES ((MAX_NAME_LENGTH + NAME_CELL) / NAME_CELL) // Name sizes in cells, up to the longest name
+#define SLAB_BYTES (64 << 10) // A slab pool that runs dry carves this many bytes into new objects
+#define RECORD_CLASSES 9 // Catalog records are pooled in sizes of 16 bytes up to 4 KiB, doubling; bigger ones are not
+#define UPLOAD_THREADS 16 // Uploads that can stream into the store at the same time
+#define MAX_PENDING_UPLOADS 1024 // Registrations waiting for their data connection (power of two)
+#define UPLOAD_TIMEOUT 60 // Seconds a registration waits for its data connection
+#define UPLOAD_IDLE_TIMEOUT 30 // Seconds an upload connection may stall before it is dropped
+#define UPLOAD_PIPE_SIZE (1 << 20) // Bytes moved per splice call
+#define UPLOAD_HEADER_SIZE 16 // Token (8 bytes), codec (1 byte) and file size (7 bytes), big-endian
+#define UPLOAD_LZ4 1 // Codec of an upload sent as one frame per chunk, each LZ4-compressed or not
+#define UPLOAD_FRAME_SIZE 4 // Length of the frame's bytes (big-endian), with UPLOAD_FRAME_PACKED if compressed
+#define UPLOAD_FRAME_PACKED 0x80000000U
+#define CONTENT_THREADS 2 // Event loops serving downloads
+#define CONTENT_EVENTS 64 // Events taken per epoll_wait
+#define CONTENT_HEADER_SIZE 9 // Status (1 byte, 0 = found) and length (8 bytes, big-endian)
+#define CONTENT_LZ4 2 // Status of a chunk sent as one LZ4 block; the length is then the compressed one
+#define CONTENT_TURN_REQUESTS 16 // Pipelined requests one connection may complete before yielding
+#define CHUNK_SIZE (1 << 20) // Content is hashed and fetched in pieces of this size
+#define MANIFEST_HEADER_SIZE 17 // Status (1), size (8), chunk count (4), source count (4)
+#define MANIFEST_SOURCE_SIZE 10 // Address (4), port (2), chunk map length (4), without the map itself
+#define MANIFEST_PEERS 15 // Peer sources a manifest lists at most, besides the index itself
+#define CONTENT_TURN_BYTES (4 << 20) // Bytes one download may send before yielding to the others
+#define CONTENT_SNDBUF (4 << 20) // Socket send buffer for downloads
+#define SEARCH_BUCKET_BITS 18 // Trigrams are hashed into 2^18 posting lists
+#define SEARCH_BUCKETS (1 << SEARCH_BUCKET_BITS)
+#define SEARCH_INITIAL_POSTINGS 4 // Ids a new posting list has room for
+#define SEARCH_PAD 0x01 // Stands before the first byte of a name in its anchored trigrams
+#define SEARCH_SLACK 16 // Readable bytes after every indexed name, for whole-vector loads
+#define SEARCH_MIN_PATTERN 3 // Shortest substring or fuzzy pattern; prefixes may be shorter
+#define SEARCH_FUZZY_MIN_SCORE 50 // Least trigram similarity (Dice coefficient, percent) of a fuzzy match
+#define SEARCH_FUZZY_RESULTS 256 // Best fuzzy matches ranked per request, and so the deepest page
+#define SEARCH_COMPACT_MIN 4096 // Dead names tolerated before the search index is rebuilt without them
+#define CATALOG_DIR ".catalog" // Snapshot and log of the catalog; no content name starts with a dot
+#define STORE_DIR ".store" // Segment files of the block store
+#define STORE_SEGMENT_BYTES (256LL << 20) // Space preallocated for each segment file
+#define STORE_PAGE 4096 // Every block starts on a page of its own, after a page holding its header
+#define STORE_MAGIC "P2PBLCK1"
+#define STORE_INITIAL_BUCKETS 1024 // Starting chains of the block and object tables (power of two)
+#define STORE_PACKED_BYTES (64 << 20) // Memory for LZ4 forms of blocks, kept to serve them compressed again
+#define CACHE_MEGABYTES 256 // Memory for hot blocks unless -m says otherwise
+#define CACHE_WINDOW_PERCENT 1 // Share of the hot cache that takes in every block asked for twice
+#define CACHE_PROTECTED_PERCENT 80 // Share of the rest kept for blocks asked for again since they got in
+#define CACHE_SKETCH_ROWS 4 // Counters a block is counted in; its frequency is the smallest
+#define CACHE_SKETCH_MAX 15 // Counters stop here, like TinyLFU's 4-bit ones
+#define CACHE_SAMPLE 10 // Counters are halved after this many requests per block the cache holds
+#define CATALOG_SNAPSHOT_BYTES (64 << 20) // Log written since the last snapshot that makes the next one due
+#define SEARCH_WARM_BATCH 4096 // Recovered names indexed per hold of the mutex while name search warms up
+#define WAL_RECORD_HEADER 17 // Payload length (4), CRC-32C of the rest (4), sequence number (8), type (1)
+#define SNAPSHOT_MAGIC "P2PSNAP1"
+#define LEASE_SECONDS 90 // A peer unheard of for this long is evicted with everything it holds
+#define WHEEL_TICK_MS 100 // Resolution of lease expiry
+#define WHEEL_BITS 6 // Each level of the lease wheel has 2^6 slots
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // Levels of the lease wheel; together they span 2^24 ticks, about 19 days
+#define FEED_BYTES (8 << 20) // Recent catalog changes kept for subscribers, who catch up from them after a gap
+#define FEED_EVENTS 65536 // Changes kept at most (power of two)
+#define FEED_TICK_MS 50 // Subscribers are told what changed this often, in coalesced batches
+#define FEED_SCAN 4096 // Changes looked through for one subscription per tick at most
+#define FEED_COALESCE 512 // Distinct content and peer pairs gathered for one subscription per tick at most
+#define FEED_BURST 16 // Notification datagrams sent to one subscription per tick at most
+#define FEED_RECORD_MAX (15 + 2 * (MAX_NAME_LENGTH + 2)) // Log number, type, seed and the two names of a change
+#define SUBSCRIPTION_SECONDS 60 // A subscription that is not renewed for this long lapses
+#define MAX_SUBSCRIPTIONS 65536 // Subscriptions kept at once
+#define REPLICA_RETRY_SECONDS 1 // Pause before connecting again to a node that could not be reached
+#define REPLICA_READ_SIZE (1 << 20) // Bytes of a replication stream taken per read
+#define REPLICA_QUEUE_LIMIT (64 << 20) // Changes queued for a lagging node before it is resynced instead
+#define ROUTER_PENDING 4096 // Requests a router has out to the nodes at once (power of two)
+#define ROUTER_TIMEOUT_MS 1000 // A routed request is answered with whatever the nodes said by then
+#define STATS_OPCODES (OP_UNSUBSCRIBE + 1) // Opcodes counted apart; unknown ones are counted under 0
+#define LOG_RING_SLOTS 4096 // Log lines waiting for the log thread (power of two)
+#define LOG_LINE_SIZE 160 // Longer log lines are cut
+#define LOG_RATE 1000 // Log lines written per second unless -l says otherwise; the rest are only counted
+#define LOG_TICK_MS 100 // The log thread writes lines out and renews the rate budget this often
+
+// Every record kept in a NameIndex starts with its key
+typedef struct {
+    char *name;
+    uint64_t hash;
+} EntryKey;
+
+typedef struct {
+    size_t capacity; // Always a power of two
+    _Atomic(EntryKey *) slots[];
+} IndexTable;
+
+// Open-addressing (linear probing) hash table from name to record. Readers probe
+// it lock-free inside an epoch section; writers replace whole records and tables.
+typedef struct {
+    _Atomic(IndexTable *) table;
+    size_t count; // Live records (writers only)
+    size_t used; // Live records plus tombstones (writers only)
+} NameIndex;
+
+// Size and per-chunk BLAKE3 hashes of a stored file
+typedef struct {
+    uint64_t size;
+    uint32_t chunk_count;
+    const uint8_t (*hashes)[BLAKE3_OUT_LEN]; // Either stored below or inside the mapped snapshot
+    uint8_t stored[][BLAKE3_OUT_LEN];
+} Manifest;
+
+// Which chunks of a content item a peer has
+typedef struct {
+    uint32_t chunk_count; // Of the manifest the map was made for
+    uint8_t bits[];
+} ChunkMap;
+
+typedef struct {
+    int slot; // Peer slot
+    const ChunkMap *chunks; // NULL when the peer has the whole content
+} Holder;
+
+// Catalog records are immutable once published: a change installs a new
+// version and retires the old one, so readers never see a half-made update.
+typedef struct {
+    EntryKey key; // Content name, shared by every version of the entry
+    const Manifest *manifest;
+    int holder_count;
+    Holder holders[]; // Peers holding all or part of this content
+} ContentEntry;
+
+// Liveness of a peer, shared by every version of its entry. Heartbeats only store last_seen, without
+// the mutex; the lease wheel looks at it when the lease falls due and either evicts or re-arms.
+typedef struct PeerLease {
+    atomic_uint_fast64_t last_seen; // Milliseconds on the monotonic clock
+    const char *peer_name; // Key of the peer entry
+    uint64_t expires; // Tick the lease is filed under (writers only)
+    struct PeerLease *next; // Neighbours in a wheel slot, pprev NULL while not filed (writers only)
+    struct PeerLease **pprev;
+} PeerLease;
+
+// Hierarchical timing wheel of peer leases. A slot of level l covers 2^(6l) ticks; when the finer
+// level wraps, the coarser slot now due is spread over it, so a tick costs O(1) plus the leases that
+// fall due, however many peers there are. Writers only.
+typedef struct {
+    uint64_t now; // Next tick to process
+    PeerLease *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} LeaseWheel;
+
+typedef uint32_t NameHandle; // Offset of a catalog name in the name arena, 0 for none
+
+typedef struct {
+    uint32_t capacity; // Always a power of two
+    _Atomic NameHandle slots[]; // 0 if never used; a dropped name keeps its handle with the low bit set
+} ContentTable;
+
+// Names of the contents a peer registered, shared by every version of its entry instead of copied into
+// each. Writers add and drop names in place; readers walk the table lock-free inside an epoch section. A
+// name added again takes back the slot it was dropped from, so a walk meets every name at most once.
+typedef struct {
+    _Atomic(ContentTable *) table;
+    uint32_t count; // Names held (writers only)
+    uint32_t used; // Names held plus dropped ones (writers only)
+} PeerContents;
+
+typedef struct {
+    EntryKey key; // Peer name, shared by every version of the entry
+    PeerLease *lease; // Shared by every version too
+    PeerContents *contents; // And this
+    int slot; // Position in peer_slots
+    struct sockaddr_in address; // Peer address
+} PeerEntry;
+
+typedef struct {
+    int capacity;
+    _Atomic(PeerEntry *) peers[]; // NULL marks a free slot
+} PeerSlots;
+
+// A content name known to the search index. A name keeps its id while it comes and goes, so
+// posting lists only ever grow; names nobody holds are left out when the index is rebuilt.
+typedef struct {
+    EntryKey key; // Content name as registered
+    atomic_int live; // Cleared while no peer holds the content
+    char text[]; // Lowercased name, then the name itself, then SEARCH_SLACK zero bytes
+} SearchName;
+
+// Ids of the names containing a trigram, ascending. An id is written before the count that
+// makes it visible; a full list is copied into a larger one and the old one retired.
+typedef struct {
+    atomic_uint count;
+    uint32_t capacity;
+    uint32_t ids[];
+} Postings;
+
+// The sizes sit next to the name pointer so that fuzzy candidates are screened without touching names
+typedef struct {
+    _Atomic(SearchName *) name; // Published after the sizes
+    uint16_t len;
+    uint16_t grams; // Distinct anchored trigrams, for fuzzy scores
+} SearchSlot;
+
+typedef struct {
+    uint32_t capacity;
+    uint8_t *grams; // Trigram counts again, capped at 255, packed after the slots for vector screening
+    SearchSlot slots[]; // By id
+} SearchNames;
+
+// Trigram inverted index over content names, read lock-free like the catalog. Rebuilding it
+// publishes a whole new index, so ids are only stable within one.
+typedef struct {
+    NameIndex by_name; // Name -> SearchName (writers only)
+    _Atomic(SearchNames *) names;
+    atomic_uint name_count; // Ids handed out
+    uint32_t live_count; // Writers only
+    uint32_t dead_count;
+    _Atomic(Postings *) buckets[SEARCH_BUCKETS];
+} SearchIndex;
+
+// Matches of one find request, written into its reply as they are found
+typedef struct {
+    ProtoWriter *writer;
+    int limit; // Names the page may hold
+    int found;
+    uint32_t next; // Cursor of the first match left out, 0 while none was
+} FindPage;
+
+// Changes recorded in the write-ahead log. Replaying one sets the state it names whatever the state
+// was, so a snapshot taken while writers kept going is made exact by replaying the log from its start.
+enum {
+    WAL_ADD = 1, // peer, content, address (4), port (2), size (8), chunk count (4), hashes: holds all of it
+    WAL_REMOVE = 2, // peer, content
+    WAL_REMOVE_PEER = 3, // peer
+    WAL_SYNC = 4, // node (1): only in replication streams, where that node's whole partition follows
+};
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+} ByteBuffer;
+
+// Group commit: writers append records under the catalog mutex while the log thread writes and
+// syncs the other buffer, so every change made during one fdatasync shares the next one
+typedef struct {
+    pthread_mutex_t lock; // Protects everything below
+    pthread_cond_t work; // Records to write or a segment to start
+    pthread_cond_t synced; // durable, rotate or failed changed
+    pthread_cond_t snapshot_wanted;
+    ByteBuffer buffers[2];
+    ByteBuffer *filling; // The buffer writers append to
+    uint64_t next_lsn; // Sequence number of the next record
+    uint64_t durable; // Every record up to this one is on disk
+    int rotate; // Start a new segment at rotate_offset of the filling buffer
+    size_t rotate_offset;
+    uint64_t rotate_lsn; // First record of that segment
+    uint64_t since_snapshot; // Bytes logged since the last snapshot started
+    int snapshot_due;
+    int fd; // Segment being appended (log thread only)
+    int logging; // Set once recovery has replayed the log
+    int failed; // Writing failed; later changes are kept in memory only
+} WriteAheadLog;
+
+// A snapshot is mapped and used in place. Fixed-size records come first, then the holder lists,
+// chunk hashes and names they refer to by offset, so only the pages of what is used are read:
+//   header | peers | contents | holders (padded to 8 bytes) | hashes | names
+typedef struct {
+    char magic[8]; // SNAPSHOT_MAGIC; also rejects a snapshot written with another byte order
+    uint64_t lsn; // Log records after this one are replayed over the snapshot
+    uint64_t peer_count;
+    uint64_t content_count;
+    uint64_t holder_count;
+    uint64_t hashes_len;
+    uint64_t names_len;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t name; // Offset into the names
+    uint32_t address; // Network byte order
+    uint16_t port; // Network byte order
+    uint16_t unused;
+} SnapshotPeer;
+
+typedef struct {
+    uint64_t name; // Offset into the names
+    uint64_t size;
+    uint64_t hashes; // Offset into the hashes
+    uint64_t holders; // Index of the first peer number in the holder lists
+    uint32_t chunk_count;
+    uint32_t holder_count; // Peers holding the whole content; partial holders are not kept
+} SnapshotContent;
+
+// The sections of a mapped snapshot
+typedef struct {
+    const SnapshotHeader *header;
+    const SnapshotPeer *peers;
+    const SnapshotContent *contents;
+    const uint32_t *holders;
+    const uint8_t *hashes;
+    const char *names;
+} SnapshotView;
+
+// A registration whose file bytes have not arrived on the data port yet
+typedef struct {
+    uint64_t token; // 0 marks a free slot
+    char peer_name[MAX_NAME_LENGTH + 1];
+    char content_name[MAX_NAME_LENGTH + 1];
+    struct sockaddr_in address;
+    uint64_t size;
+    time_t expires;
+} PendingUpload;
+
+// The block store keeps file bytes in CHUNK_SIZE blocks named by their BLAKE3 hash, so that the same
+// bytes are stored once however many names they come under. Blocks are appended to large segment
+// files, the blocks of one upload one after the other; a block nothing uses any more has its pages
+// punched out of the segment, and a segment left without blocks is deleted.
+enum { BLOCK_PENDING = 1, BLOCK_LIVE = 2, BLOCK_FREE = 3 };
+
+// Where store_stage reads the bytes of a file from
+enum { STAGE_FILE, STAGE_SOCKET, STAGE_LZ4 };
+
+// Page before the bytes of every block; a segment is read back by walking from header to header
+typedef struct {
+    char magic[8]; // STORE_MAGIC; anything else marks the end of what the segment holds
+    uint8_t hash[BLAKE3_OUT_LEN]; // Of the bytes, once the block is live
+    uint32_t len;
+    uint32_t state; // BLOCK_*
+} BlockHeader;
+
+// LZ4 form of a block, shared by the packed cache and the downloads sending it
+typedef struct PackedBlock {
+    atomic_int refs;
+    struct Block *block; // NULL once out of the cache
+    struct PackedBlock *newer; // In the cache, most recently used last
+    struct PackedBlock *older;
+    uint32_t len;
+    uint8_t data[];
+} PackedBlock;
+
+// Hot blocks are kept in memory under W-TinyLFU: a block asked for a second time enters a small LRU
+// window; what falls out of the window enters the main area only if it is asked for more often than
+// what would be evicted for it, so a scan through cold content cannot wash out the popular blocks.
+// Request frequencies come from a count-min sketch that is halved now and then to forget old
+// popularity. The main area is a segmented LRU: probation, and protected for blocks hit there.
+enum { CACHE_WINDOW, CACHE_PROBATION, CACHE_PROTECTED, CACHE_LISTS };
+
+// Copy of a block's bytes, shared by the cache and the downloads sending it
+typedef struct CachedBlock {
+    atomic_int refs;
+    struct Block *block; // NULL once out of the cache
+    int list; // CACHE_*
+    struct CachedBlock *newer; // In its list, most recently used last
+    struct CachedBlock *older;
+    uint32_t len;
+    uint8_t data[];
+} CachedBlock;
+
+typedef struct {
+    CachedBlock *oldest;
+    CachedBlock *newest;
+    uint64_t bytes;
+} CacheList;
+
+typedef struct {
+    uint64_t capacity; // Bytes; 0 when the cache is off
+    uint64_t window_limit;
+    uint64_t protected_limit;
+    CacheList lists[CACHE_LISTS];
+    uint8_t *sketch; // CACHE_SKETCH_ROWS rows of sketch_mask + 1 counters
+    uint64_t sketch_mask;
+    uint64_t sketch_count; // Requests counted since the last halving
+    uint64_t sketch_period; // Requests between halvings
+    size_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admitted; // Blocks that got into the main area
+    uint64_t rejected; // Blocks out of the window that lost against the main area's victim
+    uint64_t evicted;
+} HotCache;
+
+typedef struct Block {
+    uint8_t hash[BLAKE3_OUT_LEN];
+    int segment; // Position in store.segments
+    int fd; // Of that segment
+    off_t offset; // Of the bytes; the header is the page before
+    uint32_t len;
+    uint32_t refs; // Uses by stored objects, 0 while the block is only staged
+    struct Block *next; // In its chain of the block table
+    PackedBlock *packed; // Cached LZ4 form, if any
+    int incompressible; // Set once compressing the block turned out not to pay
+    CachedBlock *cached; // Copy in the hot cache, if any
+} Block;
+
+typedef struct {
+    int fd; // -1 once deleted
+    uint32_t number; // In the file name
+    off_t used; // Bytes handed out, headers included
+    uint32_t blocks; // Not freed yet, staged ones included
+} Segment;
+
+// A stored file: its blocks in order. Immutable once made, and shared by the object table and
+// the downloads streaming from it; its blocks are given up when the last of them lets go.
+typedef struct StoredObject {
+    char *name;
+    uint64_t hash; // Of the name
+    uint64_t size;
+    uint32_t block_count;
+    atomic_int refs;
+    struct StoredObject *next; // In its chain of the object table
+    Block *blocks[];
+} StoredObject;
+
+typedef struct {
+    pthread_mutex_t lock; // Protects everything below, but not the bytes of live blocks
+    Block **blocks; // By hash
+    size_t block_buckets; // Power of two
+    size_t block_count;
+    uint64_t block_bytes; // Bytes of every live block, each counted once
+    StoredObject **objects; // By name; the table holds a reference on each
+    size_t object_buckets; // Power of two
+    size_t object_count;
+    uint64_t object_bytes; // Sizes of the stored files, duplicated bytes counted every time
+    Segment *segments;
+    int segment_count;
+    int segment_capacity;
+    int current; // Segment new blocks go to, -1 while there is none
+    uint32_t next_number; // File number of the next segment
+    PackedBlock *packed_oldest; // Packed cache, evicted least recently used first
+    PackedBlock *packed_newest;
+    size_t packed_count;
+    uint64_t packed_bytes;
+    uint64_t packed_hits; // Compressed chunk requests served from the cache
+    uint64_t packed_misses; // Those that had to compress the block, or found it incompressible
+    HotCache cache;
+} BlockStore;
+
+enum { TRANSFER_READING, TRANSFER_SENDING };
+
+// One connection on the content listener; requests on it are served in order
+typedef struct {
+    int sock;
+    int state;
+    uint32_t events; // What epoll currently watches for
+    char request[2 * (MAX_NAME_LENGTH + 24)]; // Buffered request lines
+    size_t request_len;
+    unsigned char header[CONTENT_HEADER_SIZE];
+    unsigned char *reply; // Response preamble: header or a built manifest
+    size_t reply_len;
+    size_t reply_sent;
+    StoredObject *object; // Stored file the response streams from, if any
+    PackedBlock *packed; // Or LZ4 block it sends from memory
+    CachedBlock *cached; // Hot cache copy of the object's block being sent, if it has one
+    uint32_t cached_index; // Block of the object last looked up in the hot cache
+    off_t offset; // Next byte of it to send
+    off_t end;
+    int closing; // Drop the connection once the response is out, as after an HTTP request
+} Transfer;
+
+// Per-thread reader announcement for epoch-based reclamation
+typedef struct EpochRecord {
+    atomic_uint_fast64_t state; // (epoch << 1) | 1 inside a read section, 0 outside
+    struct EpochRecord *next;
+} EpochRecord;
+
+// Memory unlinked by a writer, freed once no reader can still hold it
+typedef struct Garbage {
+    void *ptr;
+    struct SlabPool *pool; // Where ptr goes back to, NULL for free() or the name arena
+    uint64_t epoch; // Global epoch when ptr was retired
+    struct Garbage *next;
+} Garbage;
+
+// Catalog names, interned in one reservation whose pages are backed as names reach them, so that a
+// name is known by a 32-bit handle and resolving one is an addition. The cells of a name that is gone
+// are reused by the next name of the same size. Writers only, apart from resolving handles.
+typedef struct {
+    char *base;
+    uint64_t top; // First byte never handed out
+    NameHandle free[NAME_CLASSES]; // Cells given back, by size, linked through their first bytes
+    uint64_t bytes; // Cells taken by live names
+} NameArena;
+
+// A client's interest in part of the catalog, which it is told about as it changes
+typedef struct Subscription {
+    struct Subscription *next; // Next in its hash bucket
+    struct sockaddr_in client;
+    uint32_t id; // Request id of its notifications
+    uint8_t kind; // SUBSCRIBE_*
+    uint8_t pattern_len;
+    char pattern[MAX_NAME_LENGTH + 1];
+    uint64_t cursor; // Last change looked through for it
+    uint64_t sent; // Last change the client was told it has everything up to
+    uint64_t expires; // Milliseconds on the monotonic clock
+} Subscription;
+
+// Catalog changes, numbered in the order they were made, for subscribers to be told of and to catch up
+// from. Records go round a ring of bytes, the oldest overwritten first; a subscriber that falls further
+// behind starts over from the current catalog. A change goes out once the log record describing it is
+// on disk.
+typedef struct {
+    pthread_mutex_t lock; // Protects the records and the numbers below it
+    uint8_t *ring; // FEED_BYTES of records: log number (8), type (1), seed (6), content, peer
+    uint64_t *offsets; // Where each record starts, counting every byte ever written, by number modulo FEED_EVENTS
+    uint64_t first; // Number of the oldest change kept
+    uint64_t next; // Number of the next change
+    uint64_t end; // Bytes ever written, padding at the end of the ring included
+    uint64_t id; // Random per run of the server, so that clients resuming from another run notice
+    pthread_mutex_t subscriptions_lock; // Protects the table below; taken before lock
+    Subscription **buckets; // By client address, kind and pattern
+    size_t bucket_count; // Power of two
+    size_t subscription_count;
+    uint32_t next_subscription;
+} ChangeFeed;
+
+// Objects of one size carved out of slabs and recycled through a free list, so that their user stops
+// calling the allocator once it has been through its peak; slabs are kept for good. Each pool belongs
+// to one thread or is guarded by one lock. Catalog records, whose size varies with their holders or
+// chunks, share one pool per power-of-two size class (record_pools).
+typedef struct SlabPool {
+    size_t size; // Object size, at least that of a pointer
+    void *free; // Free objects, linked through their first word
+} SlabPool;
+
+typedef struct {
+    uint8_t buffer[BUFFER_SIZE];
+    size_t len;
+    struct sockaddr_in addr;
+    int lane; // LANE_*, as admission decided
+} Request;
+
+// What admission does with a request
+enum {
+    LANE_SHED, // Turned away, and answered so if it gets answers at all
+    LANE_READ, // Handled with the first part of its batch
+    LANE_WRITE, // Handled once the rest of its batch is answered, as its reply waits for the log
+};
+
+// How admission treats an opcode
+typedef struct {
+    uint8_t cost; // Tokens per record
+    uint8_t lane; // LANE_READ or LANE_WRITE
+    uint16_t patience_ms; // Longest wait in a shard's queue before it is turned away
+} AdmitRule;
+
+// Token bucket of the client addresses hashing to it, kept as the time by which they will have earned every
+// token they spent (GCRA): a request is let in while that stays less than a burst ahead of now. Addresses
+// that collide share the bucket rather than reset it, so a client cannot buy a fresh burst by colliding.
+typedef struct {
+    atomic_uint_fast64_t paid_until; // Nanoseconds on the monotonic clock
+} AdmitBucket;
+
+// Changes this node ships to another node of the cluster that owns some of the same names
+typedef struct {
+    pthread_mutex_t lock; // Protects everything below
+    pthread_cond_t work; // Records were queued
+    ByteBuffer queue; // Records not sent yet, in the order the changes were made
+    int node; // Position in the cluster
+    int fd; // Connection to the node's replication port
+    int connected; // Records queue up only while connected; a new connection starts with a resync
+} ReplicaLink;
+
+// How a router answers a request from what the nodes answer
+enum {
+    ROUTE_RELAY, // One node answers; its reply datagrams are passed on
+    ROUTE_FIND, // Like a relay, with the cursor translated between the cluster and the node
+    ROUTE_FIRST_OK, // Every node is asked; the first success is the answer
+    ROUTE_GATHER, // Every node is asked; every part of their successes is passed on
+    ROUTE_SPLIT, // Records go to the node owning them; their answers are put back in request order
+    ROUTE_SPLIT_INDEXED, // Same, but answers name their record and are passed on as they come
+};
+
+// A request a router answers on behalf of the nodes
+typedef struct {
+    struct sockaddr_in client;
+    ProtoHeader request; // As the client sent it; answers go back under its id
+    uint8_t mode; // ROUTE_*
+    int legs; // Requests to nodes still unanswered
+    int relayed; // Successful answers so far
+    int node; // Node a find is paging through
+    int record_size; // Size of one answer record of a split
+    uint64_t deadline; // Milliseconds on the monotonic clock
+    size_t reply_len; // Answer kept until the end, 0 while there is none
+    uint8_t reply[PROTO_MAX_DATAGRAM];
+} Route;
+
+// One request sent to a node on behalf of a route
+typedef struct {
+    uint32_t id; // Id the node sees; 0 marks a free slot
+    Route *route;
+    int count; // Records of the route's request carried by this one
+    uint16_t positions[PROTO_MAX_DATAGRAM / 2]; // Where they stand in the route's request
+} RouteLeg;
+
+// Replies produced by one shard, flushed together with sendmmsg
+typedef struct {
+    int fd; // Socket they leave from
+    char data[BATCH_SIZE][BUFFER_SIZE];
+    struct sockaddr_in addr[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+    int count;
+} ReplyBatch;
+
+// One slice of the control plane: its own SO_REUSEPORT socket on the control port, which the kernel
+// hashes each client onto, served to completion by one thread pinned to its own core. Shards share
+// nothing on the way; lookups read the catalog lock-free and only catalog writes meet at the mutex.
+typedef struct {
+    int index;
+    int fd;
+    int cpu; // Core the thread runs on, -1 if it could not be pinned
+    pthread_t thread;
+    ReplyBatch replies;
+    Request requests[BATCH_SIZE]; // Receive buffers, handled in place
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    uint8_t stamps[BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))]; // When the kernel received each datagram
+} Shard;
+
+// Counters of one thread. Only the thread itself writes them, with plain relaxed stores, and readers sum
+// every thread's, so counting on the hot paths shares no cache line and takes no lock.
+typedef struct ThreadStats {
+    atomic_uint_fast64_t requests[STATS_OPCODES]; // Control requests, by opcode
+    atomic_uint_fast64_t failures[STATS_OPCODES]; // Those answered with an error status
+    atomic_uint_fast64_t latency_sum[STATS_OPCODES]; // Nanoseconds from receipt to reply
+    atomic_uint_fast64_t latency[STATS_OPCODES][HIST_BUCKETS];
+    atomic_uint_fast64_t shed[2][STATS_OPCODES]; // Requests turned away, for their client's rate and for load
+    atomic_uint_fast64_t uploads; // Files stored through the upload port
+    atomic_uint_fast64_t bytes_uploaded;
+    atomic_uint_fast64_t responses; // Responses the content port finished
+    atomic_uint_fast64_t bytes_served;
+    struct ThreadStats *next;
+} ThreadStats;
+
+// A log line waiting to be written out
+typedef struct {
+    atomic_size_t sequence; // Tells producers and the log thread whose turn the cell is
+    char line[LOG_LINE_SIZE];
+} LogCell;
+
+// Bounded ring of log lines, filled by any thread and emptied by the log thread alone, so that a slow
+// terminal or disk never holds up a request
+typedef struct {
+    LogCell cells[LOG_RING_SLOTS];
+    _Alignas(64) atomic_size_t head; // Next cell to write out
+    _Alignas(64) atomic_size_t tail; // Next cell to fill
+} LogRing;
+
+NameIndex content_index; // Content name -> ContentEntry
+NameIndex peer_index; // Peer name -> PeerEntry
+_Atomic(PeerSlots *) peer_slots; // Peers by slot
+int peer_slot_count; // Slots handed out so far
+int *free_peer_slots; // Stack of slots released by departed peers
+int free_peer_slot_count;
+int free_peer_slot_capacity;
+atomic_uint_fast64_t global_epoch; // Advanced by writers once every reader has caught up
+_Atomic(EpochRecord *) epoch_records; // Every thread that has entered a read section
+__thread EpochRecord *epoch_record; // This thread's entry in epoch_records
+Garbage *garbage_head; // Retired memory, oldest first (writers only)
+Garbage *garbage_tail;
+SlabPool garbage_pool = {sizeof(Garbage), NULL}; // Writers only
+SlabPool record_pools[RECORD_CLASSES]; // Catalog records by size class, set up by catalog_init (writers only)
+NameArena name_arena; // Every peer and content name in the catalog
+_Atomic(SearchIndex *) search_index; // Content names by trigram
+WriteAheadLog wal; // Catalog changes on their way to disk
+__thread uint64_t wal_awaited; // Last record this thread logged; its replies wait until it is durable
+const uint8_t *snapshot_map; // Snapshot the catalog was loaded from, mapped for the life of the process
+size_t snapshot_map_len;
+atomic_int search_warming; // Set until the names loaded from the snapshot are all in the search index
+LeaseWheel lease_wheel; // Peer leases by expiry tick
+ChangeFeed feed; // Catalog changes for subscribers
+int server_port = PORT; // Control port; the upload, content and replication ports follow it
+int upload_port = PORT + 1;
+int content_port = PORT + 2;
+int cluster_port = PORT + 3;
+int admit_rate = ADMIT_RATE; // Tokens a client earns per second, 0 for no limit
+AdmitBucket *admit_buckets; // By client address and shared by every shard, NULL without rate limits
+Cluster cluster; // Every node of the index, this one included
+Cluster routers; // Routers in front of this node, whose requests are limited by the routers themselves
+int cluster_self = -1; // Position of this node in the cluster, -1 when it runs alone
+ReplicaLink replica_links[CLUSTER_MAX_NODES]; // By node; this node's own is unused
+__thread int replica_applying; // Set while applying another node's changes, which are not shipped on
+RouteLeg *router_legs; // Requests a router has out to the nodes, by the low bits of their id
+SlabPool route_pool = {sizeof(Route), NULL}; // Requests the router is answering (router thread only)
+uint32_t router_next_id;
+int router_fd; // Socket a router talks to the nodes on
+
+int sockfd; // Control socket of the first shard (of a router: its only one), for replies sent outside a shard
+Shard *shards;
+int shard_count;
+pthread_mutex_t mutex; // Serializes catalog writers; readers never take it
+__thread ReplyBatch *reply_batch; // Pending replies of the current shard
+PendingUpload pending_uploads[MAX_PENDING_UPLOADS]; // Indexed by the low bits of the token
+pthread_mutex_t upload_mutex; // Protects pending_uploads
+BlockStore store; // Bytes of the uploaded files
+_Atomic(ThreadStats *) stats_records; // Counters of every thread that has counted something
+__thread ThreadStats *thread_stats; // This thread's entry in stats_records
+atomic_int uploads_active; // Upload connections being stored
+atomic_int transfers_open; // Connections on the content port
+__thread SlabPool transfer_pool = {sizeof(Transfer), NULL}; // Connections of this content thread
+LogRing log_ring;
+int log_rate = LOG_RATE; // Lines per second, 0 when logging is off
+long cache_megabytes = CACHE_MEGABYTES; // Size of the hot block cache, 0 to serve every block from disk
+atomic_int log_budget; // Lines that may still be logged until the next tick
+atomic_uint_fast64_t log_dropped; // Lines left out for the rate or a full ring
+
+void handle_peer(Request *req);
+void register_content(const ProtoHeader *request, const char *peer_name, const char *content_name, uint64_t size,
+                      struct sockaddr_in *seed, struct sockaddr_in *addr);
+void deregister_content(const ProtoHeader *request, const char *peer_name, const char *content_name,
+                        struct sockaddr_in *client_addr);
+void search_content(const ProtoHeader *request, const char *content_name, struct sockaddr_in *client_addr);
+void handle_list(const ProtoHeader *request, const char *peer_name, struct sockaddr_in *client_addr);
+void send_error(struct sockaddr_in *client_addr, const ProtoHeader *request, uint8_t status, const char *error_msg);
+void handle_download(const ProtoHeader *request, const char *content_name, struct sockaddr_in *client_addr);
+void handle_have(const char *peer_name, const char *content_name, uint32_t chunk, struct sockaddr_in *seed);
+void register_batch(const ProtoHeader *request, ProtoReader *reader, struct sockaddr_in *addr);
+void deregister_batch(const ProtoHeader *request, ProtoReader *reader, struct sockaddr_in *addr);
+void search_batch(const ProtoHeader *request, ProtoReader *reader, struct sockaddr_in *addr);
+void handle_find(const ProtoHeader *request, uint8_t mode, uint32_t cursor, uint8_t limit, const char *pattern,
+                 struct sockaddr_in *addr);
+int collect_holders(const char *content_name, struct sockaddr_in *out, int max);
+int already_held(const char *peer_name, const char *content_name, uint64_t size);
+int shards_open(struct sockaddr_in *addr, int count);
+int admit(const uint8_t *datagram, size_t len, struct sockaddr_in *client, uint64_t now, uint64_t waited);
+void *shard_thread(void *arg);
+void send_reply(struct sockaddr_in *client_addr, const void *data, size_t len);
+void flush_replies(void);
+uint64_t name_hash(const char *name);
+void epoch_enter(void);
+void epoch_exit(void);
+void retire(void *ptr);
+void epoch_collect(void);
+void *slab_get(SlabPool *pool);
+void slab_put(SlabPool *pool, void *object);
+void *record_alloc(size_t size);
+void record_free(void *record, size_t size);
+void retire_record(void *record, size_t size);
+int name_arena_init(void);
+char *name_store(const char *name);
+void name_release(char *name);
+NameHandle name_handle(const char *name);
+const char *name_at(NameHandle handle);
+int index_init(NameIndex *index, size_t capacity);
+EntryKey *index_find(NameIndex *index, const char *name, uint64_t hash);
+int index_reserve(NameIndex *index);
+void index_insert(NameIndex *index, EntryKey *key);
+void index_replace(NameIndex *index, EntryKey *old_key, EntryKey *new_key);
+void index_remove(NameIndex *index, EntryKey *key);
+PeerEntry *find_peer(const char *peer_name);
+ContentEntry *find_content(const char *content_name);
+PeerEntry *peer_at(int slot);
+int catalog_init(void);
+int catalog_add(const char *peer_name, const char *content_name, struct sockaddr_in *addr,
+                Manifest *manifest, int64_t chunk);
+int holder_has_chunk(const Holder *holder, const Manifest *manifest, uint32_t chunk);
+int catalog_remove(const char *peer_name, const char *content_name);
+int catalog_remove_peer(const char *peer_name);
+int catalog_remove_many(const char *peer_name, const char **content_names, int count, uint8_t *statuses);
+int valid_content_name(const char *content_name);
+int search_index_init(void);
+int search_index_add(const char *content_name);
+void search_index_remove(const char *content_name);
+void search_index_find(FindPage *page, uint8_t mode, const char *pattern, size_t len, uint32_t cursor);
+int catalog_recover(void);
+void wal_log(uint8_t type, const char *peer_name, const char *content_name, const struct sockaddr_in *addr,
+             const Manifest *manifest);
+int catalog_snapshot(void);
+void wal_wait(void);
+void *wal_thread(void *arg);
+void *snapshot_thread(void *arg);
+void *search_warm_thread(void *arg);
+uint64_t now_ms(void);
+PeerLease *lease_new(const char *peer_name);
+void lease_file(PeerLease *lease);
+void lease_cancel(PeerLease *lease);
+void *lease_thread(void *arg);
+int feed_init(void);
+void feed_publish(uint8_t type, const char *peer_name, const char *content_name, const struct sockaddr_in *seed);
+void *feed_thread(void *arg);
+void handle_subscribe(const ProtoHeader *request, uint8_t kind, uint64_t feed_id, uint64_t since, const char *pattern,
+                      struct sockaddr_in *addr);
+void handle_unsubscribe(const ProtoHeader *request, uint8_t kind, const char *pattern, struct sockaddr_in *addr);
+void handle_heartbeat(const ProtoHeader *request, const char *peer_name, struct sockaddr_in *addr);
+uint64_t upload_open(const char *peer_name, const char *content_name, uint64_t size, struct sockaddr_in *addr);
+int upload_claim(uint64_t token, PendingUpload *out);
+void *upload_thread(void *arg);
+int store_open(void);
+int store_attach(void);
+Block **store_stage(int fd, int source, uint64_t size, uint32_t *count);
+void store_unstage(Block **staged, uint32_t count);
+StoredObject *store_commit(const char *content_name, Block **staged, uint32_t count, uint64_t size,
+                           Manifest **manifest);
+void store_publish(StoredObject *object);
+void store_forget(const char *content_name, const Manifest *manifest);
+StoredObject *store_acquire(const char *content_name);
+void store_release(StoredObject *object);
+PackedBlock *store_pack(Block *block);
+void packed_release(PackedBlock *packed);
+CachedBlock *store_cached(Block *block);
+void cached_release(CachedBlock *entry);
+void *content_thread(void *arg);
+int cluster_find_self(void);
+int cluster_start(void);
+void *replica_thread(void *arg);
+void *cluster_thread(void *arg);
+void *replica_receive_thread(void *arg);
+void router_run(void);
+ThreadStats *stats_self(void);
+void stat_add(atomic_uint_fast64_t *counter, uint64_t n);
+void stats_request(const Request *request, uint64_t latency);
+void stats_failure(uint8_t opcode);
+void stats_shed(uint8_t opcode, int late);
+unsigned char *metrics_reply(int found, size_t *reply_len);
+uint64_t now_ns(void);
+void log_event(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void *log_thread(void *arg);
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in server_addr;
+    pthread_t uploaders[UPLOAD_THREADS];
+    pthread_t content_loops[CONTENT_THREADS];
+    pthread_t wal_writer;
+    pthread_t snapshotter;
+    pthread_t search_warmer;
+    pthread_t lease_keeper;
+    pthread_t notifier;
+    pthread_t logger;
+    int upload_fd;
+    int content_fd;
+    const char *nodes = NULL;
+    const char *trusted = NULL;
+    const char *dir = NULL;
+    int replicas = CLUSTER_DEFAULT_REPLICAS;
+    int router = 0;
+    int option;
+
+    // -p sets the control port and -d the directory the catalog and content are kept in, -s how many
+    // shards serve the control port (one per core by default), -l how many lines a second are
+    // logged (0 for none), -m how many megabytes of hot blocks are kept in memory and -a how many
+    // tokens of requests each client address may send a second (0 for no limit). -c lists the
+    // nodes of a cluster, this one among them at one of this host's addresses, and -r how many of
+    // them own each name; with -R this process owns nothing and routes requests to the nodes
+    // instead. -t lists the routers in front of this node by the address and port their clients
+    // use; what a router forwards is not limited per client, since it limits its clients itself, and
+    // only a router may name the address a peer seeds from.
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    shard_count = cores < MIN_SHARDS ? MIN_SHARDS : cores > MAX_SHARDS ? MAX_SHARDS : (int)cores;
+    while ((option = getopt(argc, argv, "p:s:l:m:a:c:r:d:Rt:")) != -1) {
+        if (option == 'p') {
+            server_port = atoi(optarg);
+        } else if (option == 'c') {
+            nodes = optarg;
+        } else if (option == 'r') {
+            replicas = atoi(optarg);
+        } else if (option == 's') {
+            shard_count = atoi(optarg);
+        } else if (option == 'l') {
+            log_rate = atoi(optarg);
+        } else if (option == 'm') {
+            cache_megabytes = atol(optarg);
+        } else if (option == 'a') {
+            admit_rate = atoi(optarg);
+        } else if (option == 'd') {
+            dir = optarg;
+        } else if (option == 'R') {
+            router = 1;
+        } else if (option == 't') {
+            trusted = optarg;
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-s shards] [-l lines] [-m megabytes] [-a tokens] [-d dir] "
+                    "[-c address:port,... [-r replicas] [-R]] [-t address:port,...]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (server_port <= 0 || server_port > 65535 - 3 || shard_count < 1 || shard_count > MAX_SHARDS || log_rate < 0 ||
+        cache_megabytes < 0 || admit_rate < 0 || (router && !nodes)) {
+        fprintf(stderr,
+                "Usage: %s [-p port] [-s shards] [-l lines] [-m megabytes] [-a tokens] [-d dir] "
+                "[-c address:port,... [-r replicas] [-R]] [-t address:port,...]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN); // A client gone in the middle of a sendfile is an error to handle, not the end
+    if (dir && chdir(dir) != 0) {
+        perror("Failed to enter the data directory");
+        exit(EXIT_FAILURE);
+    }
+    upload_port = server_port + 1;
+    content_port = server_port + 2;
+    cluster_port = server_port + 3;
+    if (nodes && cluster_init(&cluster, nodes, replicas) != 0) {
+        fprintf(stderr, "Malformed node list '%s'\n", nodes);
+        exit(EXIT_FAILURE);
+    }
+    if (trusted && cluster_init(&routers, trusted, 1) != 0) {
+        fprintf(stderr, "Malformed router list '%s'\n", trusted);
+        exit(EXIT_FAILURE);
+    }
+    if (nodes && !router && (cluster_self = cluster_find_self()) < 0) {
+        fprintf(stderr, cluster_self == -1 ? "No node listed is this host on port %d\n"
+                                           : "Several nodes listed are this host on port %d\n", server_port);
+        exit(EXIT_FAILURE);
+    }
+    if (log_rate > 0 && pthread_create(&logger, NULL, log_thread, NULL) != 0) {
+        perror("Failed to start log thread");
+        exit(EXIT_FAILURE);
+    }
+    if (admit_rate > 0 && !(admit_buckets = calloc(ADMIT_CLIENTS, sizeof(AdmitBucket)))) {
+        perror("Failed to allocate rate limits");
+        exit(EXIT_FAILURE);
+    }
+    if (router) {
+        router_run();
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize the catalog
+    if (catalog_init() != 0 || feed_init() != 0) {
+        perror("Failed to allocate catalog");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&mutex, NULL); // Initialize the mutex
+    pthread_mutex_init(&upload_mutex, NULL);
+    pthread_mutex_init(&store.lock, NULL);
+
+    // Find the stored blocks, load the last snapshot and replay the log written since, then keep logging.
+    // The recovered catalog tells which blocks are still in use.
+    if (store_open() != 0) {
+        printf("Failed to open the block store in %s\n", STORE_DIR);
+        exit(EXIT_FAILURE);
+    }
+    if (catalog_recover() != 0) {
+        printf("Failed to recover the catalog from %s\n", CATALOG_DIR);
+        exit(EXIT_FAILURE);
+    }
+    if (store_attach() != 0) {
+        printf("Failed to attach the catalog to the block store\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&wal_writer, NULL, wal_thread, NULL) != 0 ||
+        pthread_create(&lease_keeper, NULL, lease_thread, NULL) != 0 ||
+        pthread_create(&snapshotter, NULL, snapshot_thread, NULL) != 0 ||
+        (atomic_load(&search_warming) && pthread_create(&search_warmer, NULL, search_warm_thread, NULL) != 0)) {
+        perror("Failed to start catalog maintenance threads");
+        exit(EXIT_FAILURE);
+    }
+
+    // Prepare server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(server_port);
+
+    // Bind a control socket per shard
+    if (shards_open(&server_addr, shard_count) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the upload listener
+    if ((upload_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Upload socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    int reuse = 1;
+    setsockopt(upload_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    server_addr.sin_port = htons(upload_port);
+    if (bind(upload_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+        listen(upload_fd, SOMAXCONN) < 0) {
+        perror("Upload listener setup failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < UPLOAD_THREADS; i++) {
+        if (pthread_create(&uploaders[i], NULL, upload_thread, &upload_fd) != 0) {
+            perror("Failed to start upload thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Create the content listener shared by the download event loops
+    if ((content_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Content socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(content_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    server_addr.sin_port = htons(content_port);
+    if (bind(content_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+        listen(content_fd, SOMAXCONN) < 0) {
+        perror("Content listener setup failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < CONTENT_THREADS; i++) {
+        if (pthread_create(&content_loops[i], NULL, content_thread, &content_fd) != 0) {
+            perror("Failed to start content thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Subscribers are sent what changed from the first shard's socket
+    if (pthread_create(&notifier, NULL, feed_thread, NULL) != 0) {
+        perror("Failed to start notification thread");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every shard but the first gets a thread of its own; this one serves the first
+    for (int i = 1; i < shard_count; i++) {
+        if (pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i]) != 0) {
+            perror("Failed to start shard thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Ship changes to the nodes sharing our names and take theirs
+    if (cluster_self >= 0 && cluster_start() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Index Server is running on port %d in %d shard(s) (uploads on %d, downloads on %d)\n", server_port,
+           shard_count, upload_port, content_port);
+    if (cluster_self >= 0) {
+        printf("Node %d of a %d-node cluster keeping %d cop%s of each name, replicating on port %d\n", cluster_self,
+               cluster.node_count, cluster.replicas, cluster.replicas == 1 ? "y" : "ies", cluster_port);
+    }
+
+    shard_thread(&shards[0]);
+
+    pthread_mutex_destroy(&mutex); // Clean up the mutex
+    return 0;
+}
+
+// Open count sockets on the control port with SO_REUSEPORT, so that the kernel spreads clients over
+// them by address, and give each a core; returns 0, or -1 with nothing usable
+int shards_open(struct sockaddr_in *addr, int count) {
+    cpu_set_t allowed;
+    int cpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        cpus = CPU_COUNT(&allowed);
+    }
+    shards = calloc(count, sizeof(Shard));
+    if (!shards) {
+        perror("Failed to allocate shards");
+        return -1;
+    }
+
+    for (int i = 0, cpu = -1; i < count; i++) {
+        Shard *shard = &shards[i];
+        int reuse = 1;
+        shard->index = i;
+        shard->cpu = -1;
+        if ((shard->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+            setsockopt(shard->fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0 ||
+            bind(shard->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+            perror("Bind failed");
+            return -1;
+        }
+        shard->replies.fd = shard->fd;
+
+        // Receive times tell how long a request queued; without them nothing is shed for load. A request
+        // turned away is answered, unlike one the kernel drops for want of room, so the queue is deep.
+        int queue_size = SHARD_RCVBUF;
+        setsockopt(shard->fd, SOL_SOCKET, SO_TIMESTAMPNS, &reuse, sizeof(reuse));
+        setsockopt(shard->fd, SOL_SOCKET, SO_RCVBUF, &queue_size, sizeof(queue_size));
+
+        // Shards take the allowed cores in turn; more shards than cores share them
+        for (int tries = 0; cpus > 0 && tries < CPU_SETSIZE; tries++) {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+            if (CPU_ISSET(cpu, &allowed)) {
+                shard->cpu = cpu;
+                break;
+            }
+        }
+        for (int j = 0; j < BATCH_SIZE; j++) {
+            shard->iov[j].iov_base = shard->requests[j].buffer;
+            shard->iov[j].iov_len = BUFFER_SIZE;
+        }
+    }
+    sockfd = shards[0].fd;
+    return 0;
+}
+
+// Nanoseconds a datagram waited in the socket's queue, from the receive time the kernel gave it
+static uint64_t queued_for(struct msghdr *msg, const struct timespec *now) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            int64_t waited = (int64_t)(now->tv_sec - stamp.tv_sec) * 1000000000 + (now->tv_nsec - stamp.tv_nsec);
+            return waited > 0 ? (uint64_t)waited : 0;
+        }
+    }
+    return 0;
+}
+
+// Serve one shard: take a batch of datagrams, let in what admission allows, handle the reads and send
+// their replies, then the writes, whose replies wait for the log
+void *shard_thread(void *arg) {
+    Shard *shard = arg;
+    if (shard->cpu >= 0) {
+        cpu_set_t core;
+        CPU_ZERO(&core);
+        CPU_SET(shard->cpu, &core);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(core), &core) != 0) {
+            shard->cpu = -1; // Left to the scheduler
+        }
+    }
+    reply_batch = &shard->replies;
+
+    while (1) {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            memset(&shard->msgs[i].msg_hdr, 0, sizeof(shard->msgs[i].msg_hdr));
+            shard->msgs[i].msg_hdr.msg_name = &shard->requests[i].addr;
+            shard->msgs[i].msg_hdr.msg_namelen = sizeof(shard->requests[i].addr);
+            shard->msgs[i].msg_hdr.msg_iov = &shard->iov[i];
+            shard->msgs[i].msg_hdr.msg_iovlen = 1;
+            shard->msgs[i].msg_hdr.msg_control = shard->stamps[i];
+            shard->msgs[i].msg_hdr.msg_controllen = sizeof(shard->stamps[i]);
+        }
+
+        // Block for the first datagram, then take whatever else is queued
+        int n = recvmmsg(shard->fd, shard->msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            perror("Failed to receive datagrams");
+            continue;
+        }
+        uint64_t received = now_ns();
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        int writes = 0;
+        for (int i = 0; i < n; i++) {
+            Request *request = &shard->requests[i];
+            request->len = shard->msgs[i].msg_len;
+            request->lane = admit(request->buffer, request->len, &request->addr, received,
+                                  queued_for(&shard->msgs[i].msg_hdr, &wall));
+            if (request->lane == LANE_READ) {
+                handle_peer(request);
+            }
+            writes += request->lane == LANE_WRITE;
+        }
+        flush_replies();
+
+        // A request is answered when its part of the batch is, which for writes may have waited for the log
+        uint64_t answered = now_ns();
+        for (int i = 0; i < n; i++) {
+            if (shard->requests[i].lane != LANE_WRITE) {
+                stats_request(&shard->requests[i], answered - received);
+            }
+        }
+        if (writes == 0) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            if (shard->requests[i].lane == LANE_WRITE) {
+                handle_peer(&shard->requests[i]);
+            }
+        }
+        flush_replies();
+        answered = now_ns();
+        for (int i = 0; i < n; i++) {
+            if (shard->requests[i].lane == LANE_WRITE) {
+                stats_request(&shard->requests[i], answered - received);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Queue a reply; it goes out with the rest of the shard's batch
+void send_reply(struct sockaddr_in *client_addr, const void *data, size_t len) {
+    ReplyBatch *batch = reply_batch;
+    if (!batch) {
+        sendto(sockfd, data, len, 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
+        return;
+    }
+    if (batch->count == BATCH_SIZE) {
+        flush_replies();
+    }
+
+    int i = batch->count++;
+    if (len > BUFFER_SIZE) {
+        len = BUFFER_SIZE;
+    }
+    memcpy(batch->data[i], data, len);
+    batch->addr[i] = *client_addr;
+    batch->iov[i].iov_base = batch->data[i];
+    batch->iov[i].iov_len = len;
+    memset(&batch->msgs[i].msg_hdr, 0, sizeof(batch->msgs[i].msg_hdr));
+    batch->msgs[i].msg_hdr.msg_name = &batch->addr[i];
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addr[i]);
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+void flush_replies(void) {
+    ReplyBatch *batch = reply_batch;
+    if (!batch) {
+        return;
+    }
+    wal_wait(); // Never acknowledge a change that a crash could still lose
+
+    int sent = 0;
+    while (sent < batch->count) {
+        int n = sendmmsg(batch->fd, batch->msgs + sent, batch->count - sent, 0);
+        if (n < 0) {
+            perror("Failed to send replies");
+            break;
+        }
+        sent += n;
+    }
+    batch->count = 0;
+}
+
+// Tell a client its request was turned away unhandled, and after how many nanoseconds to send it again
+static void send_overloaded(struct sockaddr_in *client_addr, const ProtoHeader *request, const char *message,
+                            uint64_t retry) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    uint64_t retry_ms = retry / 1000000 + 1;
+    retry_ms = retry_ms < RETRY_MIN_MS ? RETRY_MIN_MS : retry_ms > RETRY_MAX_MS ? RETRY_MAX_MS : retry_ms;
+    stats_failure(request->opcode);
+    ProtoWriter writer;
+    ProtoHeader header = {request->opcode | PROTO_REPLY, PROTO_OVERLOADED, 0, request->request_id, 0};
+    proto_begin(&writer, buffer, sizeof(buffer), &header);
+    proto_put_name(&writer, message);
+    proto_put_int(&writer, retry_ms, 2);
+    proto_end_record(&writer);
+    size_t len = proto_finish(&writer);
+    if (len > 0) {
+        send_reply(client_addr, buffer, len);
+    }
+}
+
+// Decide what becomes of a datagram that queued for waited nanoseconds. A request that waited longer
+// than its opcode can stand is turned away for load, so that a backlog drains at once instead of
+// every request in it being answered late; then one its client has no tokens left for. A client is its
+// address, whatever port and shard its requests use. Returns the lane of a request let in; anything
+// that is not a request is left to handle_peer to drop.
+int admit(const uint8_t *datagram, size_t len, struct sockaddr_in *client, uint64_t now, uint64_t waited) {
+    static const AdmitRule rules[STATS_OPCODES] = {
+        [0] = {1, LANE_READ, SHED_READ_MS},
+        [OP_REGISTER] = {ADMIT_WRITE_COST, LANE_WRITE, SHED_WRITE_MS},
+        [OP_DEREGISTER] = {ADMIT_WRITE_COST, LANE_WRITE, SHED_WRITE_MS},
+        [OP_SEARCH] = {1, LANE_READ, SHED_READ_MS},
+        [OP_LIST] = {2, LANE_READ, SHED_READ_MS},
+        [OP_DOWNLOAD] = {1, LANE_READ, SHED_READ_MS},
+        [OP_HAVE] = {1, LANE_WRITE, SHED_WRITE_MS},
+        [OP_REGISTER_BATCH] = {ADMIT_WRITE_COST, LANE_WRITE, SHED_WRITE_MS},
+        [OP_DEREGISTER_BATCH] = {ADMIT_WRITE_COST, LANE_WRITE, SHED_WRITE_MS},
+        [OP_SEARCH_BATCH] = {1, LANE_READ, SHED_READ_MS},
+        [OP_FIND] = {2, LANE_READ, SHED_READ_MS},
+        [OP_HEARTBEAT] = {1, LANE_READ, SHED_CONTROL_MS},
+        [OP_SUBSCRIBE] = {1, LANE_READ, SHED_READ_MS},
+        [OP_UNSUBSCRIBE] = {1, LANE_READ, SHED_CONTROL_MS},
+    };
+    ProtoHeader request;
+    ProtoReader reader;
+    if (proto_parse(datagram, len, &request, &reader) != 0 || (request.opcode & PROTO_REPLY)) {
+        return LANE_READ;
+    }
+    const AdmitRule *rule = &rules[request.opcode < STATS_OPCODES ? request.opcode : 0];
+    int late = waited > (uint64_t)rule->patience_ms * 1000000;
+    uint64_t retry = late ? waited : 0;
+    if (!late && admit_buckets && !cluster_has_router(&routers, client)) { // Routers limit their clients themselves
+        uint64_t key = client->sin_addr.s_addr;
+        AdmitBucket *bucket = &admit_buckets[(key * 0x9E3779B97F4A7C15ULL >> 32) & (ADMIT_CLIENTS - 1)];
+
+        // A batch pays for every record, but never more than a burst, or it could never get in
+        uint64_t burst = (uint64_t)ADMIT_BURST_SECONDS * 1000000000;
+        uint64_t cost = (uint64_t)rule->cost * (request.count > 0 ? request.count : 1) * 1000000000 / admit_rate;
+        cost = cost < burst ? cost : burst;
+        uint64_t paid_until = atomic_load_explicit(&bucket->paid_until, memory_order_relaxed);
+        while (1) {
+            uint64_t paid = paid_until > now ? paid_until : now;
+            if (paid + cost > now + burst) {
+                retry = paid + cost - now - burst;
+                break;
+            }
+            // Fails if another shard spent from the bucket meanwhile, and then looks again
+            if (atomic_compare_exchange_weak_explicit(&bucket->paid_until, &paid_until, paid + cost,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+    if (retry == 0) {
+        return rule->lane;
+    }
+
+    stats_shed(request.opcode, late);
+    if (request.opcode != OP_HAVE) { // Never answered
+        send_overloaded(client, &request, late ? "Server is overloaded" : "Too many requests from this address",
+                        retry);
+    }
+    return LANE_SHED;
+}
+
+// Where a peer serves its content from, as a request gives it. Only a router may name an address, that of
+// the peer it forwards for; anyone else seeds from the address the datagram came from, or could send
+// every downloader of what it registers to some third party.
+static struct sockaddr_in read_seed(ProtoReader *reader, const struct sockaddr_in *from) {
+    struct sockaddr_in seed;
+    memset(&seed, 0, sizeof(seed));
+    seed.sin_family = AF_INET;
+    seed.sin_addr.s_addr = htonl((uint32_t)proto_get_int(reader, 4));
+    seed.sin_port = htons((uint16_t)proto_get_int(reader, 2));
+    if (seed.sin_addr.s_addr == htonl(INADDR_ANY) || !cluster_has_router(&routers, from)) {
+        seed.sin_addr = from->sin_addr;
+    }
+    return seed;
+}
+
+void handle_peer(Request *req) {
+    struct sockaddr_in client_addr = req->addr;
+    ProtoHeader request;
+    ProtoReader reader;
+
+    // Without a valid header there is no request id to answer to; replies are never answered
+    if (proto_parse(req->buffer, req->len, &request, &reader) != 0 || (request.opcode & PROTO_REPLY)) {
+        log_event("Dropped malformed datagram from %s\n", inet_ntoa(client_addr.sin_addr));
+        return;
+    }
+    log_event("Received: request %u, opcode %d\n", request.request_id, request.opcode);
+    if (request.count != 1 && (request.opcode < OP_REGISTER_BATCH || request.opcode >= OP_FIND)) {
+        send_error(&client_addr, &request, PROTO_MALFORMED, "Expected one record");
+        return;
+    }
+
+    // Fields point into the datagram; handlers only run once the whole record parsed
+    switch (request.opcode) {
+        case OP_REGISTER: {
+            const char *peer_name = proto_get_name(&reader);
+            const char *content_name = proto_get_name(&reader);
+            uint64_t size = proto_get_int(&reader, 8);
+            struct sockaddr_in seed = read_seed(&reader, &client_addr);
+            if (!reader.error) {
+                register_content(&request, peer_name, content_name, size, &seed, &client_addr);
+            }
+            break;
+        }
+        case OP_HAVE: {
+            // A downloading peer verified one more chunk
+            const char *peer_name = proto_get_name(&reader);
+            const char *content_name = proto_get_name(&reader);
+            uint32_t chunk = (uint32_t)proto_get_int(&reader, 4);
+            struct sockaddr_in seed = read_seed(&reader, &client_addr);
+            if (!reader.error) {
+                handle_have(peer_name, content_name, chunk, &seed);
+            }
+            return; // Never answered, even when malformed
+        }
+        case OP_DEREGISTER: {
+            const char *peer_name = proto_get_name(&reader);
+            const char *content_name = proto_get_name(&reader);
+            if (!reader.error) {
+                deregister_content(&request, peer_name, content_name, &client_addr);
+            }
+            break;
+        }
+        case OP_DOWNLOAD: {
+            const char *content_name = proto_get_name(&reader);
+            if (!reader.error) {
+                handle_download(&request, content_name, &client_addr);
+            }
+            break;
+        }
+        case OP_LIST: {
+            const char *peer_name = proto_get_name(&reader);
+            if (!reader.error) {
+                handle_list(&request, peer_name, &client_addr);
+            }
+            break;
+        }
+        case OP_SEARCH: {
+            const char *content_name = proto_get_name(&reader);
+            if (!reader.error) {
+                search_content(&request, content_name, &client_addr);
+            }
+            break;
+        }
+        case OP_HEARTBEAT: {
+            const char *peer_name = proto_get_name(&reader);
+            if (!reader.error) {
+                handle_heartbeat(&request, peer_name, &client_addr);
+            }
+            break;
+        }
+        case OP_FIND: {
+            uint8_t mode = (uint8_t)proto_get_int(&reader, 1);
+            uint32_t cursor = (uint32_t)proto_get_int(&reader, 4);
+            uint8_t limit = (uint8_t)proto_get_int(&reader, 1);
+            const char *pattern = proto_get_name(&reader);
+            if (!reader.error) {
+                handle_find(&request, mode, cursor, limit, pattern, &client_addr);
+            }
+            break;
+        }
+        case OP_SUBSCRIBE: {
+            uint8_t kind = (uint8_t)proto_get_int(&reader, 1);
+            uint64_t feed_id = proto_get_int(&reader, 8);
+            uint64_t since = proto_get_int(&reader, 8);
+            const char *pattern = proto_get_name(&reader);
+            if (!reader.error) {
+                handle_subscribe(&request, kind, feed_id, since, pattern, &client_addr);
+            }
+            break;
+        }
+        case OP_UNSUBSCRIBE: {
+            uint8_t kind = (uint8_t)proto_get_int(&reader, 1);
+            const char *pattern = proto_get_name(&reader);
+            if (!reader.error) {
+                handle_unsubscribe(&request, kind, pattern, &client_addr);
+            }
+            break;
+        }
+        case OP_REGISTER_BATCH:
+            register_batch(&request, &reader, &client_addr);
+            return;
+        case OP_DEREGISTER_BATCH:
+            deregister_batch(&request, &reader, &client_addr);
+            return;
+        case OP_SEARCH_BATCH:
+            search_batch(&request, &reader, &client_addr);
+            return;
+        default:
+            send_error(&client_addr, &request, PROTO_MALFORMED, "Invalid command");
+            return;
+    }
+
+    if (reader.error) {
+        send_error(&client_addr, &request, PROTO_MALFORMED, "Malformed request");
+    }
+}
+
+// Start the reply to a request in buffer, which holds PROTO_MAX_DATAGRAM bytes
+static void reply_begin(ProtoWriter *writer, uint8_t *buffer, const ProtoHeader *request, uint8_t status) {
+    ProtoHeader header = {request->opcode | PROTO_REPLY, status, 0, request->request_id, 0};
+    proto_begin(writer, buffer, PROTO_MAX_DATAGRAM, &header);
+}
+
+static void reply_send(ProtoWriter *writer, struct sockaddr_in *client_addr) {
+    size_t len = proto_finish(writer);
+    if (len > 0) {
+        send_reply(client_addr, writer->buffer, len);
+    }
+}
+
+// Whether this node answers for a name in listings and finds. Every owner keeps the name, but
+// only its primary lists it, so that a client gathering from every node sees each name once.
+static int lists_name(const char *content_name) {
+    return cluster_self < 0 || cluster_primary(&cluster, content_name) == cluster_self;
+}
+
+// Up to max holders of the whole content; the caller is inside an epoch section. With maps, peers that serve
+// part of it count too, each with its chunk map there (NULL for the whole), and those that serve nothing do not.
+static int content_holders(const ContentEntry *content, struct sockaddr_in *out, const ChunkMap **maps, int max) {
+    uint64_t ages[(PROTO_MAX_DATAGRAM - PROTO_HEADER_SIZE) / 6]; // As many holders as one reply lists
+    uint64_t now = now_ms();
+    int found = 0;
+    if (max > (int)(sizeof(ages) / sizeof(ages[0]))) {
+        max = sizeof(ages) / sizeof(ages[0]);
+    }
+
+    // Keep the max most recently heard from, in that order, by insertion
+    for (int i = 0; content && i < content->holder_count; i++) {
+        const ChunkMap *chunks = content->holders[i].chunks;
+        PeerEntry *holder = chunks && !maps ? NULL : peer_at(content->holders[i].slot);
+        if (!holder || (maps && (holder->address.sin_port == 0 ||
+                                 (chunks && chunks->chunk_count != content->manifest->chunk_count)))) {
+            continue;
+        }
+        uint64_t last_seen = atomic_load_explicit(&holder->lease->last_seen, memory_order_relaxed);
+        uint64_t age = now > last_seen ? now - last_seen : 0;
+        if (age >= LEASE_SECONDS * 1000 || (found == max && age >= ages[found - 1])) {
+            continue; // Lease ran out and the peer is about to be evicted, or others are fresher
+        }
+        int pos = found < max ? found++ : found - 1;
+        for (; pos > 0 && ages[pos - 1] > age; pos--) {
+            ages[pos] = ages[pos - 1];
+            out[pos] = out[pos - 1];
+            if (maps) {
+                maps[pos] = maps[pos - 1];
+            }
+        }
+        ages[pos] = age;
+        out[pos] = holder->address;
+        if (maps) {
+            maps[pos] = chunks;
+        }
+    }
+    return found;
+}
+
+// Copy out up to max registered holders that have the whole content, the ones heard from last first
+int collect_holders(const char *content_name, struct sockaddr_in *out, int max) {
+    epoch_enter(); // Lock-free read of the current catalog
+    int found = content_holders(find_content(content_name), out, NULL, max);
+    epoch_exit();
+    return found;
+}
+
+// Whether the peer already holds content of this name and size, so registering it again needs no upload
+int already_held(const char *peer_name, const char *content_name, uint64_t size) {
+    int held = 0;
+
+    epoch_enter(); // Lock-free read of the current catalog
+    PeerEntry *peer = find_peer(peer_name);
+    ContentEntry *content = find_content(content_name);
+    for (int i = 0; peer && content && content->manifest->size == size && i < content->holder_count; i++) {
+        if (content->holders[i].slot == peer->slot) {
+            held = content->holders[i].chunks == NULL;
+            break;
+        }
+    }
+    epoch_exit();
+    return held;
+}
+
+// Every registered holder that has the whole content, as many as fit in one datagram
+void search_content(const ProtoHeader *request, const char *content_name, struct sockaddr_in *client_addr) {
+    struct sockaddr_in holders[(PROTO_MAX_DATAGRAM - PROTO_HEADER_SIZE) / 6];
+    int found = collect_holders(content_name, holders, sizeof(holders) / sizeof(holders[0]));
+    if (found == 0) {
+        send_error(client_addr, request, PROTO_NOT_FOUND, "Content not found");
+        return;
+    }
+
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    for (int i = 0; i < found; i++) {
+        proto_put_int(&writer, ntohl(holders[i].sin_addr.s_addr), 4);
+        proto_put_int(&writer, ntohs(holders[i].sin_port), 2);
+        proto_end_record(&writer);
+    }
+    reply_send(&writer, client_addr);
+    log_event("Sent %d holder(s) of '%s' to client\n", found, content_name);
+}
+
+// Names registered by a peer, split over as many datagrams as it takes
+void handle_list(const ProtoHeader *request, const char *peer_name, struct sockaddr_in *client_addr) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    int listed = 0;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+
+    epoch_enter(); // Lock-free read of the current catalog
+    PeerEntry *peer = find_peer(peer_name);
+    ContentTable *table = peer ? atomic_load_explicit(&peer->contents->table, memory_order_acquire) : NULL;
+    for (uint32_t j = 0; table && j < table->capacity; j++) {
+        NameHandle name = atomic_load_explicit(&table->slots[j], memory_order_acquire);
+        if (!name || (name & 1)) {
+            continue; // Never used, or dropped
+        }
+        const char *content_name = name_at(name);
+        if (!lists_name(content_name)) {
+            continue;
+        }
+        size_t mark = proto_mark(&writer);
+        proto_put_name(&writer, content_name);
+        if (writer.overflow) {
+            // Ship what we have and carry on in a fresh datagram
+            proto_rewind(&writer, mark);
+            proto_set_flags(&writer, PROTO_FLAG_MORE);
+            reply_send(&writer, client_addr);
+            reply_begin(&writer, buffer, request, PROTO_OK);
+            proto_put_name(&writer, content_name);
+        }
+        proto_end_record(&writer);
+        listed++;
+    }
+    epoch_exit();
+
+    reply_send(&writer, client_addr);
+    log_event("Sent %d content name(s) of peer '%s' to client\n", listed, peer_name);
+}
+
+// A peer registering what it already holds may have come back with another seed; move it there
+static void refresh_seed(const char *peer_name, const char *content_name, struct sockaddr_in *seed) {
+    pthread_mutex_lock(&mutex); // Serialize with other writers
+    catalog_add(peer_name, content_name, seed, NULL, -1);
+    pthread_mutex_unlock(&mutex);
+}
+
+// Registration is metadata only: the file bytes follow on the upload port, tagged with the token we hand out.
+// The peer is recorded at its seed; the reply goes back to where the request came from.
+void register_content(const ProtoHeader *request, const char *peer_name, const char *content_name, uint64_t size,
+                      struct sockaddr_in *seed, struct sockaddr_in *addr) {
+    if (!valid_content_name(content_name)) {
+        send_error(addr, request, PROTO_INVALID, "Invalid content name");
+        return;
+    }
+
+    // Token 0 tells the peer the server already has this content from it
+    uint64_t token = 0;
+    if (already_held(peer_name, content_name, size)) {
+        refresh_seed(peer_name, content_name, seed);
+    } else if ((token = upload_open(peer_name, content_name, size, seed)) == 0) {
+        send_error(addr, request, PROTO_BUSY, "Too many pending uploads");
+        return;
+    }
+
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    proto_put_int(&writer, token, 8);
+    proto_put_int(&writer, upload_port, 2);
+    proto_end_record(&writer);
+    reply_send(&writer, addr);
+    log_event("Waiting for upload of '%s' from peer '%s'\n", content_name, peer_name);
+}
+
+// Many registrations in one datagram; every record is answered with a status and an upload token
+void register_batch(const ProtoHeader *request, ProtoReader *reader, struct sockaddr_in *addr) {
+    const char *peer_name = proto_get_name(reader);
+    struct sockaddr_in seed = read_seed(reader, addr);
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    int uploads = 0;
+
+    // A reply record can be larger than its request record (11 bytes against 10 for an empty name), so
+    // records are only taken while their answer still fits; the client sees the rest unanswered
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    for (int i = 0; i < request->count; i++) {
+        const char *content_name = proto_get_name(reader);
+        uint64_t size = proto_get_int(reader, 8);
+        if (reader->error) {
+            break;
+        }
+        size_t mark = proto_mark(&writer);
+        uint8_t *record = proto_reserve(&writer, 11); // Status (1), token (8), upload port (2)
+        if (!record) {
+            proto_rewind(&writer, mark); // The records taken so far go out
+            break;
+        }
+
+        uint8_t status = PROTO_OK;
+        uint64_t token = 0;
+        if (!valid_content_name(content_name)) {
+            status = PROTO_INVALID;
+        } else if (already_held(peer_name, content_name, size)) {
+            refresh_seed(peer_name, content_name, &seed);
+        } else if ((token = upload_open(peer_name, content_name, size, &seed)) == 0) {
+            status = PROTO_BUSY;
+        }
+        uploads += token != 0;
+        proto_store(record, status, 1);
+        proto_store(record + 1, token, 8);
+        proto_store(record + 9, upload_port, 2);
+        proto_end_record(&writer);
+    }
+
+    if (reader->error) {
+        send_error(addr, request, PROTO_MALFORMED, "Malformed request"); // Opened uploads simply expire
+        return;
+    }
+    reply_send(&writer, addr);
+    log_event("Waiting for %d of %d batched upload(s) from peer '%s'\n", uploads, writer.count, peer_name);
+}
+
+// Many deregistrations applied under one hold of the catalog lock; answered with a status per record
+void deregister_batch(const ProtoHeader *request, ProtoReader *reader, struct sockaddr_in *addr) {
+    const char *peer_name = proto_get_name(reader);
+    const char *content_names[PROTO_MAX_DATAGRAM / 2]; // Every record takes at least two bytes
+    uint8_t statuses[PROTO_MAX_DATAGRAM / 2];
+    int count = 0;
+
+    while (count < request->count && count < PROTO_MAX_DATAGRAM / 2) {
+        content_names[count] = proto_get_name(reader);
+        if (reader->error) {
+            break;
+        }
+        count++;
+    }
+    if (reader->error || count != request->count) {
+        send_error(addr, request, PROTO_MALFORMED, "Malformed request");
+        return;
+    }
+
+    pthread_mutex_lock(&mutex); // Serialize with other writers
+    int removed = catalog_remove_many(peer_name, content_names, count, statuses);
+    pthread_mutex_unlock(&mutex);
+
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    for (int i = 0; i < count; i++) {
+        proto_put_int(&writer, statuses[i], 1);
+        proto_end_record(&writer);
+    }
+    reply_send(&writer, addr);
+    log_event("Deregistered %d of %d batched item(s) for peer '%s'\n", removed, count, peer_name);
+}
+
+// Many searches in one datagram; answers are packed as tightly as they fit and split over datagrams
+void search_batch(const ProtoHeader *request, ProtoReader *reader, struct sockaddr_in *addr) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+
+    for (int i = 0; i < request->count; i++) {
+        const char *content_name = proto_get_name(reader);
+        if (reader->error) {
+            break; // Answer what parsed; the client notices the missing indexes
+        }
+
+        struct sockaddr_in holders[PROTO_BATCH_HOLDERS];
+        int found = collect_holders(content_name, holders, PROTO_BATCH_HOLDERS);
+        for (int attempt = 0; attempt < 2; attempt++) {
+            size_t mark = proto_mark(&writer);
+            proto_put_int(&writer, i, 2);
+            proto_put_int(&writer, found > 0 ? PROTO_OK : PROTO_NOT_FOUND, 1);
+            proto_put_int(&writer, found, 1);
+            for (int j = 0; j < found; j++) {
+                proto_put_int(&writer, ntohl(holders[j].sin_addr.s_addr), 4);
+                proto_put_int(&writer, ntohs(holders[j].sin_port), 2);
+            }
+            if (!writer.overflow) {
+                proto_end_record(&writer);
+                break;
+            }
+            // Full: ship this part and write the record again into a fresh datagram
+            proto_rewind(&writer, mark);
+            proto_set_flags(&writer, PROTO_FLAG_MORE);
+            reply_send(&writer, addr);
+            reply_begin(&writer, buffer, request, PROTO_OK);
+        }
+    }
+
+    reply_send(&writer, addr);
+    log_event("Answered a batch of %d search(es)\n", request->count);
+}
+
+// One page of the names matching a pattern, each with the holders of the whole content
+void handle_find(const ProtoHeader *request, uint8_t mode, uint32_t cursor, uint8_t limit, const char *pattern,
+                 struct sockaddr_in *addr) {
+    size_t len = strlen(pattern);
+    if (mode > FIND_FUZZY) {
+        send_error(addr, request, PROTO_INVALID, "Unknown match mode");
+        return;
+    }
+    if (len < (mode == FIND_PREFIX ? 1 : SEARCH_MIN_PATTERN)) {
+        send_error(addr, request, PROTO_INVALID, "Pattern too short");
+        return;
+    }
+    if (atomic_load_explicit(&search_warming, memory_order_acquire)) {
+        send_error(addr, request, PROTO_BUSY, "Name search is still indexing the recovered catalog");
+        return;
+    }
+
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    proto_put_int(&writer, 0, 4); // Next cursor, known once the page is full
+    FindPage page = {&writer, limit ? limit : PROTO_MAX_DATAGRAM, 0, 0};
+
+    epoch_enter(); // Lock-free read of the search index and the catalog
+    search_index_find(&page, mode, pattern, len, cursor);
+    epoch_exit();
+
+    proto_store(buffer + PROTO_HEADER_SIZE, page.next, 4);
+    reply_send(&writer, addr);
+    log_event("Found %d name(s) matching '%s'\n", page.found, pattern);
+}
+
+// A peer checking in renews its lease; nothing else changes, so the mutex is not needed
+void handle_heartbeat(const ProtoHeader *request, const char *peer_name, struct sockaddr_in *addr) {
+    epoch_enter(); // Lock-free read of the current catalog
+    PeerEntry *peer = find_peer(peer_name);
+    if (peer) {
+        atomic_store_explicit(&peer->lease->last_seen, now_ms(), memory_order_relaxed);
+    }
+    epoch_exit();
+
+    if (!peer) {
+        send_error(addr, request, PROTO_NOT_FOUND, "Peer has no registrations");
+        return;
+    }
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    proto_put_int(&writer, LEASE_SECONDS, 2);
+    proto_end_record(&writer);
+    reply_send(&writer, addr);
+}
+
+// Bucket of a subscription in the feed's table
+static size_t subscription_bucket(const struct sockaddr_in *client, uint8_t kind, const char *pattern) {
+    uint64_t hash = name_hash(pattern) ^ ((uint64_t)client->sin_addr.s_addr << 24 | client->sin_port << 8 | kind);
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash >> 32) & (feed.bucket_count - 1);
+}
+
+// Where the client's subscription of that kind and pattern is linked from, or where it would be; the caller
+// holds the subscriptions lock
+static Subscription **subscription_slot(const struct sockaddr_in *client, uint8_t kind, const char *pattern) {
+    Subscription **slot = &feed.buckets[subscription_bucket(client, kind, pattern)];
+    while (*slot && ((*slot)->kind != kind || (*slot)->client.sin_addr.s_addr != client->sin_addr.s_addr ||
+                     (*slot)->client.sin_port != client->sin_port || strcmp((*slot)->pattern, pattern) != 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Double the subscription table once it holds a subscription per bucket; the caller holds the subscriptions lock
+static void subscriptions_grow(void) {
+    Subscription **buckets = calloc(feed.bucket_count * 2, sizeof(Subscription *));
+    if (!buckets) {
+        return; // Chains just get longer
+    }
+    Subscription **old = feed.buckets;
+    size_t old_count = feed.bucket_count;
+    feed.buckets = buckets;
+    feed.bucket_count *= 2;
+    for (size_t i = 0; i < old_count; i++) {
+        while (old[i]) {
+            Subscription *sub = old[i];
+            old[i] = sub->next;
+            size_t bucket = subscription_bucket(&sub->client, sub->kind, sub->pattern);
+            sub->next = buckets[bucket];
+            buckets[bucket] = sub;
+        }
+    }
+    free(old);
+}
+
+// Start or renew a subscription. Notifications resume after since if the feed still has everything after
+// it; otherwise they start from now, and the reply's since tells the client it missed changes.
+void handle_subscribe(const ProtoHeader *request, uint8_t kind, uint64_t feed_id, uint64_t since, const char *pattern,
+                      struct sockaddr_in *addr) {
+    if (kind > SUBSCRIBE_PEER || (kind != SUBSCRIBE_PREFIX && !*pattern)) {
+        send_error(addr, request, PROTO_INVALID, "Unknown subscription");
+        return;
+    }
+
+    pthread_mutex_lock(&feed.subscriptions_lock);
+    Subscription **slot = subscription_slot(addr, kind, pattern);
+    Subscription *sub = *slot;
+    if (!sub && feed.subscription_count < MAX_SUBSCRIPTIONS && (sub = calloc(1, sizeof(Subscription))) != NULL) {
+        sub->client = *addr;
+        sub->id = ++feed.next_subscription;
+        sub->kind = kind;
+        sub->pattern_len = (uint8_t)strlen(pattern);
+        memcpy(sub->pattern, pattern, sub->pattern_len + 1);
+        sub->cursor = sub->sent = UINT64_MAX; // Placed below
+        *slot = sub;
+        if (++feed.subscription_count > feed.bucket_count) {
+            subscriptions_grow();
+        }
+    }
+    if (!sub) {
+        pthread_mutex_unlock(&feed.subscriptions_lock);
+        send_error(addr, request, PROTO_BUSY, "Too many subscriptions");
+        return;
+    }
+
+    pthread_mutex_lock(&feed.lock);
+    if (feed_id != feed.id || since + 1 < feed.first || since >= feed.next) {
+        since = feed.next - 1; // From another run, or too far behind: only what happens from now on
+    }
+    pthread_mutex_unlock(&feed.lock);
+    if (since != sub->sent) {
+        sub->cursor = sub->sent = since; // Whatever the client has not seen is sent again
+    }
+    sub->expires = now_ms() + SUBSCRIPTION_SECONDS * 1000;
+    uint32_t id = sub->id;
+    pthread_mutex_unlock(&feed.subscriptions_lock);
+
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    proto_put_int(&writer, id, 4);
+    proto_put_int(&writer, feed.id, 8);
+    proto_put_int(&writer, since, 8);
+    proto_put_int(&writer, SUBSCRIPTION_SECONDS, 2);
+    proto_end_record(&writer);
+    reply_send(&writer, addr);
+}
+
+void handle_unsubscribe(const ProtoHeader *request, uint8_t kind, const char *pattern, struct sockaddr_in *addr) {
+    pthread_mutex_lock(&feed.subscriptions_lock);
+    Subscription **slot = subscription_slot(addr, kind, pattern);
+    Subscription *sub = *slot;
+    if (sub) {
+        *slot = sub->next;
+        feed.subscription_count--;
+        free(sub);
+    }
+    pthread_mutex_unlock(&feed.subscriptions_lock);
+
+    if (!sub) {
+        send_error(addr, request, PROTO_NOT_FOUND, "No such subscription");
+        return;
+    }
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    reply_send(&writer, addr);
+}
+
+// Record a verified chunk; no reply, the peer sends these as it goes
+void handle_have(const char *peer_name, const char *content_name, uint32_t chunk, struct sockaddr_in *seed) {
+    pthread_mutex_lock(&mutex); // Serialize with other writers
+    catalog_add(peer_name, content_name, seed, NULL, chunk);
+    pthread_mutex_unlock(&mutex);
+}
+
+// An empty content name deregisters everything the peer has registered
+void deregister_content(const ProtoHeader *request, const char *peer_name, const char *content_name,
+                        struct sockaddr_in *client_addr) {
+    pthread_mutex_lock(&mutex); // Serialize with other writers
+
+    if (content_name[0] == '\0') {
+        if (catalog_remove_peer(peer_name) == 0) {
+            log_event("Deregistered all content for peer '%s'\n", peer_name);
+        }
+    } else if (catalog_remove(peer_name, content_name) == 0) {
+        log_event("Deregistered content '%s' for peer '%s'\n", content_name, peer_name);
+    }
+
+    pthread_mutex_unlock(&mutex); // Unlock
+
+    uint8_t buffer[PROTO_HEADER_SIZE];
+    ProtoWriter writer;
+    ProtoHeader header = {request->opcode | PROTO_REPLY, PROTO_OK, 0, request->request_id, 0};
+    proto_begin(&writer, buffer, sizeof(buffer), &header);
+    reply_send(&writer, client_addr);
+}
+
+// The bytes themselves are served by the content listener; tell the client where to fetch them
+void handle_download(const ProtoHeader *request, const char *content_name, struct sockaddr_in *client_addr) {
+    epoch_enter(); // Lock-free read of the current catalog
+    int found = find_content(content_name) != NULL;
+    epoch_exit();
+
+    if (!found) {
+        send_error(client_addr, request, PROTO_NOT_FOUND, "Content not found");
+        return;
+    }
+
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, PROTO_OK);
+    proto_put_int(&writer, content_port, 2);
+    proto_end_record(&writer);
+    reply_send(&writer, client_addr);
+    log_event("Sent content port for '%s' to client\n", content_name);
+}
+
+// A failed request is answered with its status and one record holding a readable message
+void send_error(struct sockaddr_in *client_addr, const ProtoHeader *request, uint8_t status, const char *error_msg) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    stats_failure(request->opcode);
+    ProtoWriter writer;
+    reply_begin(&writer, buffer, request, status);
+    proto_put_name(&writer, error_msg);
+    proto_end_record(&writer);
+    reply_send(&writer, client_addr);
+    log_event("Sent error to client: %s\n", error_msg);
+}
+
+// Blocks are stored by hash, but store_import still opens ./<name> for catalogs written before the block
+// store; no name may reach outside the working directory or into the hidden files of the server there
+int valid_content_name(const char *content_name) {
+    return content_name[0] != '\0' && content_name[0] != '.' && strchr(content_name, '/') == NULL;
+}
+
+// Park an upload until the peer connects to the data port; returns its token, or 0 if none is free or a
+// name is too long to park whole
+uint64_t upload_open(const char *peer_name, const char *content_name, uint64_t size, struct sockaddr_in *addr) {
+    time_t now = time(NULL);
+    uint64_t token = 0;
+    if (strlen(peer_name) > MAX_NAME_LENGTH || strlen(content_name) > MAX_NAME_LENGTH) {
+        return 0; // Registered under a cut name, the content could never be found under its own
+    }
+
+    pthread_mutex_lock(&upload_mutex);
+    for (int i = 0; i < MAX_PENDING_UPLOADS; i++) {
+        PendingUpload *upload = &pending_uploads[i];
+        if (upload->token == 0 || upload->expires < now) {
+            // The low bits of the token name the slot, the rest make it unguessable
+            uint64_t nonce;
+            if (getrandom(&nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+                break;
+            }
+            token = ((nonce | MAX_PENDING_UPLOADS) & ~(uint64_t)(MAX_PENDING_UPLOADS - 1)) | (uint64_t)i; // Never 0
+            upload->token = token;
+            memcpy(upload->peer_name, peer_name, strlen(peer_name) + 1);
+            memcpy(upload->content_name, content_name, strlen(content_name) + 1);
+            upload->address = *addr;
+            upload->size = size;
+            upload->expires = now + UPLOAD_TIMEOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&upload_mutex);
+    return token;
+}
+
+// Take a parked upload out of the table; returns -1 for unknown or expired tokens
+int upload_claim(uint64_t token, PendingUpload *out) {
+    PendingUpload *upload = &pending_uploads[token & (MAX_PENDING_UPLOADS - 1)];
+    int result = -1;
+
+    pthread_mutex_lock(&upload_mutex);
+    if (token != 0 && upload->token == token && upload->expires >= time(NULL)) {
+        *out = *upload;
+        upload->token = 0;
+        result = 0;
+    }
+    pthread_mutex_unlock(&upload_mutex);
+    return result;
+}
+
+// Move exactly size bytes from a socket into a file at offset through a pipe, without copying them into user space
+static int splice_to_file(int sock, const int pipefd[2], int file_fd, off_t offset, uint64_t size) {
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        size_t chunk = remaining < UPLOAD_PIPE_SIZE ? remaining : UPLOAD_PIPE_SIZE;
+        ssize_t in = splice(sock, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in <= 0) {
+            if (in < 0) {
+                perror("Failed to receive upload data");
+            }
+            return -1; // An early close means a truncated upload
+        }
+        remaining -= in;
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, file_fd, &offset, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out <= 0) {
+                perror("Failed to write upload data");
+                return -1;
+            }
+            in -= out;
+        }
+    }
+    return 0;
+}
+
+// Receive one upload: a header naming the parked registration, then the file bytes. Uploads
+// may follow each other on one connection; returns -1 once the connection has to be closed.
+static int handle_upload(int sock) {
+    unsigned char header[UPLOAD_HEADER_SIZE];
+    PendingUpload upload;
+    unsigned char status = 1;
+
+    ssize_t got = recv(sock, header, sizeof(header), MSG_WAITALL);
+    if (got != (ssize_t)sizeof(header)) {
+        if (got != 0) {
+            log_event("Upload connection closed inside a header\n");
+        }
+        return -1;
+    }
+    uint64_t token = 0;
+    for (int i = 0; i < 8; i++) {
+        token = (token << 8) | header[i];
+    }
+    if (upload_claim(token, &upload) != 0) {
+        log_event("Rejected upload with unknown token\n");
+        send(sock, &status, 1, MSG_NOSIGNAL);
+        return -1; // Without a trusted size the rest of the stream cannot be followed
+    }
+
+    // The bytes go straight into fresh blocks; once hashed, those the store already has are let go again.
+    // Nothing is served from the new blocks before they are published, so readers never see a partial file.
+    // The size in the header is the registered one; its top byte says how the bytes are coded.
+    uint32_t count;
+    int codec = header[8];
+    if (codec != 0 && codec != UPLOAD_LZ4) {
+        log_event("Rejected upload with unknown codec %d\n", codec);
+        send(sock, &status, 1, MSG_NOSIGNAL);
+        return -1;
+    }
+    Block **staged = store_stage(sock, codec == UPLOAD_LZ4 ? STAGE_LZ4 : STAGE_SOCKET, upload.size, &count);
+    if (!staged) {
+        send(sock, &status, 1, MSG_NOSIGNAL);
+        return -1; // The stream is out of step with the uploads
+    }
+    Manifest *manifest = NULL;
+    StoredObject *object = store_commit(upload.content_name, staged, count, upload.size, &manifest);
+    if (!object) {
+        log_event("Failed to store uploaded content '%s'\n", upload.content_name);
+        send(sock, &status, 1, MSG_NOSIGNAL);
+        return 0;
+    }
+
+    // Register content; only the catalog update itself is serialized
+    pthread_mutex_lock(&mutex);
+    store_publish(object);
+    int result = catalog_add(upload.peer_name, upload.content_name, &upload.address, manifest, -1);
+    if (result != 0) {
+        ContentEntry *content = find_content(upload.content_name);
+        store_forget(upload.content_name, content ? content->manifest : NULL);
+    }
+    pthread_mutex_unlock(&mutex);
+    wal_wait();
+
+    if (result == 0) {
+        ThreadStats *stats = stats_self();
+        stat_add(&stats->uploads, 1);
+        stat_add(&stats->bytes_uploaded, upload.size);
+        status = 0;
+        log_event("Registered content '%s' for peer '%s' (%llu bytes)\n", upload.content_name, upload.peer_name,
+                  (unsigned long long)upload.size);
+    }
+    return send(sock, &status, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Upload threads all block in accept on the shared listener, so uploads run in parallel
+void *upload_thread(void *arg) {
+    int listen_fd = *(int *)arg;
+
+    while (1) {
+        int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            perror("Failed to accept upload connection");
+            continue;
+        }
+        struct timeval timeout = {UPLOAD_IDLE_TIMEOUT, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        int buffer_size = UPLOAD_PIPE_SIZE;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+        atomic_fetch_add(&uploads_active, 1);
+        while (handle_upload(sock) == 0) {
+            // A batch registration sends its files back to back
+        }
+        atomic_fetch_sub(&uploads_active, 1);
+        close(sock);
+    }
+
+    return NULL;
+}
+
+static void transfer_finish_response(Transfer *transfer) {
+    if (transfer->object) {
+        store_release(transfer->object);
+        transfer->object = NULL;
+    }
+    if (transfer->packed) {
+        packed_release(transfer->packed);
+        transfer->packed = NULL;
+    }
+    if (transfer->cached) {
+        cached_release(transfer->cached);
+        transfer->cached = NULL;
+    }
+    transfer->cached_index = UINT32_MAX;
+    if (transfer->reply != transfer->header) {
+        free(transfer->reply);
+    }
+    transfer->reply = NULL;
+    transfer->reply_len = 0;
+    transfer->reply_sent = 0;
+    transfer->offset = 0;
+    transfer->end = 0;
+}
+
+static void transfer_close(int epoll_fd, Transfer *transfer) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, transfer->sock, NULL);
+    close(transfer->sock);
+    atomic_fetch_sub(&transfers_open, 1);
+    transfer_finish_response(transfer);
+    slab_put(&transfer_pool, transfer);
+}
+
+static void put_be(unsigned char *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (unsigned char)(value >> (8 * (bytes - 1 - i)));
+    }
+}
+
+// Manifest reply: status, size, chunk count, source count, the chunk hashes, then every source
+// as address (4), port (2), chunk map length (4) and chunk map (empty when it has every chunk)
+static unsigned char *manifest_reply(const char *content_name, size_t *reply_len) {
+    unsigned char *reply = NULL;
+
+    epoch_enter(); // Lock-free read of the current catalog
+    ContentEntry *content = find_content(content_name);
+    if (content) {
+        const Manifest *manifest = content->manifest;
+        size_t hashes = (size_t)manifest->chunk_count * BLAKE3_OUT_LEN;
+        size_t map_len = (manifest->chunk_count + 7) / 8;
+
+        // Peers serving the content come first, the most recently heard from first. The index keeps every
+        // uploaded file too and comes last; downloaders only turn to it for chunks no peer can serve.
+        struct sockaddr_in peers[MANIFEST_PEERS];
+        const ChunkMap *maps[MANIFEST_PEERS];
+        int peer_count = content_holders(content, peers, maps, MANIFEST_PEERS);
+        uint32_t source_count = peer_count + 1;
+        size_t len = MANIFEST_HEADER_SIZE + hashes + source_count * MANIFEST_SOURCE_SIZE;
+        for (int i = 0; i < peer_count; i++) {
+            len += maps[i] ? map_len : 0;
+        }
+
+        if ((reply = malloc(len)) != NULL) {
+            reply[0] = 0;
+            put_be(reply + 1, manifest->size, 8);
+            put_be(reply + 9, manifest->chunk_count, 4);
+            put_be(reply + 13, source_count, 4);
+            memcpy(reply + MANIFEST_HEADER_SIZE, manifest->hashes, hashes);
+            unsigned char *source = reply + MANIFEST_HEADER_SIZE + hashes;
+            for (int i = 0; i < peer_count; i++) {
+                put_be(source, ntohl(peers[i].sin_addr.s_addr), 4);
+                put_be(source + 4, ntohs(peers[i].sin_port), 2);
+                put_be(source + 6, maps[i] ? map_len : 0, 4);
+                source += MANIFEST_SOURCE_SIZE;
+                if (maps[i]) {
+                    memcpy(source, maps[i]->bits, map_len);
+                    source += map_len;
+                }
+            }
+            memset(source, 0, 4); // 0.0.0.0 stands for the index server itself
+            put_be(source + 4, content_port, 2);
+            put_be(source + 6, 0, 4);
+            *reply_len = len;
+        }
+    }
+    epoch_exit();
+    return reply;
+}
+
+// Read a number and the space after it; returns what follows, or NULL if there is no such number
+static char *parse_offset(char *text, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    if (end == text || *end != ' ' || *value < 0 || errno != 0) {
+        return NULL;
+    }
+    return end + 1;
+}
+
+// Parse the next request line and prepare its response; returns -1 to drop the connection
+//   D <content name>                   whole file: status, size, then the bytes
+//   M <content name>                   chunk manifest and sources (see manifest_reply)
+//   G <chunk> <content name>           one chunk: status, length, then the bytes
+//   Z <chunk> <content name>           the same, but LZ4-compressed (status CONTENT_LZ4) when that pays
+//   R <offset> <length> <content name> bytes from offset on, at most length of them: status, length, the bytes
+//   GET /metrics HTTP/1.x              the statistics as Prometheus text; the connection closes after them
+static int transfer_start(Transfer *transfer, char *line) {
+    char command = line[0];
+    char *content_name = line + 2;
+    long long first = 0;
+    long long length = 0;
+
+    if (strncmp(line, "GET ", 4) == 0) {
+        transfer->reply = metrics_reply(strncmp(line + 4, "/metrics", 8) == 0 && (line[12] == ' ' || !line[12]),
+                                        &transfer->reply_len);
+        transfer->reply_sent = 0;
+        transfer->closing = 1;
+        return transfer->reply ? 0 : -1;
+    }
+    if (line[0] == '\0' || line[1] != ' ') {
+        return -1;
+    }
+    if (command == 'G' || command == 'Z') {
+        long long chunk;
+        content_name = parse_offset(line + 2, &chunk);
+        if (!content_name || chunk > UINT32_MAX) {
+            return -1;
+        }
+        first = chunk * CHUNK_SIZE;
+        length = CHUNK_SIZE;
+    } else if (command == 'R') {
+        content_name = parse_offset(line + 2, &first);
+        content_name = content_name ? parse_offset(content_name, &length) : NULL;
+        if (!content_name) {
+            return -1;
+        }
+    } else if (command != 'D' && command != 'M') {
+        return -1;
+    }
+
+    transfer->reply = transfer->header;
+    transfer->reply_len = CONTENT_HEADER_SIZE;
+    transfer->reply_sent = 0;
+    memset(transfer->header, 0, sizeof(transfer->header));
+    transfer->header[0] = 1; // Not found
+
+    if (!valid_content_name(content_name)) {
+        return 0;
+    }
+    if (command == 'M') {
+        unsigned char *reply = manifest_reply(content_name, &transfer->reply_len);
+        if (reply) {
+            transfer->reply = reply;
+        }
+        return 0;
+    }
+
+    epoch_enter(); // Only registered content is served
+    int registered = find_content(content_name) != NULL;
+    epoch_exit();
+    if (!registered || (transfer->object = store_acquire(content_name)) == NULL) {
+        return 0;
+    }
+
+    transfer->offset = 0;
+    transfer->end = transfer->object->size;
+    if (command != 'D') {
+        // A range may end at the end of the file but not start past it; the one chunk of an empty file is empty
+        if (first > transfer->end || (command != 'R' && first == transfer->end && first != 0)) {
+            store_release(transfer->object);
+            transfer->object = NULL;
+            transfer->offset = transfer->end = 0;
+            return 0;
+        }
+        transfer->offset = first;
+        if (transfer->end - transfer->offset > length) {
+            transfer->end = transfer->offset + length;
+        }
+    }
+    PackedBlock *packed = NULL;
+    if (command == 'Z' && transfer->offset < transfer->end) {
+        packed = store_pack(transfer->object->blocks[first / CHUNK_SIZE]);
+    }
+    if (packed) {
+        // The LZ4 block stands in for the bytes; the object is no longer needed
+        store_release(transfer->object);
+        transfer->object = NULL;
+        transfer->packed = packed;
+        transfer->offset = 0;
+        transfer->end = packed->len;
+    }
+    transfer->header[0] = packed ? CONTENT_LZ4 : 0;
+    put_be(transfer->header + 1, transfer->end - transfer->offset, 8);
+    return 0;
+}
+
+// Push as much as the socket takes; returns 1 when done, 0 to wait for EPOLLOUT, -1 on error
+static int transfer_send(Transfer *transfer) {
+    ThreadStats *stats = stats_self();
+    while (transfer->reply_sent < transfer->reply_len) {
+        ssize_t n = send(transfer->sock, transfer->reply + transfer->reply_sent,
+                         transfer->reply_len - transfer->reply_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        transfer->reply_sent += n;
+        stat_add(&stats->bytes_served, n);
+    }
+
+    // An LZ4 block is smaller than a chunk and goes out of memory in one turn
+    while (transfer->packed && transfer->offset < transfer->end) {
+        ssize_t n = send(transfer->sock, transfer->packed->data + transfer->offset, transfer->end - transfer->offset,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        transfer->offset += n;
+        stat_add(&stats->bytes_served, n);
+    }
+
+    // Cap each turn so one large file cannot starve the other connections of this loop. The file is
+    // sent block by block, each from the hot cache or else straight from its place in the store.
+    size_t budget = CONTENT_TURN_BYTES;
+    while (transfer->object && transfer->offset < transfer->end && budget > 0) {
+        uint32_t index = transfer->offset / CHUNK_SIZE;
+        Block *block = transfer->object->blocks[index];
+        if (index != transfer->cached_index) {
+            if (transfer->cached) {
+                cached_release(transfer->cached);
+            }
+            transfer->cached = store_cached(block);
+            transfer->cached_index = index;
+        }
+        off_t within = transfer->offset % CHUNK_SIZE;
+        off_t position = block->offset + within;
+        size_t chunk = block->len - within;
+        if (chunk > (size_t)(transfer->end - transfer->offset)) {
+            chunk = transfer->end - transfer->offset;
+        }
+        if (chunk > budget) {
+            chunk = budget;
+        }
+        ssize_t n = transfer->cached ? send(transfer->sock, transfer->cached->data + within, chunk, MSG_NOSIGNAL)
+                                     : sendfile(transfer->sock, block->fd, &position, chunk);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1; // Segment shrank underneath us
+        }
+        transfer->offset += n;
+        budget -= n;
+        stat_add(&stats->bytes_served, n);
+    }
+    return transfer->offset == transfer->end ? 1 : 0;
+}
+
+static int transfer_watch(int epoll_fd, Transfer *transfer, uint32_t events) {
+    if (transfer->events == events) {
+        return 0;
+    }
+    struct epoll_event event = {.events = events, .data.ptr = transfer};
+    transfer->events = events;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, transfer->sock, &event);
+}
+
+// Serve pipelined requests until the socket would block; returns -1 to drop the connection
+static int transfer_step(int epoll_fd, Transfer *transfer) {
+    for (int served = 0; served < CONTENT_TURN_REQUESTS; served++) {
+        if (transfer->state == TRANSFER_READING) {
+            char *newline = memchr(transfer->request, '\n', transfer->request_len);
+            if (!newline) {
+                if (transfer->request_len == sizeof(transfer->request)) {
+                    return -1; // Request line too long
+                }
+                ssize_t got = recv(transfer->sock, transfer->request + transfer->request_len,
+                                   sizeof(transfer->request) - transfer->request_len, 0);
+                if (got < 0 && errno == EAGAIN) {
+                    return transfer_watch(epoll_fd, transfer, EPOLLIN);
+                }
+                if (got <= 0) {
+                    return -1;
+                }
+                transfer->request_len += got;
+                continue;
+            }
+
+            *newline = '\0';
+            int result = transfer_start(transfer, transfer->request);
+            size_t consumed = newline + 1 - transfer->request;
+            memmove(transfer->request, newline + 1, transfer->request_len - consumed);
+            transfer->request_len -= consumed;
+            if (result != 0) {
+                return -1;
+            }
+            transfer->state = TRANSFER_SENDING;
+        }
+
+        int result = transfer_send(transfer);
+        if (result < 0) {
+            return -1;
+        }
+        if (result == 0) {
+            return transfer_watch(epoll_fd, transfer, EPOLLOUT);
+        }
+        transfer_finish_response(transfer);
+        stat_add(&stats_self()->responses, 1);
+        if (transfer->closing) {
+            // Unread request headers would turn the close into a reset that can cut the response short
+            shutdown(transfer->sock, SHUT_WR);
+            while (recv(transfer->sock, transfer->request, sizeof(transfer->request), MSG_DONTWAIT) > 0) {
+            }
+            return -1;
+        }
+        transfer->state = TRANSFER_READING;
+    }
+
+    // Let the other connections have a turn; level-triggered epoll brings us back
+    return transfer_watch(epoll_fd, transfer, transfer->state == TRANSFER_READING ? EPOLLIN : EPOLLOUT);
+}
+
+// One of several event loops sharing the content listener; each serves the connections it accepted
+void *content_thread(void *arg) {
+    int listen_fd = *(int *)arg;
+    struct epoll_event events[CONTENT_EVENTS];
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL};
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) < 0) {
+        perror("Failed to set up content event loop");
+        return NULL;
+    }
+
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, CONTENT_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("Content event loop failed");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Transfer *transfer = events[i].data.ptr;
+
+            if (!transfer) {
+                // New downloads; the listener is non-blocking so another loop may have taken them
+                int sock;
+                while ((sock = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    Transfer *accepted = slab_get(&transfer_pool);
+                    if (!accepted) {
+                        close(sock);
+                        continue;
+                    }
+                    memset(accepted, 0, sizeof(*accepted));
+                    int buffer_size = CONTENT_SNDBUF;
+                    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+                    accepted->sock = sock;
+                    accepted->state = TRANSFER_READING;
+                    accepted->cached_index = UINT32_MAX;
+                    accepted->events = EPOLLIN;
+                    struct epoll_event event = {.events = EPOLLIN, .data.ptr = accepted};
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+                        close(sock);
+                        slab_put(&transfer_pool, accepted);
+                        continue;
+                    }
+                    atomic_fetch_add(&transfers_open, 1);
+                }
+                continue;
+            }
+
+            if (transfer_step(epoll_fd, transfer) != 0) {
+                transfer_close(epoll_fd, transfer);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// FNV-1a, 64-bit
+uint64_t name_hash(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Announce that this thread is reading the catalog; nothing it reaches is freed until epoch_exit
+void epoch_enter(void) {
+    EpochRecord *record = epoch_record;
+    if (!record) {
+        record = calloc(1, sizeof(EpochRecord));
+        if (!record) {
+            perror("Failed to allocate epoch record");
+            exit(EXIT_FAILURE);
+        }
+        record->next = atomic_load(&epoch_records);
+        while (!atomic_compare_exchange_weak(&epoch_records, &record->next, record)) {
+        }
+        epoch_record = record;
+    }
+
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_acquire);
+    atomic_store_explicit(&record->state, (epoch << 1) | 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst); // Publish the announcement before reading any pointer
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&epoch_record->state, 0, memory_order_release);
+}
+
+static void retire_to(void *ptr, SlabPool *pool) {
+    if (!ptr) {
+        return;
+    }
+    Garbage *garbage = slab_get(&garbage_pool);
+    if (!garbage) {
+        return; // Leaking is the only safe option while readers may hold ptr
+    }
+    garbage->ptr = ptr;
+    garbage->pool = pool;
+    garbage->epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    garbage->next = NULL;
+    if (garbage_tail) {
+        garbage_tail->next = garbage;
+    } else {
+        garbage_head = garbage;
+    }
+    garbage_tail = garbage;
+}
+
+// Defer freeing memory that readers may still see; the caller holds the mutex
+void retire(void *ptr) {
+    retire_to(ptr, NULL);
+}
+
+// Advance the epoch if every reader has seen it and free what no reader can reach; the caller holds the mutex
+void epoch_collect(void) {
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int quiescent = 1;
+    for (EpochRecord *record = atomic_load(&epoch_records); record; record = record->next) {
+        uint64_t state = atomic_load_explicit(&record->state, memory_order_acquire);
+        if ((state & 1) && (state >> 1) != epoch) {
+            quiescent = 0; // Still reading under an older epoch
+            break;
+        }
+    }
+    if (quiescent) {
+        atomic_store_explicit(&global_epoch, ++epoch, memory_order_release);
+    }
+
+    // Anything retired two epochs ago was unlinked before every current reader started
+    while (garbage_head && garbage_head->epoch + 2 <= epoch) {
+        Garbage *garbage = garbage_head;
+        garbage_head = garbage->next;
+        char *ptr = garbage->ptr;
+        if (garbage->pool) {
+            slab_put(garbage->pool, ptr);
+        } else if (ptr >= name_arena.base && ptr < name_arena.base + NAME_ARENA_BYTES) {
+            name_release(ptr);
+        } else {
+            free(ptr);
+        }
+        slab_put(&garbage_pool, garbage);
+    }
+    if (!garbage_head) {
+        garbage_tail = NULL;
+    }
+}
+
+// Take an object from a pool, carving up a new slab when none is free; NULL if that fails
+void *slab_get(SlabPool *pool) {
+    if (!pool->free) {
+        size_t count = SLAB_BYTES / pool->size > 0 ? SLAB_BYTES / pool->size : 1;
+        char *slab = malloc(count * pool->size);
+        if (!slab) {
+            return NULL;
+        }
+        for (size_t i = count; i-- > 0;) {
+            slab_put(pool, slab + i * pool->size);
+        }
+    }
+    void *object = pool->free;
+    pool->free = *(void **)object;
+    return object;
+}
+
+void slab_put(SlabPool *pool, void *object) {
+    *(void **)object = pool->free;
+    pool->free = object;
+}
+
+// Size class of a catalog record, NULL if it is bigger than the largest
+static SlabPool *record_pool(size_t size) {
+    for (int i = 0; i < RECORD_CLASSES; i++) {
+        if (size <= record_pools[i].size) {
+            return &record_pools[i];
+        }
+    }
+    return NULL;
+}
+
+// A catalog record of size bytes from its size class, or from malloc past the largest; the caller holds the mutex
+void *record_alloc(size_t size) {
+    SlabPool *pool = record_pool(size);
+    return pool ? slab_get(pool) : malloc(size);
+}
+
+// Give back a record nothing has seen; size is the one it was allocated with. The caller holds the mutex.
+void record_free(void *record, size_t size) {
+    SlabPool *pool = record_pool(size);
+    if (!record) {
+        return;
+    } else if (pool) {
+        slab_put(pool, record);
+    } else {
+        free(record);
+    }
+}
+
+// retire for a catalog record of size bytes; the caller holds the mutex
+void retire_record(void *record, size_t size) {
+    retire_to(record, record_pool(size));
+}
+
+// Reserve the name arena; nothing is backed until names are stored
+int name_arena_init(void) {
+    void *base = mmap(NULL, NAME_ARENA_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                      -1, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    name_arena.base = base;
+    name_arena.top = NAME_CELL; // Handle 0 stands for no name
+    return 0;
+}
+
+// Cells a name of len bytes takes, less one
+static int name_class(size_t len) {
+    return (int)((len + NAME_CELL) / NAME_CELL) - 1;
+}
+
+// Intern a copy of a name; NULL if it is too long or the arena is full. The caller holds the mutex.
+char *name_store(const char *name) {
+    size_t len = strlen(name);
+    if (len > MAX_NAME_LENGTH) {
+        return NULL;
+    }
+    int class = name_class(len);
+    uint64_t bytes = (uint64_t)(class + 1) * NAME_CELL;
+    NameHandle handle = name_arena.free[class];
+    if (handle) {
+        memcpy(&name_arena.free[class], name_arena.base + handle, sizeof(handle));
+    } else if (name_arena.top + bytes <= NAME_ARENA_BYTES) {
+        handle = (NameHandle)name_arena.top;
+        name_arena.top += bytes;
+    } else {
+        return NULL;
+    }
+    name_arena.bytes += bytes;
+    char *copy = name_arena.base + handle;
+    memcpy(copy, name, len + 1);
+    return copy;
+}
+
+// Give the cells of a stored name back once no reader can reach it (see retire); the caller holds the mutex
+void name_release(char *name) {
+    int class = name_class(strlen(name));
+    memcpy(name, &name_arena.free[class], sizeof(NameHandle));
+    name_arena.free[class] = name_handle(name);
+    name_arena.bytes -= (uint64_t)(class + 1) * NAME_CELL;
+}
+
+NameHandle name_handle(const char *name) {
+    return (NameHandle)(name - name_arena.base);
+}
+
+const char *name_at(NameHandle handle) {
+    return name_arena.base + handle;
+}
+
+// A manifest with room for its hashes, which the caller fills in
+static Manifest *manifest_alloc(uint64_t size, uint32_t chunk_count) {
+    Manifest *manifest = malloc(sizeof(Manifest) + (size_t)chunk_count * BLAKE3_OUT_LEN);
+    if (manifest) {
+        manifest->size = size;
+        manifest->chunk_count = chunk_count;
+        manifest->hashes = manifest->stored;
+    }
+    return manifest;
+}
+
+static int manifest_equal(const Manifest *a, const Manifest *b) {
+    return a->size == b->size && a->chunk_count == b->chunk_count &&
+           memcmp(a->hashes, b->hashes, (size_t)a->chunk_count * BLAKE3_OUT_LEN) == 0;
+}
+
+// Whether a holder has a chunk; maps made for an older manifest count as empty
+int holder_has_chunk(const Holder *holder, const Manifest *manifest, uint32_t chunk) {
+    if (!holder->chunks) {
+        return 1;
+    }
+    return holder->chunks->chunk_count == manifest->chunk_count && (holder->chunks->bits[chunk / 8] >> (chunk % 8)) & 1;
+}
+
+#define INDEX_TOMBSTONE ((EntryKey *)&index_tombstone)
+static EntryKey index_tombstone; // Marks a deleted slot so probe chains stay intact
+
+static IndexTable *index_table_alloc(size_t capacity) {
+    IndexTable *table = calloc(1, sizeof(IndexTable) + capacity * sizeof(table->slots[0]));
+    if (table) {
+        table->capacity = capacity;
+    }
+    return table;
+}
+
+int index_init(NameIndex *index, size_t capacity) {
+    IndexTable *table = index_table_alloc(capacity);
+    if (!table) {
+        return -1;
+    }
+    atomic_init(&index->table, table);
+    index->count = 0;
+    index->used = 0;
+    return 0;
+}
+
+// Safe for readers inside an epoch section and for writers
+EntryKey *index_find(NameIndex *index, const char *name, uint64_t hash) {
+    IndexTable *table = atomic_load_explicit(&index->table, memory_order_acquire);
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        EntryKey *key = atomic_load_explicit(&table->slots[i], memory_order_acquire);
+        if (!key) {
+            return NULL;
+        }
+        if (key != INDEX_TOMBSTONE && key->hash == hash && strcmp(key->name, name) == 0) {
+            return key;
+        }
+    }
+}
+
+// Make sure one more insert fits without growing; the caller holds the mutex
+int index_reserve(NameIndex *index) {
+    IndexTable *table = atomic_load_explicit(&index->table, memory_order_relaxed);
+    if ((index->used + 1) * 100 <= table->capacity * INDEX_MAX_LOAD) {
+        return 0;
+    }
+
+    // Size for the live count, dropping tombstones; readers keep using the old table until it is retired
+    size_t capacity = table->capacity;
+    while ((index->count + 1) * 100 >= capacity * INDEX_MAX_LOAD / 2) {
+        capacity *= 2;
+    }
+    IndexTable *grown = index_table_alloc(capacity);
+    if (!grown) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        EntryKey *key = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (key && key != INDEX_TOMBSTONE) {
+            size_t j = key->hash & (capacity - 1);
+            while (atomic_load_explicit(&grown->slots[j], memory_order_relaxed)) {
+                j = (j + 1) & (capacity - 1);
+            }
+            atomic_store_explicit(&grown->slots[j], key, memory_order_relaxed);
+        }
+    }
+
+    atomic_store_explicit(&index->table, grown, memory_order_release);
+    retire(table);
+    index->used = index->count;
+    return 0;
+}
+
+// The caller holds the mutex, made room with index_reserve and checked the name is absent
+void index_insert(NameIndex *index, EntryKey *key) {
+    IndexTable *table = atomic_load_explicit(&index->table, memory_order_relaxed);
+    size_t mask = table->capacity - 1;
+    size_t i = key->hash & mask;
+    EntryKey *slot;
+    while ((slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed)) && slot != INDEX_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (!slot) {
+        index->used++; // Reusing a tombstone does not consume a fresh slot
+    }
+    atomic_store_explicit(&table->slots[i], key, memory_order_release);
+    index->count++;
+}
+
+static _Atomic(EntryKey *) *index_slot_of(NameIndex *index, EntryKey *key) {
+    IndexTable *table = atomic_load_explicit(&index->table, memory_order_relaxed);
+    size_t mask = table->capacity - 1;
+    for (size_t i = key->hash & mask;; i = (i + 1) & mask) {
+        EntryKey *slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (!slot || slot == key) {
+            return slot ? &table->slots[i] : NULL;
+        }
+    }
+}
+
+// Swap in a new version of a record; the caller holds the mutex
+void index_replace(NameIndex *index, EntryKey *old_key, EntryKey *new_key) {
+    _Atomic(EntryKey *) *slot = index_slot_of(index, old_key);
+    if (slot) {
+        atomic_store_explicit(slot, new_key, memory_order_release);
+    }
+}
+
+// The caller holds the mutex
+void index_remove(NameIndex *index, EntryKey *key) {
+    _Atomic(EntryKey *) *slot = index_slot_of(index, key);
+    if (slot) {
+        atomic_store_explicit(slot, INDEX_TOMBSTONE, memory_order_release);
+        index->count--;
+    }
+}
+
+PeerEntry *find_peer(const char *peer_name) {
+    return (PeerEntry *)index_find(&peer_index, peer_name, name_hash(peer_name));
+}
+
+ContentEntry *find_content(const char *content_name) {
+    return (ContentEntry *)index_find(&content_index, content_name, name_hash(content_name));
+}
+
+// Current version of the peer in a slot, or NULL if the slot is free
+PeerEntry *peer_at(int slot) {
+    PeerSlots *slots = atomic_load_explicit(&peer_slots, memory_order_acquire);
+    if (slot < 0 || slot >= slots->capacity) {
+        return NULL;
+    }
+    return atomic_load_explicit(&slots->peers[slot], memory_order_acquire);
+}
+
+static PeerSlots *peer_slots_alloc(int capacity) {
+    PeerSlots *slots = calloc(1, sizeof(PeerSlots) + capacity * sizeof(slots->peers[0]));
+    if (slots) {
+        slots->capacity = capacity;
+    }
+    return slots;
+}
+
+int catalog_init(void) {
+    for (int i = 0; i < RECORD_CLASSES; i++) {
+        record_pools[i].size = (size_t)16 << i;
+    }
+    PeerSlots *slots = peer_slots_alloc(INDEX_INITIAL_CAPACITY);
+    if (!slots || name_arena_init() != 0 || index_init(&content_index, INDEX_INITIAL_CAPACITY) != 0 ||
+        index_init(&peer_index, INDEX_INITIAL_CAPACITY) != 0 || search_index_init() != 0) {
+        free(slots);
+        return -1;
+    }
+    atomic_init(&peer_slots, slots);
+    lease_wheel.now = now_ms() / WHEEL_TICK_MS;
+    return 0;
+}
+
+// Pick a slot for a new peer, growing the slot table if needed; the caller holds the mutex
+static int reserve_peer_slot(void) {
+    if (free_peer_slot_count > 0) {
+        return free_peer_slots[free_peer_slot_count - 1];
+    }
+
+    PeerSlots *slots = atomic_load_explicit(&peer_slots, memory_order_relaxed);
+    if (peer_slot_count == slots->capacity) {
+        PeerSlots *grown = peer_slots_alloc(slots->capacity * 2);
+        if (!grown) {
+            return -1;
+        }
+        for (int i = 0; i < slots->capacity; i++) {
+            atomic_init(&grown->peers[i], atomic_load_explicit(&slots->peers[i], memory_order_relaxed));
+        }
+        atomic_store_explicit(&peer_slots, grown, memory_order_release);
+        retire(slots);
+    }
+    if (peer_slot_count == free_peer_slot_capacity) {
+        int capacity = free_peer_slot_capacity ? free_peer_slot_capacity * 2 : INDEX_INITIAL_CAPACITY;
+        int *grown = realloc(free_peer_slots, capacity * sizeof(int));
+        if (!grown) {
+            return -1;
+        }
+        free_peer_slots = grown;
+        free_peer_slot_capacity = capacity;
+    }
+    return peer_slot_count;
+}
+
+static void publish_peer_slot(int slot, PeerEntry *peer) {
+    if (free_peer_slot_count > 0 && free_peer_slots[free_peer_slot_count - 1] == slot) {
+        free_peer_slot_count--;
+    } else if (slot == peer_slot_count) {
+        peer_slot_count++;
+    }
+    PeerSlots *slots = atomic_load_explicit(&peer_slots, memory_order_relaxed);
+    atomic_store_explicit(&slots->peers[slot], peer, memory_order_release);
+}
+
+static size_t content_bytes(int holder_count) {
+    return sizeof(ContentEntry) + holder_count * sizeof(Holder);
+}
+
+static size_t chunk_map_bytes(uint32_t chunk_count) {
+    return sizeof(ChunkMap) + (chunk_count + 7) / 8;
+}
+
+static size_t content_table_bytes(uint32_t capacity) {
+    return sizeof(ContentTable) + capacity * sizeof(NameHandle);
+}
+
+static void retire_content(ContentEntry *content) {
+    if (content) {
+        retire_record(content, content_bytes(content->holder_count));
+    }
+}
+
+static void retire_chunks(const ChunkMap *chunks) {
+    if (chunks) {
+        retire_record((void *)chunks, chunk_map_bytes(chunks->chunk_count));
+    }
+}
+
+// New version of a content entry: change replaces the holder with the same slot or is appended, drop_slot is left out
+static ContentEntry *content_version(const ContentEntry *old, EntryKey key, const Manifest *manifest,
+                                     const Holder *change, int drop_slot) {
+    int count = old ? old->holder_count : 0;
+    int new_count = count + (change ? 1 : 0); // Sized exactly, since the size picks the pool it goes back to
+    for (int i = 0; i < count; i++) {
+        int slot = old->holders[i].slot;
+        new_count -= slot == drop_slot || (change && slot == change->slot);
+    }
+    ContentEntry *content = record_alloc(content_bytes(new_count));
+    if (!content) {
+        return NULL;
+    }
+    content->key = key;
+    content->manifest = manifest;
+    content->holder_count = 0;
+    int replaced = 0;
+    for (int i = 0; i < count; i++) {
+        Holder holder = old->holders[i];
+        if (holder.slot == drop_slot) {
+            continue;
+        }
+        if (change && holder.slot == change->slot) {
+            holder = *change;
+            replaced = 1;
+        }
+        content->holders[content->holder_count++] = holder;
+    }
+    if (change && !replaced) {
+        content->holders[content->holder_count++] = *change;
+    }
+    return content;
+}
+
+// New version of a peer entry at another address, or the first one of a new peer
+static PeerEntry *peer_version(const PeerEntry *old, EntryKey key, int slot, struct sockaddr_in *addr) {
+    PeerEntry *peer = record_alloc(sizeof(PeerEntry));
+    if (!peer) {
+        return NULL;
+    }
+    peer->key = key;
+    peer->lease = old ? old->lease : NULL;
+    peer->contents = old ? old->contents : NULL;
+    peer->slot = slot;
+    peer->address = *addr;
+    return peer;
+}
+
+// Where a name is in a content table, held or dropped, or else the free slot ending its probe chain
+static _Atomic NameHandle *content_slot(ContentTable *table, NameHandle name) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t i = (uint32_t)((name >> 3) * 2654435761u) >> (32 - __builtin_ctz(table->capacity));
+    for (;; i = (i + 1) & mask) {
+        NameHandle slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (!slot || (slot & ~(NameHandle)1) == name) {
+            return &table->slots[i];
+        }
+    }
+}
+
+static ContentTable *content_table_alloc(uint32_t capacity) {
+    ContentTable *table = record_alloc(content_table_bytes(capacity));
+    if (table) {
+        memset(table, 0, content_table_bytes(capacity));
+        table->capacity = capacity;
+    }
+    return table;
+}
+
+// An empty set of content names with room for count of them
+static PeerContents *peer_contents_new(uint32_t count) {
+    uint32_t capacity = PEER_CONTENTS_INITIAL;
+    while ((uint64_t)(count + 1) * 100 > (uint64_t)capacity * INDEX_MAX_LOAD) {
+        capacity *= 2;
+    }
+    PeerContents *contents = record_alloc(sizeof(PeerContents));
+    ContentTable *table = contents ? content_table_alloc(capacity) : NULL;
+    if (!table) {
+        record_free(contents, sizeof(PeerContents));
+        return NULL;
+    }
+    atomic_init(&contents->table, table);
+    contents->count = 0;
+    contents->used = 0;
+    return contents;
+}
+
+// Hand a set and its table to release: record_free while nothing has seen it, retire_record once published
+static void peer_contents_release(PeerContents *contents, void (*release)(void *, size_t)) {
+    ContentTable *table = atomic_load_explicit(&contents->table, memory_order_relaxed);
+    release(table, content_table_bytes(table->capacity));
+    release(contents, sizeof(PeerContents));
+}
+
+// Make sure one more name fits without growing; the caller holds the mutex
+static int peer_contents_reserve(PeerContents *contents) {
+    ContentTable *table = atomic_load_explicit(&contents->table, memory_order_relaxed);
+    if ((uint64_t)(contents->used + 1) * 100 <= (uint64_t)table->capacity * INDEX_MAX_LOAD) {
+        return 0;
+    }
+
+    // Size for the names held, leaving the dropped ones behind; readers keep walking the old table until it is retired
+    uint32_t capacity = table->capacity;
+    while ((uint64_t)(contents->count + 1) * 100 >= (uint64_t)capacity * INDEX_MAX_LOAD / 2) {
+        capacity *= 2;
+    }
+    ContentTable *grown = content_table_alloc(capacity);
+    if (!grown) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        NameHandle name = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (name && !(name & 1)) {
+            atomic_store_explicit(content_slot(grown, name), name, memory_order_relaxed);
+        }
+    }
+
+    atomic_store_explicit(&contents->table, grown, memory_order_release);
+    retire_record(table, content_table_bytes(table->capacity));
+    contents->used = contents->count;
+    return 0;
+}
+
+// The caller holds the mutex and made room with peer_contents_reserve
+static void peer_contents_add(PeerContents *contents, NameHandle name) {
+    ContentTable *table = atomic_load_explicit(&contents->table, memory_order_relaxed);
+    _Atomic NameHandle *slot = content_slot(table, name);
+    NameHandle old = atomic_load_explicit(slot, memory_order_relaxed);
+    if (old == name) {
+        return;
+    }
+    if (!old) {
+        contents->used++; // Taking back a dropped name's slot does not consume a fresh one
+    }
+    atomic_store_explicit(slot, name, memory_order_release);
+    contents->count++;
+}
+
+// The caller holds the mutex
+static int peer_contents_has(PeerContents *contents, NameHandle name) {
+    ContentTable *table = atomic_load_explicit(&contents->table, memory_order_relaxed);
+    return atomic_load_explicit(content_slot(table, name), memory_order_relaxed) == name;
+}
+
+// The caller holds the mutex
+static void peer_contents_drop(PeerContents *contents, NameHandle name) {
+    ContentTable *table = atomic_load_explicit(&contents->table, memory_order_relaxed);
+    _Atomic NameHandle *slot = content_slot(table, name);
+    if (atomic_load_explicit(slot, memory_order_relaxed) == name) {
+        atomic_store_explicit(slot, name | 1, memory_order_release);
+        contents->count--;
+    }
+}
+
+// Chunk map of a holder with one more chunk; NULL (with *complete set) once it has them all
+static ChunkMap *chunk_map_with(const ChunkMap *old, uint32_t chunk_count, uint32_t chunk, int *complete) {
+    size_t bytes = (chunk_count + 7) / 8;
+    ChunkMap *map = record_alloc(chunk_map_bytes(chunk_count));
+    *complete = 0;
+    if (!map) {
+        return NULL;
+    }
+    memset(map, 0, chunk_map_bytes(chunk_count));
+    map->chunk_count = chunk_count;
+    if (old && old->chunk_count == chunk_count) {
+        memcpy(map->bits, old->bits, bytes);
+    }
+    map->bits[chunk / 8] |= 1 << (chunk % 8);
+
+    uint32_t held = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        held += __builtin_popcount(map->bits[i]);
+    }
+    if (held == chunk_count) {
+        record_free(map, chunk_map_bytes(chunk_count));
+        *complete = 1;
+        return NULL;
+    }
+    return map;
+}
+
+// Record that a peer holds a content item, or just one chunk of it (chunk >= 0). Takes ownership of
+// manifest, which replaces the stored one when it differs; the other holders of the name are then
+// dropped, since what they hold is a different file. The caller holds the mutex.
+int catalog_add(const char *peer_name, const char *content_name, struct sockaddr_in *addr,
+                Manifest *manifest, int64_t chunk) {
+    PeerEntry *peer = find_peer(peer_name);
+    ContentEntry *content = find_content(content_name);
+    if (peer) {
+        atomic_store_explicit(&peer->lease->last_seen, now_ms(), memory_order_relaxed); // Any registration renews it
+    }
+
+    if (manifest && content && manifest_equal(manifest, content->manifest)) {
+        free(manifest);
+        manifest = NULL;
+    }
+    const Manifest *current = manifest ? manifest : (content ? content->manifest : NULL);
+    if (!current || (chunk >= 0 && (uint64_t)chunk >= current->chunk_count)) {
+        free(manifest);
+        return -1; // Chunks only make sense against a known manifest
+    }
+
+    const Holder *held = NULL;
+    for (int i = 0; peer && content && i < content->holder_count; i++) {
+        if (content->holders[i].slot == peer->slot) {
+            held = &content->holders[i];
+            break;
+        }
+    }
+    if (held && !manifest && memcmp(&peer->address, addr, sizeof(*addr)) == 0 &&
+        (chunk < 0 ? !held->chunks : holder_has_chunk(held, current, (uint32_t)chunk))) {
+        return 0; // Nothing new
+    }
+
+    // Make room first so that publishing below cannot fail half way
+    int slot = peer ? peer->slot : reserve_peer_slot();
+    if (slot < 0 || index_reserve(&peer_index) != 0 || index_reserve(&content_index) != 0) {
+        free(manifest);
+        return -1;
+    }
+
+    Holder change = {slot, NULL};
+    int complete = 1;
+    if (chunk >= 0) {
+        const ChunkMap *old_chunks = held && !manifest ? held->chunks : NULL; // Not chunks of another file
+        change.chunks = chunk_map_with(old_chunks, current->chunk_count, (uint32_t)chunk, &complete);
+        if (!change.chunks && !complete) {
+            free(manifest);
+            return -1;
+        }
+    }
+
+    // The peer record only changes when it is new or moves to a new address; its names change in place
+    int peer_changes = !peer || memcmp(&peer->address, addr, sizeof(*addr)) != 0;
+    EntryKey peer_key = peer ? peer->key : (EntryKey){name_store(peer_name), name_hash(peer_name)};
+    EntryKey content_key = content ? content->key : (EntryKey){name_store(content_name), name_hash(content_name)};
+    PeerLease *lease = peer ? peer->lease : lease_new(peer_key.name);
+    PeerContents *contents = peer ? peer->contents : peer_contents_new(0);
+    PeerEntry *new_peer = NULL;
+    ContentEntry *new_content = NULL;
+    if (peer_key.name && content_key.name && lease && contents && (held || peer_contents_reserve(contents) == 0)) {
+        new_peer = peer_changes ? peer_version(peer, peer_key, slot, addr) : peer;
+        new_content = content_version(manifest ? NULL : content, content_key, current, &change, -1);
+    }
+    if (!new_peer || !new_content) {
+        if (!peer) {
+            if (peer_key.name) {
+                name_release(peer_key.name);
+            }
+            record_free(lease, sizeof(PeerLease));
+            if (contents) {
+                peer_contents_release(contents, record_free);
+            }
+        }
+        if (!content && content_key.name) {
+            name_release(content_key.name);
+        }
+        if (new_peer != peer) {
+            record_free(new_peer, sizeof(PeerEntry));
+        }
+        if (new_content) {
+            record_free(new_content, content_bytes(new_content->holder_count));
+        }
+        if (change.chunks) {
+            record_free((void *)change.chunks, chunk_map_bytes(change.chunks->chunk_count));
+        }
+        free(manifest);
+        return -1;
+    }
+
+    // Publish the peer before the content so readers never see a holder without a peer
+    if (new_peer != peer) {
+        new_peer->lease = lease;
+        new_peer->contents = contents;
+        if (peer) {
+            index_replace(&peer_index, &peer->key, &new_peer->key);
+        } else {
+            index_insert(&peer_index, &new_peer->key);
+            lease_file(lease);
+        }
+        publish_peer_slot(slot, new_peer);
+        retire_record(peer, sizeof(PeerEntry));
+    }
+    NameHandle content_handle = name_handle(content_key.name);
+    peer_contents_add(contents, content_handle);
+    if (content) {
+        index_replace(&content_index, &content->key, &new_content->key);
+    } else {
+        index_insert(&content_index, &new_content->key);
+        search_index_add(content_key.name); // Best effort; exact lookups work regardless
+    }
+
+    // The holders of the old file go before the new one is announced; as in content_drop_holder, only
+    // complete holders were ever announced or logged
+    for (int i = 0; content && manifest && i < content->holder_count; i++) {
+        const Holder *dropped = &content->holders[i];
+        PeerEntry *other = dropped->slot == slot ? NULL : peer_at(dropped->slot);
+        if (!other) {
+            continue;
+        }
+        peer_contents_drop(other->contents, content_handle);
+        if (!dropped->chunks) {
+            feed_publish(CHANGE_REMOVE, other->key.name, content_key.name, NULL);
+            wal_log(WAL_REMOVE, other->key.name, content_key.name, NULL, NULL);
+        }
+        retire_chunks(dropped->chunks);
+    }
+
+    if (!change.chunks) {
+        feed_publish(CHANGE_ADD, peer_key.name, content_key.name, addr);
+        wal_log(WAL_ADD, peer_key.name, content_key.name, addr, current); // Partial holders are not worth a record
+    }
+
+    if (held) {
+        retire_chunks(held->chunks);
+    }
+    if (content && manifest) {
+        store_forget(content_key.name, current); // The stored bytes, if any, are the old file's
+        retire((void *)content->manifest);
+    }
+    retire_content(content);
+    epoch_collect();
+    return 0;
+}
+
+// Take a peer off the holders of a content entry, dropping the entry with its last one; the caller holds the mutex
+static int content_drop_holder(ContentEntry *content, const PeerEntry *peer) {
+    const Holder *dropped = NULL;
+    for (int i = 0; i < content->holder_count; i++) {
+        if (content->holders[i].slot == peer->slot) {
+            dropped = &content->holders[i];
+            break;
+        }
+    }
+    if (!dropped) {
+        return 0;
+    }
+
+    if (content->holder_count == 1) {
+        search_index_remove(content->key.name);
+        index_remove(&content_index, &content->key);
+        store_forget(content->key.name, NULL);
+        retire(content->key.name);
+        retire((void *)content->manifest);
+    } else {
+        ContentEntry *new_content = content_version(content, content->key, content->manifest, NULL, peer->slot);
+        if (!new_content) {
+            return -1;
+        }
+        index_replace(&content_index, &content->key, &new_content->key);
+    }
+    if (!dropped->chunks) {
+        feed_publish(CHANGE_REMOVE, peer->key.name, content->key.name, NULL);
+    }
+    retire_chunks(dropped->chunks);
+    retire_content(content);
+    return 0;
+}
+
+// Returns -1 if the peer did not hold the content; the caller holds the mutex
+int catalog_remove(const char *peer_name, const char *content_name) {
+    PeerEntry *peer = find_peer(peer_name);
+    ContentEntry *content = find_content(content_name);
+    if (!peer || !content) {
+        return -1;
+    }
+
+    NameHandle content_handle = name_handle(content->key.name);
+    if (!peer_contents_has(peer->contents, content_handle) || content_drop_holder(content, peer) != 0) {
+        return -1;
+    }
+    peer_contents_drop(peer->contents, content_handle);
+    wal_log(WAL_REMOVE, peer->key.name, content->key.name, NULL, NULL);
+    epoch_collect();
+    return 0;
+}
+
+// Drop several registrations of one peer. statuses[i] tells how content_names[i] went; returns how
+// many were removed. The caller holds the mutex.
+int catalog_remove_many(const char *peer_name, const char **content_names, int count, uint8_t *statuses) {
+    PeerEntry *peer = find_peer(peer_name);
+    for (int i = 0; i < count; i++) {
+        statuses[i] = PROTO_NOT_FOUND;
+    }
+    if (!peer) {
+        return 0;
+    }
+
+    int removed = 0;
+    for (int i = 0; i < count; i++) {
+        ContentEntry *content = find_content(content_names[i]);
+        NameHandle content_handle = content ? name_handle(content->key.name) : 0;
+        if (!content || !peer_contents_has(peer->contents, content_handle)) {
+            continue; // Not held, or named twice in the batch
+        }
+        if (content_drop_holder(content, peer) != 0) {
+            statuses[i] = PROTO_BUSY;
+            continue;
+        }
+        peer_contents_drop(peer->contents, content_handle);
+        // Logged before the next drop publishes its change, so each change carries the number of its own record
+        wal_log(WAL_REMOVE, peer->key.name, content->key.name, NULL, NULL);
+        removed++;
+        statuses[i] = PROTO_OK;
+    }
+
+    if (removed > 0) {
+        epoch_collect();
+    }
+    return removed;
+}
+
+// Drop the peer and everything it registered; the caller holds the mutex
+int catalog_remove_peer(const char *peer_name) {
+    PeerEntry *peer = find_peer(peer_name);
+    if (!peer) {
+        return -1;
+    }
+
+    int clean = 1;
+    ContentTable *table = atomic_load_explicit(&peer->contents->table, memory_order_relaxed);
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        NameHandle name = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        ContentEntry *content = name && !(name & 1) ? find_content(name_at(name)) : NULL;
+        if (content && content_drop_holder(content, peer) != 0) {
+            clean = 0;
+        }
+    }
+
+    index_remove(&peer_index, &peer->key);
+    PeerSlots *slots = atomic_load_explicit(&peer_slots, memory_order_relaxed);
+    atomic_store_explicit(&slots->peers[peer->slot], NULL, memory_order_release);
+    if (clean) {
+        // A slot still listed as a holder somewhere must not be handed to a new peer
+        free_peer_slots[free_peer_slot_count++] = peer->slot;
+    }
+    wal_log(WAL_REMOVE_PEER, peer->key.name, NULL, NULL, NULL);
+    lease_cancel(peer->lease);
+    retire_record(peer->lease, sizeof(PeerLease));
+    peer_contents_release(peer->contents, retire_record);
+    retire(peer->key.name);
+    retire_record(peer, sizeof(PeerEntry));
+    epoch_collect();
+    return 0;
+}
+
+// Lowercase ASCII letters so that matching ignores case; returns the length
+static size_t search_fold(const char *name, char *out) {
+    size_t len = 0;
+    for (; name[len]; len++) {
+        unsigned char c = name[len];
+        out[len] = (char)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static uint32_t search_bucket(unsigned char a, unsigned char b, unsigned char c) {
+    uint32_t gram = (uint32_t)a << 16 | (uint32_t)b << 8 | c;
+    return (gram * 2654435761u) >> (32 - SEARCH_BUCKET_BITS);
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Distinct trigram buckets of a folded name, at most len + 1 of them. Anchored trigrams also
+// cover the start of the name, padded with SEARCH_PAD, so that even one-byte prefixes select a list.
+static int search_grams(const char *folded, size_t len, int anchored, uint32_t *out) {
+    const unsigned char *text = (const unsigned char *)folded;
+    int count = 0;
+    if (anchored && len > 0) {
+        out[count++] = search_bucket(SEARCH_PAD, SEARCH_PAD, text[0]);
+        if (len > 1) {
+            out[count++] = search_bucket(SEARCH_PAD, text[0], text[1]);
+        }
+    }
+    for (size_t i = 0; i + 2 < len; i++) {
+        out[count++] = search_bucket(text[i], text[i + 1], text[i + 2]);
+    }
+
+    qsort(out, count, sizeof(out[0]), compare_ids);
+    int distinct = 0;
+    for (int i = 0; i < count; i++) {
+        if (distinct == 0 || out[distinct - 1] != out[i]) {
+            out[distinct++] = out[i];
+        }
+    }
+    return distinct;
+}
+
+// Whether needle occurs in haystack, which must stay readable SEARCH_SLACK bytes past its end.
+// With SSE2 sixteen start positions are screened at once on their first and last byte, and
+// only the positions passing both are compared in full.
+static int search_contains(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    if (needle_len == 0 || needle_len > haystack_len) {
+        return needle_len == 0;
+    }
+    size_t last = haystack_len - needle_len; // Last possible start
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i final = _mm_set1_epi8(needle[needle_len - 1]);
+    for (size_t i = 0; i <= last; i += 16) {
+        __m128i starts = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i ends = _mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, final)));
+        if (last - i < 15) {
+            mask &= (1u << (last - i + 1)) - 1; // Starts past the last one read slack bytes
+        }
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit, needle, needle_len) == 0) {
+                return 1;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return 0;
+#else
+    for (size_t i = 0; i <= last; i++) {
+        if (haystack[i] == needle[0] && memcmp(haystack + i, needle, needle_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+#endif
+}
+
+static SearchNames *search_names_alloc(uint32_t capacity) {
+    SearchNames *names = calloc(1, sizeof(SearchNames) + capacity * (sizeof(names->slots[0]) + 1) + SEARCH_SLACK);
+    if (names) {
+        names->capacity = capacity;
+        names->grams = (uint8_t *)&names->slots[capacity];
+    }
+    return names;
+}
+
+// A posting list with room for capacity ids, holding a copy of old if given
+static Postings *postings_alloc(uint32_t capacity, const Postings *old) {
+    Postings *list = malloc(sizeof(Postings) + capacity * sizeof(uint32_t));
+    if (!list) {
+        return NULL;
+    }
+    uint32_t count = old ? atomic_load_explicit(&old->count, memory_order_relaxed) : 0;
+    if (old) {
+        memcpy(list->ids, old->ids, count * sizeof(uint32_t));
+    }
+    atomic_init(&list->count, count);
+    list->capacity = capacity;
+    return list;
+}
+
+static SearchIndex *search_index_alloc(void) {
+    SearchIndex *index = calloc(1, sizeof(SearchIndex));
+    SearchNames *names = search_names_alloc(INDEX_INITIAL_CAPACITY);
+    if (!index || !names || index_init(&index->by_name, INDEX_INITIAL_CAPACITY) != 0) {
+        free(index);
+        free(names);
+        return NULL;
+    }
+    atomic_init(&index->names, names);
+    return index;
+}
+
+// Hand every allocation of an index to release: free for one never published, retire otherwise
+static void search_index_release(SearchIndex *index, void (*release)(void *)) {
+    SearchNames *names = atomic_load_explicit(&index->names, memory_order_relaxed);
+    uint32_t count = atomic_load_explicit(&index->name_count, memory_order_relaxed);
+    for (uint32_t id = 0; id < count; id++) {
+        release(atomic_load_explicit(&names->slots[id].name, memory_order_relaxed));
+    }
+    for (size_t i = 0; i < SEARCH_BUCKETS; i++) {
+        Postings *list = atomic_load_explicit(&index->buckets[i], memory_order_relaxed);
+        if (list) {
+            release(list);
+        }
+    }
+    release(names);
+    release(atomic_load_explicit(&index->by_name.table, memory_order_relaxed));
+    release(index);
+}
+
+int search_index_init(void) {
+    SearchIndex *index = search_index_alloc();
+    if (!index) {
+        return -1;
+    }
+    atomic_init(&search_index, index);
+    return 0;
+}
+
+// Give a name absent from the index the next id; the caller holds the mutex
+static SearchName *search_insert(SearchIndex *index, const char *content_name) {
+    size_t len = strlen(content_name);
+    uint32_t grams[MAX_NAME_LENGTH + 1];
+    if (len > MAX_NAME_LENGTH) {
+        return NULL;
+    }
+    SearchName *name = calloc(1, sizeof(SearchName) + 2 * (len + 1) + SEARCH_SLACK);
+    if (!name || index_reserve(&index->by_name) != 0) {
+        free(name);
+        return NULL;
+    }
+    search_fold(content_name, name->text);
+    memcpy(name->text + len + 1, content_name, len + 1);
+    int gram_count = search_grams(name->text, len, 1, grams);
+    uint32_t id = atomic_load_explicit(&index->name_count, memory_order_relaxed);
+    name->key = (EntryKey){name->text + len + 1, name_hash(content_name)};
+    atomic_init(&name->live, 1);
+
+    // Make room first so that publishing below cannot fail half way; grown copies are harmless
+    SearchNames *names = atomic_load_explicit(&index->names, memory_order_relaxed);
+    if (id == names->capacity) {
+        SearchNames *grown = search_names_alloc(names->capacity * 2);
+        if (!grown) {
+            free(name);
+            return NULL;
+        }
+        for (uint32_t i = 0; i < id; i++) {
+            atomic_init(&grown->slots[i].name, atomic_load_explicit(&names->slots[i].name, memory_order_relaxed));
+            grown->slots[i].len = names->slots[i].len;
+            grown->slots[i].grams = names->slots[i].grams;
+        }
+        memcpy(grown->grams, names->grams, id);
+        atomic_store_explicit(&index->names, grown, memory_order_release);
+        retire(names);
+        names = grown;
+    }
+    for (int i = 0; i < gram_count; i++) {
+        Postings *list = atomic_load_explicit(&index->buckets[grams[i]], memory_order_relaxed);
+        if (!list || atomic_load_explicit(&list->count, memory_order_relaxed) == list->capacity) {
+            Postings *grown = postings_alloc(list ? list->capacity * 2 : SEARCH_INITIAL_POSTINGS, list);
+            if (!grown) {
+                free(name);
+                return NULL;
+            }
+            atomic_store_explicit(&index->buckets[grams[i]], grown, memory_order_release);
+            retire(list);
+        }
+    }
+
+    // The name goes in before the ids that lead readers to it
+    names->slots[id].len = (uint16_t)len;
+    names->slots[id].grams = (uint16_t)gram_count;
+    names->grams[id] = (uint8_t)(gram_count < UINT8_MAX ? gram_count : UINT8_MAX);
+    atomic_store_explicit(&names->slots[id].name, name, memory_order_release);
+    atomic_store_explicit(&index->name_count, id + 1, memory_order_release);
+    for (int i = 0; i < gram_count; i++) {
+        Postings *list = atomic_load_explicit(&index->buckets[grams[i]], memory_order_relaxed);
+        uint32_t count = atomic_load_explicit(&list->count, memory_order_relaxed);
+        list->ids[count] = id;
+        atomic_store_explicit(&list->count, count + 1, memory_order_release);
+    }
+    index_insert(&index->by_name, &name->key);
+    index->live_count++;
+    return name;
+}
+
+// Replace the index with one holding only the live names; the caller holds the mutex
+static void search_index_rebuild(void) {
+    SearchIndex *old = atomic_load_explicit(&search_index, memory_order_relaxed);
+    SearchIndex *index = search_index_alloc();
+    if (!index) {
+        return; // Dead names only cost memory; try again on a later removal
+    }
+
+    SearchNames *names = atomic_load_explicit(&old->names, memory_order_relaxed);
+    uint32_t count = atomic_load_explicit(&old->name_count, memory_order_relaxed);
+    for (uint32_t id = 0; id < count; id++) {
+        SearchName *name = atomic_load_explicit(&names->slots[id].name, memory_order_relaxed);
+        if (atomic_load_explicit(&name->live, memory_order_relaxed) && !search_insert(index, name->key.name)) {
+            search_index_release(index, free);
+            return;
+        }
+    }
+
+    atomic_store_explicit(&search_index, index, memory_order_release);
+    search_index_release(old, retire);
+    printf("Rebuilt the search index over %u name(s)\n", index->live_count);
+}
+
+// Make a content name findable; the caller holds the mutex
+int search_index_add(const char *content_name) {
+    SearchIndex *index = atomic_load_explicit(&search_index, memory_order_relaxed);
+    SearchName *name = (SearchName *)index_find(&index->by_name, content_name, name_hash(content_name));
+    if (!name) {
+        return search_insert(index, content_name) ? 0 : -1;
+    }
+    if (!atomic_load_explicit(&name->live, memory_order_relaxed)) {
+        atomic_store_explicit(&name->live, 1, memory_order_release);
+        index->live_count++;
+        index->dead_count--;
+    }
+    return 0;
+}
+
+// Hide a name once no peer holds the content any more; the caller holds the mutex
+void search_index_remove(const char *content_name) {
+    SearchIndex *index = atomic_load_explicit(&search_index, memory_order_relaxed);
+    SearchName *name = (SearchName *)index_find(&index->by_name, content_name, name_hash(content_name));
+    if (!name || !atomic_load_explicit(&name->live, memory_order_relaxed)) {
+        return;
+    }
+    atomic_store_explicit(&name->live, 0, memory_order_release);
+    index->live_count--;
+    index->dead_count++;
+    if (index->dead_count >= SEARCH_COMPACT_MIN && index->dead_count > index->live_count) {
+        search_index_rebuild();
+    }
+}
+
+// A snapshot of one posting list taken by a reader
+typedef struct {
+    const uint32_t *ids;
+    uint32_t count;
+    uint32_t pos; // Where the next seek starts
+} PostingsCursor;
+
+static int compare_cursors(const void *a, const void *b) {
+    uint32_t x = ((const PostingsCursor *)a)->count;
+    uint32_t y = ((const PostingsCursor *)b)->count;
+    return (x > y) - (x < y);
+}
+
+// Move a cursor to the first id >= target, galloping ahead before the binary search
+static void postings_seek(PostingsCursor *cursor, uint32_t target) {
+    uint32_t low = cursor->pos;
+    uint32_t step = 1;
+    while (low + step < cursor->count && cursor->ids[low + step] < target) {
+        low += step;
+        step *= 2;
+    }
+    uint32_t high = low + step < cursor->count ? low + step : cursor->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (cursor->ids[mid] < target) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    cursor->pos = low;
+}
+
+// Snapshot the posting lists of the pattern's trigrams, shortest first; returns how many, or -1
+// if one is missing and so nothing can match
+static int search_cursors(SearchIndex *index, const char *folded, size_t len, int anchored,
+                          PostingsCursor *cursors) {
+    uint32_t grams[MAX_NAME_LENGTH + 1];
+    int count = search_grams(folded, len, anchored, grams);
+    for (int i = 0; i < count; i++) {
+        Postings *list = atomic_load_explicit(&index->buckets[grams[i]], memory_order_acquire);
+        if (!list) {
+            return -1;
+        }
+        cursors[i].ids = list->ids;
+        cursors[i].count = atomic_load_explicit(&list->count, memory_order_acquire);
+        cursors[i].pos = 0;
+    }
+    qsort(cursors, count, sizeof(cursors[0]), compare_cursors);
+    return count;
+}
+
+// The slot of a listed id, or NULL if the names table read before its posting list lacks it
+static const SearchSlot *search_slot_at(const SearchNames *names, uint32_t id) {
+    const SearchSlot *slot = id < names->capacity ? &names->slots[id] : NULL;
+    return slot && atomic_load_explicit(&slot->name, memory_order_acquire) ? slot : NULL;
+}
+
+static SearchName *search_live_name(const SearchSlot *slot) {
+    SearchName *name = atomic_load_explicit(&slot->name, memory_order_relaxed);
+    return atomic_load_explicit(&name->live, memory_order_acquire) ? name : NULL;
+}
+
+// Add a match and its holders to the page; returns 0 once the page is full, leaving resume_at as its cursor
+static int find_emit(FindPage *page, const SearchName *name, uint32_t resume_at) {
+    ContentEntry *content = find_content(name->key.name);
+    if (!content || !lists_name(name->key.name)) {
+        return 1; // Dropped since the index was read, or listed by its primary
+    }
+    if (page->found == page->limit) {
+        page->next = resume_at;
+        return 0;
+    }
+
+    struct sockaddr_in holders[PROTO_BATCH_HOLDERS];
+    int count = content_holders(content, holders, NULL, PROTO_BATCH_HOLDERS);
+    size_t mark = proto_mark(page->writer);
+    proto_put_name(page->writer, name->key.name);
+    proto_put_int(page->writer, count, 1);
+    for (int i = 0; i < count; i++) {
+        proto_put_int(page->writer, ntohl(holders[i].sin_addr.s_addr), 4);
+        proto_put_int(page->writer, ntohs(holders[i].sin_port), 2);
+    }
+    if (page->writer->overflow) {
+        proto_rewind(page->writer, mark);
+        page->next = resume_at;
+        return 0;
+    }
+    proto_end_record(page->writer);
+    page->found++;
+    return 1;
+}
+
+// Prefix and substring matches in id order, starting at the id in cursor. Candidates are the
+// ids on every posting list of the pattern, walked from the shortest list; each is then checked
+// against the name itself since trigrams sharing a bucket, or out of order, also get there.
+static void find_matches(SearchIndex *index, FindPage *page, uint8_t mode, const char *folded, size_t len,
+                         uint32_t cursor) {
+    PostingsCursor cursors[MAX_NAME_LENGTH + 1];
+    int count = search_cursors(index, folded, len, mode == FIND_PREFIX, cursors);
+    if (count <= 0) {
+        return;
+    }
+
+    SearchNames *names = atomic_load_explicit(&index->names, memory_order_acquire); // After the lists
+    PostingsCursor *driver = &cursors[0];
+    for (postings_seek(driver, cursor); driver->pos < driver->count; driver->pos++) {
+        uint32_t id = driver->ids[driver->pos];
+        int everywhere = 1;
+        for (int i = 1; i < count && everywhere; i++) {
+            postings_seek(&cursors[i], id);
+            everywhere = cursors[i].pos < cursors[i].count && cursors[i].ids[cursors[i].pos] == id;
+        }
+        const SearchSlot *slot = everywhere ? search_slot_at(names, id) : NULL;
+        SearchName *name = slot ? search_live_name(slot) : NULL;
+        if (!name) {
+            continue;
+        }
+        int match = mode == FIND_PREFIX ? slot->len >= len && memcmp(name->text, folded, len) == 0
+                                        : search_contains(name->text, slot->len, folded, len);
+        if (match && !find_emit(page, name, id)) {
+            return;
+        }
+    }
+}
+
+// A fuzzy match: more similar ranks first, then closer in length, then older
+typedef struct {
+    uint32_t score; // Dice coefficient of the trigram sets, in percent
+    uint32_t distance; // Difference in length from the pattern
+    uint32_t id;
+} FindRank;
+
+static int rank_before(const FindRank *a, const FindRank *b) {
+    if (a->score != b->score) {
+        return a->score > b->score;
+    }
+    if (a->distance != b->distance) {
+        return a->distance < b->distance;
+    }
+    return a->id < b->id;
+}
+
+static int compare_ranks(const void *a, const void *b) {
+    return rank_before(b, a) - rank_before(a, b);
+}
+
+// Keep the best SEARCH_FUZZY_RESULTS ranks in a heap with the worst kept one on top
+static void rank_offer(FindRank *heap, int *count, FindRank rank) {
+    int i;
+    if (*count < SEARCH_FUZZY_RESULTS) {
+        for (i = (*count)++; i > 0 && rank_before(&heap[(i - 1) / 2], &rank); i = (i - 1) / 2) {
+            heap[i] = heap[(i - 1) / 2];
+        }
+        heap[i] = rank;
+        return;
+    }
+    if (!rank_before(&rank, &heap[0])) {
+        return;
+    }
+    for (i = 0;;) {
+        int child = 2 * i + 1;
+        if (child >= *count) {
+            break;
+        }
+        if (child + 1 < *count && rank_before(&heap[child], &heap[child + 1])) {
+            child++; // The worse child
+        }
+        if (!rank_before(&rank, &heap[child])) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = rank;
+}
+
+// Counters of the current thread's fuzzy searches, one per name id, all zero between searches
+static uint8_t *fuzzy_counters(uint32_t ids) {
+    static __thread uint8_t *counters;
+    static __thread size_t capacity;
+    size_t needed = ((size_t)ids + 15) / 16 * 16 + 16; // Whole vectors past the last id
+    if (needed > capacity) {
+        uint8_t *grown = calloc(needed * 2, 1);
+        if (!grown) {
+            return NULL;
+        }
+        free(counters);
+        counters = grown;
+        capacity = needed * 2;
+    }
+    return counters;
+}
+
+// Which of 16 ids could still score high enough, as a bit mask: their counter (shared trigrams
+// among the merged lists) must reach threshold, and with every one of the `rest` other lists
+// added, the Dice bound S * (count + grams) <= 200 * shared must hold. The counters are copied
+// to taken and reset. SSE2 checks the bound on 16-bit lanes, which hold it exactly because
+// both sides stay below 2^16 once shared is capped at 255 (any name passes beyond that).
+static unsigned fuzzy_screen(uint8_t *counters, const uint8_t *grams, uint8_t threshold, uint8_t rest,
+                             uint16_t count, uint8_t *taken) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i values = _mm_loadu_si128((const __m128i *)counters);
+    __m128i sizes = _mm_loadu_si128((const __m128i *)grams);
+    _mm_storeu_si128((__m128i *)taken, values);
+    _mm_storeu_si128((__m128i *)counters, zero);
+
+    __m128i reached = _mm_cmpeq_epi8(_mm_max_epu8(values, _mm_set1_epi8((char)threshold)), values);
+    __m128i possible = _mm_adds_epu8(values, _mm_set1_epi8((char)rest));
+    __m128i halves[2];
+    for (int half = 0; half < 2; half++) {
+        __m128i shared = half ? _mm_unpackhi_epi8(possible, zero) : _mm_unpacklo_epi8(possible, zero);
+        __m128i size = half ? _mm_unpackhi_epi8(sizes, zero) : _mm_unpacklo_epi8(sizes, zero);
+        __m128i need = _mm_mullo_epi16(_mm_add_epi16(size, _mm_set1_epi16((short)count)),
+                                       _mm_set1_epi16(SEARCH_FUZZY_MIN_SCORE));
+        __m128i have = _mm_mullo_epi16(shared, _mm_set1_epi16(200));
+        halves[half] = _mm_cmpeq_epi16(_mm_subs_epu16(need, have), zero); // need <= have
+    }
+    __m128i bounded = _mm_packs_epi16(halves[0], halves[1]);
+    return (unsigned)_mm_movemask_epi8(_mm_and_si128(reached, bounded));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < 16; i++) {
+        int possible = counters[i] + rest < UINT8_MAX ? counters[i] + rest : UINT8_MAX;
+        taken[i] = counters[i];
+        counters[i] = 0;
+        mask |= (unsigned)(taken[i] >= threshold && SEARCH_FUZZY_MIN_SCORE * (count + grams[i]) <= 200 * possible) << i;
+    }
+    return mask;
+#endif
+}
+
+// Fuzzy matches, most similar first, starting at the rank in cursor. A name scoring at least
+// SEARCH_FUZZY_MIN_SCORE shares at least `need` of the pattern's trigrams, so it is on one of the
+// kept - need + 1 shortest lists. Those are tallied per id into byte counters, which are then
+// screened sixteen at a time; only ids that can still reach `need` probe the longer lists.
+static void find_fuzzy(SearchIndex *index, FindPage *page, const char *folded, size_t len, uint32_t cursor) {
+    PostingsCursor cursors[MAX_NAME_LENGTH + 1];
+    uint32_t grams[MAX_NAME_LENGTH + 1];
+    int count = search_grams(folded, len, 1, grams);
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        Postings *list = atomic_load_explicit(&index->buckets[grams[i]], memory_order_acquire);
+        if (list) {
+            cursors[kept].ids = list->ids;
+            cursors[kept].count = atomic_load_explicit(&list->count, memory_order_acquire);
+            cursors[kept++].pos = 0;
+        }
+    }
+    qsort(cursors, kept, sizeof(cursors[0]), compare_cursors);
+
+    // Fewer than 256 lists are ever merged: long patterns need well over one shared trigram
+    int need = (SEARCH_FUZZY_MIN_SCORE * count + 199 - SEARCH_FUZZY_MIN_SCORE) / (200 - SEARCH_FUZZY_MIN_SCORE);
+    int merged = kept - (need > 0 ? need : 1) + 1; // Missing lists are the shortest of all
+    uint32_t ids = atomic_load_explicit(&index->name_count, memory_order_acquire); // Bounds every id listed above
+    SearchNames *names = atomic_load_explicit(&index->names, memory_order_acquire);
+    uint8_t *counters = merged > 0 ? fuzzy_counters(ids) : NULL;
+    if (!counters) {
+        return;
+    }
+    uint32_t low = UINT32_MAX;
+    uint32_t high = 0;
+    for (int i = 0; i < merged; i++) {
+        const PostingsCursor *list = &cursors[i];
+        for (uint32_t j = 0; j < list->count; j++) {
+            counters[list->ids[j]]++;
+        }
+        if (list->count > 0) {
+            low = list->ids[0] < low ? list->ids[0] : low;
+            high = list->ids[list->count - 1] > high ? list->ids[list->count - 1] : high;
+        }
+    }
+
+    FindRank ranks[SEARCH_FUZZY_RESULTS];
+    int ranked = 0;
+    int threshold = need - (kept - merged); // Shared trigrams still possible beyond the merged lists
+    for (uint32_t base = low & ~15u; low <= high && base <= high; base += 16) {
+        uint8_t taken[16];
+        unsigned mask = fuzzy_screen(counters + base, names->grams + base, (uint8_t)(threshold > 1 ? threshold : 1),
+                                     (uint8_t)(kept - merged), (uint16_t)count, taken);
+        for (; mask; mask &= mask - 1) {
+            int bit = __builtin_ctz(mask);
+            uint32_t id = base + bit;
+            int shared = taken[bit];
+            const SearchSlot *slot = search_slot_at(names, id);
+            if (!slot) {
+                continue;
+            }
+            int goal = SEARCH_FUZZY_MIN_SCORE * (count + slot->grams);
+            for (int i = merged; i < kept && 200 * (shared + kept - i) >= goal; i++) {
+                postings_seek(&cursors[i], id);
+                shared += cursors[i].pos < cursors[i].count && cursors[i].ids[cursors[i].pos] == id;
+            }
+            uint32_t score = 200 * (uint32_t)shared / (uint32_t)(count + slot->grams);
+            if (score >= SEARCH_FUZZY_MIN_SCORE && search_live_name(slot)) {
+                FindRank rank = {score, slot->len > len ? slot->len - (uint32_t)len : (uint32_t)len - slot->len, id};
+                rank_offer(ranks, &ranked, rank);
+            }
+        }
+    }
+
+    qsort(ranks, ranked, sizeof(ranks[0]), compare_ranks);
+    for (int i = (int)cursor; i < ranked; i++) {
+        SearchName *name = search_live_name(&names->slots[ranks[i].id]);
+        if (name && !find_emit(page, name, (uint32_t)i)) {
+            return;
+        }
+    }
+}
+
+// Fill a page with the names matching pattern; the caller is inside an epoch section
+void search_index_find(FindPage *page, uint8_t mode, const char *pattern, size_t len, uint32_t cursor) {
+    char folded[MAX_NAME_LENGTH + 1 + SEARCH_SLACK];
+    if (len > MAX_NAME_LENGTH) {
+        return;
+    }
+    search_fold(pattern, folded);
+    SearchIndex *index = atomic_load_explicit(&search_index, memory_order_acquire);
+    if (mode == FIND_FUZZY) {
+        find_fuzzy(index, page, folded, len, cursor);
+    } else {
+        find_matches(index, page, mode, folded, len, cursor);
+    }
+}
+
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+// Continue a CRC-32C (Castagnoli); start from 0xFFFFFFFF and invert the result
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+static int buffer_reserve(ByteBuffer *buffer, size_t len) {
+    if (buffer->capacity - buffer->len >= len) {
+        return 0;
+    }
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity - buffer->len < len) {
+        capacity *= 2;
+    }
+    uint8_t *data = realloc(buffer->data, capacity);
+    if (!data) {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+static int buffer_append(ByteBuffer *buffer, const void *data, size_t len) {
+    if (buffer_reserve(buffer, len) != 0) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const uint8_t *pos = data;
+    while (len > 0) {
+        ssize_t n = write(fd, pos, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint64_t store_round(uint64_t len) {
+    return (len + STORE_PAGE - 1) & ~(uint64_t)(STORE_PAGE - 1);
+}
+
+static size_t block_bucket(const uint8_t hash[BLAKE3_OUT_LEN], size_t buckets) {
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key)); // The hash is uniform already
+    return key & (buckets - 1);
+}
+
+static int store_write_header(const Block *block, uint32_t state) {
+    BlockHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    memcpy(header.hash, block->hash, BLAKE3_OUT_LEN);
+    header.len = block->len;
+    header.state = state;
+    return pwrite(block->fd, &header, sizeof(header), block->offset - STORE_PAGE) == sizeof(header) ? 0 : -1;
+}
+
+// The remaining functions down to store_stage expect the caller to hold store.lock
+
+static int store_segment_add(int fd, uint32_t number) {
+    if (store.segment_count == store.segment_capacity) {
+        int capacity = store.segment_capacity ? store.segment_capacity * 2 : 16;
+        Segment *grown = realloc(store.segments, capacity * sizeof(Segment));
+        if (!grown) {
+            return -1;
+        }
+        store.segments = grown;
+        store.segment_capacity = capacity;
+    }
+    store.segments[store.segment_count] = (Segment){fd, number, 0, 0};
+    if (number >= store.next_number) {
+        store.next_number = number + 1;
+    }
+    return store.segment_count++;
+}
+
+static void store_segment_path(char *out, size_t len, uint32_t number) {
+    snprintf(out, len, "%s/segment-%08x", STORE_DIR, number);
+}
+
+static int store_segment_create(void) {
+    char path[64];
+    uint32_t number = store.next_number;
+    store_segment_path(path, sizeof(path), number);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    int index = fd >= 0 ? store_segment_add(fd, number) : -1;
+    if (index < 0) {
+        perror("Failed to create a store segment");
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+    }
+    return index;
+}
+
+static void store_segment_delete(int index) {
+    char path[64];
+    Segment *segment = &store.segments[index];
+    store_segment_path(path, sizeof(path), segment->number);
+    close(segment->fd);
+    unlink(path);
+    segment->fd = -1;
+}
+
+// Room for a block of len bytes at the end of the current segment, or of a new one; NULL if there is none.
+// The block is staged: in no table and used by nothing until store_commit.
+static Block *block_reserve(uint32_t len) {
+    off_t need = STORE_PAGE + store_round(len);
+    if (store.current < 0 || store.segments[store.current].used + need > STORE_SEGMENT_BYTES) {
+        int full = store.current;
+        store.current = store_segment_create();
+        if (full >= 0 && store.segments[full].blocks == 0) {
+            store_segment_delete(full);
+        }
+        if (store.current < 0) {
+            return NULL;
+        }
+    }
+
+    Segment *segment = &store.segments[store.current];
+    Block *block = calloc(1, sizeof(Block));
+    if (!block) {
+        return NULL;
+    }
+    block->segment = store.current;
+    block->fd = segment->fd;
+    block->offset = segment->used + STORE_PAGE;
+    block->len = len;
+    // Allocating the space up front keeps the blocks of an upload contiguous and fails early on a full disk
+    int error = posix_fallocate(block->fd, block->offset - STORE_PAGE, need);
+    if (error != 0 || store_write_header(block, BLOCK_PENDING) != 0) {
+        log_event("Failed to reserve a block: %s\n", strerror(error ? error : errno));
+        free(block);
+        return NULL;
+    }
+    segment->used += need;
+    segment->blocks++;
+    return block;
+}
+
+static void cache_unlink(CachedBlock *entry) {
+    CacheList *list = &store.cache.lists[entry->list];
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        list->oldest = entry->newer;
+    }
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        list->newest = entry->older;
+    }
+    list->bytes -= entry->len;
+}
+
+static void cache_push(CachedBlock *entry, int to) {
+    CacheList *list = &store.cache.lists[to];
+    entry->list = to;
+    entry->newer = NULL;
+    entry->older = list->newest;
+    if (list->newest) {
+        list->newest->newer = entry;
+    } else {
+        list->oldest = entry;
+    }
+    list->newest = entry;
+    list->bytes += entry->len;
+}
+
+// Drop a copy the cache no longer lists; downloads still sending it keep it until they finish
+static void cache_drop(CachedBlock *entry) {
+    entry->block->cached = NULL;
+    entry->block = NULL;
+    store.cache.count--;
+    cached_release(entry);
+}
+
+static uint8_t *sketch_counter(const uint8_t hash[BLAKE3_OUT_LEN], int row) {
+    uint64_t word;
+    memcpy(&word, hash + row * sizeof(word), sizeof(word)); // Each row takes its own part of the hash
+    return &store.cache.sketch[(uint64_t)row * (store.cache.sketch_mask + 1) + (word & store.cache.sketch_mask)];
+}
+
+// Count a request for a block, halving every counter once a sample's worth of requests was counted
+static void sketch_add(const Block *block) {
+    HotCache *cache = &store.cache;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint8_t *counter = sketch_counter(block->hash, row);
+        *counter += *counter < CACHE_SKETCH_MAX;
+    }
+    if (++cache->sketch_count >= cache->sketch_period) {
+        for (uint64_t i = 0; i < CACHE_SKETCH_ROWS * (cache->sketch_mask + 1); i++) {
+            cache->sketch[i] >>= 1;
+        }
+        cache->sketch_count /= 2;
+    }
+}
+
+static int sketch_frequency(const Block *block) {
+    int frequency = CACHE_SKETCH_MAX;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        int count = *sketch_counter(block->hash, row);
+        frequency = count < frequency ? count : frequency;
+    }
+    return frequency;
+}
+
+// Move what overflows the window into the main area, where each candidate must be requested more
+// often than the probation victims it would push out, and keep protected within its share
+static void cache_balance(void) {
+    HotCache *cache = &store.cache;
+    uint64_t main_limit = cache->capacity - cache->window_limit;
+    while (cache->lists[CACHE_WINDOW].bytes > cache->window_limit) {
+        CachedBlock *candidate = cache->lists[CACHE_WINDOW].oldest;
+        cache_unlink(candidate);
+        int frequency = sketch_frequency(candidate->block);
+        for (;;) {
+            uint64_t main_bytes = cache->lists[CACHE_PROBATION].bytes + cache->lists[CACHE_PROTECTED].bytes;
+            if (main_bytes + candidate->len <= main_limit) {
+                cache_push(candidate, CACHE_PROBATION);
+                cache->admitted++;
+                break;
+            }
+            CachedBlock *victim = cache->lists[CACHE_PROBATION].oldest;
+            if (!victim) {
+                victim = cache->lists[CACHE_PROTECTED].oldest;
+            }
+            if (!victim || frequency <= sketch_frequency(victim->block)) {
+                cache->rejected++;
+                cache_drop(candidate);
+                break;
+            }
+            cache_unlink(victim);
+            cache_drop(victim);
+            cache->evicted++;
+        }
+    }
+    while (cache->lists[CACHE_PROTECTED].bytes > cache->protected_limit) {
+        CachedBlock *demoted = cache->lists[CACHE_PROTECTED].oldest;
+        cache_unlink(demoted);
+        cache_push(demoted, CACHE_PROBATION);
+    }
+}
+
+// Take a block's LZ4 form out of the cache; downloads still sending it keep it until they finish
+static void packed_evict(PackedBlock *packed) {
+    if (packed->older) {
+        packed->older->newer = packed->newer;
+    } else {
+        store.packed_oldest = packed->newer;
+    }
+    if (packed->newer) {
+        packed->newer->older = packed->older;
+    } else {
+        store.packed_newest = packed->older;
+    }
+    packed->block->packed = NULL;
+    packed->block = NULL;
+    store.packed_count--;
+    store.packed_bytes -= packed->len;
+    packed_release(packed);
+}
+
+// Make a cached LZ4 form the most recently used
+static void packed_touch(PackedBlock *packed) {
+    if (packed == store.packed_newest) {
+        return;
+    }
+    if (packed->older) {
+        packed->older->newer = packed->newer;
+    } else {
+        store.packed_oldest = packed->newer;
+    }
+    packed->newer->older = packed->older;
+    packed->older = store.packed_newest;
+    packed->newer = NULL;
+    store.packed_newest->newer = packed;
+    store.packed_newest = packed;
+}
+
+static void block_free(Block *block) {
+    if (block->packed) {
+        packed_evict(block->packed);
+    }
+    if (block->cached) {
+        cache_unlink(block->cached);
+        cache_drop(block->cached);
+    }
+    store_write_header(block, BLOCK_FREE);
+    if (block->len > 0) {
+        fallocate(block->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block->offset, store_round(block->len));
+    }
+    if (--store.segments[block->segment].blocks == 0 && block->segment != store.current) {
+        store_segment_delete(block->segment);
+    }
+    free(block);
+}
+
+static Block *block_find(const uint8_t hash[BLAKE3_OUT_LEN]) {
+    Block *block = store.blocks[block_bucket(hash, store.block_buckets)];
+    while (block && memcmp(block->hash, hash, BLAKE3_OUT_LEN) != 0) {
+        block = block->next;
+    }
+    return block;
+}
+
+static void block_insert(Block *block) {
+    if (store.block_count >= store.block_buckets) {
+        // Double the chains; if that fails they just get longer
+        size_t buckets = store.block_buckets * 2;
+        Block **table = calloc(buckets, sizeof(Block *));
+        for (size_t i = 0; table && i < store.block_buckets; i++) {
+            Block *next;
+            for (Block *moved = store.blocks[i]; moved; moved = next) {
+                next = moved->next;
+                size_t pos = block_bucket(moved->hash, buckets);
+                moved->next = table[pos];
+                table[pos] = moved;
+            }
+        }
+        if (table) {
+            free(store.blocks);
+            store.blocks = table;
+            store.block_buckets = buckets;
+        }
+    }
+    size_t pos = block_bucket(block->hash, store.block_buckets);
+    block->next = store.blocks[pos];
+    store.blocks[pos] = block;
+    store.block_count++;
+    store.block_bytes += block->len;
+}
+
+static void block_unref(Block *block) {
+    if (--block->refs > 0) {
+        return;
+    }
+    Block **link = &store.blocks[block_bucket(block->hash, store.block_buckets)];
+    while (*link != block) {
+        link = &(*link)->next;
+    }
+    *link = block->next;
+    store.block_count--;
+    store.block_bytes -= block->len;
+    block_free(block);
+}
+
+static StoredObject **object_link(const char *content_name, uint64_t hash) {
+    StoredObject **link = &store.objects[hash & (store.object_buckets - 1)];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->name, content_name) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Take an object out of the table; the table's reference is the caller's to drop
+static StoredObject *object_unlink(const char *content_name) {
+    StoredObject **link = object_link(content_name, name_hash(content_name));
+    StoredObject *object = *link;
+    if (object) {
+        *link = object->next;
+        store.object_count--;
+        store.object_bytes -= object->size;
+    }
+    return object;
+}
+
+// An object made of blocks the store has already, for a file described by manifest; NULL if some are missing
+static StoredObject *object_from_blocks(const char *content_name, const Manifest *manifest) {
+    StoredObject *object = calloc(1, sizeof(StoredObject) + (size_t)manifest->chunk_count * sizeof(Block *));
+    if (!object || !(object->name = strdup(content_name))) {
+        free(object);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        uint64_t offset = (uint64_t)i * CHUNK_SIZE;
+        Block *block = block_find(manifest->hashes[i]);
+        if (!block || block->len != (manifest->size - offset < CHUNK_SIZE ? manifest->size - offset : CHUNK_SIZE)) {
+            for (uint32_t j = 0; j < i; j++) {
+                block_unref(object->blocks[j]);
+            }
+            free(object->name);
+            free(object);
+            return NULL;
+        }
+        block->refs++;
+        object->blocks[i] = block;
+    }
+    object->hash = name_hash(content_name);
+    object->size = manifest->size;
+    object->block_count = manifest->chunk_count;
+    atomic_init(&object->refs, 1);
+    return object;
+}
+
+static int object_matches(const StoredObject *object, const Manifest *manifest) {
+    if (object->size != manifest->size || object->block_count != manifest->chunk_count) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < object->block_count; i++) {
+        if (memcmp(object->blocks[i]->hash, manifest->hashes[i], BLAKE3_OUT_LEN) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Walk one segment from header to header, taking in its live blocks. Blocks an upload was still
+// staging when the server stopped are freed; so are copies of a block already seen.
+static int store_segment_load(uint32_t number) {
+    char path[64];
+    store_segment_path(path, sizeof(path), number);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    int index = fd >= 0 ? store_segment_add(fd, number) : -1;
+    if (index < 0) {
+        perror("Failed to open a store segment");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    store.current = index; // Keeps the segment while its blocks are looked at
+    off_t offset = 0;
+    BlockHeader header;
+    while (offset + STORE_PAGE <= STORE_SEGMENT_BYTES &&
+           pread(fd, &header, sizeof(header), offset) == sizeof(header) &&
+           memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) == 0 && header.len <= CHUNK_SIZE) {
+        Block *block = header.state == BLOCK_FREE ? NULL : calloc(1, sizeof(Block));
+        if (block) {
+            memcpy(block->hash, header.hash, BLAKE3_OUT_LEN);
+            block->segment = index;
+            block->fd = fd;
+            block->offset = offset + STORE_PAGE;
+            block->len = header.len;
+            store.segments[index].blocks++;
+            if (header.state == BLOCK_LIVE && !block_find(block->hash)) {
+                block_insert(block);
+            } else {
+                block_free(block);
+            }
+        }
+        offset += STORE_PAGE + store_round(header.len);
+    }
+    // A header that never reached the disk ends the walk early. What lies past it cannot be told apart from
+    // uploaded bytes, and nothing logged refers to it since blocks are synced before their registration,
+    // but it must not be written over either: the segment takes no more blocks.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && offset < st.st_size) {
+        printf("Store segment %08x is unreadable past offset %lld; it takes no more blocks\n", number,
+               (long long)offset);
+        offset = STORE_SEGMENT_BYTES;
+    }
+    store.segments[index].used = offset;
+    return 0;
+}
+
+// Size the hot cache and its frequency sketch: about sixteen counters per block it can hold, so that
+// the blocks competing for a place seldom share all their counters
+static int cache_init(uint64_t capacity) {
+    HotCache *cache = &store.cache;
+    if (capacity == 0) {
+        return 0;
+    }
+    uint64_t blocks = capacity / CHUNK_SIZE;
+    uint64_t width = 4096;
+    while (width < blocks * 16) {
+        width *= 2;
+    }
+    cache->sketch = calloc(CACHE_SKETCH_ROWS, width);
+    if (!cache->sketch) {
+        return -1;
+    }
+    cache->capacity = capacity < 2 * CHUNK_SIZE ? 2 * CHUNK_SIZE : capacity; // Room for a block in each part
+    cache->window_limit = cache->capacity * CACHE_WINDOW_PERCENT / 100;
+    cache->window_limit = cache->window_limit < CHUNK_SIZE ? CHUNK_SIZE : cache->window_limit;
+    cache->protected_limit = (cache->capacity - cache->window_limit) * CACHE_PROTECTED_PERCENT / 100;
+    cache->sketch_mask = width - 1;
+    cache->sketch_period = (blocks > 100 ? blocks : 100) * CACHE_SAMPLE;
+    return 0;
+}
+
+// Find the segments and read back the blocks they hold; store_attach decides which are still used
+int store_open(void) {
+    if (cache_init((uint64_t)cache_megabytes << 20) != 0) {
+        return -1;
+    }
+    store.block_buckets = STORE_INITIAL_BUCKETS;
+    store.object_buckets = STORE_INITIAL_BUCKETS;
+    store.blocks = calloc(store.block_buckets, sizeof(Block *));
+    store.objects = calloc(store.object_buckets, sizeof(StoredObject *));
+    store.current = -1;
+    if (!store.blocks || !store.objects || (mkdir(STORE_DIR, 0755) != 0 && errno != EEXIST)) {
+        return -1;
+    }
+    DIR *dir = opendir(STORE_DIR);
+    if (!dir) {
+        return -1;
+    }
+
+    int result = 0;
+    int newest = -1;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        unsigned int number;
+        char tail;
+        if (strlen(entry->d_name) != 16 || sscanf(entry->d_name, "segment-%8x%c", &number, &tail) != 1) {
+            continue;
+        }
+        result = store_segment_load(number);
+        if (result == 0 && (newest < 0 || number > store.segments[newest].number)) {
+            newest = store.segment_count - 1;
+        }
+    }
+    closedir(dir);
+    store.current = newest; // New blocks go after the last ones written
+    return result;
+}
+
+// Move size bytes from one file to another inside the kernel
+static int copy_to_file(int in_fd, off_t in_offset, int out_fd, off_t out_offset, uint64_t size) {
+    while (size > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+// Read one frame of an LZ4 upload into a block: its bytes as they are, or an LZ4 block of them
+static int frame_to_file(int sock, const int pipefd[2], uint8_t *packed, uint8_t *plain, const Block *block) {
+    unsigned char frame[UPLOAD_FRAME_SIZE];
+    if (recv(sock, frame, sizeof(frame), MSG_WAITALL) != (ssize_t)sizeof(frame)) {
+        return -1;
+    }
+    uint32_t len = proto_load(frame, UPLOAD_FRAME_SIZE);
+    if (!(len & UPLOAD_FRAME_PACKED)) {
+        return len == block->len ? splice_to_file(sock, pipefd, block->fd, block->offset, len) : -1;
+    }
+    len &= ~UPLOAD_FRAME_PACKED;
+    if (len == 0 || len > lz4_bound(CHUNK_SIZE) || recv(sock, packed, len, MSG_WAITALL) != (ssize_t)len ||
+        lz4_decompress(packed, len, plain, block->len) != (long)block->len) {
+        return -1;
+    }
+    return pwrite(block->fd, plain, block->len, block->offset) == (ssize_t)block->len ? 0 : -1;
+}
+
+// Read size bytes into newly reserved blocks: from the start of a file, or from a socket as they are or
+// in LZ4 frames. Returns the staged blocks, *count of them, for store_commit; NULL if the bytes could
+// not all be read and stored.
+Block **store_stage(int fd, int source, uint64_t size, uint32_t *count) {
+    uint64_t total = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    Block **staged = total <= UINT32_MAX ? malloc(total * sizeof(Block *) + 1) : NULL;
+    uint8_t *packed = source == STAGE_LZ4 ? malloc(lz4_bound(CHUNK_SIZE) + CHUNK_SIZE) : NULL;
+    int pipefd[2] = {-1, -1};
+    if (!staged || (source == STAGE_LZ4 && !packed) || (source != STAGE_FILE && pipe2(pipefd, O_CLOEXEC) < 0)) {
+        perror("Failed to stage upload");
+        free(staged);
+        free(packed);
+        return NULL;
+    }
+    if (source != STAGE_FILE) {
+        fcntl(pipefd[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE); // Best effort; the default pipe still works
+    }
+
+    uint32_t done = 0;
+    int ok = 1;
+    while (done < total && ok) {
+        uint64_t offset = (uint64_t)done * CHUNK_SIZE;
+        uint32_t len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+        pthread_mutex_lock(&store.lock);
+        Block *block = block_reserve(len);
+        pthread_mutex_unlock(&store.lock);
+        if (!block) {
+            break;
+        }
+        staged[done++] = block;
+        if (source == STAGE_FILE) {
+            ok = copy_to_file(fd, offset, block->fd, block->offset, len) == 0;
+        } else if (source == STAGE_SOCKET) {
+            ok = splice_to_file(fd, pipefd, block->fd, block->offset, len) == 0;
+        } else {
+            ok = frame_to_file(fd, pipefd, packed, packed + lz4_bound(CHUNK_SIZE), block) == 0;
+        }
+    }
+    if (source != STAGE_FILE) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    free(packed);
+    if (!ok || done < total) {
+        store_unstage(staged, done);
+        return NULL;
+    }
+    *count = done;
+    return staged;
+}
+
+// Free staged blocks that will not be committed, and the array holding them
+void store_unstage(Block **staged, uint32_t count) {
+    pthread_mutex_lock(&store.lock);
+    for (uint32_t i = 0; i < count; i++) {
+        block_free(staged[i]);
+    }
+    pthread_mutex_unlock(&store.lock);
+    free(staged);
+}
+
+static int read_block(const Block *block, uint8_t *out) {
+    for (size_t done = 0; done < block->len;) {
+        ssize_t n = pread(block->fd, out + done, block->len - done, block->offset + done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Hash staged blocks and make them a stored object, keeping only the blocks the store did not have yet.
+// Takes the staged array; *manifest describes the file. NULL if the bytes could not be read back or kept.
+StoredObject *store_commit(const char *content_name, Block **staged, uint32_t count, uint64_t size,
+                           Manifest **manifest) {
+    Manifest *built = manifest_alloc(size, count);
+    StoredObject *object = calloc(1, sizeof(StoredObject) + (size_t)count * sizeof(Block *));
+    char *name = strdup(content_name);
+    unsigned char *buffer = malloc(CHUNK_SIZE);
+    int ok = built && object && name && buffer;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        Block *block = staged[i];
+        ok = read_block(block, buffer) == 0;
+        blake3_hash(buffer, block->len, built->stored[i]); // Fresh from the page cache
+        memcpy(block->hash, built->stored[i], BLAKE3_OUT_LEN);
+    }
+    free(buffer);
+    if (!ok) {
+        free(built);
+        free(object);
+        free(name);
+        store_unstage(staged, count);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&store.lock);
+    uint32_t kept = 0;
+    for (; kept < count; kept++) {
+        Block *block = staged[kept];
+        Block *existing = block_find(block->hash);
+        if (existing) {
+            block_free(block);
+        } else if (store_write_header(block, BLOCK_LIVE) == 0) {
+            block_insert(block);
+            existing = block;
+        } else {
+            break;
+        }
+        existing->refs++;
+        object->blocks[kept] = existing;
+    }
+    if (kept < count) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (i < kept) {
+                block_unref(object->blocks[i]);
+            } else {
+                block_free(staged[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&store.lock);
+    free(staged);
+
+    // The blocks and their live headers reach the disk before the caller logs the registration, or a
+    // crash could leave the catalog naming content whose blocks never made it. Blocks the store had
+    // already may be another upload's still on their way there, so every segment used is synced.
+    for (uint32_t i = 0; kept == count && i < count; i++) {
+        if ((i == 0 || object->blocks[i]->fd != object->blocks[i - 1]->fd) && fdatasync(object->blocks[i]->fd) != 0) {
+            log_event("Failed to sync a store segment: %s\n", strerror(errno));
+            pthread_mutex_lock(&store.lock);
+            for (uint32_t j = 0; j < count; j++) {
+                block_unref(object->blocks[j]);
+            }
+            pthread_mutex_unlock(&store.lock);
+            kept = 0;
+        }
+    }
+    if (kept < count) {
+        free(built);
+        free(object);
+        free(name);
+        return NULL;
+    }
+
+    object->name = name;
+    object->hash = name_hash(content_name);
+    object->size = size;
+    object->block_count = count;
+    atomic_init(&object->refs, 1); // The object table's
+    *manifest = built;
+    return object;
+}
+
+// Serve an object under its name from now on, in place of whatever was stored under it before
+void store_publish(StoredObject *object) {
+    pthread_mutex_lock(&store.lock);
+    StoredObject *old = object_unlink(object->name);
+    if (store.object_count >= store.object_buckets) {
+        size_t buckets = store.object_buckets * 2;
+        StoredObject **table = calloc(buckets, sizeof(StoredObject *));
+        for (size_t i = 0; table && i < store.object_buckets; i++) {
+            StoredObject *next;
+            for (StoredObject *moved = store.objects[i]; moved; moved = next) {
+                next = moved->next;
+                moved->next = table[moved->hash & (buckets - 1)];
+                table[moved->hash & (buckets - 1)] = moved;
+            }
+        }
+        if (table) {
+            free(store.objects);
+            store.objects = table;
+            store.object_buckets = buckets;
+        }
+    }
+    StoredObject **link = &store.objects[object->hash & (store.object_buckets - 1)];
+    object->next = *link;
+    *link = object;
+    store.object_count++;
+    store.object_bytes += object->size;
+    pthread_mutex_unlock(&store.lock);
+
+    if (old) {
+        store_release(old); // Downloads still streaming from it keep it until they finish
+    }
+}
+
+// The catalog no longer describes a name by manifest (NULL: not at all): stop serving what is stored
+// under it unless that is the same file. Called by catalog writers whenever a manifest goes away.
+void store_forget(const char *content_name, const Manifest *manifest) {
+    pthread_mutex_lock(&store.lock);
+    StoredObject *object = *object_link(content_name, name_hash(content_name));
+    if (object && !(manifest && object_matches(object, manifest))) {
+        object_unlink(content_name);
+    } else {
+        object = NULL;
+    }
+    pthread_mutex_unlock(&store.lock);
+
+    if (object) {
+        store_release(object);
+    }
+}
+
+// The file stored under a name, with a reference for the caller; NULL if there is none
+StoredObject *store_acquire(const char *content_name) {
+    pthread_mutex_lock(&store.lock);
+    StoredObject *object = *object_link(content_name, name_hash(content_name));
+    if (object) {
+        atomic_fetch_add(&object->refs, 1);
+    }
+    pthread_mutex_unlock(&store.lock);
+    return object;
+}
+
+// Drop a reference to a stored file; the last one gives up its blocks
+void store_release(StoredObject *object) {
+    if (atomic_fetch_sub(&object->refs, 1) != 1) {
+        return;
+    }
+    pthread_mutex_lock(&store.lock);
+    for (uint32_t i = 0; i < object->block_count; i++) {
+        block_unref(object->blocks[i]);
+    }
+    pthread_mutex_unlock(&store.lock);
+    free(object->name);
+    free(object);
+}
+
+// The LZ4 form of a block of an object the caller holds, with a reference for the caller; NULL if the
+// block does not compress well enough to be worth sending compressed. A block is compressed the first
+// time it is asked for and then served from the cache for as long as it stays there.
+PackedBlock *store_pack(Block *block) {
+    pthread_mutex_lock(&store.lock);
+    PackedBlock *packed = block->packed;
+    if (packed) {
+        packed_touch(packed);
+        atomic_fetch_add(&packed->refs, 1);
+        store.packed_hits++;
+    } else {
+        store.packed_misses++;
+    }
+    int incompressible = block->incompressible;
+    pthread_mutex_unlock(&store.lock);
+    if (packed || incompressible) {
+        return packed;
+    }
+
+    // Compress outside the lock; the bytes of a live block never change
+    uint8_t *plain = malloc(block->len);
+    packed = malloc(sizeof(PackedBlock) + lz4_worth(block->len));
+    int ok = plain && packed && read_block(block, plain) == 0;
+    size_t len = ok && lz4_compressible(plain, block->len)
+                     ? lz4_compress(plain, block->len, packed->data, lz4_worth(block->len))
+                     : 0;
+    free(plain);
+    if (len == 0) {
+        free(packed);
+        pthread_mutex_lock(&store.lock);
+        block->incompressible = ok; // Never tried again, unless it was the read that failed
+        pthread_mutex_unlock(&store.lock);
+        return NULL;
+    }
+    PackedBlock *shrunk = realloc(packed, sizeof(PackedBlock) + len);
+    packed = shrunk ? shrunk : packed;
+
+    pthread_mutex_lock(&store.lock);
+    if (block->packed) {
+        free(packed); // Another loop compressed it meanwhile
+        packed = block->packed;
+        packed_touch(packed);
+    } else {
+        atomic_init(&packed->refs, 1); // The cache's
+        packed->block = block;
+        packed->len = (uint32_t)len;
+        packed->newer = NULL;
+        packed->older = store.packed_newest;
+        if (store.packed_newest) {
+            store.packed_newest->newer = packed;
+        } else {
+            store.packed_oldest = packed;
+        }
+        store.packed_newest = packed;
+        block->packed = packed;
+        store.packed_count++;
+        store.packed_bytes += len;
+        while (store.packed_bytes > STORE_PACKED_BYTES && store.packed_oldest != packed) {
+            packed_evict(store.packed_oldest);
+        }
+    }
+    atomic_fetch_add(&packed->refs, 1);
+    pthread_mutex_unlock(&store.lock);
+    return packed;
+}
+
+void packed_release(PackedBlock *packed) {
+    if (atomic_fetch_sub(&packed->refs, 1) == 1) {
+        free(packed);
+    }
+}
+
+// A copy of a block of an object the caller holds, from the hot cache, with a reference for the caller;
+// NULL if the block is to be sent from its segment. A block asked for once is not copied: one-off
+// requests would otherwise churn the window for nothing.
+CachedBlock *store_cached(Block *block) {
+    HotCache *cache = &store.cache;
+    pthread_mutex_lock(&store.lock);
+    if (cache->capacity == 0) {
+        pthread_mutex_unlock(&store.lock);
+        return NULL;
+    }
+    sketch_add(block);
+    CachedBlock *entry = block->cached;
+    if (entry) {
+        cache->hits++;
+        cache_unlink(entry);
+        cache_push(entry, entry->list == CACHE_WINDOW ? CACHE_WINDOW : CACHE_PROTECTED);
+        cache_balance();
+        atomic_fetch_add(&entry->refs, 1);
+    } else {
+        cache->misses++;
+    }
+    int frequency = sketch_frequency(block);
+    pthread_mutex_unlock(&store.lock);
+    if (entry || frequency < 2 || block->len > cache->window_limit) {
+        return entry;
+    }
+
+    // Read outside the lock; the bytes of a live block never change
+    entry = malloc(sizeof(CachedBlock) + block->len);
+    if (!entry || read_block(block, entry->data) != 0) {
+        free(entry);
+        return NULL;
+    }
+    pthread_mutex_lock(&store.lock);
+    if (block->cached) {
+        free(entry); // Another loop read it meanwhile
+        entry = block->cached;
+    } else {
+        atomic_init(&entry->refs, 1); // The cache's
+        entry->block = block;
+        entry->len = block->len;
+        block->cached = entry;
+        cache->count++;
+        cache_push(entry, CACHE_WINDOW);
+    }
+    atomic_fetch_add(&entry->refs, 1);
+    cache_balance();
+    pthread_mutex_unlock(&store.lock);
+    return entry;
+}
+
+void cached_release(CachedBlock *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free(entry);
+    }
+}
+
+// Take in a file an older server kept under its content name in the data directory, if it still
+// matches the manifest; the file itself is left alone
+static StoredObject *store_import(const char *content_name, const Manifest *manifest) {
+    char file_path[MAX_NAME_LENGTH + 3];
+    snprintf(file_path, sizeof(file_path), "./%s", content_name);
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != manifest->size) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    uint32_t count;
+    Manifest *built = NULL;
+    Block **staged = store_stage(fd, STAGE_FILE, manifest->size, &count);
+    StoredObject *object = staged ? store_commit(content_name, staged, count, manifest->size, &built) : NULL;
+    close(fd);
+    if (object && !manifest_equal(built, manifest)) {
+        store_release(object);
+        object = NULL;
+    }
+    free(built);
+    return object;
+}
+
+// Give every content of the recovered catalog that this node stores its object, then free the blocks
+// nothing uses: those of files deregistered or replaced while the server was down.
+int store_attach(void) {
+    size_t imported = 0;
+    IndexTable *table = atomic_load_explicit(&content_index.table, memory_order_acquire);
+    for (size_t i = 0; i < table->capacity; i++) {
+        EntryKey *key = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (!key || key == INDEX_TOMBSTONE) {
+            continue;
+        }
+        const ContentEntry *content = (const ContentEntry *)key;
+        pthread_mutex_lock(&store.lock);
+        StoredObject *object = object_from_blocks(content->key.name, content->manifest);
+        pthread_mutex_unlock(&store.lock);
+        if (!object && (object = store_import(content->key.name, content->manifest)) != NULL) {
+            imported++;
+        }
+        if (object) {
+            store_publish(object);
+        }
+    }
+
+    pthread_mutex_lock(&store.lock);
+    for (size_t i = 0; i < store.block_buckets; i++) {
+        Block *next;
+        for (Block *block = store.blocks[i]; block; block = next) {
+            next = block->next;
+            if (block->refs == 0) {
+                block->refs = 1;
+                block_unref(block);
+            }
+        }
+    }
+    for (int i = 0; i < store.segment_count; i++) {
+        if (store.segments[i].fd >= 0 && store.segments[i].blocks == 0 && i != store.current) {
+            store_segment_delete(i);
+        }
+    }
+    printf("Block store holds %zu file(s) in %zu block(s) (%llu bytes)\n", store.object_count, store.block_count,
+           (unsigned long long)store.block_bytes);
+    pthread_mutex_unlock(&store.lock);
+    if (imported > 0) {
+        printf("Moved %zu file(s) kept by name into the block store\n", imported);
+    }
+    return 0;
+}
+
+// Make a rename or a new file in the catalog directory durable
+static int sync_catalog_dir(void) {
+    int fd = open(CATALOG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+static void segment_path(char *out, size_t len, uint64_t first_lsn) {
+    snprintf(out, len, "%s/wal-%016llx", CATALOG_DIR, (unsigned long long)first_lsn);
+}
+
+static int segment_open(uint64_t first_lsn) {
+    char path[64];
+    segment_path(path, sizeof(path), first_lsn);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || sync_catalog_dir() != 0) {
+        perror("Failed to start a catalog log segment");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static int compare_lsns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// First sequence numbers of the log segments on disk, ascending; returns how many, or -1
+static int segment_list(uint64_t **out) {
+    DIR *dir = opendir(CATALOG_DIR);
+    if (!dir) {
+        return -1;
+    }
+    uint64_t *lsns = NULL;
+    int count = 0;
+    int capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long lsn;
+        char tail;
+        if (strlen(entry->d_name) != 20 || sscanf(entry->d_name, "wal-%16llx%c", &lsn, &tail) != 1) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            uint64_t *grown = realloc(lsns, capacity * sizeof(uint64_t));
+            if (!grown) {
+                free(lsns);
+                closedir(dir);
+                return -1;
+            }
+            lsns = grown;
+        }
+        lsns[count++] = lsn;
+    }
+    closedir(dir);
+    qsort(lsns, count, sizeof(uint64_t), compare_lsns);
+    *out = lsns;
+    return count;
+}
+
+// Append one change record to buffer; returns its length, or 0 if it could not be made
+static size_t wal_record(ByteBuffer *buffer, uint64_t lsn, uint8_t type, const char *peer_name,
+                         const char *content_name, const struct sockaddr_in *addr, const Manifest *manifest) {
+    uint8_t head[2 * (MAX_NAME_LENGTH + 2) + 18];
+    ProtoWriter writer = {head, sizeof(head), 0, 0, 0}; // Payloads reuse the datagram field encoding
+    size_t hashes = 0;
+    if (type == WAL_SYNC) {
+        proto_put_int(&writer, cluster_self, 1);
+    } else {
+        proto_put_name(&writer, peer_name);
+    }
+    if (type == WAL_ADD || type == WAL_REMOVE) {
+        proto_put_name(&writer, content_name);
+    }
+    if (type == WAL_ADD) {
+        proto_put_int(&writer, ntohl(addr->sin_addr.s_addr), 4);
+        proto_put_int(&writer, ntohs(addr->sin_port), 2);
+        proto_put_int(&writer, manifest->size, 8);
+        proto_put_int(&writer, manifest->chunk_count, 4);
+        hashes = (size_t)manifest->chunk_count * BLAKE3_OUT_LEN;
+    }
+    if (writer.overflow || buffer_reserve(buffer, WAL_RECORD_HEADER + writer.len + hashes) != 0) {
+        return 0;
+    }
+
+    uint8_t *record = buffer->data + buffer->len;
+    proto_store(record, writer.len + hashes, 4);
+    proto_store(record + 8, lsn, 8);
+    record[16] = type;
+    memcpy(record + WAL_RECORD_HEADER, head, writer.len);
+    if (hashes > 0) {
+        memcpy(record + WAL_RECORD_HEADER + writer.len, manifest->hashes, hashes);
+    }
+    size_t len = WAL_RECORD_HEADER + writer.len + hashes;
+    proto_store(record + 4, ~crc32c_update(0xFFFFFFFF, record + 8, len - 8), 4);
+    buffer->len += len;
+    return len;
+}
+
+static void replica_ship(const char *content_name, const uint8_t *record, size_t len);
+
+// Append one change to the log; the caller holds the mutex, so the log keeps the order changes were made in.
+// Changes to names other nodes own as well are shipped to them, unless they came from one of them.
+void wal_log(uint8_t type, const char *peer_name, const char *content_name, const struct sockaddr_in *addr,
+             const Manifest *manifest) {
+    if (!wal.logging) {
+        return; // Replaying the log itself
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    ByteBuffer *buffer = wal.filling;
+    uint64_t lsn = wal.next_lsn;
+    size_t len = wal.failed ? 0 : wal_record(buffer, lsn, type, peer_name, content_name, addr, manifest);
+    if (len == 0) {
+        if (!wal.failed) {
+            log_event("Failed to log a catalog change; it will not survive a restart\n");
+        }
+        pthread_mutex_unlock(&wal.lock);
+        return;
+    }
+    wal.next_lsn++;
+    if (cluster_self >= 0 && !replica_applying && type != WAL_REMOVE_PEER) {
+        replica_ship(content_name, buffer->data + buffer->len - len, len);
+    }
+    pthread_cond_signal(&wal.work);
+    pthread_mutex_unlock(&wal.lock);
+    wal_awaited = lsn;
+}
+
+// Block until every change this thread logged is on disk
+void wal_wait(void) {
+    uint64_t lsn = wal_awaited;
+    if (lsn == 0) {
+        return;
+    }
+    pthread_mutex_lock(&wal.lock);
+    while (wal.durable < lsn && !wal.failed) {
+        pthread_cond_wait(&wal.synced, &wal.lock);
+    }
+    pthread_mutex_unlock(&wal.lock);
+    wal_awaited = 0;
+}
+
+// Writes and syncs whatever was appended while the previous batch was being synced
+void *wal_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&wal.lock);
+    while (1) {
+        while (wal.filling->len == 0 && !wal.rotate) {
+            pthread_cond_wait(&wal.work, &wal.lock);
+        }
+        ByteBuffer *batch = wal.filling;
+        wal.filling = batch == &wal.buffers[0] ? &wal.buffers[1] : &wal.buffers[0];
+        uint64_t last = wal.next_lsn - 1;
+        int rotate = wal.rotate;
+        size_t split = rotate ? wal.rotate_offset : batch->len;
+        uint64_t rotate_lsn = wal.rotate_lsn;
+        int failed = wal.failed;
+        pthread_mutex_unlock(&wal.lock);
+
+        // Records before a snapshot's starting point end the old segment, the rest begin the new one
+        int ok = !failed && write_all(wal.fd, batch->data, split) == 0 && fdatasync(wal.fd) == 0;
+        if (ok && rotate) {
+            int fd = segment_open(rotate_lsn);
+            close(wal.fd);
+            wal.fd = fd;
+            ok = fd >= 0 && write_all(fd, batch->data + split, batch->len - split) == 0 && fdatasync(fd) == 0;
+        }
+        if (!ok && !failed) {
+            perror("Failed to write the catalog log; changes are no longer kept across restarts");
+        }
+
+        pthread_mutex_lock(&wal.lock);
+        if (ok) {
+            wal.durable = last;
+        } else {
+            wal.failed = 1;
+        }
+        if (rotate) {
+            wal.rotate = 0;
+        }
+        wal.since_snapshot += batch->len;
+        batch->len = 0;
+        if (wal.since_snapshot >= CATALOG_SNAPSHOT_BYTES && !wal.snapshot_due) {
+            wal.snapshot_due = 1;
+            pthread_cond_signal(&wal.snapshot_wanted);
+        }
+        pthread_cond_broadcast(&wal.synced);
+    }
+    return NULL;
+}
+
+void *snapshot_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&wal.lock);
+    while (1) {
+        while (!wal.snapshot_due) {
+            pthread_cond_wait(&wal.snapshot_wanted, &wal.lock);
+        }
+        pthread_mutex_unlock(&wal.lock);
+        if (catalog_snapshot() != 0) {
+            log_event("Failed to write a catalog snapshot; the log keeps growing until the next one\n");
+        }
+        pthread_mutex_lock(&wal.lock);
+        wal.snapshot_due = 0;
+    }
+    return NULL;
+}
+
+// The catalog in snapshot layout, gathered in memory before it is written
+typedef struct {
+    ByteBuffer peers; // SnapshotPeer records
+    ByteBuffer contents; // SnapshotContent records
+    ByteBuffer holders; // Peer numbers
+    ByteBuffer hashes;
+    ByteBuffer names;
+    uint32_t *peer_table; // Peer number + 1 by name hash, 0 when empty
+    size_t peer_table_capacity;
+    uint32_t peer_count;
+} SnapshotBuilder;
+
+static int snapshot_put_name(SnapshotBuilder *builder, const char *name, uint64_t *offset) {
+    *offset = builder->names.len;
+    return buffer_append(&builder->names, name, strlen(name) + 1);
+}
+
+// Number of a peer in the snapshot, adding it on first sight; -1 if out of memory
+static int64_t snapshot_peer(SnapshotBuilder *builder, const PeerEntry *peer) {
+    if (builder->peer_count * 2 >= builder->peer_table_capacity) {
+        size_t capacity = builder->peer_table_capacity ? builder->peer_table_capacity * 2 : 1024;
+        uint32_t *table = calloc(capacity, sizeof(uint32_t));
+        if (!table) {
+            return -1;
+        }
+        const SnapshotPeer *peers = (const SnapshotPeer *)builder->peers.data;
+        for (uint32_t i = 0; i < builder->peer_count; i++) {
+            size_t pos = name_hash((const char *)builder->names.data + peers[i].name) & (capacity - 1);
+            while (table[pos]) {
+                pos = (pos + 1) & (capacity - 1);
+            }
+            table[pos] = i + 1;
+        }
+        free(builder->peer_table);
+        builder->peer_table = table;
+        builder->peer_table_capacity = capacity;
+    }
+
+    const SnapshotPeer *peers = (const SnapshotPeer *)builder->peers.data;
+    size_t pos = peer->key.hash & (builder->peer_table_capacity - 1);
+    for (; builder->peer_table[pos]; pos = (pos + 1) & (builder->peer_table_capacity - 1)) {
+        uint32_t number = builder->peer_table[pos] - 1;
+        if (strcmp((const char *)builder->names.data + peers[number].name, peer->key.name) == 0) {
+            return number;
+        }
+    }
+
+    SnapshotPeer record = {0, peer->address.sin_addr.s_addr, peer->address.sin_port, 0};
+    if (snapshot_put_name(builder, peer->key.name, &record.name) != 0 ||
+        buffer_append(&builder->peers, &record, sizeof(record)) != 0) {
+        return -1;
+    }
+    builder->peer_table[pos] = builder->peer_count + 1;
+    return builder->peer_count++;
+}
+
+// Copy one content entry and the peers holding all of it; the caller is inside an epoch section
+static int snapshot_content(SnapshotBuilder *builder, const ContentEntry *content) {
+    SnapshotContent record = {0};
+    record.holders = builder->holders.len / sizeof(uint32_t);
+    for (int i = 0; i < content->holder_count; i++) {
+        PeerEntry *peer = content->holders[i].chunks ? NULL : peer_at(content->holders[i].slot);
+        if (!peer) {
+            continue;
+        }
+        int64_t number = snapshot_peer(builder, peer);
+        uint32_t value = (uint32_t)number;
+        if (number < 0 || buffer_append(&builder->holders, &value, sizeof(value)) != 0) {
+            return -1;
+        }
+        record.holder_count++;
+    }
+    if (record.holder_count == 0) {
+        return 0; // Nobody has the whole content, so nobody could serve it after a restart
+    }
+
+    const Manifest *manifest = content->manifest;
+    record.size = manifest->size;
+    record.chunk_count = manifest->chunk_count;
+    record.hashes = builder->hashes.len;
+    if (buffer_append(&builder->hashes, manifest->hashes, (size_t)manifest->chunk_count * BLAKE3_OUT_LEN) != 0 ||
+        snapshot_put_name(builder, content->key.name, &record.name) != 0) {
+        return -1;
+    }
+    return buffer_append(&builder->contents, &record, sizeof(record));
+}
+
+static int snapshot_write(SnapshotBuilder *builder, uint64_t lsn) {
+    static const uint8_t padding[8];
+    SnapshotHeader header = {SNAPSHOT_MAGIC, lsn, builder->peer_count,
+                             builder->contents.len / sizeof(SnapshotContent),
+                             builder->holders.len / sizeof(uint32_t), builder->hashes.len, builder->names.len};
+    char temp_path[64];
+    snprintf(temp_path, sizeof(temp_path), "%s/snapshot.tmp", CATALOG_DIR);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int ok = write_all(fd, &header, sizeof(header)) == 0 &&
+             write_all(fd, builder->peers.data, builder->peers.len) == 0 &&
+             write_all(fd, builder->contents.data, builder->contents.len) == 0 &&
+             write_all(fd, builder->holders.data, builder->holders.len) == 0 &&
+             write_all(fd, padding, builder->holders.len % 8) == 0 &&
+             write_all(fd, builder->hashes.data, builder->hashes.len) == 0 &&
+             write_all(fd, builder->names.data, builder->names.len) == 0 && fdatasync(fd) == 0;
+    close(fd);
+
+    // Readers of the directory see either the old snapshot or the whole new one
+    char path[64];
+    snprintf(path, sizeof(path), "%s/snapshot", CATALOG_DIR);
+    if (!ok || rename(temp_path, path) != 0 || sync_catalog_dir() != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Write the whole catalog to a new snapshot and drop the log it replaces. Writers keep going
+// meanwhile: the log is split where the snapshot starts and everything after is replayed over it.
+int catalog_snapshot(void) {
+    pthread_mutex_lock(&mutex); // Every change logged so far has been made, and no other is under way
+    pthread_mutex_lock(&wal.lock);
+    uint64_t start = wal.next_lsn - 1;
+    wal.rotate = 1;
+    wal.rotate_offset = wal.filling->len;
+    wal.rotate_lsn = start + 1;
+    wal.since_snapshot = 0;
+    pthread_cond_signal(&wal.work);
+    pthread_mutex_unlock(&wal.lock);
+    pthread_mutex_unlock(&mutex);
+
+    SnapshotBuilder builder = {0};
+    int ok = 1;
+    epoch_enter();
+    IndexTable *table = atomic_load_explicit(&content_index.table, memory_order_acquire);
+    for (size_t i = 0; i < table->capacity && ok; i++) {
+        EntryKey *key = atomic_load_explicit(&table->slots[i], memory_order_acquire);
+        if (key && key != INDEX_TOMBSTONE) {
+            ok = snapshot_content(&builder, (const ContentEntry *)key) == 0;
+        }
+    }
+    epoch_exit();
+    ok = ok && snapshot_write(&builder, start) == 0;
+    size_t contents = builder.contents.len / sizeof(SnapshotContent);
+    free(builder.peers.data);
+    free(builder.contents.data);
+    free(builder.holders.data);
+    free(builder.hashes.data);
+    free(builder.names.data);
+    free(builder.peer_table);
+
+    // Segments before the split are covered by the snapshot once the split has happened
+    pthread_mutex_lock(&wal.lock);
+    while (wal.rotate && !wal.failed) {
+        pthread_cond_wait(&wal.synced, &wal.lock);
+    }
+    ok = ok && !wal.failed;
+    pthread_mutex_unlock(&wal.lock);
+    if (!ok) {
+        return -1;
+    }
+    uint64_t *segments;
+    int count = segment_list(&segments);
+    for (int i = 0; i < count && segments[i] <= start; i++) {
+        char path[64];
+        segment_path(path, sizeof(path), segments[i]);
+        unlink(path);
+    }
+    if (count >= 0) {
+        free(segments);
+    }
+    printf("Wrote catalog snapshot of %zu content item(s) through log record %llu\n", contents,
+           (unsigned long long)start);
+    return 0;
+}
+
+// The NUL-terminated name at offset in the snapshot names, or NULL if it runs off their end
+static const char *snapshot_name(const char *names, uint64_t names_len, uint64_t offset) {
+    if (offset >= names_len) {
+        return NULL;
+    }
+    const char *name = names + offset;
+    size_t len = strnlen(name, names_len - offset);
+    return len < names_len - offset && len > 0 && len <= MAX_NAME_LENGTH ? name : NULL;
+}
+
+// Locate the sections of a snapshot; -1 if their sizes do not add up to the file
+static int snapshot_view(const uint8_t *map, uint64_t size, SnapshotView *view) {
+    const SnapshotHeader *header = (const SnapshotHeader *)map;
+    uint64_t holders_len = (header->holder_count * sizeof(uint32_t) + 7) / 8 * 8;
+    if (size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 ||
+        header->peer_count > size / sizeof(SnapshotPeer) || header->content_count > size / sizeof(SnapshotContent) ||
+        header->holder_count > size / sizeof(uint32_t) || header->hashes_len > size || header->names_len > size ||
+        sizeof(SnapshotHeader) + header->peer_count * sizeof(SnapshotPeer) +
+                header->content_count * sizeof(SnapshotContent) + holders_len + header->hashes_len +
+                header->names_len != size) {
+        return -1;
+    }
+    view->header = header;
+    view->peers = (const SnapshotPeer *)(map + sizeof(SnapshotHeader));
+    view->contents = (const SnapshotContent *)(view->peers + header->peer_count);
+    view->holders = (const uint32_t *)(view->contents + header->content_count);
+    view->hashes = (const uint8_t *)view->holders + holders_len;
+    view->names = (const char *)view->hashes + header->hashes_len;
+    return 0;
+}
+
+// Build the catalog from the snapshot, if there is one, and report which log record it reflects. Chunk
+// hashes are used in place from the mapping, so only the pages of manifests served are read. Names are
+// copied into the name arena, since handles only locate names there, so every name page is read once
+// at load. The search index is filled in afterwards by search_warm_thread.
+static int snapshot_load(uint64_t *lsn) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/snapshot", CATALOG_DIR);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    SnapshotView view;
+    if (snapshot_view(map, st.st_size, &view) != 0) {
+        munmap((void *)map, st.st_size);
+        return -1;
+    }
+    madvise((void *)map, st.st_size, MADV_RANDOM); // Hashes are only read when a manifest is served
+    snapshot_map = map;
+    snapshot_map_len = st.st_size;
+    const SnapshotHeader *header = view.header;
+
+    // Count each peer's contents so every set of names is made at its final size
+    uint32_t *content_counts = calloc(header->peer_count + 1, sizeof(uint32_t));
+    PeerEntry **loaded = calloc(header->peer_count + 1, sizeof(PeerEntry *));
+    int ok = content_counts && loaded;
+    for (uint64_t i = 0; ok && i < header->content_count; i++) {
+        const SnapshotContent *record = &view.contents[i];
+        ok = record->holders <= header->holder_count && record->holder_count <= header->holder_count - record->holders &&
+             record->hashes <= header->hashes_len &&
+             (uint64_t)record->chunk_count * BLAKE3_OUT_LEN <= header->hashes_len - record->hashes;
+        for (uint32_t j = 0; ok && j < record->holder_count; j++) {
+            uint32_t number = view.holders[record->holders + j];
+            ok = number < header->peer_count;
+            content_counts[ok ? number : 0]++;
+        }
+    }
+
+    // Nothing reads the catalog yet, so records are filled in after they are indexed
+    for (uint64_t i = 0; ok && i < header->peer_count; i++) {
+        const char *stored = snapshot_name(view.names, header->names_len, view.peers[i].name);
+        char *name = stored && !find_peer(stored) ? name_store(stored) : NULL;
+        ok = name != NULL;
+        PeerEntry *peer = ok ? record_alloc(sizeof(PeerEntry)) : NULL;
+        PeerLease *lease = peer ? lease_new(name) : NULL; // Every recovered peer gets a whole lease to check in
+        PeerContents *contents = lease ? peer_contents_new(content_counts[i]) : NULL;
+        int slot = contents ? reserve_peer_slot() : -1;
+        if (slot < 0 || index_reserve(&peer_index) != 0) {
+            if (name) {
+                name_release(name);
+            }
+            record_free(peer, sizeof(PeerEntry));
+            record_free(lease, sizeof(PeerLease));
+            if (contents) {
+                peer_contents_release(contents, record_free);
+            }
+            ok = 0;
+            break;
+        }
+        peer->key = (EntryKey){name, name_hash(name)};
+        peer->lease = lease;
+        peer->contents = contents;
+        peer->slot = slot;
+        memset(&peer->address, 0, sizeof(peer->address));
+        peer->address.sin_family = AF_INET;
+        peer->address.sin_addr.s_addr = view.peers[i].address;
+        peer->address.sin_port = view.peers[i].port;
+        index_insert(&peer_index, &peer->key);
+        publish_peer_slot(slot, peer);
+        lease_file(lease);
+        loaded[i] = peer;
+    }
+    for (uint64_t i = 0; ok && i < header->content_count; i++) {
+        const SnapshotContent *record = &view.contents[i];
+        const char *stored = snapshot_name(view.names, header->names_len, record->name);
+        char *name = stored && record->holder_count > 0 && !find_content(stored) ? name_store(stored) : NULL;
+        ok = name != NULL;
+        ContentEntry *content = ok ? record_alloc(content_bytes(record->holder_count)) : NULL;
+        Manifest *manifest = content ? malloc(sizeof(Manifest)) : NULL;
+        if (!manifest || index_reserve(&content_index) != 0) {
+            if (name) {
+                name_release(name);
+            }
+            record_free(content, content_bytes(record->holder_count));
+            free(manifest);
+            ok = 0;
+            break;
+        }
+        manifest->size = record->size;
+        manifest->chunk_count = record->chunk_count;
+        manifest->hashes = (const uint8_t(*)[BLAKE3_OUT_LEN])(view.hashes + record->hashes);
+        content->key = (EntryKey){name, name_hash(name)};
+        content->manifest = manifest;
+        content->holder_count = record->holder_count;
+        for (uint32_t j = 0; j < record->holder_count; j++) {
+            PeerEntry *peer = loaded[view.holders[record->holders + j]];
+            content->holders[j] = (Holder){peer->slot, NULL};
+            peer_contents_add(peer->contents, name_handle(name));
+        }
+        index_insert(&content_index, &content->key);
+    }
+    free(content_counts);
+    free(loaded);
+    if (!ok) {
+        return -1; // What was loaded stays; the server refuses to start anyway
+    }
+    *lsn = header->lsn;
+    atomic_store(&search_warming, header->content_count > 0);
+    printf("Loaded catalog snapshot: %llu content item(s) from %llu peer(s)\n",
+           (unsigned long long)header->content_count, (unsigned long long)header->peer_count);
+    return 0;
+}
+
+// Add the names loaded from the snapshot to the search index a batch at a time, so that lookups and
+// registrations are served meanwhile. Names that arrived or left since are already taken care of.
+void *search_warm_thread(void *arg) {
+    (void)arg;
+    SnapshotView view;
+    snapshot_view(snapshot_map, snapshot_map_len, &view); // Checked when it was loaded
+    uint64_t count = view.header->content_count;
+    for (uint64_t first = 0; first < count; first += SEARCH_WARM_BATCH) {
+        uint64_t end = count - first < SEARCH_WARM_BATCH ? count : first + SEARCH_WARM_BATCH;
+        pthread_mutex_lock(&mutex);
+        for (uint64_t i = first; i < end; i++) {
+            const char *name = view.names + view.contents[i].name;
+            if (find_content(name)) {
+                search_index_add(name);
+            }
+        }
+        epoch_collect();
+        pthread_mutex_unlock(&mutex);
+    }
+    atomic_store_explicit(&search_warming, 0, memory_order_release);
+    printf("Name search covers the recovered catalog\n");
+    return NULL;
+}
+
+// Apply one logged change again; the caller holds the mutex
+static int wal_apply(uint8_t type, const uint8_t *payload, size_t len) {
+    ProtoReader reader = {payload, payload + len, 0};
+    const char *peer_name = proto_get_name(&reader);
+    if (type == WAL_REMOVE_PEER) {
+        if (!reader.error) {
+            catalog_remove_peer(peer_name);
+        }
+        return reader.error ? -1 : 0;
+    }
+    const char *content_name = proto_get_name(&reader);
+    if (type == WAL_REMOVE) {
+        if (!reader.error) {
+            catalog_remove(peer_name, content_name);
+        }
+        return reader.error ? -1 : 0;
+    }
+    if (type != WAL_ADD) {
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl((uint32_t)proto_get_int(&reader, 4));
+    addr.sin_port = htons((uint16_t)proto_get_int(&reader, 2));
+    uint64_t size = proto_get_int(&reader, 8);
+    uint32_t chunk_count = (uint32_t)proto_get_int(&reader, 4);
+    if (reader.error || (uint64_t)(reader.end - reader.pos) != (uint64_t)chunk_count * BLAKE3_OUT_LEN) {
+        return -1;
+    }
+    Manifest *manifest = manifest_alloc(size, chunk_count);
+    if (!manifest) {
+        return -1;
+    }
+    memcpy(manifest->stored, reader.pos, (size_t)chunk_count * BLAKE3_OUT_LEN);
+    catalog_add(peer_name, content_name, &addr, manifest, -1);
+    return 0;
+}
+
+// Replay the records of one segment that come after *last; a torn or corrupt record ends the segment
+static uint64_t wal_replay(uint64_t first_lsn, uint64_t *last) {
+    char path[64];
+    segment_path(path, sizeof(path), first_lsn);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    uint8_t *data = malloc(st.st_size + 1);
+    size_t len = 0;
+    while (data && len < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + len, st.st_size - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+
+    size_t pos = 0;
+    uint64_t replayed = 0;
+    while (data && len - pos >= WAL_RECORD_HEADER) {
+        const uint8_t *record = data + pos;
+        uint64_t payload_len = proto_load(record, 4);
+        if (payload_len > len - pos - WAL_RECORD_HEADER ||
+            (uint32_t)proto_load(record + 4, 4) !=
+                (uint32_t)~crc32c_update(0xFFFFFFFF, record + 8, WAL_RECORD_HEADER - 8 + payload_len)) {
+            printf("Catalog log %s ends in an incomplete record\n", path);
+            break;
+        }
+        uint64_t lsn = proto_load(record + 8, 8);
+        if (lsn > *last) {
+            pthread_mutex_lock(&mutex);
+            int result = wal_apply(record[16], record + WAL_RECORD_HEADER, payload_len);
+            pthread_mutex_unlock(&mutex);
+            if (result != 0) {
+                printf("Skipped malformed catalog log record %llu\n", (unsigned long long)lsn);
+            }
+            *last = lsn;
+            replayed++;
+        }
+        pos += WAL_RECORD_HEADER + payload_len;
+    }
+    free(data);
+    wal.since_snapshot += pos;
+    return replayed;
+}
+
+// Rebuild the catalog from disk and open a fresh log segment after the last record found
+int catalog_recover(void) {
+    if (mkdir(CATALOG_DIR, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create the catalog directory");
+        return -1;
+    }
+    crc32c_init();
+    pthread_mutex_init(&wal.lock, NULL);
+    pthread_cond_init(&wal.work, NULL);
+    pthread_cond_init(&wal.synced, NULL);
+    pthread_cond_init(&wal.snapshot_wanted, NULL);
+    wal.filling = &wal.buffers[0];
+
+    struct timespec began;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+    uint64_t last = 0;
+    if (snapshot_load(&last) != 0) {
+        printf("Catalog snapshot is unreadable\n");
+        return -1;
+    }
+    uint64_t *segments;
+    int count = segment_list(&segments);
+    if (count < 0) {
+        return -1;
+    }
+    uint64_t replayed = 0;
+    for (int i = 0; i < count; i++) {
+        replayed += wal_replay(segments[i], &last);
+    }
+    free(segments);
+
+    wal.next_lsn = last + 1;
+    wal.durable = last;
+    wal.fd = segment_open(last + 1);
+    if (wal.fd < 0) {
+        return -1;
+    }
+    wal.logging = 1;
+    if (wal.since_snapshot >= CATALOG_SNAPSHOT_BYTES) {
+        wal.snapshot_due = 1;
+    }
+
+    struct timespec done;
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    printf("Recovered catalog in %.3f s (%llu log record(s) replayed)\n",
+           (done.tv_sec - began.tv_sec) + (done.tv_nsec - began.tv_nsec) / 1e9, (unsigned long long)replayed);
+    return 0;
+}
+
+uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// A lease that starts now; it is filed once the peer is published. The caller holds the mutex.
+PeerLease *lease_new(const char *peer_name) {
+    PeerLease *lease = record_alloc(sizeof(PeerLease));
+    if (lease) {
+        memset(lease, 0, sizeof(PeerLease));
+        atomic_init(&lease->last_seen, now_ms());
+        lease->peer_name = peer_name;
+    }
+    return lease;
+}
+
+// File a lease under the tick it runs out at, judging by when the peer was last heard from. The
+// caller holds the mutex.
+void lease_file(PeerLease *lease) {
+    uint64_t last_seen = atomic_load_explicit(&lease->last_seen, memory_order_relaxed);
+    uint64_t expires = (last_seen + LEASE_SECONDS * 1000 + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (expires < lease_wheel.now) {
+        expires = lease_wheel.now;
+    }
+    uint64_t delta = expires - lease_wheel.now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS) != 0) {
+        expires = lease_wheel.now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1; // Checked again then
+    }
+
+    PeerLease **head = &lease_wheel.slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    lease->expires = expires;
+    lease->next = *head;
+    if (*head) {
+        (*head)->pprev = &lease->next;
+    }
+    *head = lease;
+    lease->pprev = head;
+}
+
+// Take a lease out of the wheel, if it is filed; the caller holds the mutex
+void lease_cancel(PeerLease *lease) {
+    if (!lease->pprev) {
+        return;
+    }
+    *lease->pprev = lease->next;
+    if (lease->next) {
+        lease->next->pprev = lease->pprev;
+    }
+    lease->next = NULL;
+    lease->pprev = NULL;
+}
+
+// Empty a wheel slot; the leases stay linked to each other through next
+static PeerLease *lease_take(PeerLease **head) {
+    PeerLease *list = *head;
+    *head = NULL;
+    for (PeerLease *lease = list; lease; lease = lease->next) {
+        lease->pprev = NULL;
+    }
+    return list;
+}
+
+// Process one tick: the coarser slots that come due are spread over the finer levels first, then the
+// leases filed under this tick are evicted, or filed again if the peer was heard from meanwhile.
+// Returns how many peers were evicted; the caller holds the mutex.
+static int lease_tick(uint64_t now) {
+    uint64_t tick = lease_wheel.now;
+    for (int level = 1; level < WHEEL_LEVELS && ((tick >> (WHEEL_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) == 0;
+         level++) {
+        PeerLease *lease = lease_take(&lease_wheel.slots[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+        while (lease) {
+            PeerLease *next = lease->next;
+            lease_file(lease);
+            lease = next;
+        }
+    }
+
+    PeerLease *lease = lease_take(&lease_wheel.slots[0][tick & (WHEEL_SLOTS - 1)]);
+    lease_wheel.now = tick + 1;
+    int evicted = 0;
+    while (lease) {
+        PeerLease *next = lease->next;
+        uint64_t last_seen = atomic_load_explicit(&lease->last_seen, memory_order_relaxed);
+        if (now > last_seen && now - last_seen >= LEASE_SECONDS * 1000) {
+            log_event("Lease of peer '%s' ran out, dropping it and its content\n", lease->peer_name);
+            catalog_remove_peer(lease->peer_name); // Retires the lease, which is no longer filed
+            evicted++;
+        } else {
+            lease_file(lease);
+        }
+        lease = next;
+    }
+    return evicted;
+}
+
+// Advances the lease wheel in real time; a tick with nothing due costs a slot check or two
+void *lease_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        struct timespec pause = {0, WHEEL_TICK_MS * 1000000L};
+        nanosleep(&pause, NULL);
+        uint64_t now = now_ms();
+        pthread_mutex_lock(&mutex); // Evictions are catalog writes
+        while (lease_wheel.now <= now / WHEEL_TICK_MS) {
+            lease_tick(now);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+int feed_init(void) {
+    feed.ring = malloc(FEED_BYTES);
+    feed.offsets = malloc(FEED_EVENTS * sizeof(uint64_t));
+    feed.bucket_count = 1024;
+    feed.buckets = calloc(feed.bucket_count, sizeof(Subscription *));
+    if (!feed.ring || !feed.offsets || !feed.buckets ||
+        getrandom(&feed.id, sizeof(feed.id), 0) != sizeof(feed.id)) {
+        return -1;
+    }
+    feed.id |= 1; // 0 is what a client that never subscribed sends
+    feed.first = feed.next = 1;
+    pthread_mutex_init(&feed.lock, NULL);
+    pthread_mutex_init(&feed.subscriptions_lock, NULL);
+    return 0;
+}
+
+// Add a change to the feed, ahead of the log record describing it; the caller holds the mutex, so the feed
+// keeps the order changes were made in
+void feed_publish(uint8_t type, const char *peer_name, const char *content_name, const struct sockaddr_in *seed) {
+    if (!wal.logging || !lists_name(content_name)) {
+        return; // Replaying the log is not news, and in a cluster each name is told of by its primary
+    }
+    uint8_t record[FEED_RECORD_MAX];
+    ProtoWriter writer = {record, sizeof(record), 0, 0, 0}; // Records reuse the datagram field encoding
+    proto_put_int(&writer, wal.next_lsn, 8); // Writers change it only under the mutex
+    proto_put_int(&writer, type, 1);
+    proto_put_int(&writer, seed ? ntohl(seed->sin_addr.s_addr) : 0, 4);
+    proto_put_int(&writer, seed ? ntohs(seed->sin_port) : 0, 2);
+    proto_put_name(&writer, content_name);
+    proto_put_name(&writer, peer_name);
+
+    // Records never wrap around the end of the ring; whatever the new one overwrites is forgotten
+    pthread_mutex_lock(&feed.lock);
+    uint64_t start = feed.end;
+    if (start % FEED_BYTES + writer.len > FEED_BYTES) {
+        start += FEED_BYTES - start % FEED_BYTES;
+    }
+    uint64_t end = start + writer.len;
+    if (feed.next - feed.first == FEED_EVENTS) {
+        feed.first++;
+    }
+    while (feed.first < feed.next && end > FEED_BYTES && feed.offsets[feed.first % FEED_EVENTS] < end - FEED_BYTES) {
+        feed.first++;
+    }
+    memcpy(feed.ring + start % FEED_BYTES, record, writer.len);
+    feed.offsets[feed.next % FEED_EVENTS] = start;
+    feed.next++;
+    feed.end = end;
+    pthread_mutex_unlock(&feed.lock);
+}
+
+// A change as the feed keeps it
+typedef struct {
+    uint64_t number;
+    uint8_t type;
+    uint32_t address;
+    uint16_t port;
+    const char *content_name; // In the ring
+    const char *peer_name;
+    int superseded; // A later change of the same content and peer replaces it
+} FeedChange;
+
+static int subscription_covers(const Subscription *sub, const FeedChange *change) {
+    switch (sub->kind) {
+        case SUBSCRIBE_NAME:
+            return strcmp(change->content_name, sub->pattern) == 0;
+        case SUBSCRIBE_PREFIX:
+            return strncmp(change->content_name, sub->pattern, sub->pattern_len) == 0;
+        default:
+            return strcmp(change->peer_name, sub->pattern) == 0;
+    }
+}
+
+// Write the notifications a subscription is due into datagrams, at most FEED_BURST of them, and move its
+// cursor past what they cover. Changes whose log record is not on disk yet wait. The caller holds both locks.
+static int feed_notify(Subscription *sub, uint64_t durable, uint8_t (*datagrams)[PROTO_MAX_DATAGRAM], size_t *lens) {
+    if (sub->cursor + 1 < feed.first) {
+        sub->cursor = sub->sent = feed.first - 1; // Fell behind; the client learns it when it subscribes again
+    }
+
+    // Gather what the subscription covers, the last change of each content and peer only
+    FeedChange changes[FEED_COALESCE];
+    uint16_t table[2 * FEED_COALESCE]; // Index in changes plus one by content and peer, 0 for none
+    memset(table, 0, sizeof(table));
+    int count = 0;
+    uint64_t last = feed.next - 1 - sub->cursor > FEED_SCAN ? sub->cursor + FEED_SCAN : feed.next - 1;
+    uint64_t scanned = sub->cursor;
+    for (uint64_t number = sub->cursor + 1; number <= last && count < FEED_COALESCE; number++) {
+        const uint8_t *record = feed.ring + feed.offsets[number % FEED_EVENTS] % FEED_BYTES;
+        ProtoReader reader = {record, feed.ring + FEED_BYTES, 0};
+        if (proto_get_int(&reader, 8) > durable) {
+            break;
+        }
+        FeedChange *change = &changes[count];
+        change->number = number;
+        change->type = (uint8_t)proto_get_int(&reader, 1);
+        change->address = (uint32_t)proto_get_int(&reader, 4);
+        change->port = (uint16_t)proto_get_int(&reader, 2);
+        change->content_name = proto_get_name(&reader);
+        change->peer_name = proto_get_name(&reader);
+        change->superseded = 0;
+        scanned = number;
+        if (!subscription_covers(sub, change)) {
+            continue;
+        }
+        size_t i = (name_hash(change->content_name) ^ name_hash(change->peer_name)) & (2 * FEED_COALESCE - 1);
+        for (; table[i]; i = (i + 1) & (2 * FEED_COALESCE - 1)) {
+            FeedChange *earlier = &changes[table[i] - 1];
+            if (strcmp(earlier->content_name, change->content_name) == 0 &&
+                strcmp(earlier->peer_name, change->peer_name) == 0) {
+                earlier->superseded = 1;
+                break;
+            }
+        }
+        table[i] = (uint16_t)++count;
+    }
+
+    // A datagram covers everything after the last one up to its last change, and the final one up to scanned
+    int sent = 0;
+    ProtoWriter writer;
+    uint8_t *to = NULL;
+    uint64_t included = sub->sent;
+    for (int i = 0; i < count && sent < FEED_BURST; i++) {
+        const FeedChange *change = &changes[i];
+        if (change->superseded) {
+            continue;
+        }
+        for (int attempt = 0; attempt < 2; attempt++) {
+            if (!to) {
+                ProtoHeader header = {OP_NOTIFY, PROTO_OK, 0, sub->id, 0};
+                proto_begin(&writer, datagrams[sent], PROTO_MAX_DATAGRAM, &header);
+                proto_put_int(&writer, feed.id, 8);
+                proto_put_int(&writer, sub->sent, 8);
+                to = proto_reserve(&writer, 8);
+                proto_end_record(&writer);
+            }
+            size_t mark = proto_mark(&writer);
+            proto_put_int(&writer, change->type, 1);
+            proto_put_name(&writer, change->content_name);
+            proto_put_name(&writer, change->peer_name);
+            proto_put_int(&writer, change->address, 4);
+            proto_put_int(&writer, change->port, 2);
+            if (!writer.overflow) {
+                proto_end_record(&writer);
+                included = change->number;
+                break;
+            }
+            proto_rewind(&writer, mark); // Full: finish it and start another
+            proto_store(to, included, 8);
+            lens[sent++] = proto_finish(&writer);
+            sub->sent = included;
+            to = NULL;
+            if (sent == FEED_BURST) {
+                scanned = included; // The rest waits for the next tick
+                break;
+            }
+        }
+    }
+    if (to) {
+        proto_store(to, scanned, 8);
+        lens[sent++] = proto_finish(&writer);
+        sub->sent = scanned;
+    }
+    sub->cursor = scanned;
+    return sent;
+}
+
+// Tell every subscriber what changed since the last tick, and drop the subscriptions that lapsed
+void *feed_thread(void *arg) {
+    (void)arg;
+    static uint8_t datagrams[FEED_BURST][PROTO_MAX_DATAGRAM];
+    size_t lens[FEED_BURST];
+    while (1) {
+        struct timespec pause = {0, FEED_TICK_MS * 1000000L};
+        nanosleep(&pause, NULL);
+        uint64_t now = now_ms();
+        pthread_mutex_lock(&wal.lock);
+        uint64_t durable = wal.failed ? UINT64_MAX : wal.durable;
+        pthread_mutex_unlock(&wal.lock);
+
+        pthread_mutex_lock(&feed.subscriptions_lock);
+        for (size_t i = 0; i < feed.bucket_count; i++) {
+            Subscription **slot = &feed.buckets[i];
+            while (*slot) {
+                Subscription *sub = *slot;
+                if (sub->expires <= now) {
+                    *slot = sub->next;
+                    feed.subscription_count--;
+                    free(sub);
+                    continue;
+                }
+                slot = &sub->next;
+                pthread_mutex_lock(&feed.lock);
+                int count = sub->cursor + 1 < feed.next ? feed_notify(sub, durable, datagrams, lens) : 0;
+                pthread_mutex_unlock(&feed.lock);
+                for (int j = 0; j < count; j++) {
+                    sendto(sockfd, datagrams[j], lens[j], MSG_DONTWAIT, (struct sockaddr *)&sub->client,
+                           sizeof(sub->client)); // A datagram lost here is sent again when the client notices
+                }
+            }
+        }
+        pthread_mutex_unlock(&feed.subscriptions_lock);
+    }
+    return NULL;
+}
+
+// Queue a change for the other owners of its content name; the caller holds the mutex and wal.lock
+static void replica_ship(const char *content_name, const uint8_t *record, size_t len) {
+    int owners[CLUSTER_MAX_NODES];
+    int count = cluster_owners(&cluster, content_name, owners);
+    for (int i = 0; i < count; i++) {
+        ReplicaLink *link = &replica_links[owners[i]];
+        if (owners[i] == cluster_self) {
+            continue;
+        }
+        pthread_mutex_lock(&link->lock);
+        if (link->connected && link->queue.len + len > REPLICA_QUEUE_LIMIT) {
+            // Falling this far behind costs less to catch up on with a resync
+            printf("Replication to node %d is lagging; resyncing it\n", link->node);
+            link->connected = 0;
+            link->queue.len = 0;
+            shutdown(link->fd, SHUT_RDWR);
+        } else if (link->connected && buffer_append(&link->queue, record, len) != 0) {
+            link->connected = 0;
+            shutdown(link->fd, SHUT_RDWR);
+        }
+        pthread_cond_signal(&link->work);
+        pthread_mutex_unlock(&link->lock);
+    }
+}
+
+// Queue everything a node should hold of this node's partition: a sync record, then every whole
+// holder of every name this node is primary for and the node owns too. The caller holds the mutex.
+static int replica_dump(ReplicaLink *link, size_t *records) {
+    if (wal_record(&link->queue, 0, WAL_SYNC, NULL, NULL, NULL, NULL) == 0) {
+        return -1;
+    }
+    *records = 0;
+    IndexTable *table = atomic_load_explicit(&content_index.table, memory_order_acquire);
+    for (size_t i = 0; i < table->capacity; i++) {
+        EntryKey *key = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (!key || key == INDEX_TOMBSTONE) {
+            continue;
+        }
+        const ContentEntry *content = (const ContentEntry *)key;
+        int owners[CLUSTER_MAX_NODES];
+        int count = cluster_owners(&cluster, content->key.name, owners);
+        int shared = 0;
+        for (int j = 1; j < count; j++) {
+            shared |= owners[j] == link->node;
+        }
+        if (owners[0] != cluster_self || !shared) {
+            continue;
+        }
+        for (int j = 0; j < content->holder_count; j++) {
+            PeerEntry *peer = peer_at(content->holders[j].slot);
+            if (!peer || content->holders[j].chunks) {
+                continue; // Partial holdings stay with the primary
+            }
+            if (wal_record(&link->queue, 0, WAL_ADD, peer->key.name, content->key.name, &peer->address,
+                           content->manifest) == 0) {
+                return -1;
+            }
+            (*records)++;
+        }
+    }
+    return 0;
+}
+
+static int send_all(int fd, const void *data, size_t len) {
+    const uint8_t *pos = data;
+    while (len > 0) {
+        ssize_t n = send(fd, pos, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Keeps one other node up to date: connect, resync, then stream changes until the connection breaks
+void *replica_thread(void *arg) {
+    ReplicaLink *link = arg;
+    struct sockaddr_in addr = cluster.nodes[link->node];
+    addr.sin_port = htons(ntohs(addr.sin_port) + 3);
+    ByteBuffer sending = {0};
+    int reported = 0;
+
+    while (1) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            if (!reported) {
+                printf("Node %d is not reachable yet; retrying\n", link->node);
+                reported = 1;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            sleep(REPLICA_RETRY_SECONDS);
+            continue;
+        }
+
+        // The partition as it stands goes first; changes made from then on queue up behind it
+        size_t records = 0;
+        pthread_mutex_lock(&mutex);
+        pthread_mutex_lock(&link->lock);
+        link->queue.len = 0;
+        link->fd = fd;
+        link->connected = replica_dump(link, &records) == 0;
+        int ok = link->connected;
+        pthread_mutex_unlock(&link->lock);
+        pthread_mutex_unlock(&mutex);
+        if (ok) {
+            printf("Resyncing node %d with %zu holding(s)\n", link->node, records);
+            reported = 0;
+        }
+
+        while (ok) {
+            pthread_mutex_lock(&link->lock);
+            while (link->connected && link->queue.len == 0) {
+                pthread_cond_wait(&link->work, &link->lock);
+            }
+            ByteBuffer queued = link->queue;
+            link->queue = sending; // Swap, so the next records land in the buffer just sent
+            sending = queued;
+            ok = link->connected;
+            pthread_mutex_unlock(&link->lock);
+
+            ok = ok && send_all(fd, sending.data, sending.len) == 0;
+            sending.len = 0;
+        }
+
+        pthread_mutex_lock(&link->lock);
+        link->connected = 0;
+        link->queue.len = 0;
+        pthread_mutex_unlock(&link->lock);
+        close(fd);
+        printf("Lost the replication connection to node %d\n", link->node);
+        sleep(REPLICA_RETRY_SECONDS);
+    }
+    return NULL;
+}
+
+// Forget what this node holds of another node's partition, before that node sends all of it again.
+// The caller holds the mutex.
+static void replica_drop(int node) {
+    char **pairs = NULL; // Peer and content name, alternating
+    size_t count = 0;
+    size_t capacity = 0;
+    IndexTable *table = atomic_load_explicit(&content_index.table, memory_order_acquire);
+    for (size_t i = 0; i < table->capacity; i++) {
+        EntryKey *key = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (!key || key == INDEX_TOMBSTONE || cluster_primary(&cluster, key->name) != node) {
+            continue;
+        }
+        const ContentEntry *content = (const ContentEntry *)key;
+        for (int j = 0; j < content->holder_count; j++) {
+            PeerEntry *peer = peer_at(content->holders[j].slot);
+            if (!peer || content->holders[j].chunks) {
+                continue;
+            }
+            if (count + 2 > capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                char **grown = realloc(pairs, capacity * sizeof(char *));
+                if (!grown) {
+                    break;
+                }
+                pairs = grown;
+            }
+            pairs[count++] = peer->key.name;
+            pairs[count++] = content->key.name;
+        }
+    }
+
+    // A content name is retired with its last holder, which comes last in its run; peer names outlive their holdings
+    for (size_t i = 0; i + 1 < count; i += 2) {
+        catalog_remove(pairs[i], pairs[i + 1]);
+    }
+    free(pairs);
+}
+
+// Apply another node's changes as they stream in
+void *replica_receive_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    ByteBuffer stream = {0};
+    uint64_t applied = 0;
+    int corrupt = 0;
+    replica_applying = 1;
+
+    while (!corrupt && buffer_reserve(&stream, REPLICA_READ_SIZE) == 0) {
+        ssize_t n = read(fd, stream.data + stream.len, REPLICA_READ_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        stream.len += n;
+
+        // Every whole record received so far, under one hold of the mutex
+        size_t pos = 0;
+        pthread_mutex_lock(&mutex);
+        while (stream.len - pos >= WAL_RECORD_HEADER) {
+            const uint8_t *record = stream.data + pos;
+            uint64_t payload_len = proto_load(record, 4);
+            if (payload_len > stream.len - pos - WAL_RECORD_HEADER) {
+                break; // The rest is still on its way
+            }
+            if ((uint32_t)proto_load(record + 4, 4) !=
+                (uint32_t)~crc32c_update(0xFFFFFFFF, record + 8, WAL_RECORD_HEADER - 8 + payload_len)) {
+                corrupt = 1;
+                break;
+            }
+            if (record[16] == WAL_SYNC && payload_len == 1) {
+                replica_drop(record[WAL_RECORD_HEADER]);
+            } else if (wal_apply(record[16], record + WAL_RECORD_HEADER, payload_len) != 0) {
+                printf("Skipped a malformed replicated change\n");
+            }
+            applied++;
+            pos += WAL_RECORD_HEADER + payload_len;
+        }
+        epoch_collect();
+        pthread_mutex_unlock(&mutex);
+        memmove(stream.data, stream.data + pos, stream.len - pos);
+        stream.len -= pos;
+    }
+
+    if (corrupt) {
+        printf("Dropped a corrupt replication stream\n");
+    }
+    printf("Replication stream closed after %llu change(s)\n", (unsigned long long)applied);
+    free(stream.data);
+    close(fd);
+    return NULL;
+}
+
+// Takes the replication connections of the other nodes, a thread each
+void *cluster_thread(void *arg) {
+    int listen_fd = *(int *)arg;
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        pthread_t receiver;
+        if (fd < 0) {
+            continue;
+        }
+        if (pthread_create(&receiver, NULL, replica_receive_thread, (void *)(intptr_t)fd) != 0) {
+            perror("Failed to start replication receiver");
+            close(fd);
+            continue;
+        }
+        pthread_detach(receiver);
+    }
+    return NULL;
+}
+
+// Position of this node in the node list: the one on the control port at an address of this host's
+// interfaces. -1 if no node is, -2 if several are.
+int cluster_find_self(void) {
+    struct ifaddrs *interfaces;
+    if (getifaddrs(&interfaces) != 0) {
+        perror("Failed to list the network interfaces");
+        return -1;
+    }
+    int self = -1;
+    for (int i = 0; i < cluster.node_count; i++) {
+        if (ntohs(cluster.nodes[i].sin_port) != server_port) {
+            continue;
+        }
+        int local = 0;
+        for (struct ifaddrs *entry = interfaces; entry && !local; entry = entry->ifa_next) {
+            local = entry->ifa_addr && entry->ifa_addr->sa_family == AF_INET &&
+                    ((struct sockaddr_in *)entry->ifa_addr)->sin_addr.s_addr == cluster.nodes[i].sin_addr.s_addr;
+        }
+        if (local) {
+            self = self == -1 ? i : -2;
+        }
+    }
+    freeifaddrs(interfaces);
+    return self;
+}
+
+// Listen for the other nodes' changes and start shipping ours to every node we share names with
+int cluster_start(void) {
+    static int listen_fd;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(cluster_port);
+    int reuse = 1;
+    pthread_t listener;
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0 ||
+        pthread_create(&listener, NULL, cluster_thread, &listen_fd) != 0) {
+        perror("Replication listener setup failed");
+        return -1;
+    }
+
+    for (int i = 0; i < cluster.node_count && cluster.replicas > 1; i++) {
+        ReplicaLink *link = &replica_links[i];
+        pthread_t shipper;
+        if (i == cluster_self) {
+            continue;
+        }
+        link->node = i;
+        link->fd = -1;
+        pthread_mutex_init(&link->lock, NULL);
+        pthread_cond_init(&link->work, NULL);
+        if (pthread_create(&shipper, NULL, replica_thread, link) != 0) {
+            perror("Failed to start replication thread");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Send the body of a routed request to a node under an id of its own; count records of it stand at
+// positions in the client's request. Returns 0, or -1 if it could not go out.
+static int router_send(Route *route, int node, const uint8_t *body, size_t len, uint16_t count,
+                       const uint16_t *positions) {
+    RouteLeg *leg = NULL;
+    for (int tries = 0; tries < ROUTER_PENDING && !leg; tries++) {
+        if (++router_next_id != 0 && router_legs[router_next_id & (ROUTER_PENDING - 1)].id == 0) {
+            leg = &router_legs[router_next_id & (ROUTER_PENDING - 1)];
+        }
+    }
+    if (!leg) {
+        return -1; // Too much out already; the client asks again
+    }
+
+    uint8_t datagram[PROTO_MAX_DATAGRAM];
+    ProtoWriter writer;
+    ProtoHeader header = route->request;
+    header.request_id = router_next_id;
+    proto_begin(&writer, datagram, sizeof(datagram), &header);
+    uint8_t *out = proto_reserve(&writer, len);
+    if (!out) {
+        return -1;
+    }
+    memcpy(out, body, len);
+    writer.count = count;
+    size_t total = proto_finish(&writer);
+
+    leg->id = router_next_id;
+    leg->route = route;
+    leg->count = count;
+    if (positions) {
+        memcpy(leg->positions, positions, count * sizeof(uint16_t));
+    }
+    route->legs++;
+    sendto(router_fd, datagram, total, 0, (struct sockaddr *)&cluster.nodes[node], sizeof(cluster.nodes[node]));
+    return 0;
+}
+
+// Answer the client with no records: the end of a gathered reply
+static void router_answer_empty(Route *route, uint8_t status) {
+    uint8_t buffer[PROTO_HEADER_SIZE];
+    ProtoWriter writer;
+    ProtoHeader header = {route->request.opcode | PROTO_REPLY, status, 0, route->request.request_id, 0};
+    proto_begin(&writer, buffer, sizeof(buffer), &header);
+    send_reply(&route->client, buffer, proto_finish(&writer));
+}
+
+// Every node has answered or run out of time: send what was kept for the end
+static void router_finish(Route *route) {
+    switch (route->mode) {
+        case ROUTE_FIRST_OK:
+        case ROUTE_SPLIT:
+            if (route->reply_len > 0) {
+                route->reply[3] &= ~PROTO_FLAG_MORE;
+                send_reply(&route->client, route->reply, route->reply_len);
+            }
+            break;
+        case ROUTE_GATHER:
+        case ROUTE_SPLIT_INDEXED:
+            // A gather fails only if no node succeeded and one refused
+            if (route->mode == ROUTE_GATHER && route->relayed == 0 && route->reply_len > 0) {
+                send_reply(&route->client, route->reply, route->reply_len);
+            } else {
+                router_answer_empty(route, PROTO_OK);
+            }
+            break;
+        default:
+            break; // Relays pass every part on as it comes
+    }
+    slab_put(&route_pool, route);
+}
+
+static void router_leg_done(RouteLeg *leg) {
+    Route *route = leg->route;
+    leg->id = 0;
+    if (--route->legs == 0) {
+        router_finish(route);
+    }
+}
+
+// A node answered one of the router's requests: pass it on, or keep it for the end
+static void router_reply(uint8_t *datagram, size_t len) {
+    ProtoHeader reply;
+    ProtoReader reader;
+    if (proto_parse(datagram, len, &reply, &reader) != 0 || !(reply.opcode & PROTO_REPLY) || reply.request_id == 0) {
+        return;
+    }
+    RouteLeg *leg = &router_legs[reply.request_id & (ROUTER_PENDING - 1)];
+    if (leg->id != reply.request_id) {
+        return; // Late answer to something already given up on
+    }
+    Route *route = leg->route;
+    proto_store(datagram + 4, route->request.request_id, 4); // Back under the client's id
+
+    switch (route->mode) {
+        case ROUTE_FIND:
+            if (reply.status == PROTO_OK && len >= PROTO_HEADER_SIZE + 4) {
+                uint32_t next = (uint32_t)proto_load(datagram + PROTO_HEADER_SIZE, 4);
+                proto_store(datagram + PROTO_HEADER_SIZE, cluster_cursor_next(&cluster, route->node, next), 4);
+            }
+            send_reply(&route->client, datagram, len);
+            break;
+        case ROUTE_FIRST_OK:
+        case ROUTE_GATHER:
+            if (route->mode == ROUTE_GATHER && reply.status == PROTO_OK) {
+                if (reply.count > 0) {
+                    datagram[3] |= PROTO_FLAG_MORE; // The end is sent once every node is done
+                    send_reply(&route->client, datagram, len);
+                }
+                route->relayed++;
+            } else if (reply.status == PROTO_OK ? route->relayed == 0 : route->reply_len == 0) {
+                memcpy(route->reply, datagram, len); // The first success, or the first failure until one comes
+                route->reply_len = len;
+                route->relayed += reply.status == PROTO_OK;
+            }
+            break;
+        case ROUTE_SPLIT:
+            for (int i = 0; i < leg->count; i++) {
+                uint8_t *record = route->reply + PROTO_HEADER_SIZE + (size_t)leg->positions[i] * route->record_size;
+                if (reply.status != PROTO_OK) {
+                    record[0] = reply.status;
+                } else if (i < reply.count && (size_t)(reader.end - reader.pos) >= (size_t)route->record_size) {
+                    memcpy(record, reader.pos, route->record_size);
+                    reader.pos += route->record_size;
+                }
+            }
+            break;
+        case ROUTE_SPLIT_INDEXED:
+            // Records name their position in the node's request; make that the client's
+            for (int i = 0; reply.status == PROTO_OK && i < reply.count; i++) {
+                uint8_t *index = (uint8_t *)reader.pos;
+                int position = (int)proto_get_int(&reader, 2);
+                proto_get_int(&reader, 1);
+                int holders = (int)proto_get_int(&reader, 1);
+                if (reader.error || position >= leg->count || reader.end - reader.pos < 6 * holders) {
+                    reader.error = 1;
+                    break;
+                }
+                proto_store(index, leg->positions[position], 2);
+                reader.pos += 6 * holders;
+            }
+            if (reply.status == PROTO_OK && !reader.error) {
+                datagram[3] |= PROTO_FLAG_MORE;
+                send_reply(&route->client, datagram, len);
+                route->relayed++;
+            }
+            break;
+        default:
+            send_reply(&route->client, datagram, len);
+            break;
+    }
+
+    if (!(reply.flags & PROTO_FLAG_MORE)) {
+        router_leg_done(leg);
+    } else {
+        route->deadline = now_ms() + ROUTER_TIMEOUT_MS; // More parts are on their way
+    }
+}
+
+// Spread the records of a batch over the nodes owning their names. Each node gets one request with
+// the leading fields, from lead up to where the reader stands, and its own records; tail is the size
+// of what follows each name.
+static void router_split(Route *route, ProtoReader *reader, const uint8_t *lead, int tail, int read) {
+    int count = route->request.count;
+    int nodes[PROTO_MAX_DATAGRAM / 2];
+    const uint8_t *starts[PROTO_MAX_DATAGRAM / 2 + 1];
+    size_t lead_len = reader->pos - lead;
+    if (count > PROTO_MAX_DATAGRAM / 2) {
+        reader->error = 1;
+    }
+    for (int i = 0; i < count && !reader->error; i++) {
+        starts[i] = reader->pos;
+        const char *name = proto_get_name(reader);
+        if (tail > 0) {
+            proto_get_int(reader, tail);
+        }
+        nodes[i] = read ? cluster_reader(&cluster, name) : cluster_primary(&cluster, name);
+    }
+    if (reader->error) {
+        return;
+    }
+    starts[count] = reader->pos;
+
+    // Positional answers start out busy, which is what records of a node that never answers stay
+    if (route->mode == ROUTE_SPLIT) {
+        ProtoWriter writer;
+        ProtoHeader header = {route->request.opcode | PROTO_REPLY, PROTO_OK, 0, route->request.request_id, 0};
+        proto_begin(&writer, route->reply, sizeof(route->reply), &header);
+        uint8_t *records = proto_reserve(&writer, (size_t)count * route->record_size);
+        if (!records) {
+            reader->error = 1;
+            return;
+        }
+        memset(records, 0, (size_t)count * route->record_size);
+        for (int i = 0; i < count; i++) {
+            records[(size_t)i * route->record_size] = PROTO_BUSY;
+        }
+        writer.count = count;
+        route->reply_len = proto_finish(&writer);
+    }
+
+    for (int node = 0; node < cluster.node_count; node++) {
+        uint8_t body[PROTO_MAX_DATAGRAM];
+        uint16_t positions[PROTO_MAX_DATAGRAM / 2];
+        size_t len = lead_len;
+        int taken = 0;
+        memcpy(body, lead, lead_len);
+        for (int i = 0; i < count; i++) {
+            if (nodes[i] == node) {
+                memcpy(body + len, starts[i], starts[i + 1] - starts[i]);
+                len += starts[i + 1] - starts[i];
+                positions[taken++] = (uint16_t)i;
+            }
+        }
+        if (taken > 0) {
+            router_send(route, node, body, len, (uint16_t)taken, positions);
+        }
+    }
+}
+
+// Past the router the sender is the router, and the nodes take the seed address it names, so put in the
+// client's own whatever the client wrote there
+static void router_fill_seed(uint8_t *datagram, ProtoReader *reader, const struct sockaddr_in *client) {
+    uint8_t *address = datagram + (reader->pos - datagram);
+    proto_get_int(reader, 4);
+    proto_get_int(reader, 2);
+    if (!reader->error) {
+        proto_store(address, ntohl(client->sin_addr.s_addr), 4);
+    }
+}
+
+// Work out which nodes a client's request is for and send it on
+static void router_request(uint8_t *datagram, size_t len, struct sockaddr_in *client) {
+    ProtoHeader request;
+    ProtoReader reader;
+    if (proto_parse(datagram, len, &request, &reader) != 0 || (request.opcode & PROTO_REPLY)) {
+        return;
+    }
+    const uint8_t *body = datagram + PROTO_HEADER_SIZE;
+    size_t body_len = len - PROTO_HEADER_SIZE;
+    Route *route = slab_get(&route_pool);
+    if (!route) {
+        return;
+    }
+    memset(route, 0, offsetof(Route, reply)); // The reply is only read up to reply_len
+    route->client = *client;
+    route->request = request;
+    route->deadline = now_ms() + ROUTER_TIMEOUT_MS;
+    route->mode = ROUTE_RELAY;
+
+    int everyone = 0;
+    int node = -1;
+    switch (request.opcode) {
+        case OP_REGISTER:
+        case OP_DEREGISTER:
+        case OP_HAVE: {
+            proto_get_name(&reader);
+            const char *content_name = proto_get_name(&reader);
+            if (request.opcode != OP_DEREGISTER) {
+                proto_get_int(&reader, request.opcode == OP_HAVE ? 4 : 8); // Chunk or size, then the seed
+                router_fill_seed(datagram, &reader, client);
+            }
+            if (reader.error) {
+                break;
+            }
+            if (request.opcode == OP_HAVE) {
+                // Nobody answers these; pass it straight on
+                int primary = cluster_primary(&cluster, content_name);
+                sendto(router_fd, datagram, len, 0, (struct sockaddr *)&cluster.nodes[primary],
+                       sizeof(cluster.nodes[primary]));
+            } else if (content_name[0] == '\0') {
+                route->mode = ROUTE_FIRST_OK; // Everything of the peer, wherever it is
+                everyone = 1;
+            } else {
+                node = cluster_primary(&cluster, content_name);
+            }
+            break;
+        }
+        case OP_SEARCH:
+        case OP_DOWNLOAD: {
+            const char *content_name = proto_get_name(&reader);
+            if (!reader.error) {
+                node = request.opcode == OP_SEARCH ? cluster_reader(&cluster, content_name)
+                                                   : cluster_primary(&cluster, content_name);
+            }
+            break;
+        }
+        case OP_LIST:
+            route->mode = ROUTE_GATHER;
+            everyone = 1;
+            break;
+        case OP_HEARTBEAT:
+            route->mode = ROUTE_FIRST_OK;
+            everyone = 1;
+            break;
+        case OP_FIND: {
+            uint32_t local;
+            proto_get_int(&reader, 1);
+            route->mode = ROUTE_FIND;
+            route->node = cluster_cursor_node((uint32_t)proto_get_int(&reader, 4), &local);
+            if (reader.error || route->node >= cluster.node_count) {
+                reader.error = 1;
+                break;
+            }
+            uint8_t copy[PROTO_MAX_DATAGRAM];
+            memcpy(copy, body, body_len);
+            proto_store(copy + 1, local, 4); // The node sees its own cursor
+            router_send(route, route->node, copy, body_len, request.count, NULL);
+            break;
+        }
+        case OP_REGISTER_BATCH: {
+            const uint8_t *lead = reader.pos;
+            proto_get_name(&reader);
+            router_fill_seed(datagram, &reader, client);
+            route->mode = ROUTE_SPLIT;
+            route->record_size = 11; // Status, token, upload port
+            router_split(route, &reader, lead, 8, 0);
+            break;
+        }
+        case OP_DEREGISTER_BATCH: {
+            const uint8_t *lead = reader.pos;
+            proto_get_name(&reader);
+            route->mode = ROUTE_SPLIT;
+            route->record_size = 1; // Status
+            router_split(route, &reader, lead, 0, 0);
+            break;
+        }
+        case OP_SEARCH_BATCH:
+            route->mode = ROUTE_SPLIT_INDEXED;
+            router_split(route, &reader, reader.pos, 0, 1);
+            break;
+        case OP_SUBSCRIBE:
+        case OP_UNSUBSCRIBE:
+            // Notifications come from the node itself, which would only know the router as the subscriber
+            send_error(client, &request, PROTO_INVALID, "Subscribe to the index nodes themselves");
+            break;
+        default:
+            send_error(client, &request, PROTO_MALFORMED, "Invalid command");
+            break;
+    }
+
+    if (reader.error) {
+        send_error(client, &request, PROTO_MALFORMED, "Malformed request");
+    } else if (node >= 0) {
+        router_send(route, node, body, body_len, request.count, NULL);
+    } else if (everyone) {
+        for (int i = 0; i < cluster.node_count; i++) {
+            router_send(route, i, body, body_len, request.count, NULL);
+        }
+    }
+    if (route->legs == 0) {
+        slab_put(&route_pool, route); // Nothing went out; the client asks again if it wants an answer
+    }
+}
+
+// Give up on whatever the nodes have not answered in time
+static void router_expire(void) {
+    uint64_t now = now_ms();
+    for (int i = 0; i < ROUTER_PENDING; i++) {
+        if (router_legs[i].id != 0 && router_legs[i].route->deadline <= now) {
+            router_leg_done(&router_legs[i]);
+        }
+    }
+}
+
+// Router mode: own nothing, and answer every request by asking the nodes that own its names.
+// One thread moves datagrams both ways; the nodes do the work.
+void router_run(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(server_port);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    router_legs = calloc(ROUTER_PENDING, sizeof(RouteLeg));
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        (router_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 || epoll_fd < 0 ||
+        !router_legs || bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Router setup failed");
+        return;
+    }
+    addr.sin_port = htons(cluster_port); // The port nodes given this router with -t know it by
+    if (bind(router_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Router setup failed");
+        return;
+    }
+    struct epoll_event clients = {.events = EPOLLIN, .data.fd = sockfd};
+    struct epoll_event nodes = {.events = EPOLLIN, .data.fd = router_fd};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &clients) != 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, router_fd, &nodes) != 0) {
+        perror("Router setup failed");
+        return;
+    }
+    srand((unsigned)now_ms());
+    printf("Router is running on port %d in front of %d node(s) keeping %d cop%s of each name\n", server_port,
+           cluster.node_count, cluster.replicas, cluster.replicas == 1 ? "y" : "ies");
+
+    uint8_t buffers[BATCH_SIZE][BUFFER_SIZE];
+    struct sockaddr_in from[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+    uint64_t next_expiry = 0;
+    while (1) {
+        struct epoll_event events[2];
+        int ready = epoll_wait(epoll_fd, events, 2, ROUTER_TIMEOUT_MS / 10);
+        for (int e = 0; e < ready; e++) {
+            // Take every queued datagram, a batch per system call
+            int fd = events[e].data.fd;
+            int n;
+            do {
+                for (int i = 0; i < BATCH_SIZE; i++) {
+                    iov[i].iov_base = buffers[i];
+                    iov[i].iov_len = BUFFER_SIZE;
+                    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                    msgs[i].msg_hdr.msg_name = &from[i];
+                    msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+                    msgs[i].msg_hdr.msg_iov = &iov[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                n = recvmmsg(fd, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+                for (int i = 0; i < n; i++) {
+                    // The nodes shed for load themselves; a router only keeps each client to its rate
+                    if (fd != sockfd) {
+                        router_reply(buffers[i], msgs[i].msg_len);
+                    } else if (admit(buffers[i], msgs[i].msg_len, &from[i], now_ns(), 0) != LANE_SHED) {
+                        router_request(buffers[i], msgs[i].msg_len, &from[i]);
+                    }
+                }
+            } while (n == BATCH_SIZE);
+        }
+
+        uint64_t now = now_ms();
+        if (now >= next_expiry) {
+            router_expire();
+            next_expiry = now + ROUTER_TIMEOUT_MS / 10;
+        }
+    }
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// This thread's counters, registered with the others the first time it counts something
+ThreadStats *stats_self(void) {
+    ThreadStats *stats = thread_stats;
+    if (!stats) {
+        stats = calloc(1, sizeof(ThreadStats));
+        if (!stats) {
+            perror("Failed to allocate statistics");
+            exit(EXIT_FAILURE);
+        }
+        stats->next = atomic_load(&stats_records);
+        while (!atomic_compare_exchange_weak(&stats_records, &stats->next, stats)) {
+        }
+        thread_stats = stats;
+    }
+    return stats;
+}
+
+// Only the owning thread writes a counter, so a load and a store do without a locked instruction
+void stat_add(atomic_uint_fast64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static int stats_opcode(uint8_t opcode) {
+    return opcode < STATS_OPCODES ? opcode : 0;
+}
+
+void stats_request(const Request *request, uint64_t latency) {
+    ThreadStats *stats = stats_self();
+    int opcode = request->len >= PROTO_HEADER_SIZE ? stats_opcode(request->buffer[1]) : 0;
+    stat_add(&stats->requests[opcode], 1);
+    stat_add(&stats->latency_sum[opcode], latency);
+    stat_add(&stats->latency[opcode][hist_bucket(latency)], 1);
+}
+
+void stats_failure(uint8_t opcode) {
+    stat_add(&stats_self()->failures[stats_opcode(opcode)], 1);
+}
+
+void stats_shed(uint8_t opcode, int late) {
+    stat_add(&stats_self()->shed[late][stats_opcode(opcode)], 1);
+}
+
+static void metrics_add(ByteBuffer *out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    buffer_append(out, line, len < (int)sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+// Bytes waiting in the receive queue of every shard's socket and datagrams it dropped, from the
+// kernel's table of UDP sockets; the sockets are found there by inode
+static void metrics_shard_queues(ByteBuffer *out) {
+    FILE *table = fopen("/proc/net/udp", "re");
+    char line[512];
+    if (!table) {
+        return;
+    }
+    metrics_add(out, "# HELP p2p_shard_queue_bytes Bytes waiting in the receive queue of a shard's socket.\n"
+                     "# TYPE p2p_shard_queue_bytes gauge\n");
+    ByteBuffer drops = {0};
+    while (fgets(line, sizeof(line), table)) {
+        unsigned long queued;
+        unsigned long inode;
+        unsigned long long dropped;
+        if (sscanf(line, " %*d: %*x:%*x %*x:%*x %*x %*x:%lx %*x:%*x %*x %*u %*u %lu %*u %*x %llu", &queued, &inode,
+                   &dropped) != 3) {
+            continue;
+        }
+        for (int i = 0; i < shard_count; i++) {
+            struct stat st;
+            if (fstat(shards[i].fd, &st) == 0 && st.st_ino == inode) {
+                metrics_add(out, "p2p_shard_queue_bytes{shard=\"%d\"} %lu\n", i, queued);
+                metrics_add(&drops, "p2p_shard_drops_total{shard=\"%d\"} %llu\n", i, dropped);
+            }
+        }
+    }
+    fclose(table);
+    metrics_add(out, "# HELP p2p_shard_drops_total Datagrams a shard's socket dropped for want of room.\n"
+                     "# TYPE p2p_shard_drops_total counter\n");
+    buffer_append(out, drops.data, drops.len);
+    free(drops.data);
+}
+
+// An HTTP response with the counters of every thread and the depth of every queue in the Prometheus
+// text format, or a 404 when found is 0; NULL if it cannot be built
+unsigned char *metrics_reply(int found, size_t *reply_len) {
+    static const char *const names[STATS_OPCODES] = {"other", "register", "deregister", "search", "list",
+                                                     "download", "have", "register_batch", "deregister_batch",
+                                                     "search_batch", "find", "heartbeat", "subscribe",
+                                                     "unsubscribe"};
+    ByteBuffer body = {0};
+    ByteBuffer reply = {0};
+    uint64_t *buckets = malloc(HIST_BUCKETS * sizeof(uint64_t));
+    if (!buckets) {
+        return NULL;
+    }
+
+    // Control requests by opcode: counts, failures and latency quantiles from the merged histograms
+    metrics_add(&body, "# HELP p2p_requests_total Control requests answered.\n# TYPE p2p_requests_total counter\n");
+    for (int opcode = 0; opcode < STATS_OPCODES; opcode++) {
+        uint64_t count = 0;
+        for (ThreadStats *stats = atomic_load(&stats_records); stats; stats = stats->next) {
+            count += atomic_load_explicit(&stats->requests[opcode], memory_order_relaxed);
+        }
+        metrics_add(&body, "p2p_requests_total{opcode=\"%s\"} %llu\n", names[opcode], (unsigned long long)count);
+    }
+    metrics_add(&body, "# HELP p2p_request_failures_total Control requests answered with an error.\n"
+                       "# TYPE p2p_request_failures_total counter\n");
+    for (int opcode = 0; opcode < STATS_OPCODES; opcode++) {
+        uint64_t count = 0;
+        for (ThreadStats *stats = atomic_load(&stats_records); stats; stats = stats->next) {
+            count += atomic_load_explicit(&stats->failures[opcode], memory_order_relaxed);
+        }
+        metrics_add(&body, "p2p_request_failures_total{opcode=\"%s\"} %llu\n", names[opcode],
+                    (unsigned long long)count);
+    }
+    metrics_add(&body, "# HELP p2p_requests_shed_total Control requests turned away unhandled, for their client's "
+                       "rate or for load.\n# TYPE p2p_requests_shed_total counter\n");
+    for (int opcode = 0; opcode < STATS_OPCODES; opcode++) {
+        for (int late = 0; late < 2; late++) {
+            uint64_t count = 0;
+            for (ThreadStats *stats = atomic_load(&stats_records); stats; stats = stats->next) {
+                count += atomic_load_explicit(&stats->shed[late][opcode], memory_order_relaxed);
+            }
+            metrics_add(&body, "p2p_requests_shed_total{opcode=\"%s\",reason=\"%s\"} %llu\n", names[opcode],
+                        late ? "load" : "rate", (unsigned long long)count);
+        }
+    }
+    metrics_add(&body, "# HELP p2p_request_latency_seconds Time from receiving a control request to sending its "
+                       "reply.\n# TYPE p2p_request_latency_seconds summary\n");
+    for (int opcode = 0; opcode < STATS_OPCODES; opcode++) {
+        static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        memset(buckets, 0, HIST_BUCKETS * sizeof(uint64_t));
+        for (ThreadStats *stats = atomic_load(&stats_records); stats; stats = stats->next) {
+            sum += atomic_load_explicit(&stats->latency_sum[opcode], memory_order_relaxed);
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                uint64_t n = atomic_load_explicit(&stats->latency[opcode][i], memory_order_relaxed);
+                buckets[i] += n;
+                count += n;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            metrics_add(&body, "p2p_request_latency_seconds{opcode=\"%s\",quantile=\"%g\"} %.9f\n", names[opcode],
+                        quantiles[i], hist_quantile(buckets, count, quantiles[i]) / 1e9);
+        }
+        metrics_add(&body, "p2p_request_latency_seconds_sum{opcode=\"%s\"} %.9f\n", names[opcode], sum / 1e9);
+        metrics_add(&body, "p2p_request_latency_seconds_count{opcode=\"%s\"} %llu\n", names[opcode],
+                    (unsigned long long)count);
+    }
+    free(buckets);
+
+    // Transfers
+    uint64_t uploads = 0, bytes_uploaded = 0, responses = 0, bytes_served = 0;
+    for (ThreadStats *stats = atomic_load(&stats_records); stats; stats = stats->next) {
+        uploads += atomic_load_explicit(&stats->uploads, memory_order_relaxed);
+        bytes_uploaded += atomic_load_explicit(&stats->bytes_uploaded, memory_order_relaxed);
+        responses += atomic_load_explicit(&stats->responses, memory_order_relaxed);
+        bytes_served += atomic_load_explicit(&stats->bytes_served, memory_order_relaxed);
+    }
+    metrics_add(&body, "# HELP p2p_uploads_total Files stored through the upload port.\n"
+                       "# TYPE p2p_uploads_total counter\np2p_uploads_total %llu\n", (unsigned long long)uploads);
+    metrics_add(&body, "# HELP p2p_uploaded_bytes_total Bytes of the files stored.\n"
+                       "# TYPE p2p_uploaded_bytes_total counter\np2p_uploaded_bytes_total %llu\n",
+                (unsigned long long)bytes_uploaded);
+    metrics_add(&body, "# HELP p2p_uploads_in_progress Upload connections open.\n"
+                       "# TYPE p2p_uploads_in_progress gauge\np2p_uploads_in_progress %d\n",
+                atomic_load(&uploads_active));
+    metrics_add(&body, "# HELP p2p_content_responses_total Responses the content port finished.\n"
+                       "# TYPE p2p_content_responses_total counter\np2p_content_responses_total %llu\n",
+                (unsigned long long)responses);
+    metrics_add(&body, "# HELP p2p_served_bytes_total Bytes sent by the content port.\n"
+                       "# TYPE p2p_served_bytes_total counter\np2p_served_bytes_total %llu\n",
+                (unsigned long long)bytes_served);
+    metrics_add(&body, "# HELP p2p_content_connections Connections open on the content port.\n"
+                       "# TYPE p2p_content_connections gauge\np2p_content_connections %d\n",
+                atomic_load(&transfers_open));
+
+    // Block store: what is served against what it takes on disk once duplicate blocks are shared
+    pthread_mutex_lock(&store.lock);
+    size_t stored_files = store.object_count;
+    uint64_t file_bytes = store.object_bytes;
+    size_t blocks = store.block_count;
+    uint64_t block_bytes = store.block_bytes;
+    int segments = 0;
+    for (int i = 0; i < store.segment_count; i++) {
+        segments += store.segments[i].fd >= 0;
+    }
+    size_t packed_blocks = store.packed_count;
+    uint64_t packed_bytes = store.packed_bytes;
+    uint64_t packed_hits = store.packed_hits;
+    uint64_t packed_misses = store.packed_misses;
+    HotCache cache = store.cache;
+    uint64_t cache_bytes = 0;
+    for (int i = 0; i < CACHE_LISTS; i++) {
+        cache_bytes += cache.lists[i].bytes;
+    }
+    pthread_mutex_unlock(&store.lock);
+    metrics_add(&body, "# HELP p2p_store_files Files the content port can serve.\n"
+                       "# TYPE p2p_store_files gauge\np2p_store_files %zu\n", stored_files);
+    metrics_add(&body, "# HELP p2p_store_file_bytes Bytes of the files the content port can serve.\n"
+                       "# TYPE p2p_store_file_bytes gauge\np2p_store_file_bytes %llu\n",
+                (unsigned long long)file_bytes);
+    metrics_add(&body, "# HELP p2p_store_blocks Distinct blocks kept.\n"
+                       "# TYPE p2p_store_blocks gauge\np2p_store_blocks %zu\n", blocks);
+    metrics_add(&body, "# HELP p2p_store_block_bytes Bytes of the distinct blocks kept.\n"
+                       "# TYPE p2p_store_block_bytes gauge\np2p_store_block_bytes %llu\n",
+                (unsigned long long)block_bytes);
+    metrics_add(&body, "# HELP p2p_store_segments Segment files the blocks are kept in.\n"
+                       "# TYPE p2p_store_segments gauge\np2p_store_segments %d\n", segments);
+    metrics_add(&body, "# HELP p2p_store_packed_blocks Blocks whose LZ4 form is cached.\n"
+                       "# TYPE p2p_store_packed_blocks gauge\np2p_store_packed_blocks %zu\n", packed_blocks);
+    metrics_add(&body, "# HELP p2p_store_packed_bytes Memory taken by the cached LZ4 forms.\n"
+                       "# TYPE p2p_store_packed_bytes gauge\np2p_store_packed_bytes %llu\n",
+                (unsigned long long)packed_bytes);
+    metrics_add(&body, "# HELP p2p_store_packed_requests_total Compressed chunk requests, by whether the LZ4 form "
+                       "was cached.\n# TYPE p2p_store_packed_requests_total counter\n"
+                       "p2p_store_packed_requests_total{cached=\"yes\"} %llu\n"
+                       "p2p_store_packed_requests_total{cached=\"no\"} %llu\n",
+                (unsigned long long)packed_hits, (unsigned long long)packed_misses);
+
+    // Hot cache: requests for a block's bytes, and what the admission policy made of them
+    metrics_add(&body, "# HELP p2p_cache_capacity_bytes Memory the hot block cache may take.\n"
+                       "# TYPE p2p_cache_capacity_bytes gauge\np2p_cache_capacity_bytes %llu\n",
+                (unsigned long long)cache.capacity);
+    metrics_add(&body, "# HELP p2p_cache_bytes Bytes of the blocks in the hot cache, by part.\n"
+                       "# TYPE p2p_cache_bytes gauge\np2p_cache_bytes{part=\"window\"} %llu\n"
+                       "p2p_cache_bytes{part=\"probation\"} %llu\np2p_cache_bytes{part=\"protected\"} %llu\n",
+                (unsigned long long)cache.lists[CACHE_WINDOW].bytes,
+                (unsigned long long)cache.lists[CACHE_PROBATION].bytes,
+                (unsigned long long)cache.lists[CACHE_PROTECTED].bytes);
+    metrics_add(&body, "# HELP p2p_cache_blocks Blocks in the hot cache.\n"
+                       "# TYPE p2p_cache_blocks gauge\np2p_cache_blocks %zu\n", cache.count);
+    metrics_add(&body, "# HELP p2p_cache_requests_total Block reads by whether the hot cache had the block.\n"
+                       "# TYPE p2p_cache_requests_total counter\np2p_cache_requests_total{result=\"hit\"} %llu\n"
+                       "p2p_cache_requests_total{result=\"miss\"} %llu\n",
+                (unsigned long long)cache.hits, (unsigned long long)cache.misses);
+    metrics_add(&body, "# HELP p2p_cache_hit_ratio Share of block reads served by the hot cache.\n"
+                       "# TYPE p2p_cache_hit_ratio gauge\np2p_cache_hit_ratio %.4f\n",
+                cache.hits + cache.misses ? (double)cache.hits / (cache.hits + cache.misses) : 0.0);
+    metrics_add(&body, "# HELP p2p_cache_admissions_total Blocks leaving the window, by whether they won a place "
+                       "in the main area.\n# TYPE p2p_cache_admissions_total counter\n"
+                       "p2p_cache_admissions_total{result=\"admitted\"} %llu\n"
+                       "p2p_cache_admissions_total{result=\"rejected\"} %llu\n",
+                (unsigned long long)cache.admitted, (unsigned long long)cache.rejected);
+    metrics_add(&body, "# HELP p2p_cache_evictions_total Blocks pushed out of the main area for a better one.\n"
+                       "# TYPE p2p_cache_evictions_total counter\np2p_cache_evictions_total %llu\n",
+                (unsigned long long)cache.evicted);
+
+    // Catalog size and queue depths, each read under the lock that guards it
+    pthread_mutex_lock(&mutex);
+    size_t contents = content_index.count;
+    size_t peers = peer_index.count;
+    uint64_t name_bytes = name_arena.bytes;
+    pthread_mutex_unlock(&mutex);
+    metrics_add(&body, "# HELP p2p_catalog_contents Content names registered.\n"
+                       "# TYPE p2p_catalog_contents gauge\np2p_catalog_contents %zu\n", contents);
+    metrics_add(&body, "# HELP p2p_catalog_peers Peers with a registration.\n"
+                       "# TYPE p2p_catalog_peers gauge\np2p_catalog_peers %zu\n", peers);
+    metrics_add(&body, "# HELP p2p_catalog_name_bytes Name arena space taken by peer and content names.\n"
+                       "# TYPE p2p_catalog_name_bytes gauge\np2p_catalog_name_bytes %llu\n",
+                (unsigned long long)name_bytes);
+
+    int pending = 0;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&upload_mutex);
+    for (int i = 0; i < MAX_PENDING_UPLOADS; i++) {
+        pending += pending_uploads[i].token != 0 && pending_uploads[i].expires >= now;
+    }
+    pthread_mutex_unlock(&upload_mutex);
+    metrics_add(&body, "# HELP p2p_pending_uploads Registrations waiting for their upload connection.\n"
+                       "# TYPE p2p_pending_uploads gauge\np2p_pending_uploads %d\n", pending);
+
+    pthread_mutex_lock(&wal.lock);
+    size_t wal_bytes = wal.filling ? wal.filling->len : 0;
+    uint64_t wal_records = wal.next_lsn > wal.durable + 1 ? wal.next_lsn - 1 - wal.durable : 0;
+    pthread_mutex_unlock(&wal.lock);
+    metrics_add(&body, "# HELP p2p_wal_unsynced_records Catalog changes logged but not yet on disk.\n"
+                       "# TYPE p2p_wal_unsynced_records gauge\np2p_wal_unsynced_records %llu\n",
+                (unsigned long long)wal_records);
+    metrics_add(&body, "# HELP p2p_wal_buffered_bytes Log bytes waiting for the next write.\n"
+                       "# TYPE p2p_wal_buffered_bytes gauge\np2p_wal_buffered_bytes %zu\n", wal_bytes);
+
+    if (cluster_self >= 0) {
+        metrics_add(&body, "# HELP p2p_replication_queue_bytes Changes queued for another node.\n"
+                           "# TYPE p2p_replication_queue_bytes gauge\n");
+        for (int node = 0; node < cluster.node_count; node++) {
+            if (node == cluster_self) {
+                continue;
+            }
+            ReplicaLink *link = &replica_links[node];
+            pthread_mutex_lock(&link->lock);
+            size_t queued = link->queue.len;
+            pthread_mutex_unlock(&link->lock);
+            metrics_add(&body, "p2p_replication_queue_bytes{node=\"%d\"} %zu\n", node, queued);
+        }
+    }
+    metrics_shard_queues(&body);
+    metrics_add(&body, "# HELP p2p_log_dropped_total Log lines left out for the rate limit or a full ring.\n"
+                       "# TYPE p2p_log_dropped_total counter\np2p_log_dropped_total %llu\n",
+                (unsigned long long)atomic_load(&log_dropped));
+
+    if (!found) {
+        body.len = 0;
+        metrics_add(&body, "Not found; try /metrics\n");
+    }
+    metrics_add(&reply, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n", found ? "200 OK" : "404 Not Found", body.len);
+    buffer_append(&reply, body.data, body.len);
+    free(body.data);
+    *reply_len = reply.len;
+    return reply.data;
+}
+
+// printf for the hot paths: the line goes into the log ring and the log thread writes it out. Lines past
+// the rate budget, or with the ring full, are only counted; with -l 0 nothing is even formatted.
+void log_event(const char *format, ...) {
+    if (log_rate == 0) {
+        return;
+    }
+    if (atomic_load_explicit(&log_budget, memory_order_relaxed) <= 0 ||
+        atomic_fetch_sub_explicit(&log_budget, 1, memory_order_acquire) <= 0) { // Budget comes after the ring set-up
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&log_ring.tail, memory_order_relaxed);
+    LogCell *cell;
+    while (1) {
+        cell = &log_ring.cells[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_ring.tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed); // Full
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_ring.tail, memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    if (vsnprintf(cell->line, sizeof(cell->line), format, args) >= (int)sizeof(cell->line)) {
+        cell->line[sizeof(cell->line) - 2] = '\n'; // Cut short, but still a line of its own
+    }
+    va_end(args);
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+}
+
+// Write out the logged lines every tick, note how many were left out, and renew the rate budget
+void *log_thread(void *arg) {
+    (void)arg;
+    uint64_t reported = 0;
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&log_ring.cells[i].sequence, i);
+    }
+    atomic_store(&log_budget, log_rate * LOG_TICK_MS / 1000 > 0 ? log_rate * LOG_TICK_MS / 1000 : 1);
+
+    while (1) {
+        struct timespec tick = {0, LOG_TICK_MS * 1000000L};
+        nanosleep(&tick, NULL);
+        atomic_store(&log_budget, log_rate * LOG_TICK_MS / 1000 > 0 ? log_rate * LOG_TICK_MS / 1000 : 1);
+
+        size_t pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+        while (1) {
+            LogCell *cell = &log_ring.cells[pos & (LOG_RING_SLOTS - 1)];
+            if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + 1) {
+                break; // Not filled yet
+            }
+            fputs(cell->line, stdout);
+            atomic_store_explicit(&cell->sequence, pos + LOG_RING_SLOTS, memory_order_release);
+            pos++;
+        }
+        atomic_store_explicit(&log_ring.head, pos, memory_order_relaxed);
+
+        uint64_t dropped = atomic_load(&log_dropped);
+        if (dropped != reported) {
+            printf("(%llu log line(s) left out)\n", (unsigned long long)(dropped - reported));
+            reported = dropped;
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
@@ -0,0 +1,753 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "p2p_cluster.h"
+#include "p2p_histogram.h"
+#include "p2p_protocol.h"
+
+// Load generator for the index nodes. Thousands of virtual peers, spread over a few threads, drive a
+// weighted mix of the menu's operations (R, S, L, D and Q) against the nodes, each thread keeping a
+// window of operations in flight; bulk transfers then upload and download large files. An operation
+// is timed from its first datagram to its last byte, and every kind is reported with its rate and
+// latency percentiles. Run the nodes with their output sent to /dev/null, or the terminal is what
+// gets measured, and with -a 0, or their limit on each client's rate is. Requests a node turns away
+// are sent again when it says, and an operation's latency includes the wait.
+//
+// The phases, in order:
+//   preload        every content name is registered once, so that the mix finds something
+//   mix            random operations from random virtual peers for the given time
+//   bulk upload    -x files of -z bytes each, all at once
+//   bulk download  the same files back
+//   cleanup        every virtual peer deregisters
+
+#define SERVER_NODES "127.0.0.1:8080" // Index nodes used unless -c lists others
+#define MAX_CONTENT_NAME 20
+#define MAX_PEER_NAME 20
+#define UPLOAD_HEADER_SIZE 16 // Token (8 bytes) and file size (8 bytes), big-endian
+#define CONTENT_HEADER_SIZE 9 // Status (1 byte, 0 = found) and length (8 bytes, big-endian)
+#define BENCH_THREADS 4 // Load threads; each has a socket of its own, so the nodes' shards all get work
+#define BENCH_WINDOW 32 // Operations in flight per thread
+#define BENCH_PEERS 1000 // Virtual peers
+#define BENCH_NAMES 10000 // Content names the mix draws from
+#define BENCH_SECONDS 10 // Length of the mix
+#define BENCH_MIX "S=70,R=10,L=10,D=8,Q=2" // Weights of the operations in the mix
+#define BENCH_FILE_SIZE 1024 // Bytes of every file the mix registers and downloads
+#define BENCH_BULK_SIZE (64 << 20) // Bytes of every bulk transfer
+#define SLOT_COUNT 1024 // Datagrams in flight per thread (power of two); fan-outs take one per node
+#define REQUEST_TIMEOUT 200000000ULL // Nanoseconds before a request is sent again, doubling every time
+#define MAX_ATTEMPTS 5 // Transmissions of a request before the operation counts as timed out
+#define RECV_BATCH 32 // Replies taken per recvmmsg call
+#define SOCKET_BUFFER_SIZE (1 << 20) // Receive buffer of the datagram sockets, so bursts of replies fit
+#define IO_CHUNK (256 << 10) // Bytes per send or recv on transfer connections
+
+// What an operation does; every kind gets a line of its own in the report
+enum {
+    KIND_REGISTER, // Registration and upload of a small file
+    KIND_SEARCH,
+    KIND_LIST, // Asked of every node
+    KIND_DOWNLOAD, // Download of a small file, whole
+    KIND_QUIT, // Deregistration of everything the peer has, on every node
+    KIND_BULK_UPLOAD,
+    KIND_BULK_DOWNLOAD,
+    KIND_COUNT,
+};
+
+static const char *kind_names[KIND_COUNT] = {"register", "search", "list", "download", "deregister",
+                                             "bulk upload", "bulk download"};
+static const char mix_letters[] = "RSLDQ"; // Menu letters of the kinds a mix is made of, in kind order
+
+enum { PHASE_PRELOAD, PHASE_MIX, PHASE_BULK_UPLOAD, PHASE_BULK_DOWNLOAD, PHASE_CLEANUP };
+
+enum { OP_IDLE, OP_WAITING, OP_SENDING, OP_RECEIVING };
+
+// Latencies of one kind of operation, in nanoseconds
+typedef struct {
+    uint64_t count; // Completed, misses included
+    uint64_t misses; // Answered "not found"
+    uint64_t errors; // Refused, broken off or timed out; not timed
+    uint64_t timeouts;
+    uint64_t bytes; // Moved by transfers
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Stats;
+
+// One operation of a virtual peer, from its first datagram to the end of its transfer, if any
+typedef struct {
+    int kind;
+    int state;
+    int legs; // Datagrams still unanswered
+    int missed;
+    int failed;
+    int timed_out;
+    char peer[MAX_PEER_NAME + 1];
+    char content[MAX_CONTENT_NAME + 1];
+    uint64_t size; // Bytes of the file it registers
+    uint64_t started;
+    int sock; // Upload or download connection, -1 while there is none
+    uint8_t out[UPLOAD_HEADER_SIZE + MAX_CONTENT_NAME + 4]; // Upload header or download request line
+    size_t out_len;
+    size_t out_sent;
+    uint8_t in[CONTENT_HEADER_SIZE]; // Upload status byte or download header
+    size_t in_len;
+    size_t in_got;
+    uint64_t body_left; // Bytes still to send or receive after the header
+    uint64_t bytes;
+} Op;
+
+// A datagram waiting for its reply
+typedef struct {
+    uint32_t id; // 0 marks a free slot
+    uint16_t len;
+    uint8_t node;
+    uint8_t attempts; // Transmissions so far, 0 again once a node turned the request away
+    uint64_t deadline;
+    Op *op;
+    uint8_t datagram[PROTO_MAX_DATAGRAM]; // Kept for retransmission
+} Slot;
+
+// A load thread with its own socket, operations and statistics; threads share nothing while they run
+typedef struct {
+    int index;
+    pthread_t thread;
+    int sockfd;
+    int epoll_fd;
+    uint32_t next_id;
+    unsigned seed;
+    uint32_t cursor; // Next item of a phase that walks a list; threads take every thread_count-th
+    uint64_t retransmits;
+    uint64_t turned_away; // Datagrams a node was too busy for
+    Op *ops; // window of them
+    uint8_t *scratch; // Downloaded bytes land here and are dropped
+    Stats stats[KIND_COUNT];
+    Slot slots[SLOT_COUNT];
+} Worker;
+
+Cluster cluster;
+int thread_count = BENCH_THREADS;
+int window = BENCH_WINDOW;
+uint32_t peer_count = BENCH_PEERS;
+uint32_t name_count = BENCH_NAMES;
+int mix[sizeof(mix_letters) - 1]; // Weight of every kind of the mix
+int mix_total;
+uint64_t file_size = BENCH_FILE_SIZE;
+uint32_t bulk_count;
+uint64_t bulk_size = BENCH_BULK_SIZE;
+int phase;
+uint64_t phase_end; // When the mix stops starting operations
+uint8_t upload_pattern[IO_CHUNK]; // Uploads are cut from this
+
+int parse_mix(const char *text);
+uint64_t parse_size(const char *text);
+int worker_init(Worker *worker, int index);
+double run_phase(Worker **workers, int which);
+void *worker_thread(void *arg);
+void report(const char *title, Worker **workers, double seconds);
+
+int main(int argc, char *argv[]) {
+    const char *nodes = SERVER_NODES;
+    const char *mix_text = BENCH_MIX;
+    int replicas = CLUSTER_DEFAULT_REPLICAS;
+    int seconds = BENCH_SECONDS;
+    int option;
+
+    // -c and -r must match the index nodes' own, as for the peer client. -j threads keep -w operations
+    // in flight each, for -p virtual peers over -n names, running -m for -t seconds; -s sets the size of
+    // the mix's files. -x bulk transfers of -z bytes each follow (sizes take a k, m or g suffix).
+    while ((option = getopt(argc, argv, "c:r:j:w:p:n:t:m:s:x:z:")) != -1) {
+        if (option == 'c') {
+            nodes = optarg;
+        } else if (option == 'r') {
+            replicas = atoi(optarg);
+        } else if (option == 'j') {
+            thread_count = atoi(optarg);
+        } else if (option == 'w') {
+            window = atoi(optarg);
+        } else if (option == 'p') {
+            peer_count = (uint32_t)atol(optarg);
+        } else if (option == 'n') {
+            name_count = (uint32_t)atol(optarg);
+        } else if (option == 't') {
+            seconds = atoi(optarg);
+        } else if (option == 'm') {
+            mix_text = optarg;
+        } else if (option == 's') {
+            file_size = parse_size(optarg);
+        } else if (option == 'x') {
+            bulk_count = (uint32_t)atol(optarg);
+        } else if (option == 'z') {
+            bulk_size = parse_size(optarg);
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [-c address:port,...] [-r replicas] [-j threads] [-w window] [-p peers] [-n names]\n"
+                    "          [-t seconds] [-m R=weight,S=weight,...] [-s file size] [-x transfers] [-z transfer size]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cluster_init(&cluster, nodes, replicas) != 0) {
+        fprintf(stderr, "Malformed node list '%s'\n", nodes);
+        exit(EXIT_FAILURE);
+    }
+    if (parse_mix(mix_text) != 0) {
+        fprintf(stderr, "Malformed mix '%s'\n", mix_text);
+        exit(EXIT_FAILURE);
+    }
+    if (thread_count < 1 || window < 1 || window * cluster.node_count > SLOT_COUNT || peer_count < 1 ||
+        peer_count > 1000000 || name_count < 1 || name_count > 100000000 || seconds < 0) {
+        fprintf(stderr, "Out of range: need 1..%d operations in flight per thread and up to a million peers\n",
+                SLOT_COUNT / cluster.node_count);
+        exit(EXIT_FAILURE);
+    }
+
+    Worker **workers = calloc(thread_count, sizeof(Worker *));
+    for (int i = 0; i < thread_count; i++) {
+        if (!workers || (workers[i] = calloc(1, sizeof(Worker))) == NULL || worker_init(workers[i], i) != 0) {
+            perror("Failed to set up load threads");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t i = 0; i < sizeof(upload_pattern); i++) {
+        upload_pattern[i] = (uint8_t)(i * 131 + (i >> 8));
+    }
+    printf("%d thread(s) x %d in flight, %u virtual peers, %u names, %d node(s)\n", thread_count, window,
+           peer_count, name_count, cluster.node_count);
+
+    report("preload", workers, run_phase(workers, PHASE_PRELOAD));
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    phase_end = (uint64_t)(now.tv_sec + seconds) * 1000000000ULL + now.tv_nsec;
+    report("mix", workers, run_phase(workers, PHASE_MIX));
+    if (bulk_count > 0) {
+        report("bulk upload", workers, run_phase(workers, PHASE_BULK_UPLOAD));
+        report("bulk download", workers, run_phase(workers, PHASE_BULK_DOWNLOAD));
+    }
+    report("cleanup", workers, run_phase(workers, PHASE_CLEANUP));
+    return 0;
+}
+
+// Weights as "R=10,S=70,..."; letters left out weigh nothing
+int parse_mix(const char *text) {
+    memset(mix, 0, sizeof(mix));
+    mix_total = 0;
+    while (*text) {
+        const char *letter = strchr(mix_letters, *text);
+        char *end;
+        if (!letter || text[1] != '=') {
+            return -1;
+        }
+        long weight = strtol(text + 2, &end, 10);
+        if (end == text + 2 || weight < 0 || weight > 1000000 || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        mix[letter - mix_letters] = (int)weight;
+        mix_total += (int)weight;
+        text = *end ? end + 1 : end;
+    }
+    return mix_total > 0 ? 0 : -1;
+}
+
+// Bytes, with an optional k, m or g suffix
+uint64_t parse_size(const char *text) {
+    char *end;
+    uint64_t size = strtoull(text, &end, 10);
+    int shift = *end == 'k' ? 10 : *end == 'm' ? 20 : *end == 'g' ? 30 : 0;
+    return size << shift;
+}
+
+int worker_init(Worker *worker, int index) {
+    worker->index = index;
+    worker->seed = (unsigned)time(NULL) * 2654435761u + index;
+    worker->ops = calloc(window, sizeof(Op));
+    worker->scratch = malloc(IO_CHUNK);
+    if (!worker->ops || !worker->scratch) {
+        return -1;
+    }
+    for (int i = 0; i < window; i++) {
+        worker->ops[i].sock = -1;
+    }
+
+    int buffer_size = SOCKET_BUFFER_SIZE;
+    if ((worker->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        (worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return -1;
+    }
+    setsockopt(worker->sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = worker}; // Any other pointer is an Op
+    return epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->sockfd, &event);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_record(Stats *stats, uint64_t latency) {
+    stats->count++;
+    stats->total += latency;
+    stats->max = latency > stats->max ? latency : stats->max;
+    stats->buckets[hist_bucket(latency)]++;
+}
+
+// The latency within which a fraction of the operations completed
+static uint64_t stats_percentile(const Stats *stats, double fraction) {
+    uint64_t value = hist_quantile(stats->buckets, stats->count, fraction);
+    return value < stats->max ? value : stats->max;
+}
+
+static void request_begin(ProtoWriter *writer, uint8_t *buffer, uint8_t opcode) {
+    ProtoHeader header = {opcode, PROTO_OK, 0, 0, 0};
+    proto_begin(writer, buffer, PROTO_MAX_DATAGRAM, &header);
+}
+
+static void slot_transmit(Worker *worker, Slot *slot) {
+    const struct sockaddr_in *node = &cluster.nodes[slot->node];
+    sendto(worker->sockfd, slot->datagram, slot->len, 0, (const struct sockaddr *)node, sizeof(*node));
+    slot->deadline = now_ns() + (REQUEST_TIMEOUT << slot->attempts); // A lost send is just retransmitted
+    slot->attempts++;
+}
+
+// Send one datagram of an operation to a node; the window never needs more slots than there are
+static void op_submit(Worker *worker, Op *op, int node, ProtoWriter *request) {
+    Slot *slot;
+    do {
+        worker->next_id++;
+        slot = &worker->slots[worker->next_id & (SLOT_COUNT - 1)];
+    } while (worker->next_id == 0 || slot->id != 0);
+
+    proto_store(request->buffer + 4, worker->next_id, 4);
+    slot->id = worker->next_id;
+    slot->len = (uint16_t)proto_finish(request);
+    slot->node = (uint8_t)node;
+    slot->attempts = 0;
+    slot->op = op;
+    memcpy(slot->datagram, request->buffer, slot->len);
+    op->legs++;
+    slot_transmit(worker, slot);
+}
+
+static void op_finish(Worker *worker, Op *op) {
+    Stats *stats = &worker->stats[op->kind];
+    if (op->sock >= 0) {
+        close(op->sock); // Leaves the epoll set with it
+        op->sock = -1;
+    }
+    op->state = OP_IDLE;
+    if (op->failed || op->timed_out) {
+        stats->errors++;
+        stats->timeouts += op->timed_out;
+        return;
+    }
+    stats->misses += op->missed;
+    stats->bytes += op->bytes;
+    stats_record(stats, now_ns() - op->started);
+}
+
+// Give an idle operation its next piece of work in the current phase; returns 0 once there is none
+static int op_next(Worker *worker, Op *op) {
+    uint32_t item = worker->cursor;
+    switch (phase) {
+        case PHASE_PRELOAD:
+            if (item >= name_count) {
+                return 0;
+            }
+            op->kind = KIND_REGISTER;
+            op->size = file_size;
+            snprintf(op->peer, sizeof(op->peer), "vp%u", item % peer_count);
+            snprintf(op->content, sizeof(op->content), "c%u", item);
+            break;
+        case PHASE_MIX: {
+            if (now_ns() >= phase_end) {
+                return 0;
+            }
+            int pick = rand_r(&worker->seed) % mix_total;
+            op->kind = 0;
+            while (pick >= mix[op->kind]) {
+                pick -= mix[op->kind++];
+            }
+            op->size = file_size;
+            snprintf(op->peer, sizeof(op->peer), "vp%u", (uint32_t)rand_r(&worker->seed) % peer_count);
+            snprintf(op->content, sizeof(op->content), "c%u", (uint32_t)rand_r(&worker->seed) % name_count);
+            return 1; // Drawn at random, not walked
+        }
+        case PHASE_BULK_UPLOAD:
+        case PHASE_BULK_DOWNLOAD:
+            if (item >= bulk_count) {
+                return 0;
+            }
+            op->kind = phase == PHASE_BULK_UPLOAD ? KIND_BULK_UPLOAD : KIND_BULK_DOWNLOAD;
+            op->size = bulk_size;
+            snprintf(op->peer, sizeof(op->peer), "vbulk");
+            snprintf(op->content, sizeof(op->content), "bulk%u", item);
+            break;
+        default:
+            // Every virtual peer, then the one the bulk files came from
+            if (item > peer_count) {
+                return 0;
+            }
+            op->kind = KIND_QUIT;
+            if (item < peer_count) {
+                snprintf(op->peer, sizeof(op->peer), "vp%u", item);
+            } else {
+                snprintf(op->peer, sizeof(op->peer), "vbulk");
+            }
+            op->content[0] = '\0';
+            break;
+    }
+    worker->cursor = item + thread_count;
+    return 1;
+}
+
+static void op_start(Worker *worker, Op *op) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter request;
+    op->state = OP_WAITING;
+    op->legs = op->missed = op->failed = op->timed_out = 0;
+    op->bytes = 0;
+    op->started = now_ns();
+
+    switch (op->kind) {
+        case KIND_REGISTER:
+        case KIND_BULK_UPLOAD:
+            request_begin(&request, buffer, OP_REGISTER);
+            proto_put_name(&request, op->peer);
+            proto_put_name(&request, op->content);
+            proto_put_int(&request, op->size, 8);
+            proto_put_int(&request, 0, 4); // Virtual peers seed nothing; downloads come from the index
+            proto_put_int(&request, 0, 2);
+            proto_end_record(&request);
+            op_submit(worker, op, cluster_primary(&cluster, op->content), &request);
+            break;
+        case KIND_SEARCH:
+            request_begin(&request, buffer, OP_SEARCH);
+            proto_put_name(&request, op->content);
+            proto_end_record(&request);
+            op_submit(worker, op, cluster_reader(&cluster, op->content), &request);
+            break;
+        case KIND_DOWNLOAD:
+        case KIND_BULK_DOWNLOAD:
+            request_begin(&request, buffer, OP_DOWNLOAD);
+            proto_put_name(&request, op->content);
+            proto_end_record(&request);
+            op_submit(worker, op, cluster_primary(&cluster, op->content), &request);
+            break;
+        default:
+            // A peer's names are spread over every node, so every node is asked
+            for (int node = 0; node < cluster.node_count; node++) {
+                request_begin(&request, buffer, op->kind == KIND_LIST ? OP_LIST : OP_DEREGISTER);
+                proto_put_name(&request, op->peer);
+                if (op->kind == KIND_QUIT) {
+                    proto_put_name(&request, ""); // Everything this peer registered
+                }
+                proto_end_record(&request);
+                op_submit(worker, op, node, &request);
+            }
+            break;
+    }
+}
+
+// Open the upload or download connection of an operation; its progress is then driven by epoll
+static void transfer_open(Worker *worker, Op *op, int node, int port, uint64_t token) {
+    struct sockaddr_in address = cluster.nodes[node];
+    address.sin_port = htons(port);
+    op->state = OP_SENDING;
+    op->out_sent = op->in_got = 0;
+    if (op->kind == KIND_REGISTER || op->kind == KIND_BULK_UPLOAD) {
+        proto_store(op->out, token, 8);
+        proto_store(op->out + 8, op->size, 8);
+        op->out_len = UPLOAD_HEADER_SIZE;
+        op->in_len = 1; // Status, once the node stored the file
+        op->body_left = op->size;
+    } else {
+        op->out_len = snprintf((char *)op->out, sizeof(op->out), "D %s\n", op->content);
+        op->in_len = CONTENT_HEADER_SIZE;
+        op->body_left = 0;
+    }
+
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = op};
+    if ((op->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        (connect(op->sock, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, op->sock, &event) != 0) {
+        op->failed = 1;
+        op_finish(worker, op);
+    }
+}
+
+// A datagram of an operation was answered, or given up on when reply is NULL
+static void op_answered(Worker *worker, Op *op, int node, const ProtoHeader *reply, ProtoReader *reader) {
+    op->legs--;
+    if (!reply) {
+        op->timed_out = 1;
+    } else if (reply->status == PROTO_NOT_FOUND) {
+        op->missed = 1;
+    } else if (reply->status != PROTO_OK) {
+        op->failed = 1;
+    } else if (op->kind == KIND_REGISTER || op->kind == KIND_BULK_UPLOAD) {
+        uint64_t token = proto_get_int(reader, 8);
+        int port = (int)proto_get_int(reader, 2);
+        if (!reader->error && token != 0) {
+            transfer_open(worker, op, node, port, token);
+            return;
+        }
+        op->failed = reader->error; // Token 0: the node already has the file from this peer
+    } else if (op->kind == KIND_DOWNLOAD || op->kind == KIND_BULK_DOWNLOAD) {
+        int port = (int)proto_get_int(reader, 2);
+        if (!reader->error) {
+            transfer_open(worker, op, node, port, 0);
+            return;
+        }
+        op->failed = 1;
+    }
+    if (op->legs == 0) {
+        op_finish(worker, op);
+    }
+}
+
+// Move whatever the connection of an operation allows: the upload or request out, then the answer in
+static void transfer_step(Worker *worker, Op *op) {
+    while (op->state == OP_SENDING) {
+        ssize_t n;
+        if (op->out_sent < op->out_len) {
+            n = send(op->sock, op->out + op->out_sent, op->out_len - op->out_sent, MSG_NOSIGNAL);
+        } else if (op->body_left > 0) {
+            n = send(op->sock, upload_pattern, op->body_left < IO_CHUNK ? op->body_left : IO_CHUNK, MSG_NOSIGNAL);
+        } else {
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = op};
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, op->sock, &event);
+            op->state = OP_RECEIVING;
+            return;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            op->failed = 1;
+            op_finish(worker, op);
+            return;
+        }
+        if (op->out_sent < op->out_len) {
+            op->out_sent += n;
+        } else {
+            op->body_left -= n;
+            op->bytes += n;
+        }
+    }
+
+    while (op->state == OP_RECEIVING) {
+        ssize_t n;
+        if (op->in_got < op->in_len) {
+            n = recv(op->sock, op->in + op->in_got, op->in_len - op->in_got, 0);
+        } else {
+            n = recv(op->sock, worker->scratch, op->body_left < IO_CHUNK ? op->body_left : IO_CHUNK, 0);
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            op->failed = 1;
+            op_finish(worker, op);
+            return;
+        }
+
+        if (op->in_got < op->in_len) {
+            op->in_got += n;
+            if (op->in_got < op->in_len) {
+                continue;
+            }
+            if (op->kind == KIND_REGISTER || op->kind == KIND_BULK_UPLOAD) {
+                op->failed = op->in[0] != 0;
+                op_finish(worker, op);
+                return;
+            }
+            op->missed = op->in[0] != 0; // Deregistered since the lookup
+            op->body_left = op->missed ? 0 : proto_load(op->in + 1, 8);
+        } else {
+            op->body_left -= n;
+            op->bytes += n;
+        }
+        if (op->body_left == 0) {
+            op_finish(worker, op);
+        }
+    }
+}
+
+static void worker_dispatch(Worker *worker, const uint8_t *datagram, size_t len) {
+    ProtoHeader reply;
+    ProtoReader reader;
+    if (proto_parse(datagram, len, &reply, &reader) != 0 || !(reply.opcode & PROTO_REPLY)) {
+        return;
+    }
+    Slot *slot = &worker->slots[reply.request_id & (SLOT_COUNT - 1)];
+    if (slot->id != reply.request_id || reply.request_id == 0) {
+        return; // Answer to a retransmission, or to something given up on
+    }
+    if (reply.status == PROTO_OVERLOADED) {
+        proto_get_name(&reader);
+        uint64_t retry = proto_get_int(&reader, 2) * 1000000;
+        if (!reader.error) {
+            slot->deadline = now_ns() + retry; // Sent again then, without backoff and with every attempt left
+            slot->attempts = 0;
+            worker->turned_away++;
+            return;
+        }
+    }
+    if (reply.flags & PROTO_FLAG_MORE) {
+        slot->deadline = now_ns() + REQUEST_TIMEOUT; // Only the last part of a listing finishes it
+        return;
+    }
+    slot->id = 0;
+    op_answered(worker, slot->op, slot->node, &reply, &reader);
+}
+
+// Wait for replies, transfer progress or the next retransmission, and handle whatever is due
+static void worker_poll(Worker *worker) {
+    uint64_t now = now_ns();
+    uint64_t next = now + REQUEST_TIMEOUT;
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        if (worker->slots[i].id != 0 && worker->slots[i].deadline < next) {
+            next = worker->slots[i].deadline;
+        }
+    }
+
+    struct epoll_event events[64];
+    int ready = epoll_wait(worker->epoll_fd, events, 64, next > now ? (int)((next - now + 999999) / 1000000) : 0);
+    for (int i = 0; i < ready; i++) {
+        if (events[i].data.ptr != worker) {
+            Op *op = events[i].data.ptr;
+            if (op->state == OP_SENDING || op->state == OP_RECEIVING) {
+                transfer_step(worker, op);
+            }
+            continue;
+        }
+        uint8_t datagrams[RECV_BATCH][PROTO_MAX_DATAGRAM];
+        struct iovec iov[RECV_BATCH];
+        struct mmsghdr msgs[RECV_BATCH];
+        int n;
+        do {
+            memset(msgs, 0, sizeof(msgs));
+            for (int j = 0; j < RECV_BATCH; j++) {
+                iov[j].iov_base = datagrams[j];
+                iov[j].iov_len = PROTO_MAX_DATAGRAM;
+                msgs[j].msg_hdr.msg_iov = &iov[j];
+                msgs[j].msg_hdr.msg_iovlen = 1;
+            }
+            n = recvmmsg(worker->sockfd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+            for (int j = 0; j < n; j++) {
+                worker_dispatch(worker, datagrams[j], msgs[j].msg_len);
+            }
+        } while (n == RECV_BATCH);
+    }
+
+    now = now_ns();
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        Slot *slot = &worker->slots[i];
+        if (slot->id == 0 || slot->deadline > now) {
+            continue;
+        }
+        if (slot->attempts >= MAX_ATTEMPTS) {
+            slot->id = 0;
+            op_answered(worker, slot->op, slot->node, NULL, NULL);
+            continue;
+        }
+        worker->retransmits += slot->attempts > 0; // Resends a node asked for are counted as turned away
+        slot_transmit(worker, slot);
+    }
+}
+
+// Keep the window full until the phase runs out of work, then let the last operations finish
+void *worker_thread(void *arg) {
+    Worker *worker = arg;
+    int more = 1;
+    while (1) {
+        int active = 0;
+        for (int i = 0; i < window; i++) {
+            Op *op = &worker->ops[i];
+            if (op->state == OP_IDLE && more && (more = op_next(worker, op)) != 0) {
+                op_start(worker, op);
+            }
+            active += op->state != OP_IDLE;
+        }
+        if (active == 0) {
+            break;
+        }
+        worker_poll(worker);
+    }
+    return NULL;
+}
+
+// Run a phase on every thread and return how long it took, in seconds
+double run_phase(Worker **workers, int which) {
+    phase = which;
+    uint64_t start = now_ns();
+    for (int i = 0; i < thread_count; i++) {
+        memset(workers[i]->stats, 0, sizeof(workers[i]->stats));
+        workers[i]->retransmits = 0;
+        workers[i]->turned_away = 0;
+        workers[i]->cursor = (uint32_t)i;
+        if (pthread_create(&workers[i]->thread, NULL, worker_thread, workers[i]) != 0) {
+            perror("Failed to start load thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(workers[i]->thread, NULL);
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+// Rates and latencies of every kind of operation the phase ran, in microseconds
+void report(const char *title, Worker **workers, double seconds) {
+    uint64_t retransmits = 0;
+    uint64_t turned_away = 0;
+    printf("\n%s: %.3f s\n", title, seconds);
+    printf("%-14s %9s %10s %8s %8s %9s %9s %9s %9s %9s\n", "operation", "count", "per s", "misses", "errors",
+           "mean us", "p50 us", "p99 us", "p999 us", "max us");
+    for (int kind = 0; kind < KIND_COUNT; kind++) {
+        Stats total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < thread_count; i++) {
+            const Stats *stats = &workers[i]->stats[kind];
+            total.count += stats->count;
+            total.misses += stats->misses;
+            total.errors += stats->errors;
+            total.timeouts += stats->timeouts;
+            total.bytes += stats->bytes;
+            total.total += stats->total;
+            total.max = stats->max > total.max ? stats->max : total.max;
+            for (int j = 0; j < HIST_BUCKETS; j++) {
+                total.buckets[j] += stats->buckets[j];
+            }
+        }
+        if (total.count + total.errors == 0) {
+            continue;
+        }
+        printf("%-14s %9llu %10.0f %8llu %8llu %9.1f %9.1f %9.1f %9.1f %9.1f", kind_names[kind],
+               (unsigned long long)total.count, total.count / seconds, (unsigned long long)total.misses,
+               (unsigned long long)total.errors, total.count ? total.total / 1e3 / total.count : 0.0,
+               stats_percentile(&total, 0.50) / 1e3, stats_percentile(&total, 0.99) / 1e3,
+               stats_percentile(&total, 0.999) / 1e3, total.max / 1e3);
+        if (total.bytes > 0) {
+            printf("  %.1f MB/s", total.bytes / seconds / 1e6);
+        }
+        if (total.timeouts > 0) {
+            printf("  (%llu timed out)", (unsigned long long)total.timeouts);
+        }
+        printf("\n");
+    }
+    for (int i = 0; i < thread_count; i++) {
+        retransmits += workers[i]->retransmits;
+        turned_away += workers[i]->turned_away;
+    }
+    printf("%llu retransmission(s), %llu request(s) turned away\n", (unsigned long long)retransmits,
+           (unsigned long long)turned_away);
+}
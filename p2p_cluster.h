@@ -0,0 +1,170 @@
+#ifndef P2P_CLUSTER_H
+#define P2P_CLUSTER_H
+
+// Partitioning of the catalog over several index servers, shared by the servers, the router and
+// the peers so that all of them agree on where a name lives.
+//
+// Nodes are listed as address:port, the port being the node's control port; a node also listens
+// on the three ports after it. Each node is hashed onto a ring at CLUSTER_VNODES points, and a
+// content name is owned by the first `replicas` distinct nodes met walking clockwise from the hash
+// of the name. The first owner is the primary: registrations and downloads go there, and it ships
+// every change to the other owners, which answer searches as well. Everyone must be given the same
+// node list, in the same order, with the same replica count.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define CLUSTER_MAX_NODES 16
+#define CLUSTER_VNODES 64 // Ring points per node; more points even out the partition sizes
+#define CLUSTER_DEFAULT_REPLICAS 2 // Owners of every name, the primary included
+#define CLUSTER_CURSOR_SHIFT 28 // A cluster-wide find cursor keeps its node above this bit
+#define CLUSTER_FORWARD_OFFSET 3 // A router forwards from its control port plus this, a node replicates there
+
+typedef struct {
+    uint64_t hash;
+    int node;
+} RingPoint;
+
+typedef struct {
+    struct sockaddr_in nodes[CLUSTER_MAX_NODES]; // Control address of every node
+    int node_count;
+    int replicas;
+    RingPoint ring[CLUSTER_MAX_NODES * CLUSTER_VNODES]; // Sorted by hash
+    int point_count;
+} Cluster;
+
+// FNV-1a finished with a 64-bit mix, so that similar names land far apart on the ring
+static inline uint64_t cluster_hash(const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdULL;
+    hash = (hash ^ (hash >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 33);
+}
+
+static inline int cluster_compare_points(const void *a, const void *b) {
+    const RingPoint *x = a;
+    const RingPoint *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash ? 1 : x->node - y->node;
+}
+
+// Build the ring from "address:port,address:port,..."; returns 0, or -1 if the list is malformed
+static inline int cluster_init(Cluster *cluster, const char *list, int replicas) {
+    char copy[CLUSTER_MAX_NODES * 24];
+    char *save;
+    memset(cluster, 0, sizeof(*cluster));
+    if (strlen(list) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, list);
+
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(item, ':');
+        struct sockaddr_in *node = &cluster->nodes[cluster->node_count];
+        if (!colon || cluster->node_count == CLUSTER_MAX_NODES) {
+            return -1;
+        }
+        *colon = '\0';
+        int port = atoi(colon + 1);
+        if (!inet_aton(item, &node->sin_addr) || port <= 0 || port > 65535 - 3) {
+            return -1;
+        }
+        node->sin_family = AF_INET;
+        node->sin_port = htons(port);
+
+        for (int i = 0; i < CLUSTER_VNODES; i++) {
+            char label[48];
+            int len = snprintf(label, sizeof(label), "%s:%d#%d", item, port, i);
+            cluster->ring[cluster->point_count++] = (RingPoint){cluster_hash(label, len), cluster->node_count};
+        }
+        cluster->node_count++;
+    }
+    if (cluster->node_count == 0) {
+        return -1;
+    }
+    cluster->replicas = replicas < 1 ? 1 : replicas > cluster->node_count ? cluster->node_count : replicas;
+    qsort(cluster->ring, cluster->point_count, sizeof(RingPoint), cluster_compare_points);
+    return 0;
+}
+
+// The owners of a name, primary first; returns how many there are
+static inline int cluster_owners(const Cluster *cluster, const char *name, int owners[CLUSTER_MAX_NODES]) {
+    owners[0] = 0;
+    if (cluster->node_count <= 1) {
+        return 1;
+    }
+
+    // First point at or after the hash of the name, wrapping around the ring
+    uint64_t hash = cluster_hash(name, strlen(name));
+    int low = 0;
+    int high = cluster->point_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (cluster->ring[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    int found = 0;
+    for (int i = 0; i < cluster->point_count && found < cluster->replicas; i++) {
+        int node = cluster->ring[(low + i) % cluster->point_count].node;
+        int seen = 0;
+        for (int j = 0; j < found; j++) {
+            seen |= owners[j] == node;
+        }
+        if (!seen) {
+            owners[found++] = node;
+        }
+    }
+    return found;
+}
+
+static inline int cluster_primary(const Cluster *cluster, const char *name) {
+    int owners[CLUSTER_MAX_NODES];
+    cluster_owners(cluster, name, owners);
+    return owners[0];
+}
+
+// Any owner of a name, picked at random so that searches spread over the replicas
+static inline int cluster_reader(const Cluster *cluster, const char *name) {
+    int owners[CLUSTER_MAX_NODES];
+    int count = cluster_owners(cluster, name, owners);
+    return owners[count > 1 ? rand() % count : 0];
+}
+
+// Whether a datagram came from one of the listed routers, which send to their nodes from the port
+// CLUSTER_FORWARD_OFFSET after their control port
+static inline int cluster_has_router(const Cluster *routers, const struct sockaddr_in *addr) {
+    for (int i = 0; i < routers->node_count; i++) {
+        if (routers->nodes[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+            ntohs(routers->nodes[i].sin_port) + CLUSTER_FORWARD_OFFSET == ntohs(addr->sin_port)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A find pages through the nodes one after the other. Its cursor holds the node being paged
+// through above CLUSTER_CURSOR_SHIFT and that node's own cursor below; returns the node.
+static inline int cluster_cursor_node(uint32_t cursor, uint32_t *local) {
+    *local = cursor & ((1U << CLUSTER_CURSOR_SHIFT) - 1);
+    return (int)(cursor >> CLUSTER_CURSOR_SHIFT);
+}
+
+// The cursor after a page from node whose own next cursor is next; 0 once the last node is done
+static inline uint32_t cluster_cursor_next(const Cluster *cluster, int node, uint32_t next) {
+    if (next != 0) {
+        return (uint32_t)node << CLUSTER_CURSOR_SHIFT | next;
+    }
+    return node + 1 < cluster->node_count ? (uint32_t)(node + 1) << CLUSTER_CURSOR_SHIFT : 0;
+}
+
+#endif
@@ -0,0 +1,354 @@
+#ifndef P2P_HASH_H
+#define P2P_HASH_H
+
+// BLAKE3 (unkeyed, 32-byte output), shared by the index server and the peers
+// so that chunk hashes computed on one side verify on the other.
+//
+// Long inputs are hashed BLAKE3_SIMD_DEGREE chunks at a time, one chunk per vector lane, so that
+// hashing keeps up with the network and the disk. The lanes use GCC vector extensions; on x86-64
+// an AVX2 build of the same code is picked at run time when the processor has it.
+
+#include <stdint.h>
+#include <string.h>
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54 // Enough stack for 2^64 bytes of input
+#define BLAKE3_SIMD_DEGREE 8 // Chunks compressed side by side
+
+enum {
+    BLAKE3_CHUNK_START = 1 << 0,
+    BLAKE3_CHUNK_END = 1 << 1,
+    BLAKE3_PARENT = 1 << 2,
+    BLAKE3_ROOT = 1 << 3,
+};
+
+static const uint32_t blake3_iv[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t blake3_permutation[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+// Message words taken by each round: blake3_permutation applied round after round
+static const uint8_t blake3_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+typedef struct {
+    uint32_t cv[8]; // Chaining value of the blocks compressed so far
+    uint64_t chunk_counter;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+} Blake3Chunk;
+
+typedef struct {
+    Blake3Chunk chunk;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8]; // Subtree roots still waiting for a right sibling
+    uint8_t cv_stack_len;
+} Blake3Hasher;
+
+// Everything needed to finish a node, kept so the root can be compressed with the ROOT flag
+typedef struct {
+    uint32_t input_cv[8];
+    uint32_t block_words[16];
+    uint64_t counter;
+    uint32_t block_len;
+    uint32_t flags;
+} Blake3Output;
+
+static inline uint32_t blake3_rotr(uint32_t word, int count) {
+    return (word >> count) | (word << (32 - count));
+}
+
+static inline void blake3_g(uint32_t *state, int a, int b, int c, int d, uint32_t mx, uint32_t my) {
+    state[a] = state[a] + state[b] + mx;
+    state[d] = blake3_rotr(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = blake3_rotr(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + my;
+    state[d] = blake3_rotr(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = blake3_rotr(state[b] ^ state[c], 7);
+}
+
+static inline void blake3_compress(const uint32_t cv[8], const uint32_t block_words[16], uint64_t counter,
+                                   uint32_t block_len, uint32_t flags, uint32_t out[16]) {
+    uint32_t state[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags,
+    };
+    uint32_t m[16];
+    memcpy(m, block_words, sizeof(m));
+
+    for (int round = 0; round < 7; round++) {
+        blake3_g(state, 0, 4, 8, 12, m[0], m[1]);
+        blake3_g(state, 1, 5, 9, 13, m[2], m[3]);
+        blake3_g(state, 2, 6, 10, 14, m[4], m[5]);
+        blake3_g(state, 3, 7, 11, 15, m[6], m[7]);
+        blake3_g(state, 0, 5, 10, 15, m[8], m[9]);
+        blake3_g(state, 1, 6, 11, 12, m[10], m[11]);
+        blake3_g(state, 2, 7, 8, 13, m[12], m[13]);
+        blake3_g(state, 3, 4, 9, 14, m[14], m[15]);
+
+        uint32_t permuted[16];
+        for (int i = 0; i < 16; i++) {
+            permuted[i] = m[blake3_permutation[i]];
+        }
+        memcpy(m, permuted, sizeof(m));
+    }
+
+    for (int i = 0; i < 8; i++) {
+        out[i] = state[i] ^ state[i + 8];
+        out[i + 8] = state[i + 8] ^ cv[i];
+    }
+}
+
+static inline void blake3_words(const uint8_t block[BLAKE3_BLOCK_LEN], uint32_t words[16]) {
+    for (int i = 0; i < 16; i++) {
+        words[i] = (uint32_t)block[4 * i] | ((uint32_t)block[4 * i + 1] << 8) |
+                   ((uint32_t)block[4 * i + 2] << 16) | ((uint32_t)block[4 * i + 3] << 24);
+    }
+}
+
+typedef uint32_t Blake3Lanes __attribute__((vector_size(4 * BLAKE3_SIMD_DEGREE)));
+
+// Vectors are only ever handled through pointers here, which keeps them out of the calling convention
+#define BLAKE3_SPLAT(word) ((Blake3Lanes){0} + (uint32_t)(word))
+#define BLAKE3_ROTR_LANES(word, count) (((word) >> (count)) | ((word) << (32 - (count))))
+
+static inline __attribute__((always_inline)) void blake3_g_lanes(Blake3Lanes *state, int a, int b, int c, int d,
+                                                                 const Blake3Lanes *mx, const Blake3Lanes *my) {
+    state[a] = state[a] + state[b] + *mx;
+    state[d] = BLAKE3_ROTR_LANES(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = BLAKE3_ROTR_LANES(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + *my;
+    state[d] = BLAKE3_ROTR_LANES(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = BLAKE3_ROTR_LANES(state[b] ^ state[c], 7);
+}
+
+// Chaining values of BLAKE3_SIMD_DEGREE whole chunks lying one after the other, the first being chunk
+// number counter. Lane i runs the sixteen blocks of chunk i through blake3_compress's rounds.
+static inline __attribute__((always_inline)) void blake3_hash_lanes(const uint8_t *input, uint64_t counter,
+                                                                    uint32_t cvs[BLAKE3_SIMD_DEGREE][8]) {
+    Blake3Lanes cv[8];
+    Blake3Lanes counter_low;
+    Blake3Lanes counter_high;
+    for (int i = 0; i < 8; i++) {
+        cv[i] = BLAKE3_SPLAT(blake3_iv[i]);
+    }
+    for (int lane = 0; lane < BLAKE3_SIMD_DEGREE; lane++) {
+        counter_low[lane] = (uint32_t)(counter + lane);
+        counter_high[lane] = (uint32_t)((counter + lane) >> 32);
+    }
+
+    for (int block = 0; block < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; block++) {
+        Blake3Lanes m[16];
+        for (int lane = 0; lane < BLAKE3_SIMD_DEGREE; lane++) {
+            uint32_t words[16];
+            blake3_words(input + (size_t)lane * BLAKE3_CHUNK_LEN + block * BLAKE3_BLOCK_LEN, words);
+            for (int i = 0; i < 16; i++) {
+                m[i][lane] = words[i];
+            }
+        }
+        uint32_t flags = (block == 0 ? BLAKE3_CHUNK_START : 0) |
+                         (block == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? BLAKE3_CHUNK_END : 0);
+        Blake3Lanes state[16] = {
+            cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+            BLAKE3_SPLAT(blake3_iv[0]), BLAKE3_SPLAT(blake3_iv[1]), BLAKE3_SPLAT(blake3_iv[2]),
+            BLAKE3_SPLAT(blake3_iv[3]), counter_low, counter_high, BLAKE3_SPLAT(BLAKE3_BLOCK_LEN), BLAKE3_SPLAT(flags),
+        };
+
+        for (int round = 0; round < 7; round++) {
+            const uint8_t *s = blake3_schedule[round];
+            blake3_g_lanes(state, 0, 4, 8, 12, &m[s[0]], &m[s[1]]);
+            blake3_g_lanes(state, 1, 5, 9, 13, &m[s[2]], &m[s[3]]);
+            blake3_g_lanes(state, 2, 6, 10, 14, &m[s[4]], &m[s[5]]);
+            blake3_g_lanes(state, 3, 7, 11, 15, &m[s[6]], &m[s[7]]);
+            blake3_g_lanes(state, 0, 5, 10, 15, &m[s[8]], &m[s[9]]);
+            blake3_g_lanes(state, 1, 6, 11, 12, &m[s[10]], &m[s[11]]);
+            blake3_g_lanes(state, 2, 7, 8, 13, &m[s[12]], &m[s[13]]);
+            blake3_g_lanes(state, 3, 4, 9, 14, &m[s[14]], &m[s[15]]);
+        }
+
+        for (int i = 0; i < 8; i++) {
+            cv[i] = state[i] ^ state[i + 8];
+        }
+    }
+
+    for (int lane = 0; lane < BLAKE3_SIMD_DEGREE; lane++) {
+        for (int i = 0; i < 8; i++) {
+            cvs[lane][i] = cv[i][lane];
+        }
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2"))) static void blake3_hash_lanes_avx2(const uint8_t *input, uint64_t counter,
+                                                                     uint32_t cvs[BLAKE3_SIMD_DEGREE][8]) {
+    blake3_hash_lanes(input, counter, cvs);
+}
+#endif
+
+static inline void blake3_hash_many(const uint8_t *input, uint64_t counter, uint32_t cvs[BLAKE3_SIMD_DEGREE][8]) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        blake3_hash_lanes_avx2(input, counter, cvs);
+        return;
+    }
+#endif
+    blake3_hash_lanes(input, counter, cvs);
+}
+
+static inline void blake3_chaining_value(const Blake3Output *output, uint32_t cv[8]) {
+    uint32_t out[16];
+    blake3_compress(output->input_cv, output->block_words, output->counter, output->block_len, output->flags, out);
+    memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static inline void blake3_chunk_init(Blake3Chunk *chunk, uint64_t chunk_counter) {
+    memcpy(chunk->cv, blake3_iv, sizeof(chunk->cv));
+    chunk->chunk_counter = chunk_counter;
+    memset(chunk->block, 0, sizeof(chunk->block));
+    chunk->block_len = 0;
+    chunk->blocks_compressed = 0;
+}
+
+static inline size_t blake3_chunk_len(const Blake3Chunk *chunk) {
+    return BLAKE3_BLOCK_LEN * (size_t)chunk->blocks_compressed + chunk->block_len;
+}
+
+static inline void blake3_chunk_update(Blake3Chunk *chunk, const uint8_t *input, size_t input_len) {
+    while (input_len > 0) {
+        // Only compress a full block once more input shows it is not the chunk's last
+        if (chunk->block_len == BLAKE3_BLOCK_LEN) {
+            uint32_t words[16];
+            uint32_t out[16];
+            blake3_words(chunk->block, words);
+            blake3_compress(chunk->cv, words, chunk->chunk_counter, BLAKE3_BLOCK_LEN,
+                            chunk->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0, out);
+            memcpy(chunk->cv, out, sizeof(chunk->cv));
+            chunk->blocks_compressed++;
+            memset(chunk->block, 0, sizeof(chunk->block));
+            chunk->block_len = 0;
+        }
+
+        size_t take = BLAKE3_BLOCK_LEN - chunk->block_len;
+        if (take > input_len) {
+            take = input_len;
+        }
+        memcpy(chunk->block + chunk->block_len, input, take);
+        chunk->block_len += (uint8_t)take;
+        input += take;
+        input_len -= take;
+    }
+}
+
+static inline Blake3Output blake3_chunk_output(const Blake3Chunk *chunk) {
+    Blake3Output output;
+    memcpy(output.input_cv, chunk->cv, sizeof(output.input_cv));
+    blake3_words(chunk->block, output.block_words);
+    output.counter = chunk->chunk_counter;
+    output.block_len = chunk->block_len;
+    output.flags = BLAKE3_CHUNK_END | (chunk->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0);
+    return output;
+}
+
+static inline Blake3Output blake3_parent_output(const uint32_t left[8], const uint32_t right[8]) {
+    Blake3Output output;
+    memcpy(output.input_cv, blake3_iv, sizeof(output.input_cv));
+    memcpy(output.block_words, left, 8 * sizeof(uint32_t));
+    memcpy(output.block_words + 8, right, 8 * sizeof(uint32_t));
+    output.counter = 0;
+    output.block_len = BLAKE3_BLOCK_LEN;
+    output.flags = BLAKE3_PARENT;
+    return output;
+}
+
+static inline void blake3_init(Blake3Hasher *hasher) {
+    blake3_chunk_init(&hasher->chunk, 0);
+    hasher->cv_stack_len = 0;
+}
+
+// Merge completed subtrees: the number of trailing zero bits of total_chunks is the number of merges due
+static inline void blake3_push_chunk_cv(Blake3Hasher *hasher, uint32_t cv[8], uint64_t total_chunks) {
+    while ((total_chunks & 1) == 0) {
+        Blake3Output parent = blake3_parent_output(hasher->cv_stack[--hasher->cv_stack_len], cv);
+        blake3_chaining_value(&parent, cv);
+        total_chunks >>= 1;
+    }
+    memcpy(hasher->cv_stack[hasher->cv_stack_len++], cv, 8 * sizeof(uint32_t));
+}
+
+static inline void blake3_update(Blake3Hasher *hasher, const void *data, size_t len) {
+    const uint8_t *input = data;
+    while (len > 0) {
+        if (blake3_chunk_len(&hasher->chunk) == BLAKE3_CHUNK_LEN) {
+            uint32_t cv[8];
+            Blake3Output output = blake3_chunk_output(&hasher->chunk);
+            blake3_chaining_value(&output, cv);
+            uint64_t total_chunks = hasher->chunk.chunk_counter + 1;
+            blake3_push_chunk_cv(hasher, cv, total_chunks);
+            blake3_chunk_init(&hasher->chunk, total_chunks);
+        }
+
+        // Runs of whole chunks that are not the last of the input go through the vector lanes
+        if (blake3_chunk_len(&hasher->chunk) == 0 && len > BLAKE3_SIMD_DEGREE * BLAKE3_CHUNK_LEN) {
+            uint32_t cvs[BLAKE3_SIMD_DEGREE][8];
+            uint64_t counter = hasher->chunk.chunk_counter;
+            blake3_hash_many(input, counter, cvs);
+            for (int i = 0; i < BLAKE3_SIMD_DEGREE; i++) {
+                blake3_push_chunk_cv(hasher, cvs[i], counter + i + 1);
+            }
+            blake3_chunk_init(&hasher->chunk, counter + BLAKE3_SIMD_DEGREE);
+            input += BLAKE3_SIMD_DEGREE * BLAKE3_CHUNK_LEN;
+            len -= BLAKE3_SIMD_DEGREE * BLAKE3_CHUNK_LEN;
+            continue;
+        }
+
+        size_t take = BLAKE3_CHUNK_LEN - blake3_chunk_len(&hasher->chunk);
+        if (take > len) {
+            take = len;
+        }
+        blake3_chunk_update(&hasher->chunk, input, take);
+        input += take;
+        len -= take;
+    }
+}
+
+static inline void blake3_final(const Blake3Hasher *hasher, uint8_t out[BLAKE3_OUT_LEN]) {
+    Blake3Output output = blake3_chunk_output(&hasher->chunk);
+    for (int i = hasher->cv_stack_len - 1; i >= 0; i--) {
+        uint32_t cv[8];
+        blake3_chaining_value(&output, cv);
+        output = blake3_parent_output(hasher->cv_stack[i], cv);
+    }
+
+    uint32_t words[16];
+    blake3_compress(output.input_cv, output.block_words, 0, output.block_len, output.flags | BLAKE3_ROOT, words);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (uint8_t)words[i];
+        out[4 * i + 1] = (uint8_t)(words[i] >> 8);
+        out[4 * i + 2] = (uint8_t)(words[i] >> 16);
+        out[4 * i + 3] = (uint8_t)(words[i] >> 24);
+    }
+}
+
+static inline void blake3_hash(const void *data, size_t len, uint8_t out[BLAKE3_OUT_LEN]) {
+    Blake3Hasher hasher;
+    blake3_init(&hasher);
+    blake3_update(&hasher, data, len);
+    blake3_final(&hasher, out);
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef P2P_HISTOGRAM_H
+#define P2P_HISTOGRAM_H
+
+// Log-linear latency histograms, as in HdrHistogram, shared by the index server's statistics and the
+// load generator. Values below 2^HIST_SUB_BITS get a bucket each; every power of two above them is
+// split into 2^HIST_SUB_BITS buckets, so a bucket is never wider than a sixteenth of the values in it.
+// Values of 2^HIST_MAX_BITS and more (in nanoseconds, about 18 minutes) all land in the last bucket.
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+static inline int hist_bucket(uint64_t value) {
+    if (value < (1U << HIST_SUB_BITS)) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    int mantissa = (int)(value >> (exponent - HIST_SUB_BITS)) - (1 << HIST_SUB_BITS);
+    return ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + mantissa;
+}
+
+// Smallest value that falls in a bucket
+static inline uint64_t hist_floor(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return (uint64_t)bucket;
+    }
+    int exponent = (bucket >> HIST_SUB_BITS) - 1 + HIST_SUB_BITS;
+    uint64_t mantissa = (uint64_t)(bucket & ((1 << HIST_SUB_BITS) - 1)) + (1U << HIST_SUB_BITS);
+    return mantissa << (exponent - HIST_SUB_BITS);
+}
+
+// The value at or below which a fraction of the count samples lie, as the top of its bucket
+static inline uint64_t hist_quantile(const uint64_t *buckets, uint64_t count, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0) {
+            return i + 1 < HIST_BUCKETS ? hist_floor(i + 1) - 1 : hist_floor(i);
+        }
+    }
+    return 0;
+}
+
+#endif
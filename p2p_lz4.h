@@ -0,0 +1,202 @@
+#ifndef P2P_LZ4_H
+#define P2P_LZ4_H
+
+// LZ4 block format, shared by the index server and the peers to compress chunks on the wire.
+//
+// A block is a run of sequences, each a token byte (literal count in the high nibble, match
+// length minus 4 in the low one; 15 means more length bytes follow, each adding up to 255), the
+// literals, and a 2-byte little-endian offset back to where the match is copied from. The last
+// sequence has literals only. The compressor is the greedy single-probe one of LZ4's fast mode.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_BITS 12 // Match finder table of 2^12 positions, 16 KiB of stack
+#define LZ4_LAST_LITERALS 5 // The last bytes of a block are always literals
+#define LZ4_MATCH_MARGIN 12 // A match may not start closer than this to the end of the block
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_SKIP_TRIGGER 6 // Every 2^6 positions without a match, the search steps one byte further
+#define LZ4_SAMPLE 65536 // Bytes compressed to guess whether the rest is worth compressing
+#define LZ4_MIN_SAVING 8 // Compressing must save at least 1/8 of the bytes to be worth it
+
+// Largest compressed size of len bytes
+static inline size_t lz4_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint8_t *lz4_put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Compress len bytes into at most capacity bytes; returns the compressed length, or 0 if it does not fit
+static inline size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t capacity) {
+    uint32_t table[1 << LZ4_HASH_BITS];
+    const uint8_t *end = src + len;
+    const uint8_t *anchor = src;
+    const uint8_t *ip = src + 1;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + capacity;
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ4_MATCH_MARGIN) {
+        const uint8_t *match_start_limit = end - LZ4_MATCH_MARGIN;
+        const uint8_t *match_end_limit = end - LZ4_LAST_LITERALS;
+        unsigned int misses = 0;
+        while (ip < match_start_limit) {
+            uint32_t sequence = lz4_read32(ip);
+            uint32_t slot = (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+            const uint8_t *ref = src + table[slot];
+            table[slot] = (uint32_t)(ip - src);
+            if (ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != sequence) {
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER); // Stride through data that does not compress
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *match_end = ip + LZ4_MIN_MATCH;
+            while (match_end + 8 <= match_end_limit) {
+                uint64_t a, b;
+                memcpy(&a, match_end, 8);
+                memcpy(&b, ref + (match_end - ip), 8);
+                if (a != b) {
+                    match_end += __builtin_ctzll(a ^ b) / 8; // Little-endian: the first differing byte
+                    break;
+                }
+                match_end += 8;
+            }
+            while (match_end < match_end_limit && *match_end == ref[match_end - ip]) {
+                match_end++;
+            }
+
+            size_t literals = ip - anchor;
+            size_t match = match_end - ip - LZ4_MIN_MATCH;
+            if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) {
+                return 0;
+            }
+            uint8_t *token = op++;
+            *token = (uint8_t)((literals < 15 ? literals : 15) << 4 | (match < 15 ? match : 15));
+            if (literals >= 15) {
+                op = lz4_put_length(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (uint8_t)(ip - ref);
+            *op++ = (uint8_t)((ip - ref) >> 8);
+            if (match >= 15) {
+                op = lz4_put_length(op, match - 15);
+            }
+            ip = anchor = match_end;
+        }
+    }
+
+    size_t literals = end - anchor;
+    if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    *op++ = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op = lz4_put_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    return op + literals - dst;
+}
+
+// Decompress a block into at most capacity bytes; returns the decompressed length, or -1 if the block is
+// malformed or decompresses to more than capacity
+static inline long lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t capacity) {
+    const uint8_t *ip = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    while (ip < end) {
+        unsigned int token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t more;
+            do {
+                if (ip == end) {
+                    return -1;
+                }
+                more = *ip++;
+                literals += more;
+            } while (more == 255);
+        }
+        if ((size_t)(end - ip) < literals || capacity - (op - dst) < literals) {
+            return -1;
+        }
+        if (literals <= 16 && end - ip >= 16 && capacity - (op - dst) >= 16) {
+            memcpy(op, ip, 16); // Short runs are copied whole-register; the excess is written over next
+        } else {
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+        if (ip == end) {
+            break; // The last sequence has no match
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15) {
+            uint8_t more;
+            do {
+                if (ip == end) {
+                    return -1;
+                }
+                more = *ip++;
+                match += more;
+            } while (more == 255);
+        }
+        match += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || capacity - (op - dst) < match) {
+            return -1;
+        }
+        const uint8_t *ref = op - offset;
+        if (offset >= 8 && capacity - (op - dst) >= match + 8) {
+            for (size_t i = 0; i < match; i += 8) {
+                memcpy(op + i, ref + i, 8); // Each piece is read before a later one could overwrite it
+            }
+        } else if (offset >= match) {
+            memcpy(op, ref, match);
+        } else {
+            for (size_t i = 0; i < match; i++) {
+                op[i] = ref[i]; // Overlapping: the match repeats its last offset bytes
+            }
+        }
+        op += match;
+    }
+    return op - dst;
+}
+
+// Room a compressed len-byte block may take for compressing to be worth it
+static inline size_t lz4_worth(size_t len) {
+    return len - len / LZ4_MIN_SAVING;
+}
+
+// Whether bytes look compressible, judged on their first LZ4_SAMPLE bytes; media, archives and other
+// already compressed data are turned down at the cost of compressing the sample only
+static inline int lz4_compressible(const uint8_t *src, size_t len) {
+    uint8_t scratch[LZ4_SAMPLE];
+    size_t sample = len < LZ4_SAMPLE ? len : LZ4_SAMPLE;
+    return sample > LZ4_MATCH_MARGIN && lz4_compress(src, sample, scratch, lz4_worth(sample)) > 0;
+}
+
+#endif
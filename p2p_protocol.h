@@ -0,0 +1,268 @@
+#ifndef P2P_PROTOCOL_H
+#define P2P_PROTOCOL_H
+
+// Control-plane framing shared by the index server and the peers.
+//
+// Every datagram is a fixed header followed by `count` records whose layout
+// depends on the opcode. Integers are big-endian. A name is a length byte,
+// the bytes and a trailing NUL, so a reader can hand it out in place without
+// copying. Names may contain any byte except NUL, spaces included.
+//
+//   version (1) | opcode (1) | status (1) | flags (1) | request id (4) | count (2) | length (2)
+//
+// A reply carries the opcode of its request with PROTO_REPLY set and the same
+// request id. Replies too large for one datagram are split; every part but the
+// last has PROTO_FLAG_MORE set.
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROTO_VERSION 1
+#define PROTO_HEADER_SIZE 12
+#define PROTO_MAX_DATAGRAM 1472 // Largest datagram that fits one Ethernet frame
+#define PROTO_REPLY 0x80 // Set in the opcode of every reply
+#define PROTO_FLAG_MORE 0x01 // More datagrams follow for the same request
+
+// Opcodes, with the request record and reply records of each. A register reply
+// with token 0 means the server already has the content from this peer.
+enum {
+    OP_REGISTER = 1, // peer, content, size (8), seed -> token (8), upload port (2)
+    OP_DEREGISTER = 2, // peer, content (empty = all) -> nothing
+    OP_SEARCH = 3, // content                         -> address (4), port (2) for each holder
+    OP_LIST = 4, // peer                              -> content name for each registration
+    OP_DOWNLOAD = 5, // content                       -> content port (2)
+    OP_HAVE = 6, // peer, content, chunk (4), seed    -> no reply at all
+
+    // Batches carry many items per datagram and get one packed answer. Their
+    // records are preceded by the fields shown before the colon, if any.
+    OP_REGISTER_BATCH = 7, // peer, seed: content, size (8) -> status (1), token (8), upload port (2)
+    OP_DEREGISTER_BATCH = 8, // peer: content        -> status (1)
+    OP_SEARCH_BATCH = 9, // content                   -> index (2), status (1), holder count (1),
+                         //                              then address (4), port (2) per holder
+    OP_FIND = 10, // mode (1), cursor (4), limit (1), pattern -> next cursor (4): content, holder count (1),
+                  //                                            then address (4), port (2) per holder
+    OP_HEARTBEAT = 11, // peer                        -> lease (2), in seconds
+    OP_SUBSCRIBE = 12, // kind (1), feed (8), since (8), pattern -> subscription (4), feed (8), since (8), lease (2)
+    OP_UNSUBSCRIBE = 13, // kind (1), pattern         -> nothing
+    OP_NOTIFY = 14, // Sent by the server to subscribers and never answered; see below
+};
+
+// A seed is where the peer serves its content to other peers: address (4) and port (2) of its seeding
+// listener. The address is the one the datagram came from, whatever the peer writes there; only a
+// router in front of the index fills in that of the client it forwards for. Port 0 is for a peer that
+// serves nothing. Holders are listed with their seed.
+
+// A peer's registrations are leased: every heartbeat or registration renews the lease, and a peer
+// unheard of for a whole lease is dropped. Heartbeating every third of the lease rides out a lost
+// datagram or two. Holders are listed live ones only, the most recently heard from first.
+
+// Subscriptions have the server push catalog changes instead of clients polling for them. The server
+// numbers the changes it makes, and a subscription asks for those after since under the feed id the
+// server gave (0 and 0 the first time). The reply tells where notifications carry on from: since
+// itself while the server still has every change after it, or else the end of its feed, and then the
+// client has missed changes and reads the current state again (OP_LIST, OP_FIND, OP_SEARCH). A
+// subscription is leased; subscribing again with the since reached by then renews it, and a since
+// behind what the server sent has the rest sent again. In a cluster every node tells of the names it
+// lists, so a client subscribes to each node.
+//
+// An OP_NOTIFY datagram has the subscription as its request id and a first record of feed (8),
+// from (8), to (8): it holds every change after from up to to that the subscription covers, several
+// changes of one content and peer reduced to the last. A client whose since is not from missed a
+// datagram and subscribes again. Each further record is one change:
+//   type (1), content, peer, seed address (4), port (2)    (seed 0 for a removal)
+enum {
+    SUBSCRIBE_NAME = 0, // One content name
+    SUBSCRIBE_PREFIX = 1, // Content names starting with the pattern, byte for byte; empty for every name
+    SUBSCRIBE_PEER = 2, // Whatever one peer registers or drops
+};
+
+enum {
+    CHANGE_ADD = 1, // The peer holds the whole content, serving it from the seed given
+    CHANGE_REMOVE = 2, // The peer no longer holds it
+};
+
+#define PROTO_BATCH_HOLDERS 8 // Holders listed per item of a search batch or find
+
+// How OP_FIND matches its pattern against content names, ignoring ASCII case. Prefix and
+// substring matches come oldest first, fuzzy ones most similar first. A page holds at most
+// limit names (0 = as many as fit); its next cursor resumes after it, or is 0 at the end.
+enum {
+    FIND_PREFIX = 0,
+    FIND_SUBSTRING = 1,
+    FIND_FUZZY = 2, // Names sharing enough trigrams with the pattern, typos included
+};
+
+// Reply status; failures carry one record with a readable message
+enum {
+    PROTO_OK = 0,
+    PROTO_NOT_FOUND = 1,
+    PROTO_INVALID = 2, // Well-formed request the server refuses, e.g. a bad content name
+    PROTO_BUSY = 3, // Out of some resource, try again later
+    PROTO_MALFORMED = 4, // The request did not parse
+    PROTO_OVERLOADED = 5, // Turned away unhandled; the message is followed by retry after (2), in milliseconds
+};
+
+// A server under more load than it can answer promptly turns requests away instead of queueing them,
+// writes before reads, and a client sending more than its share is turned away too. The request was
+// not carried out, so the client sends it again once the retry after has passed, better with some
+// jitter. Requests in flight together may be answered in any order.
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t status;
+    uint8_t flags;
+    uint32_t request_id;
+    uint16_t count; // Records that follow the header
+} ProtoHeader;
+
+// Builds one datagram in a caller-supplied buffer
+typedef struct {
+    uint8_t *buffer;
+    size_t capacity;
+    size_t len;
+    uint16_t count;
+    int overflow; // Set once something did not fit; the datagram is then unusable
+} ProtoWriter;
+
+// Walks the records of a received datagram; fields point into the datagram itself
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+    int error; // Set once a field was missing or malformed
+} ProtoReader;
+
+static inline void proto_store(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+static inline uint64_t proto_load(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static inline void proto_begin(ProtoWriter *writer, void *buffer, size_t capacity, const ProtoHeader *header) {
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    writer->len = PROTO_HEADER_SIZE;
+    writer->count = 0;
+    writer->overflow = capacity < PROTO_HEADER_SIZE;
+    if (!writer->overflow) {
+        writer->buffer[0] = PROTO_VERSION;
+        writer->buffer[1] = header->opcode;
+        writer->buffer[2] = header->status;
+        writer->buffer[3] = header->flags;
+        proto_store(writer->buffer + 4, header->request_id, 4);
+    }
+}
+
+static inline uint8_t *proto_reserve(ProtoWriter *writer, size_t len) {
+    if (writer->overflow || writer->capacity - writer->len < len) {
+        writer->overflow = 1;
+        return NULL;
+    }
+    uint8_t *out = writer->buffer + writer->len;
+    writer->len += len;
+    return out;
+}
+
+static inline void proto_put_int(ProtoWriter *writer, uint64_t value, int bytes) {
+    uint8_t *out = proto_reserve(writer, bytes);
+    if (out) {
+        proto_store(out, value, bytes);
+    }
+}
+
+static inline void proto_put_name(ProtoWriter *writer, const char *name) {
+    size_t len = strlen(name);
+    if (len > UINT8_MAX) {
+        writer->overflow = 1;
+        return;
+    }
+    uint8_t *out = proto_reserve(writer, len + 2);
+    if (out) {
+        out[0] = (uint8_t)len;
+        memcpy(out + 1, name, len);
+        out[len + 1] = '\0';
+    }
+}
+
+// Records are appended field by field; a record that turns out not to fit can be
+// taken back with proto_rewind to the mark taken before it
+static inline size_t proto_mark(const ProtoWriter *writer) {
+    return writer->len;
+}
+
+static inline void proto_rewind(ProtoWriter *writer, size_t mark) {
+    writer->len = mark;
+    writer->overflow = 0;
+}
+
+static inline void proto_end_record(ProtoWriter *writer) {
+    writer->count++;
+}
+
+// Fill in the record count and length; returns the datagram size, or 0 if it overflowed
+static inline size_t proto_finish(ProtoWriter *writer) {
+    if (writer->overflow) {
+        return 0;
+    }
+    proto_store(writer->buffer + 8, writer->count, 2);
+    proto_store(writer->buffer + 10, writer->len - PROTO_HEADER_SIZE, 2);
+    return writer->len;
+}
+
+static inline void proto_set_flags(ProtoWriter *writer, uint8_t flags) {
+    writer->buffer[3] = flags;
+}
+
+// Check the header of a received datagram; returns 0 and readies reader for the records
+static inline int proto_parse(const void *data, size_t len, ProtoHeader *header, ProtoReader *reader) {
+    const uint8_t *in = data;
+    if (len < PROTO_HEADER_SIZE || in[0] != PROTO_VERSION ||
+        proto_load(in + 10, 2) != len - PROTO_HEADER_SIZE) {
+        return -1;
+    }
+    header->opcode = in[1];
+    header->status = in[2];
+    header->flags = in[3];
+    header->request_id = (uint32_t)proto_load(in + 4, 4);
+    header->count = (uint16_t)proto_load(in + 8, 2);
+    reader->pos = in + PROTO_HEADER_SIZE;
+    reader->end = in + len;
+    reader->error = 0;
+    return 0;
+}
+
+static inline uint64_t proto_get_int(ProtoReader *reader, int bytes) {
+    if (reader->error || reader->end - reader->pos < bytes) {
+        reader->error = 1;
+        return 0;
+    }
+    uint64_t value = proto_load(reader->pos, bytes);
+    reader->pos += bytes;
+    return value;
+}
+
+// Returns the name in place, or "" (with reader->error set) if it is missing or malformed
+static inline const char *proto_get_name(ProtoReader *reader) {
+    if (reader->error || reader->pos == reader->end) {
+        reader->error = 1;
+        return "";
+    }
+    size_t len = reader->pos[0];
+    const char *name = (const char *)reader->pos + 1;
+    if ((size_t)(reader->end - reader->pos) < len + 2 || name[len] != '\0' || memchr(name, '\0', len) != NULL) {
+        reader->error = 1;
+        return "";
+    }
+    reader->pos += len + 2;
+    return name;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#!/bin/bash
+# Soak test on localhost: one index server and a crowd of peers, driven through peer_client's commands.
+# Every peer syncs a directory of files of its own, the first one a large file as well, all at once.
+# Then every peer downloads the files of the next two peers while watching the catalog, and the first
+# few download the large file too, all at once again. Last, two more peers register different files
+# under one name, and only the later one may be left holding it. One file of every peer, the clashing
+# name and the peer name of the later clashing peer take the protocol's whole 255 bytes, so names are
+# carried whole through sync, register, upload and download. Passes when every command exits 0,
+# every download matches its source byte for byte, and no sanitizer reported anything in any log.
+#
+#   ./p2p_soak.sh [directory holding index_server and peer_client]
+#
+# make test runs it against the ThreadSanitizer builds in tsan/. The environment tunes it:
+#   SOAK_PEERS          peers (4)
+#   SOAK_FILES          files each peer shares (4), a few MiB each
+#   SOAK_BIG_MB         size of the large file (32); 2048 or more for a multi-GB run
+#   SOAK_BIG_DOWNLOADS  peers downloading the large file (2)
+#   SOAK_PORT           control port of the server (9400); nothing else may listen there
+#   SOAK_DIR            where it all happens (soak), wiped first and removed after a pass
+#   SOAK_TIMEOUT        seconds any one phase may take (600)
+# File contents come from a keystream seeded by the file name when openssl is around, so every run
+# moves the same bytes; otherwise from /dev/urandom.
+
+set -u
+
+BIN=$(cd "${1:-.}" && pwd) || exit 1
+PEERS=${SOAK_PEERS:-4}
+FILES=${SOAK_FILES:-4}
+BIG_MB=${SOAK_BIG_MB:-32}
+BIG_DOWNLOADS=${SOAK_BIG_DOWNLOADS:-2}
+PORT=${SOAK_PORT:-9400}
+DIR=${SOAK_DIR:-soak}
+TIMEOUT=${SOAK_TIMEOUT:-600}
+NODE=127.0.0.1:$PORT
+
+for program in index_server peer_client; do
+    if [ ! -x "$BIN/$program" ]; then
+        echo "No $program in $BIN; run make first" >&2
+        exit 1
+    fi
+done
+if [ "$BIG_DOWNLOADS" -gt "$PEERS" ]; then
+    BIG_DOWNLOADS=$PEERS
+fi
+
+rm -rf "$DIR"
+mkdir -p "$DIR/server" || exit 1
+DIR=$(cd "$DIR" && pwd)
+trap 'kill $(jobs -p) 2>/dev/null' EXIT
+
+failures=0
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# fill <file> <bytes>
+fill() {
+    if command -v openssl >/dev/null; then
+        head -c "$2" /dev/zero | openssl enc -aes-128-ctr -nosalt -pass "pass:$(basename "$1")" -pbkdf2 >"$1"
+    else
+        head -c "$2" /dev/urandom >"$1"
+    fi
+}
+
+# Wait until every process listed has written a line matching pattern to its log, or one of them exited
+# wait_for <pattern> <log>...
+wait_for() {
+    local pattern=$1
+    shift
+    local deadline=$((SECONDS + TIMEOUT))
+    for log in "$@"; do
+        until grep -q "$pattern" "$log" 2>/dev/null; do
+            if [ -e "${log%.log}.status" ] || [ $SECONDS -ge $deadline ]; then
+                fail "$log never showed '$pattern'"
+                return 1
+            fi
+            sleep 0.5
+        done
+    done
+}
+
+# What makes <prefix>-<tag>.bin exactly the protocol's 255 bytes long
+# long_tag <prefix>
+long_tag() {
+    printf 'x%.0s' $(seq 1 $((255 - ${#1} - 5)))
+}
+
+# The files: peer<i>-<j>.bin of a few MiB, never a whole number of chunks, and per peer one empty file
+# and one whose name is 255 bytes, long enough to fill a whole chunk window
+echo "Writing $((PEERS * (FILES + 1))) file(s) and a $BIG_MB MiB one"
+for i in $(seq 1 "$PEERS"); do
+    mkdir -p "$DIR/peer$i/share" "$DIR/peer$i/get"
+    for j in $(seq 1 "$FILES"); do
+        fill "$DIR/peer$i/share/peer$i-$j.bin" $(((i * 7 + j * 13) % 9 * 1048576 + i * 1000 + j))
+    done
+    : >"$DIR/peer$i/share/peer$i-empty.bin"
+    fill "$DIR/peer$i/share/peer$i-$(long_tag "peer$i").bin" $((5 * 1048576 + i))
+done
+fill "$DIR/peer1/share/big.bin" $((BIG_MB * 1048576))
+
+"$BIN/index_server" -p "$PORT" -a 0 -d "$DIR/server" >"$DIR/server.log" 2>&1 &
+server=$!
+if ! wait_for "is running" "$DIR/server.log"; then
+    cat "$DIR/server.log"
+    exit 1
+fi
+
+# Seeders sync at once and keep serving until the end of their input, which the script holds open
+echo "Syncing $PEERS peer(s) at once"
+mkfifo "$DIR/hold"
+exec 9<>"$DIR/hold"
+for i in $(seq 1 "$PEERS"); do
+    (
+        exec 9>&- # Only the script keeps the seeders going
+        cd "$DIR/peer$i" || exit 1
+        "$BIN/peer_client" -c "$NODE" -n "peer$i" sync share wait 0 <"$DIR/hold" >seed.log 2>&1
+        echo $? >seed.status
+    ) &
+done
+seed_logs=()
+for i in $(seq 1 "$PEERS"); do
+    seed_logs+=("$DIR/peer$i/seed.log")
+done
+wait_for "^Synced" "${seed_logs[@]}"
+
+# Downloaders fetch the files of the next two peers, the first few the large file as well, all at once
+echo "Downloading from $PEERS peer(s) at once"
+pids=()
+for i in $(seq 1 "$PEERS"); do
+    commands=(watch prefix peer find prefix peer)
+    for k in 1 2; do
+        from=$(((i + k - 1) % PEERS + 1))
+        if [ "$from" -eq "$i" ]; then
+            continue
+        fi
+        commands+=(search "peer$from-1.bin")
+        for j in $(seq 1 "$FILES") empty "$(long_tag "peer$from")"; do
+            commands+=(download "peer$from-$j.bin")
+        done
+    done
+    if [ "$i" -le "$BIG_DOWNLOADS" ]; then
+        commands+=(download big.bin)
+    fi
+    commands+=(list)
+    (
+        exec 9>&-
+        cd "$DIR/peer$i/get" || exit 1
+        timeout "$TIMEOUT" "$BIN/peer_client" -c "$NODE" -n "get$i" "${commands[@]}" </dev/null >get.log 2>&1
+        echo $? >get.status
+    ) &
+    pids+=($!)
+done
+wait "${pids[@]}"
+
+echo "Checking"
+for i in $(seq 1 "$PEERS"); do
+    status=$(cat "$DIR/peer$i/get/get.status" 2>/dev/null)
+    if [ "$status" != 0 ]; then
+        fail "downloads of peer $i exited with '$status'; see $DIR/peer$i/get/get.log"
+    fi
+    for k in 1 2; do
+        from=$(((i + k - 1) % PEERS + 1))
+        if [ "$from" -eq "$i" ]; then
+            continue
+        fi
+        for j in $(seq 1 "$FILES") empty "$(long_tag "peer$from")"; do
+            name=peer$from-$j.bin
+            cmp -s "$DIR/peer$from/share/$name" "$DIR/peer$i/get/$name" || fail "peer $i got $name wrong"
+        done
+    done
+    if [ "$i" -le "$BIG_DOWNLOADS" ]; then
+        cmp -s "$DIR/peer1/share/big.bin" "$DIR/peer$i/get/big.bin" || fail "peer $i got big.bin wrong"
+    fi
+done
+
+# A second file registered under a taken name replaces the first, whose holder must stop being listed
+echo "Registering one name with two different files"
+CLASH=clash-$(long_tag clash).bin
+mkdir -p "$DIR/clash"
+for k in 1 2; do
+    mkdir -p "$DIR/clash$k"
+    fill "$DIR/clash$k/$k.bin" $((k * 1048576 + k))
+    peer=clash$k
+    if [ "$k" -eq 2 ]; then
+        peer=$(printf 'p%.0s' $(seq 1 255))
+    fi
+    (
+        exec 9>&-
+        cd "$DIR/clash$k" || exit 1
+        "$BIN/peer_client" -c "$NODE" -n "$peer" register "$CLASH" "$k.bin" wait 0 <"$DIR/hold" >seed.log 2>&1
+        echo $? >seed.status
+    ) &
+    wait_for "^Registered" "$DIR/clash$k/seed.log"
+done
+(
+    exec 9>&-
+    cd "$DIR/clash" || exit 1
+    timeout "$TIMEOUT" "$BIN/peer_client" -c "$NODE" -n clash search "$CLASH" download "$CLASH" </dev/null \
+        >get.log 2>&1
+    echo $? >get.status
+)
+status=$(cat "$DIR/clash/get.status" 2>/dev/null)
+if [ "$status" != 0 ]; then
+    fail "download of the clashing name exited with '$status'; see $DIR/clash/get.log"
+fi
+holders=$(grep -c "^  [0-9]" "$DIR/clash/get.log")
+if [ "$holders" != 1 ]; then
+    fail "the clashing name is listed at $holders holder(s) instead of 1; see $DIR/clash/get.log"
+fi
+cmp -s "$DIR/clash2/2.bin" "$DIR/clash/$CLASH" || fail "the clashing name is not the file registered last"
+
+# Let the seeders go, then the server
+exec 9>&-
+deadline=$((SECONDS + TIMEOUT))
+for seeder in $(seq -f "peer%g" 1 "$PEERS") clash1 clash2; do
+    until [ -e "$DIR/$seeder/seed.status" ] || [ $SECONDS -ge $deadline ]; do
+        sleep 0.5
+    done
+    status=$(cat "$DIR/$seeder/seed.status" 2>/dev/null)
+    if [ "$status" != 0 ]; then
+        fail "seeder $seeder exited with '$status'; see $DIR/$seeder/seed.log"
+    fi
+done
+kill "$server" 2>/dev/null
+wait "$server" 2>/dev/null
+
+for log in "$DIR/server.log" "$DIR"/*/seed.log "$DIR"/peer*/get/get.log "$DIR/clash/get.log"; do
+    if grep -q "WARNING: ThreadSanitizer\|ERROR: AddressSanitizer\|runtime error" "$log"; then
+        fail "sanitizer report in $log"
+    fi
+done
+
+if [ "$failures" -gt 0 ]; then
+    echo "$failures failure(s); everything is left in $DIR"
+    exit 1
+fi
+echo "PASS: $PEERS peer(s), $((PEERS * (FILES + 2))) file(s) and $BIG_MB MiB moved without a difference"
+rm -rf "$DIR"
@@ -1,281 +1,2892 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-
-#define SERVER_PORT 8080
-#define BUFFER_SIZE 256
-#define MAX_CONTENT_NAME 20
-#define MAX_PEER_NAME 20
-
-void register_content(const char *peer_name, const char *content_name, int sockfd, struct sockaddr_in *server_addr);
-void deregister_content(const char *peer_name, int sockfd, struct sockaddr_in *server_addr);
-void search_content(const char *content_name, int sockfd, struct sockaddr_in *server_addr);
-void send_download_request(const char *content_name, const char *server_ip, int server_port);
-void list_content(int sockfd, struct sockaddr_in *server_addr);
-int send_to_server(int sockfd, struct sockaddr_in *server_addr, const char *message);
-
-int main() {
-    int sockfd;
-    struct sockaddr_in server_addr;
-    char peer_name[MAX_PEER_NAME + 1];
-    char command[2];
-    char content_name[MAX_CONTENT_NAME + 1];
-
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Prepare server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1"); // Change to server IP if needed
-    server_addr.sin_port = htons(SERVER_PORT);
-
-    // Get peer name
-    printf("Enter your peer name (max %d characters): ", MAX_PEER_NAME);
-    fgets(peer_name, sizeof(peer_name), stdin);
-    peer_name[strcspn(peer_name, "\n")] = 0; // Remove newline character
-
-    while (1) {
-        printf("\n--- Peer-to-Peer Menu ---\n");
-        printf("R: Register content\n");
-        printf("D: Download content\n");
-        printf("S: Search for content\n");
-        printf("L: List available content\n");
-        printf("Q: Quit (and deregister)\n");
-        printf("Enter command: ");
-        fgets(command, sizeof(command), stdin);
-        command[strcspn(command, "\n")] = 0; // Remove newline character
-
-        // Wait for the user to press Enter
-        printf("Press Enter to continue...\n");
-        getchar(); // Wait for the user to press Enter
-
-        switch (command[0]) {
-            case 'R':
-                printf("Enter content name to register (max %d characters): ", MAX_CONTENT_NAME);
-                fgets(content_name, sizeof(content_name), stdin);
-                content_name[strcspn(content_name, "\n")] = 0; // Remove newline character
-
-                // Check if content_name is empty
-                if (strlen(content_name) == 0) {
-                    printf("Content name cannot be empty. Please try again.\n");
-                    break;
-                }
-
-                register_content(peer_name, content_name, sockfd, &server_addr);
-                break;
-            case 'D':
-                printf("Enter content name to download (max %d characters): ", MAX_CONTENT_NAME);
-                fgets(content_name, sizeof(content_name), stdin);
-                content_name[strcspn(content_name, "\n")] = 0; // Remove newline character
-                send_download_request(content_name, "127.0.0.1", SERVER_PORT); // Replace with actual server IP and port
-                break;
-            case 'S':
-                printf("Enter content name to search (max %d characters): ", MAX_CONTENT_NAME);
-                fgets(content_name, sizeof(content_name), stdin);
-                content_name[strcspn(content_name, "\n")] = 0; // Remove newline character
-                search_content(content_name, sockfd, &server_addr);
-                break;
-            case 'L':
-                list_content(sockfd, &server_addr);
-                break;
-            case 'Q':
-                printf("Deregistering content and exiting...\n");
-                deregister_content(peer_name, sockfd, &server_addr); // Deregister without specific content
-                close(sockfd);
-                return 0;
-            default:
-                printf("Invalid command. Please try again.\n");
-                break;
-        }
-    }
-
-    close(sockfd);
-    return 0;
-}
-
-int send_to_server(int sockfd, struct sockaddr_in *server_addr, const char *message) {
-    if (sendto(sockfd, message, strlen(message), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) <  0) {
-        perror("Failed to send message");
-        return -1;
-    }
-    return 0;
-}
-
-void register_content(const char *peer_name, const char *content_name, int sockfd, struct sockaddr_in *server_addr) {
-    char buffer[BUFFER_SIZE];
-    char file_path[BUFFER_SIZE];
-
-    // Prompt for the file path
-    printf("Enter the file path to register for content '%s': ", content_name);
-    fgets(file_path, sizeof(file_path), stdin);
-    file_path[strcspn(file_path, "\n")] = 0; // Remove newline character
-
-    // Open the file
-    FILE *file = fopen(file_path, "rb");
-    if (!file) {
-        perror("Failed to open file");
-        return;
-    }
-
-    // Send the registration request
-    sprintf(buffer, "R %s %s", peer_name, content_name);
-    if (send_to_server(sockfd, server_addr, buffer) != 0) {
-        fclose(file);
-        return;
-    }
-
-    // Read the file and send its contents to the server
-    while (1) {
-        size_t bytes_read = fread(buffer, 1, BUFFER_SIZE, file);
-        if (bytes_read > 0) {
-            if (send_to_server(sockfd, server_addr, buffer) < 0) {
-                perror("Failed to send file data to server");
-                break;
-            }
-        }
-        if (bytes_read < BUFFER_SIZE) {
-            // End of file or error
-            if (feof(file)) {
-                printf("End of file reached.\n");
-                break;
-            }
-            if (ferror(file)) {
-                perror("Error reading file");
-                break;
-            }
-        }
-    }
-
-    fclose(file);
-    printf("Registered content '%s' from peer '%s'\n", content_name, peer_name);
-}
-
-void deregister_content(const char *peer_name, int sockfd, struct sockaddr_in *server_addr) {
-    char buffer[BUFFER_SIZE];
-    sprintf(buffer, "Q %s", peer_name); // Use 'Q' for deregistration
-    if (send_to_server(sockfd, server_addr, buffer) == 0) {
-        printf("Deregistered content from peer '%s'\n", peer_name);
-    }
-}
-
-void search_content(const char *content_name, int sockfd, struct sockaddr_in *server_addr) {
-    char buffer[BUFFER_SIZE];
-    sprintf(buffer, "S %s", content_name);
-    if (send_to_server(sockfd, server_addr, buffer) < 0) {
-        return;
-    }
-
-    // Receive response from index server
-    socklen_t addr_len = sizeof(*server_addr);
-    int n = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)server_addr, &addr_len);
-    if (n < 0) {
-        perror("Failed to receive search response");
-        return;
-    }
-    buffer[n] = '\0';
-    
-    // Debug print to see the full response
-    printf("Received from server: %s\n", buffer);
-    
-    // If content is found, initiate download
-    if (strncmp(buffer, "Content", 7) == 0) { // Check if response starts with "Content"
-        char server_ip[INET_ADDRSTRLEN];
-        int server_port;
-
-        // Parse the server IP and port from the response
-        if (sscanf(buffer, "Content '%*s' found at %s:%d", server_ip, &server_port) == 2) {
-            send_download_request(content_name, server_ip, server_port);
-        } else {
-            printf("Invalid response format from server.\n");
-        }
-    } else {
-        printf("Search response: %s\n", buffer);
-    }
-}
-
-void send_download_request(const char *content_name, const char *server_ip, int server_port) {
-    int tcp_sock;
-    struct sockaddr_in content_server_addr;
-    char buffer[BUFFER_SIZE];
-
-    // Create TCP socket for downloading content
-    if ((tcp_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("TCP socket creation failed");
-        return;
-    }
-
-    // Prepare content server address
-    memset(&content_server_addr, 0, sizeof(content_server_addr));
-    content_server_addr.sin_family = AF_INET;
-    content_server_addr.sin_addr.s_addr = inet_addr(server_ip);
-    content_server_addr.sin_port = htons(server_port);
-
-    // Connect to the content server
-    if (connect(tcp_sock, (struct sockaddr *)&content_server_addr, sizeof(content_server_addr)) < 0) {
-        perror("Connection to content server failed");
-        close(tcp_sock);
-        return;
-    }
-
-    // Send download request
-    sprintf(buffer, "D %s", content_name);
-    if (send(tcp_sock, buffer, strlen(buffer), 0) < 0) {
-        perror("Failed to send download request");
-        close(tcp_sock);
-        return;
-    }
-    printf("Download request sent for content '%s'\n", content_name);
-
-    // Receive content data and save to file
-    FILE *file = fopen(content_name, "wb");
-    if (!file) {
-        perror("File creation failed");
-        close(tcp_sock);
-        return;
-    }
-
-    while (1) {
-        int bytes_received = recv(tcp_sock, buffer, BUFFER_SIZE, 0);
-        if (bytes_received < 0) {
-            perror("Error receiving data");
-            break; // Connection closed or error
-        }
-        if (bytes_received == 0) {
-            break; // Connection closed
-        }
-        fwrite(buffer, 1, bytes_received, file);
-    }
-
-    fclose(file);
-    close(tcp_sock);
-    printf("Download completed for content '%s'\n", content_name);
-}
-
-void list_content(int sockfd, struct sockaddr_in *server_addr) {
-    char buffer[BUFFER_SIZE];
-    sprintf(buffer, "L"); // Send 'L' to request the list of content
-    if (send_to_server(sockfd, server_addr, buffer) < 0) {
-        return;
-    }
-
-    // Receive response from the index server
-    socklen_t addr_len = sizeof(*server_addr);
-    int n = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)server_addr, &addr_len);
-    if (n <  0) {
-        perror("Failed to receive content list");
-        return;
-    }
-    buffer[n] = '\0';
-
-    if (n > 0) {
-        printf("Available content:\n%s\n", buffer);
-    } else {
-        printf("Failed to retrieve content list.\n");
-    }
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "p2p_cluster.h"
+#include "p2p_hash.h"
+#include "p2p_lz4.h"
+#include "p2p_protocol.h"
+
+#define SERVER_NODES "127.0.0.1:8080" // Index nodes used unless -c lists others
+#define BUFFER_SIZE 256
+#define MAX_CONTENT_NAME UINT8_MAX // As long as a name can be on the wire
+#define MAX_PEER_NAME UINT8_MAX
+#define UPLOAD_BUFFER_SIZE (1 << 20) // Socket send buffer for uploads
+#define SYNC_BATCH_BYTES (256LL << 20) // File bytes one sync request registers (or one file), so no token expires
+#define UPLOAD_HEADER_SIZE 16 // Token (8 bytes), codec (1 byte) and file size (7 bytes), big-endian
+#define UPLOAD_LZ4 1 // Codec of an upload sent as one frame per chunk, each LZ4-compressed or not
+#define UPLOAD_FRAME_SIZE 4 // Length of the frame's bytes (big-endian), with UPLOAD_FRAME_PACKED if compressed
+#define UPLOAD_FRAME_PACKED 0x80000000U
+#define DOWNLOAD_BUFFER_SIZE (1 << 20) // Bytes read per recv call while downloading
+#define CONTENT_HEADER_SIZE 9 // Status (1 byte, 0 = found) and length (8 bytes, big-endian)
+#define CONTENT_LZ4 2 // Status of a chunk sent as one LZ4 block; the length is then the compressed one
+#define CHUNK_SIZE (1 << 20) // Content is hashed and fetched in pieces of this size
+#define CHUNK_WINDOW 4 // Chunk requests kept in flight per source
+#define CHUNK_REQUEST_MAX (2 * 20 + UINT8_MAX + 6) // Longest request line: "R <offset> <length> <name>\n"
+#define MAX_SOURCES 16 // Sources one download uses at most
+#define SOURCE_RETRIES 3 // Reconnections to a source whose connection failed before giving up on it
+#define MANIFEST_HEADER_SIZE 17 // Status (1), size (8), chunk count (4), source count (4)
+#define MANIFEST_SOURCE_SIZE 10 // Address (4), port (2), chunk map length (4), then the map
+#define MANIFEST_REQUEST_MAX (2 + UINT8_MAX + 2) // "M <name>\n" and its terminator
+#define MANIFEST_TIMEOUT 30 // Seconds the content server may leave a manifest request unanswered
+#define CLIENT_WINDOW 256 // Requests in flight at once (power of two)
+#define CLIENT_RECV_BATCH 32 // Replies taken per recvmmsg call
+#define CLIENT_INITIAL_RTO 200000 // Microseconds before the first retransmission, until RTTs are measured
+#define CLIENT_MIN_RTO 200000 // Bounds of the retransmission timeout (microseconds); a busy node may need the floor
+#define CLIENT_MAX_RTO 2000000
+#define CLIENT_MAX_ATTEMPTS 6 // Transmissions of a request before giving up on it
+#define FIND_PAGE 20 // Names shown per page of a find
+#define HEARTBEAT_INTERVAL 10 // Seconds between heartbeats until the server tells its lease
+#define WATCH_MAX 8 // Watches of catalog changes kept at once
+#define WATCH_RETRY 2000000 // Microseconds before subscribing again to a node that did not answer
+#define SEED_EVENTS 64 // Events the seeding loop takes per epoll_wait
+#define SEED_REQUEST_SIZE 640 // Buffered request lines; names from other peers may be up to 255 bytes
+#define SEED_TURN_REQUESTS 16 // Pipelined requests one connection may complete before yielding
+#define SEED_TURN_BYTES (4 << 20) // Bytes one connection may send before yielding to the others
+#define SEED_SNDBUF (4 << 20) // Socket send buffer for the peers downloading from this one
+
+// Called with every reply datagram of a request, or with NULL reply and reader once it was given up on
+typedef void (*ReplyHandler)(void *context, const ProtoHeader *reply, ProtoReader *reader);
+
+// Called with every notification a node pushes, which answers no request
+typedef void (*NotifyHandler)(void *context, const ProtoHeader *notice, ProtoReader *reader);
+
+// A request waiting for its reply
+typedef struct {
+    uint32_t id; // 0 marks a free slot
+    uint16_t len;
+    uint8_t node; // Index node it goes to
+    uint8_t attempts; // Transmissions so far, 0 again once a node turned the request away
+    uint64_t sent_at; // Time of the latest transmission (microseconds)
+    uint64_t deadline; // When to retransmit next
+    ReplyHandler handler;
+    void *context;
+    uint8_t datagram[PROTO_MAX_DATAGRAM]; // Kept for retransmission
+} Outstanding;
+
+// Asynchronous connection to the index nodes: many requests in flight, each to the node owning its
+// names, matched to replies by id, with retransmission timeouts adapted to the measured round-trip time
+typedef struct {
+    int sockfd;
+    int epoll_fd;
+    const Cluster *cluster;
+    uint32_t next_id;
+    int in_flight;
+    Outstanding slots[CLIENT_WINDOW]; // Indexed by the low bits of the request id
+    uint64_t srtt; // Smoothed round-trip time (microseconds), 0 until the first sample
+    uint64_t rttvar;
+    uint64_t rto; // Current retransmission timeout
+    uint64_t sent;
+    uint64_t retransmits;
+    uint64_t timeouts;
+    uint64_t turned_away; // Requests a node was too busy for, and that were sent again when it said
+    NotifyHandler notify; // Takes OP_NOTIFY datagrams, which are dropped while it is NULL
+    void *notify_context;
+} Client;
+
+// What the heartbeat thread needs to keep a peer's lease alive
+typedef struct {
+    const char *peer_name;
+    const Cluster *cluster;
+} Heartbeat;
+
+// Where a watch stands with one index node
+typedef struct {
+    struct Watch *watch;
+    int node;
+    uint32_t id; // Subscription the node notifies under
+    uint64_t feed; // Feed of the node, 0 until it accepted the subscription
+    uint64_t since; // Last change of the feed told of
+    uint64_t asked; // since as sent with the latest subscription
+    uint64_t renew_at; // Microseconds on the monotonic clock
+    int waiting; // A subscription is on its way
+    int refused; // The node will not take it; it is not asked again
+} WatchLink;
+
+// Changes of a name, prefix or peer the index tells this peer of as they happen
+typedef struct Watch {
+    uint8_t kind; // SUBSCRIBE_*
+    char pattern[MAX_CONTENT_NAME + 1];
+    WatchLink links[CLUSTER_MAX_NODES]; // By node; a name is only watched on the node that lists it
+} Watch;
+
+// Every watch, kept up by a thread of its own on a connection of its own, as notifications go to the
+// address that subscribed
+typedef struct {
+    pthread_mutex_t lock; // Guards count and stopping; the menu adds watches while the thread keeps them
+    Watch watches[WATCH_MAX]; // A watch is filled in before count takes it in
+    int count;
+    int stopping;
+    int kept; // Watches the thread has taken in (thread only)
+    int wake_fd; // Poked by the menu so that the thread sees a change at once
+    pthread_t thread;
+    const Cluster *cluster;
+} Watcher;
+
+// A file this peer serves to others: one it registered, or one it downloads or downloaded
+typedef struct Seed {
+    char *name;
+    char *path;
+    uint64_t size;
+    uint8_t *chunks; // Chunks verified so far of a download, NULL once the file is whole
+    uint32_t missing; // Chunks not verified yet
+    int compressible; // Whether chunks are worth sending LZ4-compressed, -1 until the first one is tried
+    struct Seed *next; // Next in its hash bucket
+} Seed;
+
+// The seeding service: a listener, served by its own thread, and the files it serves by name
+typedef struct {
+    pthread_mutex_t lock; // Guards the table; the menu changes it while the seeding thread reads it
+    Seed **buckets;
+    size_t bucket_count; // Always a power of two
+    size_t count;
+    int listen_fd;
+    int port; // Seed port the index is told, 0 while nothing is served
+} Seeder;
+
+enum { SEED_READING, SEED_SENDING };
+
+// A connection from a peer downloading from this one; requests on it are answered in order
+typedef struct {
+    int sock;
+    int state;
+    uint32_t events; // What epoll currently watches for
+    char request[SEED_REQUEST_SIZE];
+    size_t request_len;
+    unsigned char header[CONTENT_HEADER_SIZE];
+    size_t header_sent;
+    int fd; // File the response streams from, -1 if none
+    off_t offset; // Next byte of it (or of the LZ4 block) to send
+    off_t end;
+    int lz4; // The response is the LZ4 block in packed rather than bytes of the file
+    unsigned char *plain; // Chunk read for compression, and its compressed form; made on first use
+    unsigned char *packed;
+} SeedConnection;
+
+static Seeder seeder = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, -1, 0};
+static Watcher watcher = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake_fd = -1};
+
+int register_content(const char *peer_name, const char *content_name, const char *file_path, Client *client);
+int deregister_content(const char *peer_name, Client *client);
+int search_content(const char *content_name, Client *client);
+int download_content(const char *peer_name, const char *content_name, Client *client);
+int list_content(const char *peer_name, Client *client);
+void batch_search(Client *client, FILE *input, int single);
+int find_names(const char *pattern, uint8_t mode, int ask, Client *client);
+int run_commands(const char *peer_name, char **args, int count, Client *client);
+int read_line(char *buffer, size_t size);
+int client_init(Client *client, const Cluster *cluster);
+void client_close(Client *client);
+void request_begin(ProtoWriter *writer, uint8_t *buffer, uint8_t opcode);
+uint32_t client_submit(Client *client, int node, ProtoWriter *request, ReplyHandler handler, void *context);
+void client_send(Client *client, int node, ProtoWriter *request);
+void client_poll(Client *client);
+void client_drain(Client *client);
+int client_call(Client *client, int node, ProtoWriter *request, uint8_t *buffer, ProtoHeader *reply,
+                ProtoReader *reader);
+void print_refusal(const char *what, ProtoReader *reader);
+int upload_file(int file_fd, off_t size, uint64_t token, struct in_addr server_ip, int upload_port);
+int upload_connect(struct in_addr server_ip, int upload_port);
+int upload_send(int tcp_sock, int file_fd, off_t size, uint64_t token);
+int sync_directory(const char *peer_name, const char *dir_path, Client *client);
+char **fetch_registrations(const char *peer_name, Client *client, int *count);
+void *heartbeat_thread(void *arg);
+int watch_add(const Cluster *cluster, uint8_t kind, const char *pattern);
+void watch_stop(void);
+void *watch_thread(void *arg);
+int seeder_start(int port);
+void seed_add(const char *name, const char *path, uint64_t size, int partial);
+void seed_mark(const char *name, uint32_t chunk);
+void seed_remove(const char *name);
+void put_seed(ProtoWriter *request);
+void *seed_thread(void *arg);
+
+int main(int argc, char *argv[]) {
+    Client *client = malloc(sizeof(Client));
+    char peer_name[MAX_PEER_NAME + 1];
+    char command[2];
+    char content_name[MAX_CONTENT_NAME + 1];
+    char dir_path[BUFFER_SIZE];
+    char file_path[BUFFER_SIZE];
+    int batch = 0;
+    int single = 0;
+    int seed_port = 0;
+    int option;
+    const char *nodes = SERVER_NODES;
+    int replicas = CLUSTER_DEFAULT_REPLICAS;
+    static Cluster cluster;
+
+    signal(SIGPIPE, SIG_IGN); // Uploads and seeding use sendfile, which cannot be told MSG_NOSIGNAL
+
+    // -b runs searches for the names in a file (or stdin) instead of the menu; -s sends them one per request.
+    // Commands after the options run instead of the menu too, as the peer -n names (see run_commands).
+    // -c and -r must match the index nodes' own; a router is given as the only node. -p is the port other
+    // peers download this one's content from (any free one by default).
+    peer_name[0] = '\0';
+    while ((option = getopt(argc, argv, "bsc:r:p:n:")) != -1) {
+        if (option == 'n' && strlen(optarg) <= MAX_PEER_NAME) {
+            strcpy(peer_name, optarg);
+        } else if (option == 'b') {
+            batch = 1;
+        } else if (option == 's') {
+            single = 1;
+        } else if (option == 'c') {
+            nodes = optarg;
+        } else if (option == 'r') {
+            replicas = atoi(optarg);
+        } else if (option == 'p') {
+            seed_port = atoi(optarg);
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [-c address:port,... [-r replicas]] [-p seed port] "
+                    "[-b [-s] [file] | -n peer [command]...]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!batch && optind < argc && !peer_name[0]) {
+        fprintf(stderr, "Commands need a peer name of at most %d characters (-n)\n", MAX_PEER_NAME);
+        exit(EXIT_FAILURE);
+    }
+    if (seed_port < 0 || seed_port > 65535) {
+        fprintf(stderr, "Invalid seed port %d\n", seed_port);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cluster_init(&cluster, nodes, replicas) != 0) {
+        fprintf(stderr, "Invalid node list '%s'\n", nodes);
+        exit(EXIT_FAILURE);
+    }
+    srand((unsigned)time(NULL));
+    if (!client || client_init(client, &cluster) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (batch) {
+        FILE *input = optind < argc ? fopen(argv[optind], "r") : stdin;
+        if (!input) {
+            perror("Failed to open query file");
+            exit(EXIT_FAILURE);
+        }
+        batch_search(client, input, single);
+        client_close(client);
+        return 0;
+    }
+
+    // Get peer name
+    if (!peer_name[0]) {
+        printf("Enter your peer name (max %d characters): ", MAX_PEER_NAME);
+        if (read_line(peer_name, sizeof(peer_name)) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Other peers download what this one holds straight from it; the index only tells them where
+    if (seeder_start(seed_port) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    printf("Seeding on port %d\n", seeder.port);
+
+    // The server drops peers it stops hearing from, so check in while the menu waits on the user
+    Heartbeat heartbeat = {peer_name, &cluster};
+    pthread_t heartbeat_sender;
+    if (pthread_create(&heartbeat_sender, NULL, heartbeat_thread, &heartbeat) != 0) {
+        perror("Failed to start heartbeat thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(heartbeat_sender);
+
+    if (optind < argc) {
+        int status = run_commands(peer_name, argv + optind, argc - optind, client);
+        watch_stop();
+        if (deregister_content(peer_name, client) != 0) {
+            status = EXIT_FAILURE;
+        }
+        client_close(client);
+        return status;
+    }
+
+    while (1) {
+        printf("\n--- Peer-to-Peer Menu ---\n");
+        printf("R: Register content\n");
+        printf("B: Sync a shared directory (register its files, drop the rest)\n");
+        printf("D: Download content\n");
+        printf("S: Search for content\n");
+        printf("F: Search every name listed in a file\n");
+        printf("N: Find content by prefix, substring or similar name\n");
+        printf("L: List available content\n");
+        printf("W: Watch a name, prefix or peer for changes\n");
+        printf("Q: Quit (and deregister)\n");
+        printf("Enter command: ");
+        if (!fgets(command, sizeof(command), stdin)) {
+            strcpy(command, "Q"); // End of input
+        }
+        command[strcspn(command, "\n")] = 0; // Remove newline character
+
+        // Wait for the user to press Enter
+        printf("Press Enter to continue...\n");
+        getchar(); // Wait for the user to press Enter
+
+        switch (command[0]) {
+            case 'R':
+                printf("Enter content name to register (max %d characters): ", MAX_CONTENT_NAME);
+                if (read_line(content_name, sizeof(content_name)) != 0) {
+                    break;
+                }
+
+                // Check if content_name is empty
+                if (strlen(content_name) == 0) {
+                    printf("Content name cannot be empty. Please try again.\n");
+                    break;
+                }
+
+                printf("Enter the file path to register for content '%s': ", content_name);
+                if (read_line(file_path, sizeof(file_path)) != 0) {
+                    break;
+                }
+                register_content(peer_name, content_name, file_path, client);
+                break;
+            case 'B':
+                printf("Enter the directory to share: ");
+                if (read_line(dir_path, sizeof(dir_path)) != 0) {
+                    break;
+                }
+                sync_directory(peer_name, dir_path, client);
+                break;
+            case 'D':
+                printf("Enter content name to download (max %d characters): ", MAX_CONTENT_NAME);
+                if (read_line(content_name, sizeof(content_name)) != 0) {
+                    break;
+                }
+                download_content(peer_name, content_name, client);
+                break;
+            case 'S':
+                printf("Enter content name to search (max %d characters): ", MAX_CONTENT_NAME);
+                if (read_line(content_name, sizeof(content_name)) != 0) {
+                    break;
+                }
+                if (search_content(content_name, client) == 0) {
+                    download_content(peer_name, content_name, client); // Chunk by chunk from its sources
+                }
+                break;
+            case 'F': {
+                printf("Enter the file listing names to search: ");
+                if (read_line(dir_path, sizeof(dir_path)) != 0) {
+                    break;
+                }
+                FILE *input = fopen(dir_path, "r");
+                if (!input) {
+                    perror("Failed to open query file");
+                    break;
+                }
+                batch_search(client, input, 0);
+                fclose(input);
+                break;
+            }
+            case 'N': {
+                printf("Match by (P)refix, (S)ubstring or (F)uzzy similarity? ");
+                int mode = toupper(getchar());
+                while (mode != '\n' && mode != EOF && getchar() != '\n') {
+                    // Skip the rest of the line
+                }
+                printf("Enter the pattern (max %d characters): ", MAX_CONTENT_NAME);
+                if (read_line(content_name, sizeof(content_name)) != 0) {
+                    break;
+                }
+                find_names(content_name, mode == 'S' ? FIND_SUBSTRING : mode == 'F' ? FIND_FUZZY : FIND_PREFIX, 1,
+                           client);
+                break;
+            }
+            case 'L':
+                list_content(peer_name, client);
+                break;
+            case 'W': {
+                printf("Watch a (N)ame, a (P)refix or a pe(E)r? ");
+                int kind = toupper(getchar());
+                while (kind != '\n' && kind != EOF && getchar() != '\n') {
+                    // Skip the rest of the line
+                }
+                printf("Enter the name, prefix (empty for every name) or peer (max %d characters): ",
+                       MAX_CONTENT_NAME);
+                if (read_line(content_name, sizeof(content_name)) != 0) {
+                    break;
+                }
+                if (watch_add(&cluster, kind == 'P' ? SUBSCRIBE_PREFIX : kind == 'E' ? SUBSCRIBE_PEER : SUBSCRIBE_NAME,
+                              content_name) == 0) {
+                    printf("Watching '%s'; changes are shown as they happen\n", content_name);
+                }
+                break;
+            }
+            case 'Q':
+                watch_stop();
+                printf("Deregistering content and exiting...\n");
+                deregister_content(peer_name, client); // Deregister without specific content
+                client_close(client);
+                return 0;
+            default:
+                printf("Invalid command. Please try again.\n");
+                break;
+        }
+    }
+
+    client_close(client);
+    return 0;
+}
+
+// Read one line of the menu's input without its newline. A line too long for the buffer is refused rather
+// than cut short, and read to its end so that its rest is not taken for the answer to the next prompt.
+int read_line(char *buffer, size_t size) {
+    if (!fgets(buffer, (int)size, stdin)) {
+        buffer[0] = '\0';
+        return -1;
+    }
+    size_t len = strcspn(buffer, "\n");
+    if (buffer[len] == '\n' || len < size - 1) {
+        buffer[len] = '\0';
+        return 0;
+    }
+    int c = getchar();
+    if (c == '\n' || c == EOF) {
+        return 0; // It just fit
+    }
+    while (c != '\n' && c != EOF) {
+        c = getchar();
+    }
+    buffer[0] = '\0';
+    printf("That is longer than %zu characters. Please try again.\n", size - 1);
+    return -1;
+}
+
+// Arguments a command of run_commands takes, -1 if there is no such command
+static int command_arguments(const char *command) {
+    if (!strcmp(command, "list")) {
+        return 0;
+    }
+    if (!strcmp(command, "sync") || !strcmp(command, "search") || !strcmp(command, "download") ||
+        !strcmp(command, "wait")) {
+        return 1;
+    }
+    if (!strcmp(command, "register") || !strcmp(command, "find") || !strcmp(command, "watch")) {
+        return 2;
+    }
+    return -1;
+}
+
+// Run the commands given after the options one after the other, like their menu entries but asking
+// nothing, so that scripts can drive a peer:
+//   register <name> <file>   sync <dir>   search <name>   download <name>   list
+//   find prefix|substring|fuzzy <pattern>   watch name|prefix|peer <pattern>   wait <seconds>
+// Search only prints the holders. Wait keeps the peer seeding, heartbeating and watching for that long,
+// or with 0 until its input ends. Stops at the first command that fails; returns the exit status.
+int run_commands(const char *peer_name, char **args, int count, Client *client) {
+    // A mistyped command fails before anything runs
+    for (int i = 0; i < count;) {
+        int needed = command_arguments(args[i]);
+        if (needed < 0 || count - i - 1 < needed) {
+            fprintf(stderr, needed < 0 ? "Unknown command '%s'\n" : "Missing arguments of '%s'\n", args[i]);
+            return EXIT_FAILURE;
+        }
+        i += 1 + needed;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0); // Whoever reads the output sees each line as it happens
+    for (int i = 0; i < count;) {
+        const char *command = args[i++];
+        int needed = command_arguments(command);
+        const char *first = needed > 0 ? args[i] : NULL;
+        const char *second = needed > 1 ? args[i + 1] : NULL;
+        i += needed;
+
+        int result = -1;
+        if (!strcmp(command, "register")) {
+            result = register_content(peer_name, first, second, client);
+        } else if (!strcmp(command, "sync")) {
+            result = sync_directory(peer_name, first, client);
+        } else if (!strcmp(command, "search")) {
+            result = search_content(first, client);
+        } else if (!strcmp(command, "download")) {
+            result = download_content(peer_name, first, client);
+        } else if (!strcmp(command, "list")) {
+            result = list_content(peer_name, client);
+        } else if (!strcmp(command, "find")) {
+            int mode = !strcmp(first, "prefix") ? FIND_PREFIX : !strcmp(first, "substring") ? FIND_SUBSTRING
+                       : !strcmp(first, "fuzzy") ? FIND_FUZZY : -1;
+            result = mode < 0 ? -1 : find_names(second, (uint8_t)mode, 0, client);
+        } else if (!strcmp(command, "watch")) {
+            int kind = !strcmp(first, "name") ? SUBSCRIBE_NAME : !strcmp(first, "prefix") ? SUBSCRIBE_PREFIX
+                       : !strcmp(first, "peer") ? SUBSCRIBE_PEER : -1;
+            result = kind < 0 ? -1 : watch_add(client->cluster, (uint8_t)kind, second);
+        } else {
+            char *end;
+            long seconds = strtol(first, &end, 10);
+            if (*first && !*end && seconds > 0) {
+                for (time_t until = time(NULL) + seconds; time(NULL) < until;) {
+                    sleep(1);
+                }
+                result = 0;
+            } else if (*first && !*end && seconds == 0) {
+                while (getchar() != EOF) {
+                    // Anything read is ignored; only the end of input matters
+                }
+                result = 0;
+            }
+        }
+        if (result != 0) {
+            fprintf(stderr, "Command '%s' failed\n", command);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int client_init(Client *client, const Cluster *cluster) {
+    memset(client, 0, sizeof(*client));
+    client->cluster = cluster;
+    client->rto = CLIENT_INITIAL_RTO;
+
+    if ((client->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    if ((client->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        close(client->sockfd);
+        return -1;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = client->sockfd};
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->sockfd, &event) != 0) {
+        perror("epoll_ctl failed");
+        close(client->epoll_fd);
+        close(client->sockfd);
+        return -1;
+    }
+    return 0;
+}
+
+void client_close(Client *client) {
+    close(client->epoll_fd);
+    close(client->sockfd);
+}
+
+// Start a request datagram of the given opcode; its id is assigned when it is submitted
+void request_begin(ProtoWriter *writer, uint8_t *buffer, uint8_t opcode) {
+    ProtoHeader header = {opcode, PROTO_OK, 0, 0, 0};
+    proto_begin(writer, buffer, PROTO_MAX_DATAGRAM, &header);
+}
+
+static void client_transmit(Client *client, Outstanding *request) {
+    const struct sockaddr_in *node = &client->cluster->nodes[request->node];
+    if (sendto(client->sockfd, request->datagram, request->len, 0, (const struct sockaddr *)node, sizeof(*node)) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Failed to send message");
+    }
+    // A datagram the socket could not take is simply retransmitted later, like a lost one.
+    // Every retransmission of a request waits twice as long as the one before.
+    uint64_t now = now_us();
+    uint64_t backoff = (uint64_t)client->rto << (request->attempts < 8 ? request->attempts : 8);
+    request->sent_at = now;
+    request->deadline = now + (backoff < CLIENT_MAX_RTO ? backoff : CLIENT_MAX_RTO);
+    request->attempts++;
+}
+
+// Send a request to a node and track it until its reply arrives or it is given up on; handler sees every
+// reply datagram, or a NULL reply once CLIENT_MAX_ATTEMPTS transmissions went unanswered. Returns the id.
+uint32_t client_submit(Client *client, int node, ProtoWriter *request, ReplyHandler handler, void *context) {
+    size_t len = proto_finish(request);
+    if (len == 0) {
+        printf("Request does not fit in one datagram\n");
+        handler(context, NULL, NULL);
+        return 0;
+    }
+    while (client->in_flight == CLIENT_WINDOW) {
+        client_poll(client); // Wait for room
+    }
+
+    // Skip ids whose slot is still taken by an older request
+    Outstanding *slot;
+    do {
+        client->next_id++;
+        slot = &client->slots[client->next_id & (CLIENT_WINDOW - 1)];
+    } while (client->next_id == 0 || slot->id != 0);
+
+    proto_store(request->buffer + 4, client->next_id, 4);
+    slot->id = client->next_id;
+    slot->len = len;
+    slot->node = (uint8_t)node;
+    slot->attempts = 0;
+    slot->handler = handler;
+    slot->context = context;
+    memcpy(slot->datagram, request->buffer, len);
+    client->in_flight++;
+    client->sent++;
+    client_transmit(client, slot);
+    return slot->id;
+}
+
+// Send a request nobody answers (chunk announcements); losing one is harmless
+void client_send(Client *client, int node, ProtoWriter *request) {
+    size_t len = proto_finish(request);
+    if (len > 0) {
+        sendto(client->sockfd, request->buffer, len, 0, (const struct sockaddr *)&client->cluster->nodes[node],
+               sizeof(client->cluster->nodes[node]));
+    }
+}
+
+// RTT estimation as in RFC 6298, in microseconds
+static void client_sample_rtt(Client *client, uint64_t rtt) {
+    if (client->srtt == 0) {
+        client->srtt = rtt;
+        client->rttvar = rtt / 2;
+    } else {
+        uint64_t delta = rtt > client->srtt ? rtt - client->srtt : client->srtt - rtt;
+        client->rttvar = (3 * client->rttvar + delta) / 4;
+        client->srtt = (7 * client->srtt + rtt) / 8;
+    }
+    uint64_t rto = client->srtt + 4 * client->rttvar;
+    client->rto = rto < CLIENT_MIN_RTO ? CLIENT_MIN_RTO : rto > CLIENT_MAX_RTO ? CLIENT_MAX_RTO : rto;
+}
+
+static void client_dispatch(Client *client, const uint8_t *datagram, size_t len) {
+    ProtoHeader reply;
+    ProtoReader reader;
+    if (proto_parse(datagram, len, &reply, &reader) != 0) {
+        return;
+    }
+    if (reply.opcode == OP_NOTIFY) {
+        if (client->notify) {
+            client->notify(client->notify_context, &reply, &reader);
+        }
+        return;
+    }
+    if (!(reply.opcode & PROTO_REPLY)) {
+        return;
+    }
+    Outstanding *slot = &client->slots[reply.request_id & (CLIENT_WINDOW - 1)];
+    if (slot->id != reply.request_id || reply.request_id == 0) {
+        return; // Duplicate or late reply to a request already finished
+    }
+
+    // Karn: a reply to a retransmitted request says nothing about the round trip
+    uint64_t now = now_us();
+    if (slot->attempts == 1) {
+        client_sample_rtt(client, now - slot->sent_at);
+    }
+    if (reply.status == PROTO_OVERLOADED) {
+        // Sent again once the retry after has passed, give or take a quarter so that the clients
+        // turned away together do not all come back together. Nothing was lost, so the resend
+        // starts afresh: no backoff, and the whole attempt budget.
+        proto_get_name(&reader);
+        uint64_t retry = proto_get_int(&reader, 2) * 1000;
+        if (!reader.error) {
+            slot->deadline = now + retry * 3 / 4 + (uint64_t)rand() % (retry / 2 + 1);
+            slot->attempts = 0;
+            client->turned_away++;
+            return;
+        }
+    }
+    if (reply.flags & PROTO_FLAG_MORE) {
+        slot->deadline = now + client->rto; // More parts are on their way
+    } else {
+        slot->id = 0;
+        client->in_flight--;
+    }
+    slot->handler(slot->context, &reply, &reader);
+}
+
+static void client_expire(Client *client) {
+    uint64_t now = now_us();
+    for (int i = 0; i < CLIENT_WINDOW; i++) {
+        Outstanding *slot = &client->slots[i];
+        if (slot->id == 0 || slot->deadline > now) {
+            continue;
+        }
+        if (slot->attempts >= CLIENT_MAX_ATTEMPTS) {
+            slot->id = 0;
+            client->in_flight--;
+            client->timeouts++;
+            slot->handler(slot->context, NULL, NULL);
+            continue;
+        }
+        client->retransmits += slot->attempts > 0; // A resend the node asked for is counted as turned away
+        client_transmit(client, slot);
+    }
+}
+
+// Wait for replies or the next retransmission deadline, then handle whatever is due
+void client_poll(Client *client) {
+    uint64_t now = now_us();
+    uint64_t next = now + CLIENT_MAX_RTO;
+    for (int i = 0; i < CLIENT_WINDOW; i++) {
+        if (client->slots[i].id != 0 && client->slots[i].deadline < next) {
+            next = client->slots[i].deadline;
+        }
+    }
+    int timeout = next > now ? (int)((next - now + 999) / 1000) : 0;
+
+    struct epoll_event event;
+    if (epoll_wait(client->epoll_fd, &event, 1, timeout) > 0) {
+        // Take every queued reply, a batch per system call
+        uint8_t datagrams[CLIENT_RECV_BATCH][PROTO_MAX_DATAGRAM];
+        struct iovec iov[CLIENT_RECV_BATCH];
+        struct mmsghdr msgs[CLIENT_RECV_BATCH];
+        int n;
+        do {
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < CLIENT_RECV_BATCH; i++) {
+                iov[i].iov_base = datagrams[i];
+                iov[i].iov_len = PROTO_MAX_DATAGRAM;
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            n = recvmmsg(client->sockfd, msgs, CLIENT_RECV_BATCH, MSG_DONTWAIT, NULL);
+            for (int i = 0; i < n; i++) {
+                client_dispatch(client, datagrams[i], msgs[i].msg_len);
+            }
+        } while (n == CLIENT_RECV_BATCH);
+    }
+    client_expire(client);
+}
+
+// Run the event loop until every submitted request has finished
+void client_drain(Client *client) {
+    while (client->in_flight > 0) {
+        client_poll(client);
+    }
+}
+
+// Keeps the single reply datagram of a request for client_call
+typedef struct {
+    uint8_t *buffer;
+    size_t len; // 0 while nothing arrived
+} ReplyCopy;
+
+static void copy_reply(void *context, const ProtoHeader *reply, ProtoReader *reader) {
+    ReplyCopy *copy = context;
+    if (reply) {
+        // The records start right after the header, so the whole datagram is still in front of us
+        const uint8_t *datagram = reader->pos - PROTO_HEADER_SIZE;
+        copy->len = reader->end - datagram;
+        memcpy(copy->buffer, datagram, copy->len);
+    }
+}
+
+// Send one request to a node and wait for its reply, which is left in buffer and parsed into reply and reader
+int client_call(Client *client, int node, ProtoWriter *request, uint8_t *buffer, ProtoHeader *reply,
+                ProtoReader *reader) {
+    ReplyCopy copy = {buffer, 0};
+    client_submit(client, node, request, copy_reply, &copy);
+    client_drain(client);
+    if (copy.len == 0) {
+        printf("No response from server\n");
+        return -1;
+    }
+    return proto_parse(buffer, copy.len, reply, reader);
+}
+
+// Print why the server refused a request, from the message record of the reply
+void print_refusal(const char *what, ProtoReader *reader) {
+    const char *message = proto_get_name(reader);
+    printf("%s: %s\n", what, reader->error ? "unknown error" : message);
+}
+
+// Register the file at file_path under content_name and upload it; returns 0 once the index has it
+int register_content(const char *peer_name, const char *content_name, const char *file_path, Client *client) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+
+    // Open the file
+    int file_fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+        perror("Failed to open file");
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return -1;
+    }
+
+    // Serve it before the index can send anyone here for it
+    seed_add(content_name, file_path, (uint64_t)st.st_size, 0);
+
+    // Send the registration request; only metadata goes over UDP
+    ProtoWriter request;
+    request_begin(&request, buffer, OP_REGISTER);
+    proto_put_name(&request, peer_name);
+    proto_put_name(&request, content_name);
+    proto_put_int(&request, (uint64_t)st.st_size, 8);
+    put_seed(&request);
+    proto_end_record(&request);
+
+    // The name's primary answers with a token for the upload connection
+    int node = cluster_primary(client->cluster, content_name);
+    ProtoHeader reply;
+    ProtoReader reader;
+    if (client_call(client, node, &request, buffer, &reply, &reader) != 0) {
+        seed_remove(content_name);
+        close(file_fd);
+        return -1;
+    }
+    if (reply.status != PROTO_OK) {
+        print_refusal("Registration refused", &reader);
+        seed_remove(content_name);
+        close(file_fd);
+        return -1;
+    }
+    uint64_t token = proto_get_int(&reader, 8);
+    int upload_port = (int)proto_get_int(&reader, 2);
+    if (reader.error) {
+        printf("Malformed registration response\n");
+        seed_remove(content_name);
+        close(file_fd);
+        return -1;
+    }
+
+    int result = 0;
+    if (token == 0) {
+        printf("Content '%s' is already registered from peer '%s'\n", content_name, peer_name);
+    } else if (upload_file(file_fd, st.st_size, token, client->cluster->nodes[node].sin_addr, upload_port) == 0) {
+        printf("Registered content '%s' from peer '%s'\n", content_name, peer_name);
+    } else {
+        seed_remove(content_name);
+        result = -1;
+    }
+    close(file_fd);
+    return result;
+}
+
+// Stream a file to the server's upload port with sendfile; returns 0 once the server has stored it
+int upload_file(int file_fd, off_t size, uint64_t token, struct in_addr server_ip, int upload_port) {
+    int tcp_sock = upload_connect(server_ip, upload_port);
+    if (tcp_sock < 0) {
+        return -1;
+    }
+    if (upload_send(tcp_sock, file_fd, size, token) != 0) {
+        close(tcp_sock);
+        return -1;
+    }
+
+    // The server acknowledges with a single status byte once the file is stored and registered
+    unsigned char status = 1;
+    if (recv(tcp_sock, &status, 1, MSG_WAITALL) != 1 || status != 0) {
+        printf("Server failed to store the upload.\n");
+        close(tcp_sock);
+        return -1;
+    }
+
+    close(tcp_sock);
+    return 0;
+}
+
+int upload_connect(struct in_addr server_ip, int upload_port) {
+    int tcp_sock;
+    struct sockaddr_in upload_addr;
+
+    if ((tcp_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("TCP socket creation failed");
+        return -1;
+    }
+    int buffer_size = UPLOAD_BUFFER_SIZE;
+    setsockopt(tcp_sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    memset(&upload_addr, 0, sizeof(upload_addr));
+    upload_addr.sin_family = AF_INET;
+    upload_addr.sin_addr = server_ip;
+    upload_addr.sin_port = htons(upload_port);
+    if (connect(tcp_sock, (struct sockaddr *)&upload_addr, sizeof(upload_addr)) < 0) {
+        perror("Connection to upload port failed");
+        close(tcp_sock);
+        return -1;
+    }
+    return tcp_sock;
+}
+
+static int send_all(int sock, const void *data, size_t len) {
+    const unsigned char *pos = data;
+    while (len > 0) {
+        ssize_t sent = send(sock, pos, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        pos += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Send a file as LZ4 frames, one per chunk; a chunk that does not shrink enough goes as it is
+static int upload_frames(int tcp_sock, int file_fd, off_t size) {
+    unsigned char *plain = malloc(CHUNK_SIZE);
+    unsigned char *frame = malloc(UPLOAD_FRAME_SIZE + lz4_worth(CHUNK_SIZE));
+    int result = plain && frame ? 0 : -1;
+    for (off_t offset = 0; result == 0 && offset < size; offset += CHUNK_SIZE) {
+        size_t len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+        if (pread(file_fd, plain, len, offset) != (ssize_t)len) {
+            result = -1;
+            break;
+        }
+        size_t packed = lz4_compress(plain, len, frame + UPLOAD_FRAME_SIZE, lz4_worth(len));
+        proto_store(frame, packed ? packed | UPLOAD_FRAME_PACKED : len, UPLOAD_FRAME_SIZE);
+        if (packed) {
+            result = send_all(tcp_sock, frame, UPLOAD_FRAME_SIZE + packed);
+        } else {
+            result = send_all(tcp_sock, frame, UPLOAD_FRAME_SIZE) == 0 ? send_all(tcp_sock, plain, len) : -1;
+        }
+    }
+    free(plain);
+    free(frame);
+    return result;
+}
+
+// Send one upload (header, then the file); several may follow each other on a connection. A file whose
+// start compresses well goes in LZ4 frames, anything else straight from the file through sendfile.
+int upload_send(int tcp_sock, int file_fd, off_t size, uint64_t token) {
+    unsigned char sample[LZ4_SAMPLE];
+    ssize_t got = pread(file_fd, sample, sizeof(sample), 0);
+    int codec = got > 0 && lz4_compressible(sample, got) ? UPLOAD_LZ4 : 0;
+
+    // Header: token, then the codec in the top byte of the file size, both big-endian
+    unsigned char header[UPLOAD_HEADER_SIZE];
+    proto_store(header, token, 8);
+    proto_store(header + 8, (uint64_t)size, 8);
+    header[8] = (unsigned char)codec;
+    if (send(tcp_sock, header, sizeof(header), MSG_NOSIGNAL) != (ssize_t)sizeof(header)) {
+        perror("Failed to send upload header");
+        return -1;
+    }
+    if (codec == UPLOAD_LZ4) {
+        if (upload_frames(tcp_sock, file_fd, size) != 0) {
+            perror("Failed to send file data to server");
+            return -1;
+        }
+        return 0;
+    }
+
+    // Let the kernel copy the file straight into the socket
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t sent = sendfile(tcp_sock, file_fd, &offset, size - offset);
+        if (sent <= 0) {
+            perror("Failed to send file data to server");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The peer's names are spread over every node, so every node is told; returns 0 once every node answered
+int deregister_content(const char *peer_name, Client *client) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    int answered = 0;
+    for (int node = 0; node < client->cluster->node_count; node++) {
+        ProtoWriter request;
+        ProtoHeader reply;
+        ProtoReader reader;
+        request_begin(&request, buffer, OP_DEREGISTER);
+        proto_put_name(&request, peer_name);
+        proto_put_name(&request, ""); // No content name: everything this peer registered
+        proto_end_record(&request);
+        answered += client_call(client, node, &request, buffer, &reply, &reader) == 0;
+    }
+    if (answered < client->cluster->node_count) {
+        return -1;
+    }
+    printf("Deregistered content from peer '%s'\n", peer_name);
+    return 0;
+}
+
+// Print who holds the whole content; returns 0 if anyone does
+int search_content(const char *content_name, Client *client) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter request;
+    request_begin(&request, buffer, OP_SEARCH);
+    proto_put_name(&request, content_name);
+    proto_end_record(&request);
+
+    // Any owner of the name can answer
+    ProtoHeader reply;
+    ProtoReader reader;
+    if (client_call(client, cluster_reader(client->cluster, content_name), &request, buffer, &reply, &reader) != 0) {
+        return -1;
+    }
+    if (reply.status != PROTO_OK) {
+        print_refusal("Search failed", &reader);
+        return -1;
+    }
+
+    // One record per holder of the whole content
+    printf("Content '%s' found at:\n", content_name);
+    for (int i = 0; i < reply.count; i++) {
+        struct in_addr address = {htonl((uint32_t)proto_get_int(&reader, 4))};
+        int port = (int)proto_get_int(&reader, 2);
+        if (reader.error) {
+            break;
+        }
+        printf("  %s:%d\n", inet_ntoa(address), port);
+    }
+    return 0;
+}
+
+enum { CHUNK_MISSING, CHUNK_REQUESTED, CHUNK_DONE };
+
+// One seeder of a chunked download, with its own connection and request window
+typedef struct {
+    struct sockaddr_in address;
+    uint8_t *chunks; // Chunk map from the manifest, NULL when the source has every chunk
+    int sock;
+    uint32_t window[CHUNK_WINDOW]; // Chunks requested and not yet received, oldest first
+    uint32_t window_from[CHUNK_WINDOW]; // Bytes of each of them already here, the rest asked for as a range
+    int window_head;
+    int in_flight;
+    uint32_t cursor; // Position in the rarest-first order to look for more work from
+    int retries; // Reconnections left
+    int fallback; // The index itself, only asked for chunks no peer source can still serve
+    unsigned char header[CONTENT_HEADER_SIZE];
+    size_t header_got;
+    unsigned char *body; // Chunk being received
+    size_t body_len;
+    size_t body_got;
+    Blake3Hasher hasher; // Hash of the body so far, kept up to date as the bytes arrive
+    int lz4; // The chunk comes as an LZ4 block, gathered in packed and decompressed into body once whole
+    unsigned char *packed;
+    size_t packed_len;
+    size_t packed_got;
+} Source;
+
+// The first part of a chunk whose source went away in the middle of it
+typedef struct {
+    uint32_t chunk;
+    size_t got;
+    unsigned char *body;
+    Blake3Hasher hasher;
+} PartialChunk;
+
+// Everything a chunked download needs between events
+typedef struct {
+    const char *peer_name;
+    const char *content_name;
+    Client *client; // Index connection, for chunk announcements
+    int node; // Primary of the content, which serves its manifest and hears the announcements
+    int file_fd;
+    uint64_t size;
+    uint32_t chunk_count;
+    uint8_t (*hashes)[BLAKE3_OUT_LEN];
+    uint8_t *state; // CHUNK_* for every chunk
+    uint32_t *order; // Chunks, rarest first
+    uint32_t done;
+    uint32_t orphans; // Chunks not done that no peer source can still serve, as last counted
+    Source sources[MAX_SOURCES];
+    int source_count;
+    PartialChunk partials[MAX_SOURCES * (SOURCE_RETRIES + 1)]; // At most one per failed connection
+    int partial_count;
+} Download;
+
+static uint64_t get_be(const unsigned char *p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static int recv_all(int sock, void *buffer, size_t len) {
+    return len == 0 || recv(sock, buffer, len, MSG_WAITALL) == (ssize_t)len ? 0 : -1;
+}
+
+static int source_has(const Source *source, uint32_t chunk) {
+    return !source->chunks || (source->chunks[chunk / 8] >> (chunk % 8)) & 1;
+}
+
+static size_t chunk_length(const Download *download, uint32_t chunk) {
+    uint64_t offset = (uint64_t)chunk * CHUNK_SIZE;
+    return download->size - offset < CHUNK_SIZE ? download->size - offset : CHUNK_SIZE;
+}
+
+static PartialChunk *partial_find(Download *download, uint32_t chunk) {
+    for (int i = 0; i < download->partial_count; i++) {
+        if (download->partials[i].chunk == chunk) {
+            return &download->partials[i];
+        }
+    }
+    return NULL;
+}
+
+static int connect_to(struct sockaddr_in *address) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    int buffer_size = DOWNLOAD_BUFFER_SIZE;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    if (connect(sock, (struct sockaddr *)address, sizeof(*address)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Fetch the manifest (sizes, chunk hashes and sources) from the content port of the content's primary
+static int fetch_manifest(Download *download) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter lookup;
+    ProtoHeader reply;
+    ProtoReader reader;
+    download->node = cluster_primary(download->client->cluster, download->content_name);
+    request_begin(&lookup, buffer, OP_DOWNLOAD);
+    proto_put_name(&lookup, download->content_name);
+    proto_end_record(&lookup);
+    if (client_call(download->client, download->node, &lookup, buffer, &reply, &reader) != 0) {
+        return -1;
+    }
+    if (reply.status != PROTO_OK) {
+        printf("Content '%s' is not available for download.\n", download->content_name);
+        return -1;
+    }
+
+    struct sockaddr_in content_addr = download->client->cluster->nodes[download->node];
+    content_addr.sin_port = htons((uint16_t)proto_get_int(&reader, 2));
+    int sock = reader.error ? -1 : connect_to(&content_addr);
+    if (sock < 0) {
+        perror("Connection to content server failed");
+        return -1;
+    }
+
+    // The server waits for the whole line, so a cut one would leave both sides waiting
+    char request[MANIFEST_REQUEST_MAX];
+    int request_len = snprintf(request, sizeof(request), "M %s\n", download->content_name);
+    if (request_len < 0 || (size_t)request_len >= sizeof(request)) {
+        printf("Content name '%s' is too long.\n", download->content_name);
+        close(sock);
+        return -1;
+    }
+    struct timeval timeout = {MANIFEST_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    unsigned char header[MANIFEST_HEADER_SIZE];
+    if (send(sock, request, request_len, MSG_NOSIGNAL) < 0 || recv_all(sock, header, 1) != 0) {
+        perror("Failed to fetch manifest");
+        close(sock);
+        return -1;
+    }
+    if (header[0] != 0) {
+        printf("Content '%s' is not available for download.\n", download->content_name);
+        close(sock);
+        return -1;
+    }
+    if (recv_all(sock, header + 1, sizeof(header) - 1) != 0) {
+        perror("Failed to fetch manifest");
+        close(sock);
+        return -1;
+    }
+
+    download->size = get_be(header + 1, 8);
+    download->chunk_count = (uint32_t)get_be(header + 9, 4);
+    uint32_t source_count = (uint32_t)get_be(header + 13, 4);
+    if (download->chunk_count != (download->size + CHUNK_SIZE - 1) / CHUNK_SIZE) {
+        printf("Malformed manifest for '%s'\n", download->content_name);
+        close(sock);
+        return -1;
+    }
+    download->hashes = malloc((size_t)download->chunk_count * BLAKE3_OUT_LEN + 1);
+    if (!download->hashes ||
+        recv_all(sock, download->hashes, (size_t)download->chunk_count * BLAKE3_OUT_LEN) != 0) {
+        perror("Failed to fetch manifest");
+        close(sock);
+        return -1;
+    }
+
+    size_t map_len = (download->chunk_count + 7) / 8;
+    for (uint32_t i = 0; i < source_count; i++) {
+        unsigned char entry[MANIFEST_SOURCE_SIZE];
+        if (recv_all(sock, entry, sizeof(entry)) != 0) {
+            perror("Failed to fetch manifest");
+            close(sock);
+            return -1;
+        }
+        uint32_t len = (uint32_t)get_be(entry + 6, 4);
+        uint8_t *chunks = len ? malloc(len) : NULL;
+        if ((len && !chunks) || recv_all(sock, chunks, len) != 0) {
+            free(chunks);
+            close(sock);
+            return -1;
+        }
+        if ((len && len != map_len) || download->source_count == MAX_SOURCES) {
+            free(chunks); // Not usable, or enough sources already
+            continue;
+        }
+
+        Source *source = &download->sources[download->source_count++];
+        memset(source, 0, sizeof(*source));
+        source->sock = -1;
+        source->chunks = chunks;
+        source->address.sin_family = AF_INET;
+        source->address.sin_addr.s_addr = htonl((uint32_t)get_be(entry, 4));
+        source->address.sin_port = htons((uint16_t)get_be(entry + 4, 2));
+        if (source->address.sin_addr.s_addr == htonl(INADDR_ANY)) {
+            source->address.sin_addr = content_addr.sin_addr; // The index node itself
+            source->fallback = 1;
+        }
+    }
+
+    close(sock);
+    return 0;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Order chunks by how many sources have them, fewest first, breaking ties at random
+static int rarest_first(Download *download) {
+    uint32_t count = download->chunk_count;
+    uint64_t *keys = malloc((size_t)count * sizeof(uint64_t) + 1);
+    download->order = malloc((size_t)count * sizeof(uint32_t) + 1);
+    if (!keys || !download->order) {
+        free(keys);
+        return -1;
+    }
+    for (uint32_t chunk = 0; chunk < count; chunk++) {
+        uint64_t holders = 0;
+        for (int i = 0; i < download->source_count; i++) {
+            holders += source_has(&download->sources[i], chunk);
+        }
+        keys[chunk] = holders << 56 | (uint64_t)(rand() & 0xFFFFFF) << 32 | chunk;
+    }
+    qsort(keys, count, sizeof(uint64_t), compare_keys);
+    for (uint32_t i = 0; i < count; i++) {
+        download->order[i] = (uint32_t)keys[i];
+    }
+    free(keys);
+    return 0;
+}
+
+// Whether a peer source that is connected, or still has tries left, has a chunk
+static int chunk_on_peers(const Download *download, uint32_t chunk) {
+    for (int i = 0; i < download->source_count; i++) {
+        const Source *source = &download->sources[i];
+        if (!source->fallback && (source->sock >= 0 || source->retries > 0) && source_has(source, chunk)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Count the chunks left to the index since no peer can serve them; called at the start and whenever a
+// peer source gives out for good, which also sends the index's source over the chunks again
+static void orphans_count(Download *download) {
+    download->orphans = 0;
+    for (uint32_t chunk = 0; chunk < download->chunk_count; chunk++) {
+        download->orphans += download->state[chunk] != CHUNK_DONE && !chunk_on_peers(download, chunk);
+    }
+    for (int i = 0; i < download->source_count; i++) {
+        if (download->sources[i].fallback) {
+            download->sources[i].cursor = 0;
+        }
+    }
+}
+
+// Top up a source's request window with the rarest chunks it has that nobody is fetching yet, LZ4-compressed
+// where the source finds that worth it. A chunk another source broke off in the middle is asked for from
+// where it stopped, as it is. The index only gets the chunks no peer can serve.
+static int source_fill(Download *download, Source *source) {
+    char request[CHUNK_WINDOW * CHUNK_REQUEST_MAX];
+    size_t len = 0;
+    while (source->in_flight < CHUNK_WINDOW && source->cursor < download->chunk_count) {
+        uint32_t chunk = download->order[source->cursor];
+        if (download->state[chunk] != CHUNK_MISSING || !source_has(source, chunk) ||
+            (source->fallback && chunk_on_peers(download, chunk))) {
+            source->cursor++;
+            continue;
+        }
+        PartialChunk *partial = partial_find(download, chunk);
+        int line;
+        if (partial) {
+            line = snprintf(request + len, sizeof(request) - len, "R %llu %zu %s\n",
+                            (unsigned long long)chunk * CHUNK_SIZE + partial->got,
+                            chunk_length(download, chunk) - partial->got, download->content_name);
+        } else {
+            line = snprintf(request + len, sizeof(request) - len, "Z %u %s\n", chunk, download->content_name);
+        }
+        if (line < 0 || (size_t)line >= sizeof(request) - len) {
+            break; // The window goes out as far as it got; a name longer than the protocol's never fits
+        }
+        len += (size_t)line;
+        int slot = (source->window_head + source->in_flight++) % CHUNK_WINDOW;
+        download->state[chunk] = CHUNK_REQUESTED;
+        source->window[slot] = chunk;
+        source->window_from[slot] = partial ? (uint32_t)partial->got : 0;
+    }
+    if (len > 0 && send(source->sock, request, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        return -1;
+    }
+    return 0;
+}
+
+// Open a connection to a source and have the event loop watch it
+static int source_connect(int epoll_fd, Source *source) {
+    if (!source->body && (source->body = malloc(CHUNK_SIZE)) == NULL) {
+        return -1;
+    }
+    if (!source->packed && (source->packed = malloc(lz4_bound(CHUNK_SIZE))) == NULL) {
+        return -1;
+    }
+    if ((source->sock = connect_to(&source->address)) < 0) {
+        return -1;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = source};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->sock, &event) != 0) {
+        close(source->sock);
+        source->sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Give up on a source's connection; what it still owed goes back to the others, along with whatever
+// it had already sent of the chunk it was in the middle of
+static void source_drop(Download *download, Source *source) {
+    if (source->in_flight > 0 && source->header_got == CONTENT_HEADER_SIZE && source->body_got > 0 &&
+        source->body_got < source->body_len && download->partial_count < MAX_SOURCES * (SOURCE_RETRIES + 1)) {
+        PartialChunk *partial = &download->partials[download->partial_count++];
+        partial->chunk = source->window[source->window_head];
+        partial->got = source->body_got;
+        partial->body = source->body;
+        partial->hasher = source->hasher;
+        source->body = NULL;
+    }
+    for (int i = 0; i < source->in_flight; i++) {
+        download->state[source->window[(source->window_head + i) % CHUNK_WINDOW]] = CHUNK_MISSING;
+    }
+    source->in_flight = 0;
+    source->header_got = 0;
+    close(source->sock);
+    source->sock = -1;
+    for (int i = 0; i < download->source_count; i++) {
+        download->sources[i].cursor = 0; // Let everyone pick the returned chunks up again
+    }
+    if (source->retries == 0 && !source->fallback) {
+        orphans_count(download);
+    }
+}
+
+// Serve a chunk this peer now holds and tell the index, which sends other downloaders here for it
+static void chunk_announce(Download *download, uint32_t chunk) {
+    uint8_t announce[PROTO_MAX_DATAGRAM];
+    ProtoWriter request;
+    seed_mark(download->content_name, chunk);
+    request_begin(&request, announce, OP_HAVE);
+    proto_put_name(&request, download->peer_name);
+    proto_put_name(&request, download->content_name);
+    proto_put_int(&request, chunk, 4);
+    put_seed(&request);
+    proto_end_record(&request);
+    client_send(download->client, download->node, &request);
+}
+
+// A whole chunk arrived, hashed on the way in: check it against the manifest, store it and tell the index
+static int chunk_received(Download *download, Source *source) {
+    uint32_t chunk = source->window[source->window_head];
+    uint8_t hash[BLAKE3_OUT_LEN];
+    blake3_final(&source->hasher, hash);
+    if (memcmp(hash, download->hashes[chunk], BLAKE3_OUT_LEN) != 0) {
+        printf("Chunk %u of '%s' failed verification\n", chunk, download->content_name);
+        return -1;
+    }
+    if (pwrite(download->file_fd, source->body, source->body_len, (off_t)chunk * CHUNK_SIZE) !=
+        (ssize_t)source->body_len) {
+        perror("Failed to write downloaded data");
+        return -1;
+    }
+
+    download->state[chunk] = CHUNK_DONE;
+    download->done++;
+    source->window_head = (source->window_head + 1) % CHUNK_WINDOW;
+    source->in_flight--;
+    chunk_announce(download, chunk);
+    return 0;
+}
+
+// Keep the chunks an earlier, interrupted download of the same content left in the file, once
+// they hash right; everything else is fetched again. Returns how many were kept.
+static uint32_t resume_existing(Download *download, uint64_t existing) {
+    unsigned char *buffer = malloc(CHUNK_SIZE);
+    uint32_t kept = 0;
+    for (uint32_t chunk = 0; buffer && chunk < download->chunk_count; chunk++) {
+        uint64_t offset = (uint64_t)chunk * CHUNK_SIZE;
+        size_t len = chunk_length(download, chunk);
+        uint8_t hash[BLAKE3_OUT_LEN];
+        if (offset + len > existing || len == 0 ||
+            pread(download->file_fd, buffer, len, (off_t)offset) != (ssize_t)len) {
+            continue;
+        }
+        blake3_hash(buffer, len, hash);
+        if (memcmp(hash, download->hashes[chunk], BLAKE3_OUT_LEN) == 0) {
+            download->state[chunk] = CHUNK_DONE;
+            download->done++;
+            kept++;
+            chunk_announce(download, chunk);
+        }
+    }
+    free(buffer);
+    return kept;
+}
+
+// Read whatever a source has sent; returns -1 once the source is no longer usable
+static int source_read(Download *download, Source *source) {
+    while (source->in_flight > 0) {
+        ssize_t n;
+        if (source->header_got < CONTENT_HEADER_SIZE) {
+            n = recv(source->sock, source->header + source->header_got, CONTENT_HEADER_SIZE - source->header_got,
+                     MSG_DONTWAIT);
+        } else if (source->lz4) {
+            n = recv(source->sock, source->packed + source->packed_got, source->packed_len - source->packed_got,
+                     MSG_DONTWAIT);
+        } else {
+            n = recv(source->sock, source->body + source->body_got, source->body_len - source->body_got,
+                     MSG_DONTWAIT);
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+
+        if (source->header_got < CONTENT_HEADER_SIZE) {
+            source->header_got += n;
+            if (source->header_got < CONTENT_HEADER_SIZE) {
+                continue;
+            }
+            uint32_t chunk = source->window[source->window_head];
+            uint32_t from = source->window_from[source->window_head];
+            size_t expected = chunk_length(download, chunk);
+            uint64_t len = get_be(source->header + 1, 8);
+            source->lz4 = source->header[0] == CONTENT_LZ4 && from == 0;
+            int valid = source->lz4 ? len > 0 && len <= lz4_bound(expected)
+                                    : source->header[0] == 0 && len == expected - from;
+            if (!valid) {
+                return -1;
+            }
+            source->packed_len = len;
+            source->packed_got = 0;
+            PartialChunk *partial = from > 0 ? partial_find(download, chunk) : NULL;
+            if (from > 0 && !partial) {
+                return -1;
+            }
+            if (partial) {
+                // Carry on from the bytes and the hash state the failed source left
+                free(source->body);
+                source->body = partial->body;
+                source->hasher = partial->hasher;
+                *partial = download->partials[--download->partial_count];
+            } else {
+                blake3_init(&source->hasher);
+            }
+            source->body_len = expected;
+            source->body_got = from;
+        } else if (source->lz4) {
+            source->packed_got += n;
+            if (source->packed_got == source->packed_len) {
+                if (lz4_decompress(source->packed, source->packed_len, source->body, source->body_len) !=
+                    (long)source->body_len) {
+                    printf("Chunk %u of '%s' did not decompress\n", source->window[source->window_head],
+                           download->content_name);
+                    return -1;
+                }
+                blake3_update(&source->hasher, source->body, source->body_len);
+                source->body_got = source->body_len;
+            }
+        } else {
+            blake3_update(&source->hasher, source->body + source->body_got, n);
+            source->body_got += n;
+        }
+
+        if (source->body_got == source->body_len) {
+            if (chunk_received(download, source) != 0) {
+                return -1;
+            }
+            source->header_got = 0;
+        }
+    }
+    return 0;
+}
+
+// Download content chunk by chunk from every source the index knows, rarest chunks first.
+// Each source gets its own connection with up to CHUNK_WINDOW pipelined chunk requests.
+// Returns 0 once the whole content is here.
+int download_content(const char *peer_name, const char *content_name, Client *client) {
+    Download download;
+    memset(&download, 0, sizeof(download));
+    download.peer_name = peer_name;
+    download.content_name = content_name;
+    download.client = client;
+    download.file_fd = -1;
+    int epoll_fd = -1;
+    int result = -1;
+
+    if (fetch_manifest(&download) != 0 || rarest_first(&download) != 0 ||
+        (download.state = calloc(download.chunk_count + 1, 1)) == NULL) {
+        goto out;
+    }
+    printf("Downloading '%s': %llu bytes in %u chunks from %d source(s)\n", content_name,
+           (unsigned long long)download.size, download.chunk_count, download.source_count);
+
+    // An existing file is kept so that an interrupted download picks up where it stopped
+    struct stat existing;
+    download.file_fd = open(content_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (download.file_fd < 0 || fstat(download.file_fd, &existing) != 0 ||
+        ftruncate(download.file_fd, download.size) != 0) {
+        perror("File creation failed");
+        goto out;
+    }
+    seed_add(content_name, content_name, download.size, 1); // Chunks are served as they are verified
+    if (existing.st_size > 0) {
+        uint32_t kept = resume_existing(&download, (uint64_t)existing.st_size);
+        printf("Resuming '%s': %u of %u chunks already here\n", content_name, kept, download.chunk_count);
+    }
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        goto out;
+    }
+
+    // Peers are connected to right away, the index only once there are chunks no peer can serve
+    for (int i = 0; i < download.source_count; i++) {
+        download.sources[i].retries = SOURCE_RETRIES;
+        if (!download.sources[i].fallback) {
+            source_connect(epoll_fd, &download.sources[i]);
+        }
+    }
+    orphans_count(&download);
+
+    while (download.done < download.chunk_count) {
+        // Hand out work; a source with nothing left to do simply idles, one that failed gets a few more tries
+        int active = 0;
+        int retrying = 0;
+        for (int i = 0; i < download.source_count; i++) {
+            Source *source = &download.sources[i];
+            if (source->sock >= 0 && source_fill(&download, source) != 0) {
+                source_drop(&download, source);
+            }
+            if (source->sock < 0 && source->retries > 0 && (!source->fallback || download.orphans > 0)) {
+                source->retries--;
+                if (source_connect(epoll_fd, source) != 0) {
+                    if (source->retries == 0 && !source->fallback) {
+                        orphans_count(&download);
+                    }
+                } else if (source_fill(&download, source) != 0) {
+                    source_drop(&download, source);
+                }
+            }
+            active += source->sock >= 0 && source->in_flight > 0;
+            retrying += source->sock < 0 && source->retries > 0 && (!source->fallback || download.orphans > 0);
+        }
+        if (active == 0 && retrying == 0) {
+            break; // Every remaining chunk is on sources that failed
+        }
+        if (active == 0) {
+            continue; // Nothing to wait for; sources with tries left get their next one, the index its turn
+        }
+
+        struct epoll_event events[MAX_SOURCES];
+        int ready = epoll_wait(epoll_fd, events, MAX_SOURCES, -1);
+        if (ready < 0 && errno != EINTR) {
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            Source *source = events[i].data.ptr;
+            if (source->sock >= 0 && source_read(&download, source) != 0) {
+                source_drop(&download, source);
+            }
+        }
+    }
+
+    if (download.done == download.chunk_count) {
+        printf("Download completed for content '%s' (%llu bytes)\n", content_name, (unsigned long long)download.size);
+        result = 0;
+    } else {
+        printf("Download of '%s' stopped with %u of %u chunks\n", content_name, download.done, download.chunk_count);
+    }
+
+out:
+    for (int i = 0; i < download.source_count; i++) {
+        if (download.sources[i].sock >= 0) {
+            close(download.sources[i].sock);
+        }
+        free(download.sources[i].chunks);
+        free(download.sources[i].body);
+        free(download.sources[i].packed);
+    }
+    for (int i = 0; i < download.partial_count; i++) {
+        free(download.partials[i].body);
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    if (download.file_fd >= 0) {
+        close(download.file_fd);
+    }
+    free(download.hashes);
+    free(download.order);
+    free(download.state);
+    return result;
+}
+
+// A file of a shared directory
+typedef struct {
+    char *name;
+    off_t size;
+} SharedFile;
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Names collected from the parts of a list reply
+typedef struct {
+    char **names;
+    int count;
+    int failed;
+} NameList;
+
+static void collect_names(void *context, const ProtoHeader *reply, ProtoReader *reader) {
+    NameList *list = context;
+    if (!reply) {
+        printf("No response from server\n");
+        list->failed = 1;
+        return;
+    }
+    if (reply->status != PROTO_OK) {
+        print_refusal("Failed to retrieve content list", reader);
+        list->failed = 1;
+        return;
+    }
+    char **grown = realloc(list->names, (list->count + reply->count + 1) * sizeof(char *));
+    if (!grown) {
+        list->failed = 1;
+        return;
+    }
+    list->names = grown;
+    for (int i = 0; i < reply->count; i++) {
+        const char *name = proto_get_name(reader);
+        if (reader->error || (list->names[list->count] = strdup(name)) == NULL) {
+            break;
+        }
+        list->count++;
+    }
+}
+
+// Every name the index has registered for this peer, sorted; NULL (with *count -1) on failure
+char **fetch_registrations(const char *peer_name, Client *client, int *count) {
+    // Each node lists the names it is primary for, all nodes at once. Long lists arrive over
+    // several datagrams; a retransmission may repeat some of them.
+    NameList list = {NULL, 0, 0};
+    for (int node = 0; node < client->cluster->node_count; node++) {
+        uint8_t buffer[PROTO_MAX_DATAGRAM];
+        ProtoWriter request;
+        request_begin(&request, buffer, OP_LIST);
+        proto_put_name(&request, peer_name);
+        proto_end_record(&request);
+        client_submit(client, node, &request, collect_names, &list);
+    }
+    client_drain(client);
+
+    int unique = 0;
+    if (list.names) {
+        qsort(list.names, list.count, sizeof(char *), compare_names);
+        for (int i = 0; i < list.count; i++) {
+            if (unique > 0 && strcmp(list.names[unique - 1], list.names[i]) == 0) {
+                free(list.names[i]);
+            } else {
+                list.names[unique++] = list.names[i];
+            }
+        }
+    }
+    if (list.failed) {
+        for (int i = 0; i < unique; i++) {
+            free(list.names[i]);
+        }
+        free(list.names);
+        *count = -1;
+        return NULL;
+    }
+    *count = unique;
+    return list.names ? list.names : calloc(1, sizeof(char *));
+}
+
+// Drop registrations that are no longer shared, a datagram's worth per round trip to each primary
+static int deregister_missing(const char *peer_name, char **registered, int registered_count, SharedFile *files,
+                              int file_count, Client *client) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    int removed = 0;
+
+    for (int node = 0; node < client->cluster->node_count; node++) {
+        int next = 0;
+        while (next < registered_count) {
+            ProtoWriter request;
+            ProtoHeader reply;
+            ProtoReader reader;
+            request_begin(&request, buffer, OP_DEREGISTER_BATCH);
+            proto_put_name(&request, peer_name);
+            for (; next < registered_count; next++) {
+                SharedFile key = {registered[next], 0};
+                if (cluster_primary(client->cluster, registered[next]) != node ||
+                    bsearch(&key, files, file_count, sizeof(SharedFile), compare_names)) {
+                    continue; // Another node's, or still shared
+                }
+                size_t mark = proto_mark(&request);
+                proto_put_name(&request, registered[next]);
+                if (request.overflow) {
+                    proto_rewind(&request, mark);
+                    break;
+                }
+                proto_end_record(&request);
+                seed_remove(registered[next]);
+            }
+            if (request.count == 0) {
+                break;
+            }
+            if (client_call(client, node, &request, buffer, &reply, &reader) != 0) {
+                return -1;
+            }
+            for (int i = 0; i < reply.count; i++) {
+                removed += proto_get_int(&reader, 1) == PROTO_OK && !reader.error;
+            }
+        }
+    }
+    return removed;
+}
+
+// Read the acknowledgements of uploads sent back to back on one connection
+static void upload_collect(int upload_sock, int sent, int *uploaded, int *failed) {
+    for (int i = 0; i < sent; i++) {
+        unsigned char status = 1;
+        if (recv(upload_sock, &status, 1, MSG_WAITALL) != 1 || status != 0) {
+            (*failed)++;
+        } else {
+            (*uploaded)++;
+        }
+    }
+}
+
+// Register every regular file in a directory and drop registrations of files that are gone.
+// Registrations go a datagram's worth per round trip to each primary, and the uploads to one
+// node share a connection. Returns 0 if every file is registered and nothing else is.
+int sync_directory(const char *peer_name, const char *dir_path, Client *client) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        perror("Failed to open directory");
+        return -1;
+    }
+
+    SharedFile *files = NULL;
+    int file_count = 0;
+    int file_capacity = 0;
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue; // Hidden names are not valid content names
+        }
+        if (file_count == file_capacity) {
+            file_capacity = file_capacity ? file_capacity * 2 : 64;
+            SharedFile *grown = realloc(files, file_capacity * sizeof(SharedFile));
+            if (!grown) {
+                break;
+            }
+            files = grown;
+        }
+        if ((files[file_count].name = strdup(entry->d_name)) != NULL) {
+            files[file_count++].size = st.st_size;
+        }
+    }
+    qsort(files, file_count, sizeof(SharedFile), compare_names);
+    for (int i = 0; i < file_count; i++) {
+        char path[2 * BUFFER_SIZE];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, files[i].name);
+        seed_add(files[i].name, path, (uint64_t)files[i].size, 0);
+    }
+
+    int registered_count;
+    char **registered = fetch_registrations(peer_name, client, &registered_count);
+    int removed = registered ? deregister_missing(peer_name, registered, registered_count, files, file_count,
+                                                  client) : 0;
+
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    int batch[PROTO_MAX_DATAGRAM / 11]; // Files of the request in flight; a record takes 11 bytes or more
+    int upload_sock = -1;
+    int upload_port = 0;
+    int unchanged = 0, uploaded = 0, failed = 0;
+    for (int node = 0; node < client->cluster->node_count; node++) {
+        int next = 0;
+        while (next < file_count) {
+            ProtoWriter request;
+            ProtoHeader reply;
+            ProtoReader reader;
+            request_begin(&request, buffer, OP_REGISTER_BATCH);
+            proto_put_name(&request, peer_name);
+            put_seed(&request);
+            long long batch_bytes = 0;
+            for (; next < file_count; next++) {
+                if (cluster_primary(client->cluster, files[next].name) != node) {
+                    continue;
+                }
+                if (request.count > 0 && batch_bytes + files[next].size > SYNC_BATCH_BYTES) {
+                    break;
+                }
+                batch_bytes += files[next].size;
+                size_t mark = proto_mark(&request);
+                proto_put_name(&request, files[next].name);
+                proto_put_int(&request, (uint64_t)files[next].size, 8);
+                if (request.overflow) {
+                    proto_rewind(&request, mark);
+                    break;
+                }
+                batch[request.count] = next;
+                proto_end_record(&request);
+            }
+            if (request.count == 0) {
+                failed += next < file_count; // A name too long for the protocol
+                next++;
+                continue;
+            }
+            if (client_call(client, node, &request, buffer, &reply, &reader) != 0) {
+                failed += request.count;
+                continue;
+            }
+            if (reply.status != PROTO_OK) {
+                print_refusal("Registration refused", &reader);
+                failed += request.count;
+                continue;
+            }
+
+            // Send every file the node asked for back to back, then collect their acknowledgements. The tokens
+            // were all handed out at once, which is why a request covers SYNC_BATCH_BYTES at most. Records
+            // the node had no room to answer count as failed.
+            failed += reply.count < request.count ? request.count - reply.count : 0;
+            int sent = 0;
+            for (int i = 0; i < reply.count && i < request.count; i++) {
+                uint8_t status = (uint8_t)proto_get_int(&reader, 1);
+                uint64_t token = proto_get_int(&reader, 8);
+                int port = (int)proto_get_int(&reader, 2);
+                if (reader.error || status != PROTO_OK) {
+                    failed++;
+                    continue;
+                }
+                if (token == 0) {
+                    unchanged++;
+                    continue;
+                }
+                if (upload_sock >= 0 && port != upload_port) {
+                    upload_collect(upload_sock, sent, &uploaded, &failed); // Another node's upload port
+                    sent = 0;
+                    close(upload_sock);
+                    upload_sock = -1;
+                }
+                if (upload_sock < 0 &&
+                    (upload_sock = upload_connect(client->cluster->nodes[node].sin_addr, port)) < 0) {
+                    failed++;
+                    continue;
+                }
+                upload_port = port;
+                int file_fd = openat(dirfd(dir), files[batch[i]].name, O_RDONLY | O_CLOEXEC);
+                if (file_fd < 0) {
+                    failed++; // Its registration expires on the server
+                    continue;
+                }
+                if (upload_send(upload_sock, file_fd, files[batch[i]].size, token) != 0) {
+                    // The stream is broken; settle what went before and start a new connection
+                    failed++;
+                    upload_collect(upload_sock, sent, &uploaded, &failed);
+                    sent = 0;
+                    close(upload_sock);
+                    upload_sock = -1;
+                } else {
+                    sent++;
+                }
+                close(file_fd);
+            }
+            upload_collect(upload_sock, sent, &uploaded, &failed);
+        }
+        if (upload_sock >= 0) {
+            close(upload_sock); // The next node takes its uploads itself
+            upload_sock = -1;
+        }
+    }
+
+    printf("Synced '%s': %d uploaded, %d already registered, %d removed, %d failed\n", dir_path, uploaded, unchanged,
+           removed, failed);
+
+    int result = registered && failed == 0 ? 0 : -1; // Without the old registrations, stale ones may be left
+    for (int i = 0; registered && i < registered_count; i++) {
+        free(registered[i]);
+    }
+    free(registered);
+    for (int i = 0; i < file_count; i++) {
+        free(files[i].name);
+    }
+    free(files);
+    closedir(dir);
+    return result;
+}
+
+int list_content(const char *peer_name, Client *client) {
+    int count;
+    char **names = fetch_registrations(peer_name, client, &count);
+    if (!names) {
+        return -1;
+    }
+
+    printf("Registered content:\n");
+    for (int i = 0; i < count; i++) {
+        printf("%s\n", names[i]);
+        free(names[i]);
+    }
+    if (count == 0) {
+        printf("No content registered.\n");
+    }
+    free(names);
+    return 0;
+}
+
+// Names looked up by a batch search and how the lookups went
+typedef struct {
+    char **names;
+    int count;
+    int found;
+    int missing;
+    int unanswered;
+} SearchRun;
+
+// One request of a batch search: a packed OP_SEARCH_BATCH, or a single OP_SEARCH when count is 1
+typedef struct {
+    SearchRun *run;
+    int first; // Index of its first name in run->names
+    int count;
+    uint8_t answered[];
+} SearchPart;
+
+static void print_holders(const char *name, int holder_count, ProtoReader *reader) {
+    printf("%s\t", name);
+    for (int i = 0; i < holder_count; i++) {
+        struct in_addr address = {htonl((uint32_t)proto_get_int(reader, 4))};
+        int port = (int)proto_get_int(reader, 2);
+        if (reader->error) {
+            break;
+        }
+        printf("%s%s:%d", i ? " " : "", inet_ntoa(address), port);
+    }
+    printf("\n");
+}
+
+static void search_part_reply(void *context, const ProtoHeader *reply, ProtoReader *reader) {
+    SearchPart *part = context;
+    SearchRun *run = part->run;
+
+    if (reply && reply->opcode == (OP_SEARCH | PROTO_REPLY)) {
+        // Single search: the records are the holders
+        if (!part->answered[0] && reply->status == PROTO_OK) {
+            print_holders(run->names[part->first], reply->count, reader);
+            run->found++;
+            part->answered[0] = 1;
+        } else if (!part->answered[0] && reply->status == PROTO_NOT_FOUND) {
+            printf("%s\tnot found\n", run->names[part->first]);
+            run->missing++;
+            part->answered[0] = 1;
+        }
+    } else if (reply && reply->status == PROTO_OK) {
+        for (int i = 0; i < reply->count; i++) {
+            int index = (int)proto_get_int(reader, 2);
+            int status = (int)proto_get_int(reader, 1);
+            int holder_count = (int)proto_get_int(reader, 1);
+            if (reader->error || index >= part->count) {
+                break;
+            }
+            if (part->answered[index]) {
+                reader->pos += 6 * holder_count; // Repeated by a retransmission
+                continue;
+            }
+            part->answered[index] = 1;
+            if (status == PROTO_OK) {
+                print_holders(run->names[part->first + index], holder_count, reader);
+                run->found++;
+            } else {
+                printf("%s\tnot found\n", run->names[part->first + index]);
+                run->missing++;
+            }
+        }
+    }
+
+    // Once the request is over, whatever did not get an answer is reported as such
+    if (!reply || !(reply->flags & PROTO_FLAG_MORE)) {
+        for (int i = 0; i < part->count; i++) {
+            if (!part->answered[i]) {
+                printf("%s\tno answer\n", run->names[part->first + i]);
+                run->unanswered++;
+            }
+        }
+        free(part);
+    }
+}
+
+static SearchPart *search_part_new(SearchRun *run, int first, int count) {
+    SearchPart *part = calloc(1, sizeof(SearchPart) + count);
+    if (part) {
+        part->run = run;
+        part->first = first;
+        part->count = count;
+    }
+    return part;
+}
+
+// Group names by the owner each is looked up at, keeping their order otherwise; fills nodes to match
+static int group_by_reader(const Cluster *cluster, char **names, int count, int *nodes) {
+    int starts[CLUSTER_MAX_NODES + 1] = {0};
+    int *picked = malloc((count + 1) * sizeof(int));
+    char **grouped = malloc((count + 1) * sizeof(char *));
+    if (!picked || !grouped) {
+        free(picked);
+        free(grouped);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        picked[i] = cluster_reader(cluster, names[i]);
+        starts[picked[i] + 1]++;
+    }
+    for (int node = 0; node < cluster->node_count; node++) {
+        starts[node + 1] += starts[node];
+    }
+    for (int i = 0; i < count; i++) {
+        nodes[starts[picked[i]]] = picked[i];
+        grouped[starts[picked[i]]++] = names[i];
+    }
+    memcpy(names, grouped, count * sizeof(char *));
+    free(picked);
+    free(grouped);
+    return 0;
+}
+
+// Look up every name listed in a file, one per line, keeping up to CLIENT_WINDOW requests in flight.
+// Names are packed into OP_SEARCH_BATCH requests, one owner's names per request, unless single is
+// set. Results go to stdout.
+void batch_search(Client *client, FILE *input, int single) {
+    SearchRun run = {NULL, 0, 0, 0, 0};
+    int capacity = 0;
+    char line[BUFFER_SIZE + 2];
+    while (fgets(line, sizeof(line), input)) {
+        line[strcspn(line, "\n")] = 0; // Remove newline character
+        if (line[0] == '\0' || strlen(line) > UINT8_MAX) {
+            continue;
+        }
+        if (run.count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            char **grown = realloc(run.names, capacity * sizeof(char *));
+            if (!grown) {
+                break;
+            }
+            run.names = grown;
+        }
+        if ((run.names[run.count] = strdup(line)) != NULL) {
+            run.count++;
+        }
+    }
+
+    uint64_t started = now_us();
+    uint64_t retransmits = client->retransmits;
+    uint64_t turned_away = client->turned_away;
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    int *nodes = malloc((run.count + 1) * sizeof(int));
+    int next = 0;
+    if (!nodes || group_by_reader(client->cluster, run.names, run.count, nodes) != 0) {
+        next = run.count; // Nothing can be sent
+    }
+    while (next < run.count) {
+        ProtoWriter request;
+        int first = next;
+        request_begin(&request, buffer, single ? OP_SEARCH : OP_SEARCH_BATCH);
+        do {
+            size_t mark = proto_mark(&request);
+            proto_put_name(&request, run.names[next]);
+            if (request.overflow) {
+                proto_rewind(&request, mark);
+                break;
+            }
+            proto_end_record(&request);
+            next++;
+        } while (!single && next < run.count && nodes[next] == nodes[first]);
+
+        SearchPart *part = search_part_new(&run, first, next - first);
+        if (!part) {
+            break;
+        }
+        client_submit(client, nodes[first], &request, search_part_reply, part);
+    }
+    client_drain(client);
+    free(nodes);
+
+    double elapsed = (now_us() - started) / 1e6;
+    fprintf(stderr, "%d searches in %.3f s (%.0f/s): %d found, %d not found, %d unanswered, %llu retransmits "
+            "(%llu turned away), srtt %.3f ms\n", run.count, elapsed, elapsed > 0 ? run.count / elapsed : 0.0,
+            run.found, run.missing, run.unanswered, (unsigned long long)(client->retransmits - retransmits),
+            (unsigned long long)(client->turned_away - turned_away), client->srtt / 1000.0);
+    for (int i = 0; i < run.count; i++) {
+        free(run.names[i]);
+    }
+    free(run.names);
+}
+
+// Page through the names matching a pattern, FIND_PAGE at a time, for as long as the user wants more,
+// or to the end unless ask is set. With several nodes the pages of one node come before those of the
+// next; a single node, or a router, is handed the cursor as it is. Returns 0 if every page came.
+int find_names(const char *pattern, uint8_t mode, int ask, Client *client) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    uint32_t cursor = 0;
+    int shown = 0;
+    int spread = client->cluster->node_count > 1;
+
+    do {
+        uint32_t local = cursor;
+        int node = spread ? cluster_cursor_node(cursor, &local) : 0;
+        ProtoWriter request;
+        request_begin(&request, buffer, OP_FIND);
+        proto_put_int(&request, mode, 1);
+        proto_put_int(&request, local, 4);
+        proto_put_int(&request, FIND_PAGE, 1);
+        proto_put_name(&request, pattern);
+        proto_end_record(&request);
+
+        ProtoHeader reply;
+        ProtoReader reader;
+        if (client_call(client, node, &request, buffer, &reply, &reader) != 0) {
+            return -1;
+        }
+        if (reply.status != PROTO_OK) {
+            print_refusal("Find failed", &reader);
+            return -1;
+        }
+
+        // Each record is a name and the holders of the whole content
+        cursor = (uint32_t)proto_get_int(&reader, 4);
+        if (spread) {
+            cursor = cluster_cursor_next(client->cluster, node, cursor);
+        }
+        for (int i = 0; i < reply.count && !reader.error; i++) {
+            const char *name = proto_get_name(&reader);
+            int holder_count = (int)proto_get_int(&reader, 1);
+            if (reader.error) {
+                break;
+            }
+            print_holders(name, holder_count, &reader);
+            shown++;
+        }
+        if (reader.error) {
+            printf("Malformed find response\n");
+            return -1;
+        }
+        if (cursor == 0) {
+            break;
+        }
+        if (!ask) {
+            continue;
+        }
+
+        printf("Show more? (y/N): ");
+        int answer = getchar();
+        while (answer != '\n' && answer != EOF && getchar() != '\n') {
+            // Skip the rest of the line
+        }
+        if (toupper(answer) != 'Y') {
+            return 0;
+        }
+    } while (1);
+
+    if (shown == 0) {
+        printf("No content matches '%s'\n", pattern);
+    }
+    return 0;
+}
+
+// Renew the peer's lease on every node a few times per lease, on a connection of its own. A node
+// holding nothing of the peer yet does not know it and refuses its heartbeats until it registers.
+void *heartbeat_thread(void *arg) {
+    const Heartbeat *heartbeat = arg;
+    Client *client = malloc(sizeof(Client));
+    if (!client || client_init(client, heartbeat->cluster) != 0) {
+        free(client);
+        return NULL;
+    }
+
+    unsigned interval = HEARTBEAT_INTERVAL;
+    while (1) {
+        sleep(interval);
+        unsigned shortest = 0; // The node with the shortest lease sets the pace
+        for (int node = 0; node < heartbeat->cluster->node_count; node++) {
+            uint8_t buffer[PROTO_MAX_DATAGRAM];
+            ProtoWriter request;
+            ProtoHeader reply;
+            ProtoReader reader;
+            request_begin(&request, buffer, OP_HEARTBEAT);
+            proto_put_name(&request, heartbeat->peer_name);
+            proto_end_record(&request);
+            if (client_call(client, node, &request, buffer, &reply, &reader) != 0 || reply.status != PROTO_OK) {
+                continue;
+            }
+            unsigned lease = (unsigned)proto_get_int(&reader, 2);
+            if (!reader.error && lease >= 3 && (shortest == 0 || lease < shortest)) {
+                shortest = lease;
+            }
+        }
+        if (shortest > 0) {
+            interval = shortest / 3; // Rides out a lost heartbeat or two
+        }
+    }
+    return NULL;
+}
+
+// Start watching; the watch thread starts with the first watch
+int watch_add(const Cluster *cluster, uint8_t kind, const char *pattern) {
+    if (strlen(pattern) > UINT8_MAX) {
+        printf("Cannot watch more than %d characters\n", UINT8_MAX);
+        return -1;
+    }
+    pthread_mutex_lock(&watcher.lock);
+    if (watcher.count == WATCH_MAX) {
+        pthread_mutex_unlock(&watcher.lock);
+        printf("Already watching %d things\n", WATCH_MAX);
+        return -1;
+    }
+    if (watcher.wake_fd < 0) {
+        watcher.cluster = cluster;
+        if ((watcher.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+            pthread_create(&watcher.thread, NULL, watch_thread, NULL) != 0) {
+            perror("Failed to start watching");
+            if (watcher.wake_fd >= 0) {
+                close(watcher.wake_fd);
+                watcher.wake_fd = -1;
+            }
+            pthread_mutex_unlock(&watcher.lock);
+            return -1;
+        }
+    }
+
+    Watch *watch = &watcher.watches[watcher.count];
+    memset(watch, 0, sizeof(*watch));
+    watch->kind = kind;
+    snprintf(watch->pattern, sizeof(watch->pattern), "%s", pattern);
+    for (int node = 0; node < cluster->node_count; node++) {
+        watch->links[node].watch = watch;
+        watch->links[node].node = node;
+        watch->links[node].refused = kind == SUBSCRIBE_NAME && cluster->node_count > 1 &&
+                                     cluster_primary(cluster, pattern) != node;
+    }
+    watcher.count++;
+    pthread_mutex_unlock(&watcher.lock);
+
+    uint64_t poke = 1;
+    if (write(watcher.wake_fd, &poke, sizeof(poke)) < 0) {
+        // The thread still picks the watch up on its next turn
+    }
+    return 0;
+}
+
+// Cancel every watch before quitting
+void watch_stop(void) {
+    pthread_mutex_lock(&watcher.lock);
+    int running = watcher.wake_fd >= 0;
+    watcher.stopping = 1;
+    pthread_mutex_unlock(&watcher.lock);
+    if (running) {
+        uint64_t poke = 1;
+        if (write(watcher.wake_fd, &poke, sizeof(poke)) >= 0) {
+            pthread_join(watcher.thread, NULL);
+        }
+    }
+}
+
+static void watch_subscribed(void *context, const ProtoHeader *reply, ProtoReader *reader) {
+    WatchLink *link = context;
+    link->waiting = 0;
+    if (!reply) {
+        link->renew_at = now_us() + WATCH_RETRY;
+        return;
+    }
+    if (reply->status != PROTO_OK) {
+        printf("\n[watch '%s'] Node %d will not take it", link->watch->pattern, link->node);
+        print_refusal("", reader);
+        link->refused = 1;
+        return;
+    }
+    uint32_t id = (uint32_t)proto_get_int(reader, 4);
+    uint64_t feed = proto_get_int(reader, 8);
+    uint64_t since = proto_get_int(reader, 8);
+    unsigned lease = (unsigned)proto_get_int(reader, 2);
+    if (reader->error) {
+        link->renew_at = now_us() + WATCH_RETRY;
+        return;
+    }
+
+    // Anything but the since asked for means the node could not resume; its notifications start over
+    if (feed != link->feed || since != link->asked) {
+        if (link->feed != 0) {
+            printf("\n[watch '%s'] Changes were missed; list them again to catch up\n", link->watch->pattern);
+        }
+        link->since = since;
+    }
+    link->id = id;
+    link->feed = feed;
+    link->renew_at = now_us() + (uint64_t)(lease >= 3 ? lease / 3 : 1) * 1000000; // Rides out a lost renewal
+}
+
+static void watch_subscribe(Client *client, WatchLink *link) {
+    uint8_t buffer[PROTO_MAX_DATAGRAM];
+    ProtoWriter request;
+    request_begin(&request, buffer, OP_SUBSCRIBE);
+    proto_put_int(&request, link->watch->kind, 1);
+    proto_put_int(&request, link->feed, 8);
+    proto_put_int(&request, link->since, 8);
+    proto_put_name(&request, link->watch->pattern);
+    proto_end_record(&request);
+    link->asked = link->since;
+    link->waiting = 1;
+    client_submit(client, link->node, &request, watch_subscribed, link);
+}
+
+// Print what a notification tells, or ask again for what a lost one told
+static void watch_notified(void *context, const ProtoHeader *notice, ProtoReader *reader) {
+    (void)context;
+    uint64_t feed = proto_get_int(reader, 8);
+    uint64_t from = proto_get_int(reader, 8);
+    uint64_t to = proto_get_int(reader, 8);
+    WatchLink *link = NULL;
+    for (int i = 0; i < watcher.kept && !link; i++) {
+        for (int node = 0; node < watcher.cluster->node_count; node++) {
+            WatchLink *candidate = &watcher.watches[i].links[node];
+            if (candidate->feed == feed && candidate->id == notice->request_id) {
+                link = candidate;
+                break;
+            }
+        }
+    }
+    if (reader->error || !link) {
+        return;
+    }
+    if (from != link->since) {
+        link->renew_at = 0; // Something went missing in between; subscribing again has it sent again
+        return;
+    }
+
+    for (int i = 1; i < notice->count; i++) {
+        uint8_t type = (uint8_t)proto_get_int(reader, 1);
+        const char *content_name = proto_get_name(reader);
+        const char *peer_name = proto_get_name(reader);
+        struct in_addr address = {htonl((uint32_t)proto_get_int(reader, 4))};
+        unsigned port = (unsigned)proto_get_int(reader, 2);
+        if (reader->error) {
+            break;
+        }
+        if (type == CHANGE_ADD) {
+            printf("\n[watch '%s'] + '%s' from '%s' at %s:%u\n", link->watch->pattern, content_name, peer_name,
+                   inet_ntoa(address), port);
+        } else {
+            printf("\n[watch '%s'] - '%s' from '%s'\n", link->watch->pattern, content_name, peer_name);
+        }
+    }
+    fflush(stdout);
+    link->since = to;
+}
+
+// Keep every watch subscribed on its nodes, renewing before the subscriptions lapse, and show what they tell
+void *watch_thread(void *arg) {
+    (void)arg;
+    Client *client = malloc(sizeof(Client));
+    if (!client || client_init(client, watcher.cluster) != 0) {
+        free(client);
+        return NULL;
+    }
+    client->notify = watch_notified;
+    struct epoll_event wake = {.events = EPOLLIN, .data.fd = watcher.wake_fd};
+    epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, watcher.wake_fd, &wake);
+
+    while (1) {
+        client_poll(client);
+        uint64_t pokes;
+        if (read(watcher.wake_fd, &pokes, sizeof(pokes)) < 0) {
+            // Nothing new from the menu
+        }
+        pthread_mutex_lock(&watcher.lock);
+        watcher.kept = watcher.count;
+        int stopping = watcher.stopping;
+        pthread_mutex_unlock(&watcher.lock);
+
+        uint64_t now = now_us();
+        for (int i = 0; i < watcher.kept; i++) {
+            for (int node = 0; node < watcher.cluster->node_count; node++) {
+                WatchLink *link = &watcher.watches[i].links[node];
+                if (stopping && link->feed != 0) {
+                    uint8_t buffer[PROTO_MAX_DATAGRAM];
+                    ProtoWriter request;
+                    request_begin(&request, buffer, OP_UNSUBSCRIBE);
+                    proto_put_int(&request, link->watch->kind, 1);
+                    proto_put_name(&request, link->watch->pattern);
+                    proto_end_record(&request);
+                    client_send(client, node, &request); // Left to lapse if this is lost
+                } else if (!stopping && !link->refused && !link->waiting && link->renew_at <= now) {
+                    watch_subscribe(client, link);
+                }
+            }
+        }
+        if (stopping) {
+            break;
+        }
+    }
+    client_close(client);
+    free(client);
+    return NULL;
+}
+
+// FNV-1a, 64-bit
+static uint64_t seed_hash(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Where a seed of this name is or would go; the caller holds the lock
+static Seed **seed_slot(const char *name) {
+    if (!seeder.buckets) {
+        return NULL;
+    }
+    Seed **slot = &seeder.buckets[seed_hash(name) & (seeder.bucket_count - 1)];
+    while (*slot && strcmp((*slot)->name, name) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void seed_free(Seed *seed) {
+    free(seed->name);
+    free(seed->path);
+    free(seed->chunks);
+    free(seed);
+}
+
+// Double the buckets; the caller holds the lock. If that fails the chains just get longer.
+static void seed_grow(void) {
+    size_t count = seeder.bucket_count ? seeder.bucket_count * 2 : 64;
+    Seed **buckets = calloc(count, sizeof(Seed *));
+    if (!buckets) {
+        return;
+    }
+    for (size_t i = 0; i < seeder.bucket_count; i++) {
+        Seed *next;
+        for (Seed *seed = seeder.buckets[i]; seed; seed = next) {
+            next = seed->next;
+            Seed **bucket = &buckets[seed_hash(seed->name) & (count - 1)];
+            seed->next = *bucket;
+            *bucket = seed;
+        }
+    }
+    free(seeder.buckets);
+    seeder.buckets = buckets;
+    seeder.bucket_count = count;
+}
+
+// Serve a file under a name, in place of whatever was served under it. Of a partial one, a download,
+// only the chunks seed_mark reports verified are served.
+void seed_add(const char *name, const char *path, uint64_t size, int partial) {
+    uint32_t chunk_count = (uint32_t)((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    Seed *seed = calloc(1, sizeof(Seed));
+    if (!seed || (seed->name = strdup(name)) == NULL || (seed->path = strdup(path)) == NULL ||
+        (partial && chunk_count > 0 && (seed->chunks = calloc((chunk_count + 7) / 8, 1)) == NULL)) {
+        if (seed) {
+            seed_free(seed);
+        }
+        return;
+    }
+    seed->size = size;
+    seed->missing = seed->chunks ? chunk_count : 0;
+    seed->compressible = -1;
+
+    pthread_mutex_lock(&seeder.lock);
+    if (seeder.count >= seeder.bucket_count) {
+        seed_grow();
+    }
+    Seed **slot = seed_slot(name);
+    if (!slot) {
+        seed_free(seed);
+    } else if (*slot) {
+        seed->next = (*slot)->next;
+        seed_free(*slot);
+        *slot = seed;
+    } else {
+        *slot = seed;
+        seeder.count++;
+    }
+    pthread_mutex_unlock(&seeder.lock);
+}
+
+// A chunk of a download was verified and may be served
+void seed_mark(const char *name, uint32_t chunk) {
+    pthread_mutex_lock(&seeder.lock);
+    Seed **slot = seed_slot(name);
+    Seed *seed = slot ? *slot : NULL;
+    if (seed && seed->chunks && (uint64_t)chunk * CHUNK_SIZE < seed->size &&
+        !((seed->chunks[chunk / 8] >> (chunk % 8)) & 1)) {
+        seed->chunks[chunk / 8] |= 1 << (chunk % 8);
+        if (--seed->missing == 0) {
+            free(seed->chunks); // Whole now
+            seed->chunks = NULL;
+        }
+    }
+    pthread_mutex_unlock(&seeder.lock);
+}
+
+void seed_remove(const char *name) {
+    pthread_mutex_lock(&seeder.lock);
+    Seed **slot = seed_slot(name);
+    Seed *seed = slot ? *slot : NULL;
+    if (seed) {
+        *slot = seed->next;
+        seed_free(seed);
+        seeder.count--;
+    }
+    pthread_mutex_unlock(&seeder.lock);
+}
+
+// The seed field of a request: the index takes the address the datagram comes from and the seeding port
+void put_seed(ProtoWriter *request) {
+    proto_put_int(request, 0, 4);
+    proto_put_int(request, (uint64_t)seeder.port, 2);
+}
+
+// Open the seeding listener on a port (0 for any free one) and start serving it
+int seeder_start(int port) {
+    struct sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    int reuse = 1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t)port);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("Seed socket creation failed");
+        return -1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&address, &address_len) < 0) {
+        perror("Seed listener setup failed");
+        close(listen_fd);
+        return -1;
+    }
+    seeder.listen_fd = listen_fd;
+    seeder.port = ntohs(address.sin_port);
+
+    pthread_t seeding;
+    if (pthread_create(&seeding, NULL, seed_thread, NULL) != 0) {
+        perror("Failed to start seeding thread");
+        return -1;
+    }
+    pthread_detach(seeding);
+    return 0;
+}
+
+static void seed_finish_response(SeedConnection *connection) {
+    if (connection->fd >= 0) {
+        close(connection->fd);
+        connection->fd = -1;
+    }
+    connection->header_sent = 0;
+    connection->offset = 0;
+    connection->end = 0;
+    connection->lz4 = 0;
+}
+
+static void seed_close(int epoll_fd, SeedConnection *connection) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->sock, NULL);
+    close(connection->sock);
+    seed_finish_response(connection);
+    free(connection->plain);
+    free(connection->packed);
+    free(connection);
+}
+
+// Read a number and the space after it; returns what follows, or NULL if there is no such number
+static char *parse_offset(char *text, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    if (end == text || *end != ' ' || *value < 0 || errno != 0) {
+        return NULL;
+    }
+    return end + 1;
+}
+
+// Remember whether a file's chunks turned out worth compressing
+static void seed_judged(const char *name, int compressible) {
+    pthread_mutex_lock(&seeder.lock);
+    Seed **slot = seed_slot(name);
+    if (slot && *slot) {
+        (*slot)->compressible = compressible;
+    }
+    pthread_mutex_unlock(&seeder.lock);
+}
+
+// Parse the next request line and prepare its response; returns -1 to drop the connection. The requests
+// and responses are those of the index's content port (D, G, Z and R), but manifests only come from the
+// index. Bytes go straight from the file with sendfile; a chunk asked for compressed is only read in when
+// the file's chunks compress.
+static int seed_respond(SeedConnection *connection, char *line) {
+    char command = line[0];
+    char *name = line + 2;
+    long long first = 0;
+    long long length = 0;
+
+    if (line[0] == '\0' || line[1] != ' ') {
+        return -1;
+    }
+    if (command == 'G' || command == 'Z') {
+        long long chunk;
+        name = parse_offset(line + 2, &chunk);
+        if (!name || chunk > UINT32_MAX) {
+            return -1;
+        }
+        first = chunk * CHUNK_SIZE;
+        length = CHUNK_SIZE;
+    } else if (command == 'R') {
+        name = parse_offset(line + 2, &first);
+        name = name ? parse_offset(name, &length) : NULL;
+        if (!name) {
+            return -1;
+        }
+    } else if (command != 'D' && command != 'M') {
+        return -1;
+    }
+    memset(connection->header, 0, sizeof(connection->header));
+    connection->header[0] = 1; // Not found
+
+    // Look the file up under the lock and open it outside of it; of a download, every chunk of the range
+    // must be verified already
+    char path[2 * BUFFER_SIZE];
+    uint64_t end = 0;
+    int compressible = 0;
+    int found = 0;
+    pthread_mutex_lock(&seeder.lock);
+    Seed **slot = command == 'M' ? NULL : seed_slot(name);
+    Seed *seed = slot ? *slot : NULL;
+    if (seed) {
+        end = seed->size;
+        if (command != 'D') {
+            // A range may end at the end of the file but not start past it; the one chunk of an empty file is empty
+            found = (uint64_t)first < end || (first == (long long)end && (command == 'R' || first == 0));
+            if (end - first > (uint64_t)length) {
+                end = first + length;
+            }
+        } else {
+            found = 1;
+        }
+        for (uint64_t chunk = first / CHUNK_SIZE; found && seed->chunks && chunk * CHUNK_SIZE < end; chunk++) {
+            found = (seed->chunks[chunk / 8] >> (chunk % 8)) & 1;
+        }
+        compressible = seed->compressible;
+        found = found && snprintf(path, sizeof(path), "%s", seed->path) < (int)sizeof(path);
+    }
+    pthread_mutex_unlock(&seeder.lock);
+    if (!found || (connection->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+
+    connection->offset = first;
+    connection->end = end;
+    if (command == 'Z' && compressible != 0 && end > (uint64_t)first) {
+        size_t len = end - first;
+        size_t packed = 0;
+        if (!connection->plain) {
+            connection->plain = malloc(CHUNK_SIZE);
+            connection->packed = malloc(lz4_worth(CHUNK_SIZE));
+        }
+        if (connection->plain && connection->packed &&
+            pread(connection->fd, connection->plain, len, first) == (ssize_t)len) {
+            packed = lz4_compress(connection->plain, len, connection->packed, lz4_worth(len));
+        }
+        if (compressible < 0 && len >= LZ4_SAMPLE) {
+            seed_judged(name, packed > 0); // The first chunk decides for the rest
+        }
+        if (packed) {
+            connection->lz4 = 1;
+            connection->offset = 0;
+            connection->end = packed;
+        }
+    }
+    connection->header[0] = connection->lz4 ? CONTENT_LZ4 : 0;
+    proto_store(connection->header + 1, connection->end - connection->offset, 8);
+    return 0;
+}
+
+// Push as much as the socket takes; returns 1 when done, 0 to wait for EPOLLOUT, -1 on error
+static int seed_send(SeedConnection *connection) {
+    while (connection->header_sent < CONTENT_HEADER_SIZE) {
+        ssize_t n = send(connection->sock, connection->header + connection->header_sent,
+                         CONTENT_HEADER_SIZE - connection->header_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        connection->header_sent += n;
+    }
+
+    // Cap each turn so one large file cannot starve the other connections
+    size_t budget = SEED_TURN_BYTES;
+    while (connection->offset < connection->end && budget > 0) {
+        size_t len = connection->end - connection->offset;
+        if (len > budget) {
+            len = budget;
+        }
+        ssize_t n = connection->lz4 ? send(connection->sock, connection->packed + connection->offset, len, MSG_NOSIGNAL)
+                                    : sendfile(connection->sock, connection->fd, &connection->offset, len);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1; // The file shrank underneath us
+        }
+        if (connection->lz4) {
+            connection->offset += n; // sendfile moves the offset itself
+        }
+        budget -= n;
+    }
+    return connection->offset == connection->end ? 1 : 0;
+}
+
+static int seed_watch(int epoll_fd, SeedConnection *connection, uint32_t events) {
+    if (connection->events == events) {
+        return 0;
+    }
+    struct epoll_event event = {.events = events, .data.ptr = connection};
+    connection->events = events;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->sock, &event);
+}
+
+// Serve pipelined requests until the socket would block; returns -1 to drop the connection
+static int seed_step(int epoll_fd, SeedConnection *connection) {
+    for (int served = 0; served < SEED_TURN_REQUESTS; served++) {
+        if (connection->state == SEED_READING) {
+            char *newline = memchr(connection->request, '\n', connection->request_len);
+            if (!newline) {
+                if (connection->request_len == sizeof(connection->request)) {
+                    return -1; // Request line too long
+                }
+                ssize_t got = recv(connection->sock, connection->request + connection->request_len,
+                                   sizeof(connection->request) - connection->request_len, 0);
+                if (got < 0 && errno == EAGAIN) {
+                    return seed_watch(epoll_fd, connection, EPOLLIN);
+                }
+                if (got <= 0) {
+                    return -1;
+                }
+                connection->request_len += got;
+                continue;
+            }
+
+            *newline = '\0';
+            int result = seed_respond(connection, connection->request);
+            size_t consumed = newline + 1 - connection->request;
+            memmove(connection->request, newline + 1, connection->request_len - consumed);
+            connection->request_len -= consumed;
+            if (result != 0) {
+                return -1;
+            }
+            connection->state = SEED_SENDING;
+        }
+
+        int result = seed_send(connection);
+        if (result < 0) {
+            return -1;
+        }
+        if (result == 0) {
+            return seed_watch(epoll_fd, connection, EPOLLOUT);
+        }
+        seed_finish_response(connection);
+        connection->state = SEED_READING;
+    }
+
+    // Let the other connections have a turn; level-triggered epoll brings us back
+    return seed_watch(epoll_fd, connection, connection->state == SEED_READING ? EPOLLIN : EPOLLOUT);
+}
+
+// The seeding event loop: serves other peers' chunk requests for the files in the seed table
+void *seed_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[SEED_EVENTS];
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, seeder.listen_fd, &listen_event) < 0) {
+        perror("Failed to set up seeding event loop");
+        return NULL;
+    }
+
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, SEED_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("Seeding event loop failed");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            SeedConnection *connection = events[i].data.ptr;
+            if (connection) {
+                if (seed_step(epoll_fd, connection) != 0) {
+                    seed_close(epoll_fd, connection);
+                }
+                continue;
+            }
+
+            // New downloaders
+            int sock;
+            while ((sock = accept4(seeder.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                SeedConnection *accepted = calloc(1, sizeof(SeedConnection));
+                if (!accepted) {
+                    close(sock);
+                    continue;
+                }
+                int buffer_size = SEED_SNDBUF;
+                setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+                accepted->sock = sock;
+                accepted->state = SEED_READING;
+                accepted->fd = -1;
+                accepted->events = EPOLLIN;
+                struct epoll_event event = {.events = EPOLLIN, .data.ptr = accepted};
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+                    close(sock);
+                    free(accepted);
+                }
+            }
+        }
+    }
+    return NULL;
+}